@@ -0,0 +1,106 @@
+#!/bin/bash
+#
+# Measures TCP goodput and bundle latency through two NpsGate DTN gateways on
+# this host, see README.dtn_loopback. Needs root, iproute2 and iperf3, or
+# python3 and wget to time page loads.
+#
+#	bench.sh [seconds] [iperf3 options...]
+#	bench.sh page [loads] [objects] [object KB]
+#
+# Run from NpsGate's 'run' directory.
+
+if [ "$1" = "page" ]; then
+	MODE=page
+	LOADS=${2:-10}
+	OBJECTS=${3:-20}
+	OBJECT_KB=${4:-16}
+else
+	MODE=iperf
+	DURATION=${1:-30}
+	shift
+fi
+EXAMPLE=$(cd "$(dirname "$0")" && pwd)
+LOGS=$(mktemp -d /tmp/dtn_loopback.XXXXXX)
+PIDS=
+
+cleanup() {
+	[ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+	wait 2>/dev/null
+	ip netns del dtn-client 2>/dev/null
+	ip netns del dtn-server 2>/dev/null
+}
+trap cleanup EXIT
+
+if [ ! -x ./npsgate ]; then
+	echo "Run $0 from NpsGate's run directory."
+	exit 1
+fi
+
+# client 10.0.1.2 <-> [host: gateway A | gateway B] <-> server 10.0.2.2
+ip netns add dtn-client || exit 1
+ip netns add dtn-server || exit 1
+ip link add dtn-c type veth peer name eth0 netns dtn-client
+ip link add dtn-s type veth peer name eth0 netns dtn-server
+ip addr add 10.0.1.1/24 dev dtn-c
+ip addr add 10.0.2.1/24 dev dtn-s
+ip link set dtn-c up
+ip link set dtn-s up
+ip -n dtn-client addr add 10.0.1.2/24 dev eth0
+ip -n dtn-server addr add 10.0.2.2/24 dev eth0
+ip -n dtn-client link set eth0 up
+ip -n dtn-server link set eth0 up
+ip -n dtn-client route add default via 10.0.1.1
+ip -n dtn-server route add default via 10.0.2.1
+sysctl -qw net.ipv4.ip_forward=1
+
+./npsgate -c "$EXAMPLE/gateway_a.config" > "$LOGS/gateway_a.log" 2>&1 &
+PIDS="$PIDS $!"
+./npsgate -c "$EXAMPLE/gateway_b.config" > "$LOGS/gateway_b.log" 2>&1 &
+PIDS="$PIDS $!"
+
+if [ "$MODE" = "page" ]; then
+	# A page of OBJECTS images served over HTTP/1.1, fetched with its images by
+	# wget over persistent connections, LOADS times
+	mkdir -p "$LOGS/site" "$LOGS/fetch"
+	echo "<html><body>" > "$LOGS/site/index.html"
+	for i in $(seq 1 "$OBJECTS"); do
+		head -c $((OBJECT_KB * 1024)) /dev/urandom > "$LOGS/site/object-$i.bin"
+		echo "<img src=\"object-$i.bin\">" >> "$LOGS/site/index.html"
+	done
+	echo "</body></html>" >> "$LOGS/site/index.html"
+
+	(cd "$LOGS/site" && exec ip netns exec dtn-server python3 -c '
+import http.server as h
+h.SimpleHTTPRequestHandler.protocol_version = "HTTP/1.1"
+h.ThreadingHTTPServer(("10.0.2.2", 80), h.SimpleHTTPRequestHandler).serve_forever()
+') > "$LOGS/http_server.log" 2>&1 &
+	PIDS="$PIDS $!"
+	sleep 2
+
+	for i in $(seq 1 "$LOADS"); do
+		rm -f "$LOGS/fetch/"*
+		START=$(date +%s%N)
+		ip netns exec dtn-client wget -q -p -nd -e robots=off -P "$LOGS/fetch" http://10.0.2.2/index.html
+		STATUS=$?
+		END=$(date +%s%N)
+		echo "load $i: $(( (END - START) / 1000000 )) ms, $(ls "$LOGS/fetch" | wc -l) files, wget exit $STATUS"
+	done | tee "$LOGS/page_loads.log"
+	awk '{ ms = $3; sum += ms; if(min == "" || ms < min) min = ms; if(ms > max) max = ms }
+		END { if(NR) printf "page load: %d loads, average %d ms, min %d ms, max %d ms\n", NR, sum / NR, min, max }' \
+		"$LOGS/page_loads.log"
+else
+	ip netns exec dtn-server iperf3 -s -1 > "$LOGS/iperf3_server.log" 2>&1 &
+	PIDS="$PIDS $!"
+	sleep 2
+
+	ip netns exec dtn-client iperf3 -c 10.0.2.2 -t "$DURATION" "$@" | tee "$LOGS/iperf3_client.log"
+fi
+
+echo
+echo "Client to server bundles (gateway B's DTNInput):"
+grep "DTNInput:" "$LOGS/gateway_b.log" | tail -5
+echo
+echo "Server to client bundles (gateway A's DTNInput):"
+grep "DTNInput:" "$LOGS/gateway_a.log" | tail -5
+echo
+echo "Logs are in $LOGS"
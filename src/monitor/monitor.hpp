@@ -70,6 +70,7 @@ namespace NpsGate {
 			bool generate_plugin_graph(ClientRequest* in); 
 			bool generate_plugin_stats(ClientRequest* in);
 			bool process_config(ClientRequest* in);
+			bool trigger_cmd(ClientRequest* in);
 
 			/* Publish Subscribe */
 			bool pubsub(ClientRequest* req);
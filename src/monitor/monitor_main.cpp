@@ -54,6 +54,7 @@ Monitor::Monitor(NpsGateContext& c, MonitorType t, string s) : PluginCore(c, "Mo
 	msg_handlers["pubsub_publications"] = &Monitor::list_publications;
 	msg_handlers["pubsub_publication_list"] = &Monitor::list_plugin_publications;
 	msg_handlers["pubsub_subscription_list"] = &Monitor::list_plugin_subscriptions;
+	msg_handlers["trigger"] = &Monitor::trigger_cmd;
 }
 
 Monitor::~Monitor() {
@@ -85,8 +86,9 @@ void Monitor::main(const bool* exit_flag) {
 			}
 		}
 
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
+		/* Short enough that subscriptions reach the clients as they are published */
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
 
 		rval = select(max_fd + 1, &fds, NULL, NULL, &tv);
 		if(rval > 0) {
@@ -122,12 +124,18 @@ void Monitor::main(const bool* exit_flag) {
 			break;
 		}
 
-		JobQueueItem* item = input_queue.Dequeue(0);
-		if(item && item->type == MESSAGE) {
-			LOG_DEBUG("Monitor::main received message.\n");
-			subscription_receive(item->message);
+		/* Forward everything published since the last pass. The queue holds a
+		   reference to each value for us. */
+		JobQueueItem* item;
+		while((item = input_queue.Dequeue(0)) != NULL) {
+			if(item->type == MESSAGE) {
+				subscription_receive(item->message);
+				item->message->value->unref();
+				delete item->message;
+			}
+			delete item;
 		}
-	
+
 	}
 
 
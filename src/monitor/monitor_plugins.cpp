@@ -166,5 +166,40 @@ bool Monitor::process_config(ClientRequest* in) {
 	transmit_response(&out);
 	return true;
 }
+
+/*  SEND A TRIGGER TO A PLUGIN
+	Options:
+		plugin	- Plugin to trigger (required)
+		reason	- Free form text passed along to the plugin
+
+	The plugin receives a message with fq_name 'trigger' and the reason
+	as a string value. What a trigger does is up to the plugin.
+*/
+bool Monitor::trigger_cmd(ClientRequest* in) {
+	ClientRequest out;
+	string plugin_name = in->options["plugin"];
+	string reason = in->options["reason"];
+
+	if(reason.empty()) {
+		reason = "monitor";
+	}
+
+	out.command = in->command;
+	out.options["plugin"] = plugin_name;
+
+	NpsGateVar* v = new NpsGateVar();
+	v->set(reason);
+	if(publish(plugin_name, "trigger", v)) {
+		LOG_INFO("Sent trigger '%s' to plugin '%s'.\n", reason.c_str(), plugin_name.c_str());
+		out.options["result"] = "ok";
+	} else {
+		LOG_WARNING("Failed to send trigger to plugin '%s'.\n", plugin_name.c_str());
+		out.options["result"] = "error";
+		v->unref();
+	}
+
+	transmit_response(&out);
+	return true;
+}
 }
 
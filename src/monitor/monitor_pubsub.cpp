@@ -26,6 +26,17 @@
 
 namespace NpsGate {
 
+/* Formats the value if it holds a T */
+template <typename T>
+static bool format_value(NpsGateVar* v, string* out) {
+	if(v->type() != typeid(T)) {
+		return false;
+	}
+
+	*out = boost::lexical_cast<string>(v->get<T>());
+	return true;
+}
+
 bool Monitor::pubsub(ClientRequest* req) {
 	if(req->options.find("action") == req->options.end()) {
 		LOG_WARNING("'action' option not defined. Ignoring request.\n");
@@ -36,9 +47,9 @@ bool Monitor::pubsub(ClientRequest* req) {
 	LOG_DEBUG("Action is: %s\n", action.c_str());
 
 	if(action == "subscribe") {
-//		return subscribe(req);
+		return subscribe_cmd(req);
 	} else if(action == "unsubscribe") {
-//		return unsubscribe(req);
+		return unsubscribe_cmd(req);
 	} else if(action == "list") {
 		return list_subscribed();
 	} else if(action == "publications") {
@@ -72,6 +83,7 @@ bool Monitor::unsubscribe_cmd(ClientRequest* req) {
 		return false;
 	}
 
+	context.publish_subscribe->remove_subscription(this, fq_name->second);
 
 	return true;
 }
@@ -124,11 +136,13 @@ bool Monitor::list_subscribed() {
 	string msg;
 
 	LOG_DEBUG("Listing subscriptions\n");
-	list<PluginCore*>::iterator p;
-	map<string, list<PluginCore*>*>::iterator iter = context.publish_subscribe->subscriptions.begin();
-	while(iter != context.publish_subscribe->subscriptions.end()) {
+	map<string, vector<PluginCore*> > subs;
+	vector<PluginCore*>::iterator p;
+	context.publish_subscribe->list_subscriptions(&subs);
+	map<string, vector<PluginCore*> >::iterator iter = subs.begin();
+	while(iter != subs.end()) {
 		msg += iter->first;
-		for(p = iter->second->begin();p != iter->second->end(); p++) {
+		for(p = iter->second.begin();p != iter->second.end(); p++) {
 			msg += "|";
 			msg += (*p)->name;
 		}
@@ -162,13 +176,18 @@ bool Monitor::subscription_receive(Message* m) {
 	out.options["plugin"] = m->orig->name;
 	out.options["module"] = m->orig->filename;
 
-	free(type_name);
+	/* Strings and numbers are sent as text. Anything else only by its type. */
+	if(!format_value<string>(v, &out.data) && !format_value<bool>(v, &out.data) &&
+			!format_value<int>(v, &out.data) && !format_value<unsigned int>(v, &out.data) &&
+			!format_value<long>(v, &out.data) && !format_value<unsigned long>(v, &out.data) &&
+			!format_value<long long>(v, &out.data) && !format_value<unsigned long long>(v, &out.data) &&
+			!format_value<double>(v, &out.data)) {
+		LOG_DEBUG("No text form for '%s' of type %s.\n", m->fq_name.c_str(), type_name);
+	}
 
-//	if(v->type() == typeid(string)) {
-		out.data = v->get<string>();
-//	}
+	free(type_name);
 
-	LOG_DEBUG("DATA: %s\n", out.data.c_str());
+	LOG_TRACE("DATA: %s\n", out.data.c_str());
 
 	transmit_response(&out);
 
@@ -26,6 +26,7 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sys/time.h>
 
 #include <string>
 #include <list>
@@ -43,10 +44,18 @@ namespace NpsGate {
 
 	class NpsGateContext;
 
+/* Book keeping for each packet in the store. 'ingress' is the time the packet
+   first entered the store, which for input plugins is when it was forwarded,
+   or the time set_ingress() last restamped it. */
+struct PacketInfo {
+	unsigned int refs;
+	timeval ingress;
+};
+
 class PacketManager {
 	public:
 		PacketManager(const NpsGateContext& c) : context(c) {
-			total_packets = total_refs = total_unrefs = total_frees = total_bad_unrefs = 0;
+			total_packets = total_refs = total_unrefs = total_frees = total_bad_unrefs = total_copies = 0;
 			bytes_in = bytes_out = packets_in = packets_out = bytes_dropped = packets_dropped = 0;
 			pthread_mutex_init(&mutex, NULL);
 		}
@@ -57,58 +66,129 @@ class PacketManager {
 		void ref_packet(Packet* p) { 
 			pthread_mutex_lock(&mutex);
 
-			map<Packet*, unsigned int>::iterator itr = packet_list.find(p);
+			map<Packet*, PacketInfo>::iterator itr = packet_list.find(p);
 			if(itr == packet_list.end()) {
 				LOG_TRACE("Adding packet %p to packet store. Ref=1\n", p);
-				packet_list[p] = 1;
+				PacketInfo& info = packet_list[p];
+				info.refs = 1;
+				gettimeofday(&info.ingress, NULL);
 				total_packets++;
 				bytes_in += p->GetSize();
 				packets_in++;
 			} else {
-				LOG_TRACE("Adding reference to packet %p. Ref=%d\n", p, packet_list[p] + 1);
-				packet_list[p]++;	
+				LOG_TRACE("Adding reference to packet %p. Ref=%d\n", p, itr->second.refs + 1);
+				itr->second.refs++;
 			}
 			total_refs++;
 
-			LOG_INFO("Total Packets: %d\n", total_refs - total_unrefs);
+			LOG_TRACE("Total Packets: %d\n", total_refs - total_unrefs);
 			pthread_mutex_unlock(&mutex);
 		}
 
 		void unref_packet(Packet* p) {
 			pthread_mutex_lock(&mutex);
 
-			map<Packet*, unsigned int>::iterator itr = packet_list.find(p);
+			map<Packet*, PacketInfo>::iterator itr = packet_list.find(p);
 			if(itr == packet_list.end()) {
 				total_bad_unrefs++;
 				for(itr = packet_list.begin(); itr != packet_list.end(); itr++) {
 					LOG_WARNING("Packet: %p\n", itr->first);
 				}
+				pthread_mutex_unlock(&mutex);
 				LOG_CRITICAL("Bad unref to packet %p not maintained by PacketManager.\n", p);
 				return;
 			}
 
 			total_unrefs++;
 
-			LOG_TRACE("Removing reference to packet %p. Ref=%d\n", p, packet_list[p] - 1);
-			packet_list[p]--;	
-			if(packet_list[p] == 0) {
+			LOG_TRACE("Removing reference to packet %p. Ref=%d\n", p, itr->second.refs - 1);
+			if(--itr->second.refs == 0) {
 				LOG_TRACE("Reference count of %p is zero. Freeing.\n", p);
-				packet_list.erase(p);
+				packet_list.erase(itr);
+				bytes_out += p->GetSize();
 				delete p;
 				total_frees++;
-				bytes_out += p->GetSize();
 				packets_out++;
 			}
 			pthread_mutex_unlock(&mutex);
 		}
 
 		unsigned int ref_count(Packet* p) {
-			map<Packet*, unsigned int>::iterator iter = packet_list.find(p);
-			if(iter == packet_list.end()) {
-				return 0;
+			unsigned int count = 0;
+
+			pthread_mutex_lock(&mutex);
+			map<Packet*, PacketInfo>::iterator iter = packet_list.find(p);
+			if(iter != packet_list.end()) {
+				count = iter->second.refs;
 			}
+			pthread_mutex_unlock(&mutex);
 	
-			return iter->second;
+			return count;
+		}
+
+		/* Time 'p' entered the packet store. Returns false for unknown packets. */
+		bool ingress_time(Packet* p, timeval* tv) {
+			bool found = false;
+
+			pthread_mutex_lock(&mutex);
+			map<Packet*, PacketInfo>::iterator iter = packet_list.find(p);
+			if(iter != packet_list.end()) {
+				*tv = iter->second.ingress;
+				found = true;
+			}
+			pthread_mutex_unlock(&mutex);
+
+			return found;
+		}
+
+		/* Restamps 'p' as entering now, for inputs that keep their packets and
+		   forward them again. Returns false for unknown packets. */
+		bool set_ingress(Packet* p) {
+			bool found = false;
+
+			pthread_mutex_lock(&mutex);
+			map<Packet*, PacketInfo>::iterator iter = packet_list.find(p);
+			if(iter != packet_list.end()) {
+				gettimeofday(&iter->second.ingress, NULL);
+				found = true;
+			}
+			pthread_mutex_unlock(&mutex);
+
+			return found;
+		}
+
+		/* Trades one reference to 'p' for a packet that the caller holds the only
+		   reference to. If nobody else references 'p' it is returned unchanged,
+		   otherwise a private copy is added to the packet store with Ref=1 and
+		   the caller's reference to the shared packet is released. */
+		Packet* copy_on_write(Packet* p) {
+			if(ref_count(p) <= 1) {
+				return p;
+			}
+
+			/* We still hold a reference, so 'p' can not be freed while the copy is
+			   made. The copy is done outside the lock to keep other plugins moving. */
+			Packet* copy = new Packet(*p);
+			PacketInfo info;
+
+			info.refs = 1;
+			if(!ingress_time(p, &info.ingress)) {
+				gettimeofday(&info.ingress, NULL);
+			}
+
+			LOG_TRACE("Packet %p is shared. Copied to %p.\n", p, copy);
+			unref_packet(p);
+
+			pthread_mutex_lock(&mutex);
+			packet_list[copy] = info;
+			total_packets++;
+			total_refs++;
+			total_copies++;
+			bytes_in += copy->GetSize();
+			packets_in++;
+			pthread_mutex_unlock(&mutex);
+
+			return copy;
 		}
 
 		unsigned int packet_count() {
@@ -119,7 +199,7 @@ class PacketManager {
 	private:
 		pthread_mutex_t mutex;
 		const NpsGateContext& context;
-		map<Packet*, unsigned int> packet_list;
+		map<Packet*, PacketInfo> packet_list;
 
 		/* Statistics variables */
 		unsigned int total_packets;
@@ -127,6 +207,7 @@ class PacketManager {
 		unsigned int total_unrefs;
 		unsigned int total_frees;
 		unsigned int total_bad_unrefs;
+		unsigned int total_copies;
 		unsigned long long bytes_in;
 		unsigned long long bytes_out;
 		unsigned long long bytes_dropped;
@@ -142,6 +223,7 @@ class PacketManager {
 			LOG_INFO("    Total Unrefs:     %u\n", total_unrefs);
 			LOG_INFO("    Total Frees:      %u\n", total_frees);
 			LOG_INFO("    Total Bad Unrefs: %u\n", total_bad_unrefs);
+			LOG_INFO("    Total COW Copies: %u\n", total_copies);
 		}
 };
 
@@ -48,7 +48,7 @@ using namespace std;
 namespace NpsGate {
 
 PluginCore::PluginCore(const NpsGateContext& c, string pname) : context(c), 
-	handle(NULL), config(NULL), create(NULL), destroy(NULL),
+	handle(NULL), current_packet(NULL), config(NULL), create(NULL), destroy(NULL),
 	packets_in(0), packets_out(0), packets_dropped(0) {
 	name = pname;
 	exit_flag = false;
@@ -198,18 +198,57 @@ bool PluginCore::forward_packet(string queue, Packet* p) {
 	item->packet = p;
 	pq->Enqueue(item);
 
-	packets_out++;
+	__sync_fetch_and_add(&packets_out, 1);
 
 	return true;
 }
 
 bool PluginCore::drop_packet(Packet* p) {
 	LOG_TRACE("Dropping packet %p\n", p);
-	packets_dropped++;
+	__sync_fetch_and_add(&packets_dropped, 1);
 //	context.packet_manager->unref_packet(p);
 	return true;
 }
 
+/*
+ * Packets forwarded to more than one plugin are not copied. Every holder
+ * references the same Packet through the PacketManager, so a shared packet
+ * must be treated as read-only. A plugin that needs to modify a packet calls
+ * make_writable() first and continues with the returned packet.
+ */
+Packet* PluginCore::share_packet(Packet* p) {
+	context.packet_manager->ref_packet(p);
+	return p;
+}
+
+void PluginCore::release_packet(Packet* p) {
+	context.packet_manager->unref_packet(p);
+}
+
+bool PluginCore::is_shared(Packet* p) {
+	return context.packet_manager->ref_count(p) > 1;
+}
+
+Packet* PluginCore::make_writable(Packet* p) {
+	Packet* w = context.packet_manager->copy_on_write(p);
+
+	/* The reference message_loop() releases after process_packet() moved
+	   to the private copy. */
+	if(p == current_packet) {
+		current_packet = w;
+	}
+
+	return w;
+}
+
+bool PluginCore::ingress_time(Packet* p, timeval* tv) {
+	return context.packet_manager->ingress_time(p, tv);
+}
+
+bool PluginCore::set_ingress(Packet* p) {
+	return context.packet_manager->set_ingress(p);
+}
+
 /*
  * Direct publish to a particular module
  */
@@ -228,11 +267,34 @@ bool PluginCore::publish(const string module, const string fq_name, NpsGateVar*
 	item->message->type = SUBSCRIBE_UPDATE;
 	item->message->fq_name = fq_name;
 	item->message->value = v;
+	item->message->orig = this;
 
 	pq->Enqueue(item);
 	return true;
 }
 
+/*
+ * Number of items waiting in another plugin's input queue. Returns -1 if
+ * there is no plugin by that name.
+ */
+int PluginCore::queue_depth(const string plugin) {
+	JobQueue* pq = context.plugin_manager->get_input_queue(plugin);
+
+	if(!pq) {
+		return -1;
+	}
+
+	return pq->Length();
+}
+
+TopicId PluginCore::register_topic(const string fq_name) {
+	return context.publish_subscribe->register_topic(fq_name);
+}
+
+bool PluginCore::publish(TopicId topic, NpsGateVar* v) {
+	return context.publish_subscribe->publish(this, topic, v);
+}
+
 bool PluginCore::publish(const string fq_name, NpsGateVar* v) {
 	return context.publish_subscribe->publish(this, fq_name, v);
 }
@@ -284,8 +346,10 @@ bool PluginCore::message_loop() {
 
 
 				packets_in++;
-				plugin->process_packet(item->packet);
-				context.packet_manager->unref_packet(item->packet);
+				current_packet = pkt;
+				plugin->process_packet(pkt);
+				context.packet_manager->unref_packet(current_packet);
+				current_packet = NULL;
 				delete item;
 				break;
 			case MESSAGE:
@@ -69,6 +69,14 @@ class PluginCore {
 
 		virtual bool forward_packet(string queue, Packet* p);
 		virtual bool drop_packet(Packet* p);
+		virtual Packet* share_packet(Packet* p);
+		virtual void release_packet(Packet* p);
+		virtual bool is_shared(Packet* p);
+		virtual Packet* make_writable(Packet* p);
+		virtual bool ingress_time(Packet* p, timeval* tv);
+		virtual bool set_ingress(Packet* p);
+		virtual TopicId register_topic(const string fq_name);
+		virtual bool publish(TopicId topic, NpsGateVar* v);
 		virtual bool publish(const string fq_name, NpsGateVar* v);
 		virtual bool publish(const string module, const string fq_name, NpsGateVar* v);
 		virtual bool subscribe(const string fq_name);
@@ -79,6 +87,7 @@ class PluginCore {
 		virtual string get_default_output();
 
 		virtual bool set_timeout(uint32_t);
+		virtual int queue_depth(const string plugin);
 
 		JobQueue input_queue;
 		string name;
@@ -102,6 +111,7 @@ class PluginCore {
 		dlhandle_t handle;
 
 		NpsGatePlugin* plugin;
+		Packet* current_packet;
 
 		string cfg_name;
 		Config* config;
@@ -0,0 +1,446 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file afpacket_input.cpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#include <pcap.h>
+#include <crafter.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include <vector>
+#include <sstream>
+
+#include "../npsgate_plugin.hpp"
+#include "../logger.hpp"
+
+using namespace Crafter;
+using namespace NpsGate;
+
+class AFPacketInput;
+
+/* One TPACKET_V3 receive ring. Each capture thread owns exactly one. */
+struct RxRing {
+	int fd;
+	uint8_t* map;
+	size_t map_size;
+	tpacket_req3 req;
+	unsigned int block_index;
+
+	/* Totals from PACKET_STATISTICS. The kernel resets its counters on every
+	   read so they are accumulated here. */
+	unsigned long long kernel_packets;
+	unsigned long long kernel_drops;
+	unsigned long long freeze_count;
+
+	/* Updated only by the owning thread */
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long blocks;
+	unsigned long long non_ip;
+
+	pthread_t thread;
+	bool started;			/* 'thread' is running and must be joined */
+	AFPacketInput* plugin;
+
+	inline tpacket_block_desc* block(unsigned int i) {
+		return (tpacket_block_desc*)(map + (size_t)i * req.tp_block_size);
+	}
+};
+
+class AFPacketInput : public NpsGatePlugin {
+
+public:
+
+	AFPacketInput(PluginCore* c) : NpsGatePlugin(c) {
+		threads = 1;
+		fanout_mode = "hash";
+		fanout_id = getpid() & 0xffff;
+		block_size = 1 << 20;
+		block_count = 16;
+		frame_size = 2048;
+		block_timeout = 10;
+		stats_interval = 5;
+		ignore_outgoing = true;
+		running = true;
+	}
+
+	virtual ~AFPacketInput() {
+		for(size_t i = 0; i < rings.size(); i++) {
+			if(rings[i]->map) {
+				munmap(rings[i]->map, rings[i]->map_size);
+			}
+			if(rings[i]->fd != -1) {
+				close(rings[i]->fd);
+			}
+			delete rings[i];
+		}
+	}
+
+	bool init() {
+		const Config* config = get_config();
+
+		LOG_INFO("AFPacketInput plugin starting initialization.\n");
+		stats_topic = register_topic("AFPacketInput.stats");
+
+		if(!config->lookupValue("afpacketinput.interface", interface)) {
+			LOG_CRITICAL("Capture interface not specified in configuration file!\n");
+			return false;
+		}
+
+		config->lookupValue("afpacketinput.threads", threads);
+		config->lookupValue("afpacketinput.fanout", fanout_mode);
+		config->lookupValue("afpacketinput.fanout-id", fanout_id);
+		config->lookupValue("afpacketinput.block-size", block_size);
+		config->lookupValue("afpacketinput.block-count", block_count);
+		config->lookupValue("afpacketinput.frame-size", frame_size);
+		config->lookupValue("afpacketinput.block-timeout", block_timeout);
+		config->lookupValue("afpacketinput.filter", filter_string);
+		config->lookupValue("afpacketinput.stats-interval", stats_interval);
+		config->lookupValue("afpacketinput.ignore-outgoing", ignore_outgoing);
+
+		if(threads < 1) {
+			threads = 1;
+		}
+
+		if(get_default_output().empty()) {
+			LOG_CRITICAL("AFPacketInput requires an output.\n");
+			return false;
+		}
+
+		if(!filter_string.empty() && !compile_filter()) {
+			return false;
+		}
+
+		for(int i = 0; i < threads; i++) {
+			RxRing* r = new RxRing();
+			memset(r, 0, sizeof(*r));
+			r->fd = -1;
+			r->plugin = this;
+			rings.push_back(r);
+
+			if(!open_ring(r)) {
+				return false;
+			}
+		}
+
+		LOG_INFO("Capturing on '%s' with %d thread(s), %d blocks of %d bytes each.\n",
+				interface.c_str(), threads, block_count, block_size);
+
+		return true;
+	}
+
+	bool process_packet(Packet* p) {
+		drop_packet(p);
+		return true;
+	}
+
+	bool main() {
+		time_t last_stats = time(NULL);
+
+		/* Ring 0 is serviced by the plugin thread, the rest get their own */
+		for(size_t i = 1; i < rings.size(); i++) {
+			if(pthread_create(&rings[i]->thread, NULL, rx_thread, rings[i])) {
+				LOG_CRITICAL("Failed to create capture thread %u.\n", (unsigned int)i);
+				return false;
+			}
+			rings[i]->started = true;
+		}
+
+		while(running) {
+			rx_poll(rings[0], 1000);
+
+			if(stats_interval > 0 && time(NULL) - last_stats >= stats_interval) {
+				publish_stats();
+				last_stats = time(NULL);
+			}
+		}
+
+		return true;
+	}
+
+	/* The plugin thread is cancelled on unload, so the capture threads are
+	   joined here, before the destructor unmaps their rings. They notice
+	   'running' within a poll timeout. */
+	virtual void exit_handler() {
+		running = false;
+
+		for(size_t i = 1; i < rings.size(); i++) {
+			if(rings[i]->started) {
+				pthread_join(rings[i]->thread, NULL);
+				rings[i]->started = false;
+			}
+		}
+	}
+
+private:
+	string interface;
+	string filter_string;
+	string fanout_mode;
+	int threads;
+	int fanout_id;
+	int block_size;
+	int block_count;
+	int frame_size;
+	int block_timeout;
+	int stats_interval;
+	TopicId stats_topic;
+	bool ignore_outgoing;
+	volatile bool running;
+
+	sock_fprog filter;
+	vector<sock_filter> filter_code;
+	vector<RxRing*> rings;
+
+	static void* rx_thread(void* arg) {
+		RxRing* r = (RxRing*)arg;
+
+		while(r->plugin->running) {
+			r->plugin->rx_poll(r, 1000);
+		}
+
+		return NULL;
+	}
+
+	/* Waits for the next block to be handed to user space, walks every packet
+	   in it and gives the whole block back to the kernel in one step. */
+	void rx_poll(RxRing* r, int timeout) {
+		tpacket_block_desc* bd = r->block(r->block_index);
+
+		if(!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+			pollfd pfd;
+			pfd.fd = r->fd;
+			pfd.events = POLLIN | POLLERR;
+			pfd.revents = 0;
+			poll(&pfd, 1, timeout);
+			return;
+		}
+
+		__sync_synchronize();
+
+		tpacket3_hdr* hdr = (tpacket3_hdr*)((uint8_t*)bd + bd->hdr.bh1.offset_to_first_pkt);
+		for(uint32_t i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			rx_frame(r, hdr);
+			hdr = (tpacket3_hdr*)((uint8_t*)hdr + hdr->tp_next_offset);
+		}
+
+		r->blocks++;
+
+		__sync_synchronize();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		r->block_index = (r->block_index + 1) % r->req.tp_block_nr;
+	}
+
+	/* Hands a single frame to the pipeline. The Crafter packet is decoded straight
+	   from ring memory, so this is the only copy between the NIC and the plugins. */
+	inline void rx_frame(RxRing* r, tpacket3_hdr* hdr) {
+		const uint8_t* data = (const uint8_t*)hdr + hdr->tp_net;
+		uint32_t len = hdr->tp_snaplen - (hdr->tp_net - hdr->tp_mac);
+		const sockaddr_ll* sll = (const sockaddr_ll*)((const uint8_t*)hdr + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+
+		/* On loopback every packet is seen twice, once in each direction */
+		if(ignore_outgoing && sll->sll_pkttype == PACKET_OUTGOING) {
+			return;
+		}
+
+		if(hdr->tp_net < hdr->tp_mac || len < 20 || (data[0] >> 4) != 4) {
+			r->non_ip++;
+			return;
+		}
+
+		Packet* pkt = new Packet();
+		pkt->PacketFromIP(data, len);
+
+		r->packets++;
+		r->bytes += len;
+
+		if(!forward_packet(get_default_output(), pkt)) {
+			delete pkt;
+		}
+	}
+
+	bool open_ring(RxRing* r) {
+		int version = TPACKET_V3;
+		sockaddr_ll sll;
+		ifreq ifr;
+
+		r->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+		if(r->fd == -1) {
+			LOG_CRITICAL("Failed to create packet socket. Reason: %s\n", strerror(errno));
+			return false;
+		}
+
+		if(setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+			LOG_CRITICAL("Kernel does not support TPACKET_V3. Reason: %s\n", strerror(errno));
+			return false;
+		}
+
+		/* The filter must be in place before the socket is bound, otherwise
+		   unfiltered traffic may already be sitting in the ring. */
+		if(!filter_code.empty() &&
+				setsockopt(r->fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) < 0) {
+			LOG_CRITICAL("Failed to attach BPF filter. Reason: %s\n", strerror(errno));
+			return false;
+		}
+
+		memset(&r->req, 0, sizeof(r->req));
+		r->req.tp_block_size = block_size;
+		r->req.tp_block_nr = block_count;
+		r->req.tp_frame_size = frame_size;
+		r->req.tp_frame_nr = (block_size / frame_size) * block_count;
+		r->req.tp_retire_blk_tov = block_timeout;
+		r->req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+
+		if(setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &r->req, sizeof(r->req)) < 0) {
+			LOG_CRITICAL("Failed to create PACKET_RX_RING. Reason: %s\n", strerror(errno));
+			return false;
+		}
+
+		r->map_size = (size_t)r->req.tp_block_size * r->req.tp_block_nr;
+		r->map = (uint8_t*)mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, r->fd, 0);
+		if(r->map == MAP_FAILED) {
+			r->map = (uint8_t*)mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+		}
+		if(r->map == MAP_FAILED) {
+			r->map = NULL;
+			LOG_CRITICAL("Failed to mmap RX ring. Reason: %s\n", strerror(errno));
+			return false;
+		}
+
+		memset(&ifr, 0, sizeof(ifr));
+		strncpy(ifr.ifr_name, interface.c_str(), IFNAMSIZ - 1);
+		if(ioctl(r->fd, SIOCGIFINDEX, &ifr) < 0) {
+			LOG_CRITICAL("Unknown interface '%s'.\n", interface.c_str());
+			return false;
+		}
+
+		memset(&sll, 0, sizeof(sll));
+		sll.sll_family = AF_PACKET;
+		sll.sll_protocol = htons(ETH_P_ALL);
+		sll.sll_ifindex = ifr.ifr_ifindex;
+		if(bind(r->fd, (sockaddr*)&sll, sizeof(sll)) < 0) {
+			LOG_CRITICAL("Failed to bind to '%s'. Reason: %s\n", interface.c_str(), strerror(errno));
+			return false;
+		}
+
+		if(threads > 1) {
+			int mode;
+			if(fanout_mode == "hash") {
+				mode = PACKET_FANOUT_HASH;
+			} else if(fanout_mode == "lb") {
+				mode = PACKET_FANOUT_LB;
+			} else if(fanout_mode == "cpu") {
+				mode = PACKET_FANOUT_CPU;
+			} else if(fanout_mode == "qm") {
+				mode = PACKET_FANOUT_QM;
+			} else {
+				LOG_CRITICAL("Unknown fanout mode '%s'. Expected hash, lb, cpu or qm.\n", fanout_mode.c_str());
+				return false;
+			}
+
+			/* Keep IP fragments of one datagram on the same thread */
+			int arg = (fanout_id & 0xffff) | ((mode | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+			if(setsockopt(r->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+				LOG_CRITICAL("Failed to join fanout group %d. Reason: %s\n", fanout_id, strerror(errno));
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	/* libpcap does the compiling. The resulting program is handed to the kernel
+	   with SO_ATTACH_FILTER so filtered packets never reach the ring. */
+	bool compile_filter() {
+		bpf_program prog;
+		pcap_t* p = pcap_open_dead(DLT_EN10MB, 65535);
+
+		if(!p) {
+			LOG_CRITICAL("pcap_open_dead() failed.\n");
+			return false;
+		}
+
+		if(pcap_compile(p, &prog, filter_string.c_str(), 1, 0xffffffff) < 0) {
+			LOG_CRITICAL("Failed to compile filter '%s': %s\n", filter_string.c_str(), pcap_geterr(p));
+			pcap_close(p);
+			return false;
+		}
+
+		for(unsigned int i = 0; i < prog.bf_len; i++) {
+			sock_filter f;
+			f.code = prog.bf_insns[i].code;
+			f.jt = prog.bf_insns[i].jt;
+			f.jf = prog.bf_insns[i].jf;
+			f.k = prog.bf_insns[i].k;
+			filter_code.push_back(f);
+		}
+
+		filter.len = filter_code.size();
+		filter.filter = &filter_code[0];
+
+		pcap_freecode(&prog);
+		pcap_close(p);
+
+		LOG_INFO("Using capture filter '%s' (%u instructions).\n", filter_string.c_str(), filter.len);
+		return true;
+	}
+
+	/* Reads PACKET_STATISTICS from every ring and publishes the totals on
+	   'AFPacketInput.stats' so they show up in the Monitor. */
+	void publish_stats() {
+		unsigned long long packets = 0, bytes = 0, blocks = 0, drops = 0, seen = 0, freezes = 0;
+		ostringstream out;
+
+		for(size_t i = 0; i < rings.size(); i++) {
+			RxRing* r = rings[i];
+			tpacket_stats_v3 st;
+			socklen_t len = sizeof(st);
+
+			if(r->fd != -1 && getsockopt(r->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0) {
+				r->kernel_packets += st.tp_packets;
+				r->kernel_drops += st.tp_drops;
+				r->freeze_count += st.tp_freeze_q_cnt;
+			}
+
+			packets += r->packets;
+			bytes += r->bytes;
+			blocks += r->blocks;
+			seen += r->kernel_packets;
+			drops += r->kernel_drops;
+			freezes += r->freeze_count;
+		}
+
+		out << "packets=" << packets << " bytes=" << bytes << " blocks=" << blocks
+			<< " kernel_packets=" << seen << " kernel_drops=" << drops << " freeze_q=" << freezes;
+
+		LOG_DEBUG("AFPacketInput stats: %s\n", out.str().c_str());
+
+		NpsGateVar* var = new NpsGateVar();
+		var->set(out.str());
+		publish(stats_topic, var);
+		var->unref();
+	}
+};
+
+NPSGATE_PLUGIN_CREATE(AFPacketInput);
+NPSGATE_PLUGIN_DESTROY();
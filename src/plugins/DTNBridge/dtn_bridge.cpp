@@ -23,29 +23,24 @@
 #include "../npsgate_plugin.hpp"
 #include "../logger.hpp"
 #include "dtn_bridge.h"
+#include "dtn_stream.h"
 #include "npsgate_lwip.h"
 
+#include "lwip/sys.h"
 #include "lwip/tcp.h"
 #include "lwip/tcp_impl.h"
 #include "lwip/stats.h"
+#include "lwip/memp.h"
 
 using namespace Crafter;
 using namespace NpsGate;
 
-/*static string addr_to_str(uint32_t addr) { 
-	char buffer[16];
-	sprintf(buffer, "%hhu.%hhu.%hhu.%hhu", (addr>>24), (addr>>16), (addr>>8), addr);
-	return string(buffer);
-}*/
-
-static uint32_t str_to_addr(const string& str) {
-	uint8_t a, b, c, d;
-	sscanf(str.c_str(), "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d);
-	return (a<<24) + (b<<16) + (c<<8) + d;
-}
-
 DTNBridge::DTNBridge(PluginCore* c) : NpsGatePlugin(c) {
-	lwip = new NpsGateLWIP(this, 1500);
+	lwip = NULL;
+	stats_interval = 5;
+	stats_connections = 256;
+	last_stats = 0;
+	last_tmr = 0;
 }
 
 DTNBridge::~DTNBridge() {
@@ -54,15 +49,78 @@ DTNBridge::~DTNBridge() {
 
 bool DTNBridge::init() {
 	string dtn_subnet;
-
-	set_timeout(250);
+	unsigned int idle_timeout = 3600;
+	unsigned int window = TCP_WND;
+	unsigned int send_buffer = TCP_SND_BUF;
+	bool sack = true;
+	unsigned int coalesce = 16384;
+	unsigned int coalesce_delay = 5;
 
 	const Config* config = get_config();
 
+	sack_topic = register_topic("DTNBridge.sack");
+	stream_topic = register_topic("DTNBridge.stream");
+	http_topic = register_topic("DTNBridge.http");
+	pools_topic = register_topic("DTNBridge.pools");
+	totals_topic = register_topic("DTNBridge.totals");
+	connections_topic = register_topic("DTNBridge.connections");
+
 	if(!config->lookupValue("dtnbridge.dtn_subnet", dtn_subnet)) {
 		LOG_CRITICAL("Missing 'dtn_subnet' configuration directive.\n");
 	}
 
+	/* lwIP carves its pools out when the stack is created, so they are sized from
+	   dtnbridge.pools first, by their names in memp_std.h */
+	if(config->exists("dtnbridge.pools")) {
+		try {
+			const Setting& pools = config->lookup("dtnbridge.pools");
+
+			for(int i = 0; i < pools.getLength(); i++) {
+				memp_t type = memp_find(pools[i].getName());
+				unsigned int num = pools[i];
+
+				if(type == MEMP_MAX) {
+					LOG_CRITICAL("Unknown lwIP pool '%s'.\n", pools[i].getName());
+					return false;
+				}
+				memp_set_num(type, num);
+			}
+		} catch(SettingException& ex) {
+			LOG_CRITICAL("Invalid pool configuration at '%s'.\n", ex.getPath());
+			return false;
+		}
+	}
+
+	lwip = new NpsGateLWIP(this, 1500);
+
+	config->lookupValue("dtnbridge.idle_timeout", idle_timeout);
+	lwip->set_idle_timeout(idle_timeout);
+
+	config->lookupValue("dtnbridge.window", window);
+	config->lookupValue("dtnbridge.send_buffer", send_buffer);
+	lwip->set_window(window, send_buffer);
+
+	config->lookupValue("dtnbridge.sack", sack);
+	lwip->set_sack(sack);
+
+	config->lookupValue("dtnbridge.coalesce", coalesce);
+	config->lookupValue("dtnbridge.coalesce_delay", coalesce_delay);
+	lwip->set_coalesce(coalesce, coalesce_delay);
+
+	if(!parse_http(config)) {
+		return false;
+	}
+
+	/* Wakes up for lwIP's 250ms timer and to send data that has waited out the
+	   coalescing delay */
+	set_timeout(coalesce_delay < 1 ? 1 : (coalesce_delay < 250 ? coalesce_delay : 250));
+
+	config->lookupValue("dtnbridge.stats_interval", stats_interval);
+	config->lookupValue("dtnbridge.stats_connections", stats_connections);
+	if(stats_interval < 1) {
+		stats_interval = 1;
+	}
+
 	dtn_path = "DTNOutput";
 	dtn_network = LWIPSocket::str_to_addr(dtn_subnet);
 	dtn_netmask = LWIPSocket::prefix_to_netmask(24);
@@ -70,6 +128,44 @@ bool DTNBridge::init() {
 	return true;
 }
 
+/* dtnbridge.http carries connections to 'ports' as HTTP transactions, holding
+   each message for up to 'hold' KB and 'hold_time' milliseconds. The far end
+   needs no configuration, the open of each connection tells it. */
+bool DTNBridge::parse_http(const Config* config) {
+	vector<uint16_t> ports;
+	unsigned int hold = 1024;
+	unsigned int hold_time = 2000;
+
+	if(!config->exists("dtnbridge.http")) {
+		return true;
+	}
+
+	try {
+		const Setting& http = config->lookup("dtnbridge.http");
+
+		http.lookupValue("hold", hold);
+		http.lookupValue("hold_time", hold_time);
+
+		if(http.exists("ports")) {
+			const Setting& list = http["ports"];
+			for(int i = 0; i < list.getLength(); i++) {
+				int port = list[i];
+				ports.push_back(port);
+			}
+		} else {
+			ports.push_back(80);
+		}
+	} catch(SettingException& ex) {
+		LOG_CRITICAL("Invalid HTTP configuration at '%s'.\n", ex.getPath());
+		return false;
+	}
+
+	lwip->set_http(ports, (size_t)hold << 10, hold_time);
+	LOG_INFO("DTNBridge carrying HTTP transactions on %u ports, holding up to %u KB for %u ms.\n",
+			(unsigned int)ports.size(), hold, hold_time);
+	return true;
+}
+
 bool DTNBridge::send_data(uint8_t* data, int len) {
 	Packet* p = new Packet();
 
@@ -80,118 +176,114 @@ bool DTNBridge::send_data(uint8_t* data, int len) {
 	return true;
 }
 
-bool DTNBridge::process_packet(Packet* p) {
-	IP* ip = p->GetLayer<IP>();
-	string dstaddr = ip->GetDestinationIP();
-
-	uint32_t daddr = LWIPSocket::str_to_addr(dstaddr);
-
+bool DTNBridge::send_dtn(uint8_t* data, int len) {
+	Packet* p = new Packet();
 
-	daddr &= dtn_netmask;
+	p->PacketFromIP((byte*)data, len);
 
-	if(daddr == dtn_network) {
-		process_ip_packet(p);
-	} else {
-		process_dtn_packet(p);
-	}
+	forward_packet(dtn_path, p);
 
-	drop_packet(p);
 	return true;
 }
 
-bool DTNBridge::process_dtn_packet(Packet* p) {
-	IP* ip = p->GetLayer<IP>();
-	TCP* tcp = p->GetLayer<TCP>();
-	if(!ip || !tcp) {
-		LOG_WARNING("Packet is not a TCP/IP packet. Dropping!\n");
-		return false;
-	}
-
-	uint32_t saddr = str_to_addr(ip->GetSourceIP());
-	uint32_t daddr = str_to_addr(ip->GetDestinationIP());
-	uint16_t sport = tcp->GetSrcPort();
-	uint16_t dport = tcp->GetDstPort();
-	uint16_t flags = tcp->GetFlags();
-
-	LWIPSocket* s = lwip->find_socket(saddr, daddr, sport, dport);
+bool DTNBridge::process_packet(Packet* p) {
+	FlowKey key;
+	uint8_t flags;
 
-	/* If we get a SYN, if there is an existing connection, drop. Otherwise,
-	   create a new connection. */
-	if(flags == TCP::SYN && s) {
-		LOG_WARNING("Received a SYN for an existing connection. Dropping.\n");
-		return false;
-	} else if(flags == TCP::SYN) {
-		lwip->connect(saddr, daddr, sport, dport);
+	if(dtn_stream_message(p->GetRawPtr(), p->GetSize())) {
+		process_dtn_packet(p);
+		lwip->flush_streams();
+		drop_packet(p);
 		return true;
 	}
 
-	/* Should not be receiving SYN/ACKs over DTN */
-	if(flags == (TCP::SYN | TCP::ACK)) {
-		LOG_WARNING("Should not receive a SYN/ACK over DTN.\n");
-		return false;
-	}
-
-	/* Handle packets not associated with a connection */
-	if(!s) {
-		LOG_WARNING("Received a packet not associated with a socket. Dropping.\n");
-		return false;
-	}
-
-	if(flags & TCP::FIN) {
-		s->close();
+	/* Addresses and ports are read straight out of the headers rather than going
+	   through Crafter's string representation. */
+	if(!FlowKey::from_ip_header(p->GetRawPtr(), p->GetSize(), &key, &flags)) {
+		LOG_WARNING("Packet is not a TCP/IP packet. Dropping!\n");
+		drop_packet(p);
 		return true;
 	}
 
-	RawLayer* data = p->GetLayer<RawLayer>();
-	if(data) {
-		s->send((uint8_t*)data->GetPayload().GetRawPointer(), data->GetSize());
-		return true;
+	if((key.daddr & dtn_netmask) == dtn_network) {
+		process_ip_packet(p, key, flags);
+		lwip->flush_streams();
+	} else {
+		LOG_DEBUG("TCP packet to %s is not for the DTN subnet. Dropping.\n", key.str().c_str());
 	}
 
-	//LOG_WARNING("No data in this packet!\n");
-
-	return false;
+	drop_packet(p);
+	return true;
 }
 
-bool DTNBridge::process_ip_packet(Packet* p) {
-	IP* ip = p->GetLayer<IP>();
-	TCP* tcp = p->GetLayer<TCP>();
-	if(!ip || !tcp) {
-		LOG_WARNING("Packet is not a TCP/IP packet. Dropping!\n");
+/* Replays a connection's stream records from the other end of the DTN link */
+bool DTNBridge::process_dtn_packet(Packet* p) {
+	DtnStreamReader r(p->GetRawPtr(), p->GetSize());
+	const uint8_t* data;
+	uint8_t type;
+	size_t len;
+
+	if(!r.valid()) {
+		LOG_WARNING("Malformed stream message received over DTN. Dropping.\n");
 		return false;
 	}
 
-	//uint32_t saddr = str_to_addr(ip->GetSourceIP());
-	uint32_t daddr = str_to_addr(ip->GetDestinationIP());
-	//uint16_t sport = tcp->GetSrcPort();
-	uint16_t dport = tcp->GetDstPort();
-	uint16_t flags = tcp->GetFlags();
-
-	/* If we get a SYN, first make sure LWIP is listening */
-	if(flags == TCP::SYN) {
-		lwip->listen(daddr, dport);
+	LWIPSocket* s = lwip->find_socket(r.saddr, r.daddr, r.sport, r.dport);
+
+	while(r.next(&type, &data, &len)) {
+		switch(type) {
+			case DTN_STREAM_OPEN:
+				if(s) {
+					LOG_WARNING("Received an open for an existing connection. Ignoring.\n");
+				} else {
+					s = lwip->connect(r.saddr, r.daddr, r.sport, r.dport);
+					if(s && len >= 1 && (data[0] & DTN_STREAM_OPEN_HTTP)) {
+						lwip->enable_http(s, HTTP_RESPONSE);
+					}
+				}
+				break;
+
+			case DTN_STREAM_DATA:
+				if(!s) {
+					LOG_DEBUG("Received data not associated with a socket. Dropping.\n");
+					return false;
+				}
+				s->send((uint8_t*)data, len);
+				lwip->http_request_sent(s, data, len);
+				break;
+
+			case DTN_STREAM_FIN:
+				if(s) {
+					s->close();
+				}
+				break;
+
+			case DTN_STREAM_RESET:
+				if(s) {
+					s->abort();
+					s = NULL;
+				}
+				break;
+
+			default:
+				LOG_WARNING("Unknown stream record type %u. Dropping the rest of the message.\n", type);
+				return false;
+		}
 	}
 
-	/* We always send the packet to LWIP */
-	lwip->inject_packet(p);
-
-
-	/* All packets with flags set (other than ACK) get sent regardless */
-	if(flags & (~TCP::ACK)) {
-		//LOG_INFO("Got packet with flags, sending over DTN.\n");
-		forward_packet(dtn_path, p);
-		return true;
-	}
+	return true;
+}
 
-	/* Only data packets get sent over DTN */
-	RawLayer* data = p->GetLayer<RawLayer>();
-	if(data) {
-		//LOG_INFO("Data in this packet, sending over DTN.\n");
-		forward_packet(dtn_path, p);
-		return true;
+bool DTNBridge::process_ip_packet(Packet* p, const FlowKey& key, uint8_t flags) {
+	/* If we get a SYN, first make sure LWIP is listening. A retransmitted SYN for
+	   a connection that was already accepted does not need another listener. */
+	if(flags == TCP::SYN && !lwip->find_socket(key.daddr, key.saddr, key.dport, key.sport)) {
+		lwip->listen(key.daddr, key.dport);
 	}
 
-	//LOG_INFO("No data in this packet, not sending over DTN.\n");
+	/* The host's segments end in lwIP. What goes over DTN is the stream lwIP
+	   hands back, so ACKs, retransmissions and headers never cross the link. */
+	lwip->inject_packet(p);
 
 	return true;
 }
@@ -201,7 +293,48 @@ bool DTNBridge::process_message(Message* m) {
 }
 
 bool DTNBridge::message_timeout() {
-	lwip->timeout();
+	lwip->flush_streams();
+	if(sys_now() - last_tmr >= 250) {
+		lwip->timeout();
+		last_tmr = sys_now();
+	}
+
+	if(time(NULL) - last_stats >= (time_t)stats_interval) {
+		ProxyTotals totals;
+		NpsGateVar* var = new NpsGateVar();
+		var->set(lwip->sack_stats());
+		publish(sack_topic, var);
+		var->unref();
+
+		var = new NpsGateVar();
+		var->set(lwip->stream_stats());
+		publish(stream_topic, var);
+		var->unref();
+
+		var = new NpsGateVar();
+		var->set(lwip->http_stats());
+		publish(http_topic, var);
+		var->unref();
+
+		var = new NpsGateVar();
+		var->set(lwip->pool_stats());
+		publish(pools_topic, var);
+		var->unref();
+
+		lwip->proxy_totals(&totals);
+		var = new NpsGateVar();
+		var->set(totals.str());
+		publish(totals_topic, var);
+		var->unref();
+
+		if(stats_connections) {
+			var = new NpsGateVar();
+			var->set(lwip->connection_stats(stats_connections));
+			publish(connections_topic, var);
+			var->unref();
+		}
+		last_stats = time(NULL);
+	}
 
 	return true;
 }
@@ -42,9 +42,10 @@ public:
 	~DTNBridge();
 	bool init();
 	bool send_data(uint8_t* data, int len);
+	bool send_dtn(uint8_t* data, int len);
 	bool process_packet(Packet* p);
 	bool process_dtn_packet(Packet* p);
-	bool process_ip_packet(Packet* p);
+	bool process_ip_packet(Packet* p, const FlowKey& key, uint8_t flags);
 	bool process_message(Message* m);
 	bool message_timeout();
 	bool main();
@@ -57,8 +58,14 @@ private:
 	string ip_path;
 	uint32_t dtn_network;
 	uint32_t dtn_netmask;
+	unsigned int stats_interval;	/* Seconds between publications */
+	unsigned int stats_connections;	/* Most connections listed on DTNBridge.connections */
+	time_t last_stats;
+	TopicId sack_topic, stream_topic, http_topic, pools_topic, totals_topic, connections_topic;
+	uint32_t last_tmr;		/* sys_now() of the last tcp_tmr() */
 
 	uint32_t generate_sequence_num();
+	bool parse_http(const Config* config);
 };
 
 
@@ -0,0 +1,171 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file dtn_stream.h
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef DTN_STREAM_H
+#define DTN_STREAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "../checksum.h"
+
+/* What DTNBridge sends over DTN for a connection: the stream its host wrote and
+ * the opening and closing of the connection, instead of the host's segments.
+ * Records of one connection are collected in to a message:
+ *
+ *	IPv4 header (20) | source port (2) | destination port (2) | { type (1) | length (2) | data } ...
+ *
+ * The IPv4 header carries DTN_STREAM_PROTO and the connection's addresses, so
+ * the message travels through the pipeline and is routed by DTNOutput like any
+ * packet. Addresses and ports are those of the host that opened the connection
+ * when it flows from that host, and swapped when it flows to it, as they would
+ * be in the host's own segments.
+ *
+ * An OPEN record may carry one byte of DTN_STREAM_OPEN_* flags. With
+ * DTN_STREAM_OPEN_HTTP the connection carries HTTP/1.1, and each end sends a
+ * whole request or response, or a pipelined run of them, in one go rather than
+ * as the host writes it. */
+
+#define DTN_STREAM_PROTO	253		/* RFC 3692 experimental protocol number */
+#define DTN_STREAM_HEADER	24
+#define DTN_STREAM_RECORD	3
+#define DTN_STREAM_MAX		0xffff	/* Largest message, the IPv4 limit */
+
+enum DtnStreamType {
+	DTN_STREAM_OPEN = 1,	/* Connect to the destination */
+	DTN_STREAM_DATA,
+	DTN_STREAM_FIN,			/* The host closed its side */
+	DTN_STREAM_RESET		/* The connection was aborted */
+};
+
+#define DTN_STREAM_OPEN_HTTP	0x01
+
+/* Starts an empty message */
+static inline void dtn_stream_begin(std::vector<uint8_t>& msg) {
+	msg.assign(DTN_STREAM_HEADER, 0);
+}
+
+static inline void dtn_stream_append(std::vector<uint8_t>& msg, uint8_t type, const uint8_t* data, size_t len) {
+	size_t off;
+
+	if(msg.empty()) {
+		dtn_stream_begin(msg);
+	}
+
+	off = msg.size();
+	msg.resize(off + DTN_STREAM_RECORD + len);
+	msg[off] = type;
+	msg[off + 1] = len >> 8;
+	msg[off + 2] = len & 0xff;
+	if(len) {
+		memcpy(&msg[off + DTN_STREAM_RECORD], data, len);
+	}
+}
+
+/* Fills in the header, addresses and ports in host byte order */
+static inline void dtn_stream_finish(std::vector<uint8_t>& msg, uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport) {
+	uint8_t* h = &msg[0];
+	uint16_t check;
+
+	memset(h, 0, 20);
+	h[0] = 0x45;
+	h[2] = msg.size() >> 8;
+	h[3] = msg.size() & 0xff;
+	h[6] = 0x40;				/* Don't fragment */
+	h[8] = 64;
+	h[9] = DTN_STREAM_PROTO;
+	h[12] = saddr >> 24; h[13] = saddr >> 16; h[14] = saddr >> 8; h[15] = saddr;
+	h[16] = daddr >> 24; h[17] = daddr >> 16; h[18] = daddr >> 8; h[19] = daddr;
+	check = csum_buffer(h, 20);
+	memcpy(h + 10, &check, 2);
+
+	h[20] = sport >> 8;
+	h[21] = sport & 0xff;
+	h[22] = dport >> 8;
+	h[23] = dport & 0xff;
+}
+
+static inline bool dtn_stream_message(const uint8_t* data, size_t len) {
+	return len >= DTN_STREAM_HEADER && (data[0] >> 4) == 4 && data[9] == DTN_STREAM_PROTO;
+}
+
+/**************************************************************
+ **
+ ** DtnStreamReader walks the records of a received message.
+ ** It stops at the first record that runs past the end.
+ **
+ **************************************************************/
+class DtnStreamReader {
+	public:
+		DtnStreamReader(const uint8_t* data, size_t len) : p(NULL), end(NULL), saddr(0), daddr(0), sport(0), dport(0) {
+			size_t ihl;
+			size_t total;
+
+			if(!dtn_stream_message(data, len)) {
+				return;
+			}
+
+			ihl = (data[0] & 0x0f) * 4;
+			total = (data[2] << 8) | data[3];
+			if(ihl < 20 || total > len || total < ihl + 4) {
+				return;
+			}
+
+			saddr = (data[12] << 24) | (data[13] << 16) | (data[14] << 8) | data[15];
+			daddr = (data[16] << 24) | (data[17] << 16) | (data[18] << 8) | data[19];
+			sport = (data[ihl] << 8) | data[ihl + 1];
+			dport = (data[ihl + 2] << 8) | data[ihl + 3];
+			p = data + ihl + 4;
+			end = data + total;
+		}
+
+		bool valid() const { return p != NULL; }
+
+		bool next(uint8_t* type, const uint8_t** data, size_t* len) {
+			size_t n;
+
+			if(!p || end - p < DTN_STREAM_RECORD) {
+				return false;
+			}
+
+			n = (p[1] << 8) | p[2];
+			if((size_t)(end - p) < DTN_STREAM_RECORD + n) {
+				p = end;
+				return false;
+			}
+
+			*type = p[0];
+			*data = p + DTN_STREAM_RECORD;
+			*len = n;
+			p += DTN_STREAM_RECORD + n;
+			return true;
+		}
+
+	private:
+		const uint8_t* p;
+		const uint8_t* end;
+
+	public:
+		uint32_t saddr;
+		uint32_t daddr;
+		uint16_t sport;
+		uint16_t dport;
+};
+
+#endif /* DTN_STREAM_H */
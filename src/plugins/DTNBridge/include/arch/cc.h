@@ -53,6 +53,7 @@ typedef uint16_t	u16_t;
 typedef int16_t		s16_t;
 typedef uint32_t	u32_t;
 typedef int32_t		s32_t;
+typedef uint64_t	u64_t;
 
 typedef uint64_t mem_ptr_t;
 
@@ -67,7 +68,10 @@ typedef u32_t sys_prot_t;
 #define PACK_STRUCT_END
 #define PACK_STRUCT_FIELD(x) x
 
-#define LWIP_CHKSUM_ALGORITHM 2
+/* Every segment in and out is summed, so use the vectorized checksum the
+   plugins share instead of lwIP's generic loops */
+#include "../../../checksum.h"
+#define LWIP_CHKSUM csum_lwip
 
 /* prototypes for printf() and abort() */
 #include <stdio.h>
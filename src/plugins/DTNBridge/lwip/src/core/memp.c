@@ -64,6 +64,9 @@
 #include "lwip/mld6.h"
 
 #include <string.h>
+#if MEMP_ARENA
+#include <stdlib.h>
+#endif /* MEMP_ARENA */
 
 #if !MEMP_MEM_MALLOC /* don't build if not configured for use in lwipopts.h */
 
@@ -116,9 +119,11 @@ struct memp {
 
 #endif /* MEMP_OVERFLOW_CHECK */
 
+#if !MEMP_ARENA
 /** This array holds the first free element of each pool.
  *  Elements form a linked list. */
 static struct memp *memp_tab[MEMP_MAX];
+#endif /* !MEMP_ARENA */
 
 #else /* MEMP_MEM_MALLOC */
 
@@ -135,7 +140,7 @@ const u16_t memp_sizes[MEMP_MAX] = {
 #include "lwip/memp_std.h"
 };
 
-#if !MEMP_MEM_MALLOC /* don't build if not configured for use in lwipopts.h */
+#if !MEMP_MEM_MALLOC && !MEMP_ARENA /* don't build if not configured for use in lwipopts.h */
 
 /** This array holds the number of elements in each pool. */
 static const u16_t memp_num[MEMP_MAX] = {
@@ -483,4 +488,209 @@ memp_free(memp_t type, void *mem)
   SYS_ARCH_UNPROTECT(old_level);
 }
 
-#endif /* MEMP_MEM_MALLOC */
+#endif /* !MEMP_MEM_MALLOC && !MEMP_ARENA */
+
+#if MEMP_ARENA
+
+#if MEMP_OVERFLOW_CHECK
+#error "MEMP_ARENA does not support MEMP_OVERFLOW_CHECK"
+#endif
+
+#define MEMP_ARENA_ROUND(x, a) (((x) + ((a) - 1)) & ~(size_t)((a) - 1))
+
+/** Names of the pools, for memp_find() and memp_get_usage() */
+static const char *const memp_names[MEMP_MAX] = {
+#define LWIP_MEMPOOL(name,num,size,desc)  #name,
+#include "lwip/memp_std.h"
+};
+
+/** Number of elements the next memp_init() gives each pool */
+static LWIP_PER_THREAD u32_t memp_num[MEMP_MAX] = {
+#define LWIP_MEMPOOL(name,num,size,desc)  (num),
+#include "lwip/memp_std.h"
+};
+
+/** One pool's slice of the arena. Freed elements are reused first, then the
+ *  ones from 'next' up to 'end' that were never handed out. */
+struct memp_pool {
+  struct memp *free;
+  u8_t *next;
+  u8_t *end;
+  u32_t stride;
+  u32_t num;
+  u32_t used;
+  u32_t max;
+  u32_t err;
+};
+
+static LWIP_PER_THREAD struct memp_pool memp_pools[MEMP_MAX];
+/** What malloc() returned for the arena, the pools start on the first line in it */
+static LWIP_PER_THREAD void *memp_arena;
+
+/** Bytes between two elements of a pool */
+static size_t
+memp_stride(u16_t type)
+{
+  size_t size = LWIP_MAX(memp_sizes[type], sizeof(struct memp));
+
+  if (size >= MEMP_ARENA_LINE) {
+    return MEMP_ARENA_ROUND(size, MEMP_ARENA_LINE);
+  }
+  return MEMP_ARENA_ROUND(size, LWIP_MAX(MEM_ALIGNMENT, sizeof(void *)));
+}
+
+/**
+ * Allocates the arena and divides it between the pools, sized by
+ * memp_set_num(). Called by lwip_init(), again releases the previous arena.
+ * If the arena cannot be allocated every pool is empty.
+ */
+void
+memp_init(void)
+{
+  size_t total = 0;
+  u8_t *p;
+  u16_t i;
+
+  memp_release();
+
+  for (i = 0; i < MEMP_MAX; ++i) {
+    total += MEMP_ARENA_ROUND((size_t)memp_num[i] * memp_stride(i), MEMP_ARENA_LINE);
+  }
+
+  memp_arena = malloc(total + MEMP_ARENA_LINE);
+  if (memp_arena == NULL) {
+    LWIP_DEBUGF(MEMP_DEBUG | LWIP_DBG_LEVEL_SEVERE, ("memp_init: cannot allocate %lu bytes\n", (unsigned long)total));
+    return;
+  }
+
+  p = (u8_t *)MEMP_ARENA_ROUND((mem_ptr_t)memp_arena, MEMP_ARENA_LINE);
+  for (i = 0; i < MEMP_MAX; ++i) {
+    struct memp_pool *pool = &memp_pools[i];
+
+    pool->stride = (u32_t)memp_stride(i);
+    pool->num = memp_num[i];
+    pool->next = p;
+    pool->end = p + (size_t)pool->num * pool->stride;
+    p += MEMP_ARENA_ROUND((size_t)pool->num * pool->stride, MEMP_ARENA_LINE);
+  }
+}
+
+/**
+ * Frees the arena. Every element handed out from it is gone, so only call
+ * this once the stack is no longer used.
+ */
+void
+memp_release(void)
+{
+  free(memp_arena);
+  memp_arena = NULL;
+  memset(memp_pools, 0, sizeof(memp_pools));
+}
+
+/**
+ * Sets the number of elements a pool gets from the next memp_init().
+ *
+ * @param type the pool to size
+ * @param num its number of elements
+ */
+void
+memp_set_num(memp_t type, u32_t num)
+{
+  LWIP_ERROR("memp_set_num: type < MEMP_MAX", (type < MEMP_MAX), return;);
+  memp_num[type] = num;
+}
+
+/**
+ * @param name a pool's name in memp_std.h, e.g. "TCP_SEG"
+ * @return the pool, MEMP_MAX if there is none by that name
+ */
+memp_t
+memp_find(const char *name)
+{
+  u16_t i;
+
+  for (i = 0; i < MEMP_MAX; ++i) {
+    if (strcmp(memp_names[i], name) == 0) {
+      return (memp_t)i;
+    }
+  }
+  return MEMP_MAX;
+}
+
+/**
+ * @param type the pool to look at
+ * @param usage filled in with the pool's size and occupancy
+ */
+void
+memp_get_usage(memp_t type, struct memp_usage *usage)
+{
+  struct memp_pool *pool;
+
+  LWIP_ERROR("memp_get_usage: type < MEMP_MAX", (type < MEMP_MAX), return;);
+  pool = &memp_pools[type];
+  usage->name = memp_names[type];
+  usage->size = (u32_t)memp_stride(type);
+  usage->num = pool->num;
+  usage->used = pool->used;
+  usage->max = pool->max;
+  usage->err = pool->err;
+}
+
+/**
+ * Get an element from a specific pool.
+ *
+ * @param type the pool to get an element from
+ *
+ * @return a pointer to the allocated memory or a NULL pointer on error
+ */
+void *
+memp_malloc(memp_t type)
+{
+  struct memp_pool *pool;
+  void *mem;
+
+  LWIP_ERROR("memp_malloc: type < MEMP_MAX", (type < MEMP_MAX), return NULL;);
+
+  pool = &memp_pools[type];
+  if (pool->free != NULL) {
+    mem = pool->free;
+    pool->free = pool->free->next;
+  } else if (pool->next < pool->end) {
+    mem = pool->next;
+    pool->next += pool->stride;
+  } else {
+    LWIP_DEBUGF(MEMP_DEBUG | LWIP_DBG_LEVEL_SERIOUS, ("memp_malloc: out of memory in pool %s\n", memp_names[type]));
+    pool->err++;
+    return NULL;
+  }
+
+  pool->used++;
+  if (pool->used > pool->max) {
+    pool->max = pool->used;
+  }
+  return mem;
+}
+
+/**
+ * Put an element back into its pool.
+ *
+ * @param type the pool where to put mem
+ * @param mem the memp element to free
+ */
+void
+memp_free(memp_t type, void *mem)
+{
+  struct memp_pool *pool;
+
+  if (mem == NULL) {
+    return;
+  }
+  LWIP_ERROR("memp_free: type < MEMP_MAX", (type < MEMP_MAX), return;);
+
+  pool = &memp_pools[type];
+  ((struct memp *)mem)->next = pool->free;
+  pool->free = (struct memp *)mem;
+  pool->used--;
+}
+
+#endif /* MEMP_ARENA */
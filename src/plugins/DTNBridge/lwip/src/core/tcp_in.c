@@ -61,25 +61,40 @@
 #if LWIP_ND6_TCP_REACHABILITY_HINTS
 #include "lwip/nd6.h"
 #endif /* LWIP_ND6_TCP_REACHABILITY_HINTS */
+#if LWIP_TCP_CC
+#include "lwip/sys.h"
+#endif
 
 /* These variables are global to all functions involved in the input
    processing of TCP segments. They are set by the tcp_input()
    function. */
-static struct tcp_seg inseg;
-static struct tcp_hdr *tcphdr;
-static u32_t seqno, ackno;
-static u8_t flags;
-static u16_t tcplen;
+static LWIP_PER_THREAD struct tcp_seg inseg;
+static LWIP_PER_THREAD struct tcp_hdr *tcphdr;
+static LWIP_PER_THREAD u32_t seqno, ackno;
+static LWIP_PER_THREAD u8_t flags;
+static LWIP_PER_THREAD u16_t tcplen;
+
+static LWIP_PER_THREAD u8_t recv_flags;
+static LWIP_PER_THREAD struct pbuf *recv_data;
 
-static u8_t recv_flags;
-static struct pbuf *recv_data;
+#if LWIP_TCP_SACK
+/* SACK blocks of the incoming segment, left/right edge pairs in host byte order */
+static LWIP_PER_THREAD u32_t sack_blocks[2 * LWIP_TCP_SACK_BLOCKS];
+static LWIP_PER_THREAD u8_t sack_count;
+#endif /* LWIP_TCP_SACK */
 
-struct tcp_pcb *tcp_input_pcb;
+LWIP_PER_THREAD struct tcp_pcb *tcp_input_pcb;
 
 /* Forward declarations. */
 static err_t tcp_process(struct tcp_pcb *pcb);
 static void tcp_receive(struct tcp_pcb *pcb);
 static void tcp_parseopt(struct tcp_pcb *pcb);
+#if LWIP_TCP_SACK
+static void tcp_sack_mark(struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_CC
+static void tcp_rtt_sample(struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_CC */
 
 static err_t tcp_listen_input(struct tcp_pcb_listen *pcb);
 static err_t tcp_timewait_input(struct tcp_pcb *pcb);
@@ -171,7 +186,11 @@ tcp_input(struct pbuf *p, struct netif *inp)
      for an active connection. */
   prev = NULL;
 
-  
+#if LWIP_TCP_PCB_HOOKS && !LWIP_IPV6
+  /* The port keeps its own index of the active pcbs */
+  pcb = lwip_hook_tcp_pcb_lookup(ip_current_src_addr()->addr, ip_current_dest_addr()->addr,
+                                 tcphdr->src, tcphdr->dest);
+#else /* LWIP_TCP_PCB_HOOKS && !LWIP_IPV6 */
   for(pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
     LWIP_ASSERT("tcp_input: active pcb->state != CLOSED", pcb->state != CLOSED);
     LWIP_ASSERT("tcp_input: active pcb->state != TIME-WAIT", pcb->state != TIME_WAIT);
@@ -195,6 +214,7 @@ tcp_input(struct pbuf *p, struct netif *inp)
     }
     prev = pcb;
   }
+#endif /* LWIP_TCP_PCB_HOOKS && !LWIP_IPV6 */
 
   if (pcb == NULL) {
     /* If it did not go to an active connection, we check the connections
@@ -257,6 +277,15 @@ tcp_input(struct pbuf *p, struct netif *inp)
       prev = lpcb_prev;
     }
 #endif /* SO_REUSE */
+#if LWIP_TCP_TRANSPARENT
+    /* A SYN nobody listens for goes to the transparent listener. It is not
+       moved to the front, its place in the list does not matter. */
+    if ((lpcb == NULL) && (tcp_transparent_pcb != NULL) &&
+        ((flags & (TCP_SYN | TCP_ACK)) == TCP_SYN)) {
+      lpcb = tcp_transparent_pcb;
+      prev = NULL;
+    }
+#endif /* LWIP_TCP_TRANSPARENT */
     if (lpcb != NULL) {
       /* Move this PCB to the front of the list so that subsequent
          lookups will be faster (we exploit locality in TCP segment
@@ -424,7 +453,7 @@ tcp_input(struct pbuf *p, struct netif *inp)
           } else {
             /* correct rcv_wnd as the application won't call tcp_recved()
                for the FIN's seqno */
-            if (pcb->rcv_wnd != TCP_WND) {
+            if (pcb->rcv_wnd != TCP_WND_CFG) {
               pcb->rcv_wnd++;
             }
             TCP_EVENT_CLOSED(pcb, err);
@@ -536,7 +565,7 @@ tcp_listen_input(struct tcp_pcb_listen *pcb)
 #endif /* LWIP_IPV6 */
     ipX_addr_copy(ip_current_is_v6(), npcb->local_ip, *ipX_current_dest_addr());
     ipX_addr_copy(ip_current_is_v6(), npcb->remote_ip, *ipX_current_src_addr());
-    npcb->local_port = pcb->local_port;
+    npcb->local_port = tcphdr->dest;
     npcb->remote_port = tcphdr->src;
     npcb->state = SYN_RCVD;
     npcb->rcv_nxt = seqno + 1;
@@ -554,7 +583,8 @@ tcp_listen_input(struct tcp_pcb_listen *pcb)
 
     /* Parse any options in the SYN. */
     tcp_parseopt(npcb);
-    npcb->snd_wnd = SND_WND_SCALE(npcb, tcphdr->wnd);
+    /* The window in a SYN is never scaled (RFC 7323, 2.2) */
+    npcb->snd_wnd = tcphdr->wnd;
     npcb->snd_wnd_max = npcb->snd_wnd;
     npcb->ssthresh = npcb->snd_wnd;
 
@@ -695,7 +725,8 @@ tcp_process(struct tcp_pcb *pcb)
       pcb->rcv_nxt = seqno + 1;
       pcb->rcv_ann_right_edge = pcb->rcv_nxt;
       pcb->lastack = ackno;
-      pcb->snd_wnd = SND_WND_SCALE(pcb, tcphdr->wnd);
+      /* The window in a SYN is never scaled (RFC 7323, 2.2) */
+      pcb->snd_wnd = tcphdr->wnd;
       pcb->snd_wnd_max = pcb->snd_wnd;
       pcb->snd_wl1 = seqno - 1; /* initialise to seqno - 1 to force window update */
       pcb->state = ESTABLISHED;
@@ -930,7 +961,7 @@ tcp_receive(struct tcp_pcb *pcb)
     /* Update window. */
     if (TCP_SEQ_LT(pcb->snd_wl1, seqno) ||
        (pcb->snd_wl1 == seqno && TCP_SEQ_LT(pcb->snd_wl2, ackno)) ||
-       (pcb->snd_wl2 == ackno && tcphdr->wnd > pcb->snd_wnd)) {
+       (pcb->snd_wl2 == ackno && (tcpwnd_size_t)SND_WND_SCALE(pcb, tcphdr->wnd) > pcb->snd_wnd)) {
       pcb->snd_wnd = SND_WND_SCALE(pcb, tcphdr->wnd); 
       /* keep track of the biggest window announced by the remote host to calculate
          the maximum segment size */
@@ -981,6 +1012,12 @@ tcp_receive(struct tcp_pcb *pcb)
      *
      */
 
+#if LWIP_TCP_SACK
+    if (sack_count > 0) {
+      tcp_sack_mark(pcb);
+    }
+#endif /* LWIP_TCP_SACK */
+
     /* Clause 1 */
     if (TCP_SEQ_LEQ(ackno, pcb->lastack)) {
       pcb->acked = 0;
@@ -1022,8 +1059,23 @@ tcp_receive(struct tcp_pcb *pcb)
          in fast retransmit. Also reset the congestion window to the
          slow start threshold. */
       if (pcb->flags & TF_INFR) {
-        pcb->flags &= ~TF_INFR;
-        pcb->cwnd = pcb->ssthresh;
+#if LWIP_TCP_SACK
+        if ((pcb->flags & TF_SACK) && TCP_SEQ_LT(ackno, pcb->recover)) {
+          /* A partial ACK: more holes are left to fill, so recovery goes
+             on. Deflate the window by what was acked so the amount in
+             flight stays the same, plus one segment for the next hole. */
+          if (pcb->cwnd > ackno - pcb->lastack) {
+            pcb->cwnd -= (tcpwnd_size_t)(ackno - pcb->lastack);
+          } else {
+            pcb->cwnd = 0;
+          }
+          pcb->cwnd = LWIP_MAX(pcb->cwnd, pcb->mss) + pcb->mss;
+        } else
+#endif /* LWIP_TCP_SACK */
+        {
+          pcb->flags &= ~TF_INFR;
+          pcb->cwnd = pcb->ssthresh;
+        }
       }
 
       /* Reset the number of retransmissions. */
@@ -1037,14 +1089,23 @@ tcp_receive(struct tcp_pcb *pcb)
       pcb->acked = (tcpwnd_size_t)(ackno - pcb->lastack);
 
       pcb->snd_buf += pcb->acked;
+#if LWIP_TCP_CC
+      pcb->delivered += pcb->acked;
+#endif /* LWIP_TCP_CC */
 
       /* Reset the fast retransmit variables. */
       pcb->dupacks = 0;
       pcb->lastack = ackno;
 
       /* Update the congestion control variables (cwnd and
-         ssthresh). */
-      if (pcb->state >= ESTABLISHED) {
+         ssthresh). Not while still recovering from a loss. */
+      if (pcb->state >= ESTABLISHED && !(pcb->flags & TF_INFR)) {
+#if LWIP_TCP_CC
+        if (pcb->cc != NULL) {
+          pcb->cc->acked(pcb, pcb->acked);
+          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: %s cwnd %"TCPWNDSIZE_F"\n", pcb->cc->name, pcb->cwnd));
+        } else
+#endif /* LWIP_TCP_CC */
         if (pcb->cwnd < pcb->ssthresh) {
           if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
             pcb->cwnd += pcb->mss;
@@ -1086,6 +1147,12 @@ tcp_receive(struct tcp_pcb *pcb)
         }
 
         pcb->snd_queuelen -= pbuf_clen(next->p);
+#if LWIP_TCP_CC && LWIP_TCP_SACK
+        /* Already counted as delivered when it was SACKed */
+        if (next->flags & TF_SEG_SACKED) {
+          pcb->delivered -= next->len;
+        }
+#endif /* LWIP_TCP_CC && LWIP_TCP_SACK */
         tcp_seg_free(next);
 
         LWIP_DEBUGF(TCP_QLEN_DEBUG, ("%"TCPWNDSIZE_F" (after freeing unacked)\n", (tcpwnd_size_t)pcb->snd_queuelen));
@@ -1152,6 +1219,12 @@ tcp_receive(struct tcp_pcb *pcb)
     }
     /* End of ACK for new data processing. */
 
+#if LWIP_TCP_SACK
+    if ((pcb->flags & TF_SACK) && pcb->unacked != NULL) {
+      tcp_rexmit_sack(pcb);
+    }
+#endif /* LWIP_TCP_SACK */
+
     LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_receive: pcb->rttest %"U32_F" rtseq %"U32_F" ackno %"U32_F"\n",
                                 pcb->rttest, pcb->rtseq, ackno));
 
@@ -1181,6 +1254,11 @@ tcp_receive(struct tcp_pcb *pcb)
 
       pcb->rttest = 0;
     }
+#if LWIP_TCP_CC
+    if (pcb->rtt_timing && TCP_SEQ_LT(pcb->rtt_seq, ackno)) {
+      tcp_rtt_sample(pcb);
+    }
+#endif /* LWIP_TCP_CC */
   }
 
   /* If the incoming segment contains data, we must process it
@@ -1435,6 +1513,12 @@ tcp_receive(struct tcp_pcb *pcb)
 
 
         /* Acknowledge the segment(s). */
+#if LWIP_TCP_SACK
+        if ((pcb->flags & TF_SACK) && pcb->ooseq != NULL) {
+          /* A hole was filled but others remain, tell the sender right away */
+          tcp_ack_now(pcb);
+        } else
+#endif /* LWIP_TCP_SACK */
         tcp_ack(pcb);
 
 #if LWIP_IPV6 && LWIP_ND6_TCP_REACHABILITY_HINTS
@@ -1446,6 +1530,13 @@ tcp_receive(struct tcp_pcb *pcb)
 
       } else {
         /* We get here if the incoming segment is out-of-sequence. */
+#if LWIP_TCP_SACK
+        /* With SACK the duplicate ACK waits until the segment is queued,
+           it reports the segment's block first */
+        if (pcb->flags & TF_SACK) {
+          pcb->sack_recent = seqno;
+        } else
+#endif /* LWIP_TCP_SACK */
         tcp_send_empty_ack(pcb);
 #if TCP_QUEUE_OOSEQ
         /* We queue the segment on the ->ooseq queue. */
@@ -1594,6 +1685,11 @@ tcp_receive(struct tcp_pcb *pcb)
         }
 #endif /* TCP_OOSEQ_MAX_BYTES || TCP_OOSEQ_MAX_PBUFS */
 #endif /* TCP_QUEUE_OOSEQ */
+#if LWIP_TCP_SACK
+        if (pcb->flags & TF_SACK) {
+          tcp_send_empty_ack(pcb);
+        }
+#endif /* LWIP_TCP_SACK */
       }
     } else {
       /* The incoming segment is not withing the window. */
@@ -1629,6 +1725,9 @@ tcp_parseopt(struct tcp_pcb *pcb)
 #endif
 
   opts = (u8_t *)tcphdr + TCP_HLEN;
+#if LWIP_TCP_SACK
+  sack_count = 0;
+#endif /* LWIP_TCP_SACK */
 
   /* Parse the TCP MSS option, if present. */
   if (TCPH_HDRLEN(tcphdr) > 0x5) {
@@ -1682,6 +1781,41 @@ tcp_parseopt(struct tcp_pcb *pcb)
         c += 0x03;
         break;
 #endif
+#if LWIP_TCP_SACK
+      case 0x04:
+        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: SACK_PERM\n"));
+        if (opts[c + 1] != 0x02 || c + 0x02 > max_c) {
+          /* Bad length */
+          LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: bad length\n"));
+          return;
+        }
+        /* Only a SYN may allow SACK, and only if we offer it too */
+        if ((flags & TCP_SYN) && tcp_cfg_sack) {
+          pcb->flags |= TF_SACK;
+        }
+        /* Advance to next option */
+        c += 0x02;
+        break;
+      case 0x05:
+        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: SACK\n"));
+        if (opts[c + 1] < 10 || ((opts[c + 1] - 2) & 7) != 0 || c + opts[c + 1] > max_c) {
+          /* Bad length */
+          LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: bad length\n"));
+          return;
+        }
+        if ((pcb->flags & TF_SACK) && (flags & TCP_ACK)) {
+          u8_t i, n = (opts[c + 1] - 2) >> 3;
+          u8_t *b = opts + c + 2;
+          for (i = 0; i < n && sack_count < LWIP_TCP_SACK_BLOCKS; i++, b += 8) {
+            sack_blocks[2 * sack_count] = ((u32_t)b[0] << 24) | ((u32_t)b[1] << 16) | ((u32_t)b[2] << 8) | b[3];
+            sack_blocks[2 * sack_count + 1] = ((u32_t)b[4] << 24) | ((u32_t)b[5] << 16) | ((u32_t)b[6] << 8) | b[7];
+            sack_count++;
+          }
+        }
+        /* Advance to next option */
+        c += opts[c + 1];
+        break;
+#endif /* LWIP_TCP_SACK */
 #if LWIP_TCP_TIMESTAMPS
       case 0x08:
         LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: TS\n"));
@@ -1721,4 +1855,85 @@ tcp_parseopt(struct tcp_pcb *pcb)
   }
 }
 
+#if LWIP_TCP_SACK
+/**
+ * Updates the SACK scoreboard with the blocks of the incoming ACK. An
+ * unacked segment counts as SACKed once a single block covers all of it.
+ * Blocks at or below ackno (D-SACK) or beyond snd_nxt are ignored.
+ *
+ * Called from tcp_receive().
+ *
+ * @param pcb the tcp_pcb that received the ACK
+ */
+static void
+tcp_sack_mark(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg;
+  u32_t left, right, seg_left;
+  u8_t i;
+
+  for (i = 0; i < sack_count; i++) {
+    left = sack_blocks[2 * i];
+    right = sack_blocks[2 * i + 1];
+    if (TCP_SEQ_LEQ(right, ackno) || TCP_SEQ_GT(right, pcb->snd_nxt) ||
+        TCP_SEQ_GEQ(left, right)) {
+      continue;
+    }
+
+    for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+      seg_left = ntohl(seg->tcphdr->seqno);
+      if (TCP_SEQ_GEQ(seg_left, right)) {
+        break;
+      }
+      if (!(seg->flags & TF_SEG_SACKED) && TCP_SEQ_GEQ(seg_left, left) &&
+          TCP_SEQ_LEQ(seg_left + TCP_TCPLEN(seg), right)) {
+        seg->flags |= TF_SEG_SACKED;
+        tcp_sack_stats.sacked_bytes += seg->len;
+#if LWIP_TCP_CC
+        pcb->delivered += seg->len;
+#endif /* LWIP_TCP_CC */
+      }
+    }
+  }
+}
+#endif /* LWIP_TCP_SACK */
+
+#if LWIP_TCP_CC
+/**
+ * Takes a millisecond RTT sample for the segment timed by rtt_seq, which the
+ * slow timer's ticks are too coarse for, and the rate data was delivered
+ * at over that round trip. Then hands both to the congestion control.
+ *
+ * Called from tcp_receive() when rtt_seq is acked.
+ *
+ * @param pcb the tcp_pcb that received the ACK
+ */
+static void
+tcp_rtt_sample(struct tcp_pcb *pcb)
+{
+  u32_t rtt = sys_now() - pcb->rtt_start_ms;
+
+  pcb->rtt_timing = 0;
+  if (rtt == 0) {
+    rtt = 1;
+  }
+  if (pcb->srtt_ms == 0) {
+    pcb->srtt_ms = rtt;
+  } else {
+    pcb->srtt_ms = (pcb->srtt_ms * 7 + rtt) >> 3;
+  }
+  if (pcb->min_rtt_ms == 0 || rtt < pcb->min_rtt_ms) {
+    pcb->min_rtt_ms = rtt;
+  }
+  pcb->delivery_rate = (u32_t)((u64_t)(pcb->delivered - pcb->rtt_delivered) * 1000 / rtt);
+
+  LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_rtt_sample: rtt %"U32_F" ms, srtt %"U32_F" ms, rate %"U32_F" B/s\n",
+                              rtt, pcb->srtt_ms, pcb->delivery_rate));
+
+  if (pcb->cc != NULL && pcb->cc->rtt_sample != NULL) {
+    pcb->cc->rtt_sample(pcb, rtt);
+  }
+}
+#endif /* LWIP_TCP_CC */
+
 #endif /* LWIP_TCP */
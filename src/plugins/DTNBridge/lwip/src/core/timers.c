@@ -63,14 +63,14 @@
 #include "lwip/pbuf.h"
 
 /** The one and only timeout list */
-static struct sys_timeo *next_timeout;
+static LWIP_PER_THREAD struct sys_timeo *next_timeout;
 #if NO_SYS
-static u32_t timeouts_last_time;
+static LWIP_PER_THREAD u32_t timeouts_last_time;
 #endif /* NO_SYS */
 
 #if LWIP_TCP
 /** global variable that shows if the tcp timer is currently scheduled or not */
-static int tcpip_tcp_timer_active;
+static LWIP_PER_THREAD int tcpip_tcp_timer_active;
 
 /**
  * Timer callback function that calls tcp_tmr() and reschedules itself.
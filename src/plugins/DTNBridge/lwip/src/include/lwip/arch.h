@@ -42,6 +42,12 @@
 
 #include "arch/cc.h"
 
+/** Storage class for lwIP's global state. A port that runs one stack per
+    thread defines this as its compiler's thread-local storage keyword. */
+#ifndef LWIP_PER_THREAD
+#define LWIP_PER_THREAD
+#endif
+
 /** Temporary: define format string for size_t if not defined in cc.h */
 #ifndef SZT_F
 #define SZT_F U32_F
@@ -301,9 +301,9 @@ struct netif {
 
 
 /** The list of network interfaces. */
-extern struct netif *netif_list;
+extern LWIP_PER_THREAD struct netif *netif_list;
 /** The default network interface. */
-extern struct netif *netif_default;
+extern LWIP_PER_THREAD struct netif *netif_default;
 
 void netif_init(void);
 
@@ -125,6 +125,28 @@
 #define MEMP_MEM_MALLOC                 0
 #endif
 
+/**
+ * MEMP_ARENA==1: Carve the pools out of one block allocated by memp_init()
+ * instead of a static array. The MEMP_NUM_* values are only defaults, the
+ * port can size each pool with memp_set_num() before lwip_init(). Elements
+ * are handed out from the block as they are first needed, so pages of a
+ * pool that never fills are not touched. Requires MEMP_MEM_MALLOC==0 and
+ * MEMP_OVERFLOW_CHECK==0. The pools are LWIP_PER_THREAD like the rest of
+ * lwIP's state.
+ */
+#ifndef MEMP_ARENA
+#define MEMP_ARENA                      0
+#endif
+
+/**
+ * MEMP_ARENA_LINE: Every pool in the arena, and every element at least this
+ * big, starts on a boundary of this many bytes. Set to the cache line size
+ * so elements do not share lines.
+ */
+#ifndef MEMP_ARENA_LINE
+#define MEMP_ARENA_LINE                 64
+#endif
+
 /**
  * MEM_ALIGNMENT: should be set to the alignment of the CPU
  *    4 byte alignment -> #define MEM_ALIGNMENT 4
@@ -1110,6 +1132,16 @@
 #define LWIP_TCP_TIMESTAMPS             0
 #endif
 
+/**
+ * LWIP_TCP_PCB_HOOKS==1: Tell the port whenever a pcb joins or leaves
+ * tcp_active_pcbs and let it find the pcb for an incoming segment instead of
+ * walking the list. The port provides lwip_hook_tcp_pcb_active(),
+ * lwip_hook_tcp_pcb_inactive() and lwip_hook_tcp_pcb_lookup(). IPv4 only.
+ */
+#ifndef LWIP_TCP_PCB_HOOKS
+#define LWIP_TCP_PCB_HOOKS              0
+#endif
+
 /**
  * TCP_WND_UPDATE_THRESHOLD: difference in window to trigger an
  * explicit window update
@@ -1143,6 +1175,53 @@
 #define TCP_RCV_SCALE                   0
 #endif
 
+/**
+ * LWIP_TCP_RUNTIME_WND==1: TCP_WND, TCP_SND_BUF and TCP_SND_QUEUELEN are only
+ * the initial values of variables the application may change with
+ * tcp_set_window(). The new values apply to pcbs allocated afterwards.
+ */
+#ifndef LWIP_TCP_RUNTIME_WND
+#define LWIP_TCP_RUNTIME_WND            0
+#endif
+
+/**
+ * LWIP_TCP_SACK==1: Support selective acknowledgements (RFC 2018) and
+ * SACK based loss recovery (RFC 6675). Whether new connections offer it
+ * can be changed at runtime with tcp_set_sack(). Needs TCP_QUEUE_OOSEQ.
+ */
+#ifndef LWIP_TCP_SACK
+#define LWIP_TCP_SACK                   0
+#endif
+
+/**
+ * LWIP_TCP_CC==1: Let each connection pick its congestion control algorithm
+ * with tcp_set_cc(). Connections without one use the built in Reno. The
+ * algorithms themselves live in tcp_cc.c. Needs a millisecond sys_now().
+ */
+#ifndef LWIP_TCP_CC
+#define LWIP_TCP_CC                     0
+#endif
+
+/**
+ * TCP_PACE_INTERVAL: How often, in milliseconds, the port calls
+ * tcp_pace_tmr() while paced connections have data waiting. A paced
+ * connection may send this many milliseconds worth of its rate, and at
+ * least two segments, in one burst.
+ */
+#ifndef TCP_PACE_INTERVAL
+#define TCP_PACE_INTERVAL               2
+#endif
+
+/**
+ * LWIP_TCP_TRANSPARENT==1: Allow one listening pcb, set with
+ * tcp_listen_transparent(), to accept a SYN to any address and port that no
+ * other pcb matches. The accepted pcb keeps the address and port the SYN
+ * was sent to.
+ */
+#ifndef LWIP_TCP_TRANSPARENT
+#define LWIP_TCP_TRANSPARENT            0
+#endif
+
 
 /*
    ----------------------------------
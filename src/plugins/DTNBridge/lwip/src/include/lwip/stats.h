@@ -161,7 +161,7 @@ struct stats_ {
 #endif
 };
 
-extern struct stats_ lwip_stats;
+extern LWIP_PER_THREAD struct stats_ lwip_stats;
 
 void stats_init(void);
 
@@ -71,6 +71,9 @@ err_t            tcp_send_empty_ack(struct tcp_pcb *pcb);
 void             tcp_rexmit  (struct tcp_pcb *pcb);
 void             tcp_rexmit_rto  (struct tcp_pcb *pcb);
 void             tcp_rexmit_fast (struct tcp_pcb *pcb);
+#if LWIP_TCP_SACK
+void             tcp_rexmit_sack (struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_SACK */
 u32_t            tcp_update_rcv_ann_wnd(struct tcp_pcb *pcb);
 err_t            tcp_process_refused_data(struct tcp_pcb *pcb);
 
@@ -87,7 +90,7 @@ err_t            tcp_process_refused_data(struct tcp_pcb *pcb);
                             ((tpcb)->flags & (TF_NODELAY | TF_INFR)) || \
                             (((tpcb)->unsent != NULL) && (((tpcb)->unsent->next != NULL) || \
                               ((tpcb)->unsent->len >= (tpcb)->mss))) || \
-                            ((tcp_sndbuf(tpcb) == 0) || (tcp_sndqueuelen(tpcb) >= TCP_SND_QUEUELEN)) \
+                            ((tcp_sndbuf(tpcb) == 0) || (tcp_sndqueuelen(tpcb) >= TCP_SND_QUEUELEN_CFG)) \
                             ) ? 1 : 0)
 #define tcp_output_nagle(tpcb) (tcp_do_output_nagle(tpcb) ? tcp_output(tpcb) : ERR_OK)
 
@@ -295,6 +298,9 @@ struct tcp_seg {
 #define TF_SEG_DATA_CHECKSUMMED (u8_t)0x04U /* ALL data (not the header) is
                                                checksummed into 'chksum' */
 #define TF_SEG_OPTS_WND_SCALE   (u8_t)0x08U /* Include WND SCALE option */
+#define TF_SEG_OPTS_SACK_PERM   (u8_t)0x10U /* Include SACK permitted option */
+#define TF_SEG_SACKED           (u8_t)0x20U /* Unacked segment the peer has SACKed */
+#define TF_SEG_SACK_REXMIT      (u8_t)0x40U /* Retransmitted during this loss recovery */
   struct tcp_hdr *tcphdr;  /* the TCP header */
 };
 
@@ -309,11 +315,21 @@ struct tcp_seg {
 #else
 #define LWIP_TCP_OPT_LEN_WS   0
 #endif
+#if LWIP_TCP_SACK
+#define LWIP_TCP_OPT_LEN_SACK_PERM 4
+/* Two NOPs, kind and length, then 8 bytes a block */
+#define LWIP_TCP_OPT_LEN_SACK(n)   (4 + 8 * (n))
+/* 4 blocks fill the 40 bytes of option space, 3 when timestamps are used */
+#define LWIP_TCP_SACK_BLOCKS       4
+#else
+#define LWIP_TCP_OPT_LEN_SACK_PERM 0
+#endif
 
 #define LWIP_TCP_OPT_LENGTH(flags) \
   (flags & TF_SEG_OPTS_MSS       ? LWIP_TCP_OPT_LEN_MSS : 0) + \
   (flags & TF_SEG_OPTS_TS        ? LWIP_TCP_OPT_LEN_TS  : 0) + \
-  (flags & TF_SEG_OPTS_WND_SCALE ? LWIP_TCP_OPT_LEN_WS  : 0)
+  (flags & TF_SEG_OPTS_WND_SCALE ? LWIP_TCP_OPT_LEN_WS  : 0) + \
+  (flags & TF_SEG_OPTS_SACK_PERM ? LWIP_TCP_OPT_LEN_SACK_PERM : 0)
 
 /** This returns a TCP header option for MSS in an u32_t */
 #define TCP_BUILD_MSS_OPTION(mss) htonl(0x02040000 | ((mss) & 0xFFFF))
@@ -326,24 +342,48 @@ struct tcp_seg {
 #define TCPWND_MAX    0xFFFFU
 #endif /* LWIP_WND_SCALE */
 
+/* A window as it fits in the 16 bit header field */
+#define TCPWND_MIN16(x) ((u16_t)LWIP_MIN((x), 0xFFFF))
+
+#if LWIP_TCP_RUNTIME_WND
+extern LWIP_PER_THREAD tcpwnd_size_t tcp_cfg_wnd;
+extern LWIP_PER_THREAD tcpwnd_size_t tcp_cfg_snd_buf;
+extern LWIP_PER_THREAD u16_t tcp_cfg_snd_queuelen;
+#define TCP_WND_CFG             tcp_cfg_wnd
+#define TCP_SND_BUF_CFG         tcp_cfg_snd_buf
+#define TCP_SND_QUEUELEN_CFG    tcp_cfg_snd_queuelen
+#else /* LWIP_TCP_RUNTIME_WND */
+#define TCP_WND_CFG             TCP_WND
+#define TCP_SND_BUF_CFG         TCP_SND_BUF
+#define TCP_SND_QUEUELEN_CFG    TCP_SND_QUEUELEN
+#endif /* LWIP_TCP_RUNTIME_WND */
+
+#if LWIP_TCP_SACK
+/* Whether new connections offer SACK, see tcp_set_sack() */
+extern LWIP_PER_THREAD u8_t tcp_cfg_sack;
+#endif /* LWIP_TCP_SACK */
+
 /* Global variables: */
-extern struct tcp_pcb *tcp_input_pcb;
-extern u32_t tcp_ticks;
-extern u8_t tcp_active_pcbs_changed;
+extern LWIP_PER_THREAD struct tcp_pcb *tcp_input_pcb;
+extern LWIP_PER_THREAD u32_t tcp_ticks;
+extern LWIP_PER_THREAD u8_t tcp_active_pcbs_changed;
 
 /* The TCP PCB lists. */
 union tcp_listen_pcbs_t { /* List of all TCP PCBs in LISTEN state. */
   struct tcp_pcb_listen *listen_pcbs; 
   struct tcp_pcb *pcbs;
 };
-extern struct tcp_pcb *tcp_bound_pcbs;
-extern union tcp_listen_pcbs_t tcp_listen_pcbs;
-extern struct tcp_pcb *tcp_active_pcbs;  /* List of all TCP PCBs that are in a
+extern LWIP_PER_THREAD struct tcp_pcb *tcp_bound_pcbs;
+extern LWIP_PER_THREAD union tcp_listen_pcbs_t tcp_listen_pcbs;
+extern LWIP_PER_THREAD struct tcp_pcb *tcp_active_pcbs;  /* List of all TCP PCBs that are in a
               state in which they accept or send
               data. */
-extern struct tcp_pcb *tcp_tw_pcbs;      /* List of all TCP PCBs in TIME-WAIT. */
+extern LWIP_PER_THREAD struct tcp_pcb *tcp_tw_pcbs;      /* List of all TCP PCBs in TIME-WAIT. */
+#if LWIP_TCP_TRANSPARENT
+extern LWIP_PER_THREAD struct tcp_pcb_listen *tcp_transparent_pcb; /* Also in tcp_listen_pcbs */
+#endif /* LWIP_TCP_TRANSPARENT */
 
-extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
+extern LWIP_PER_THREAD struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
 
 /* Axioms about the above lists:   
    1) Every TCP PCB that is not CLOSED is in one of the lists.
@@ -416,14 +456,29 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
 
 #endif /* LWIP_DEBUG */
 
+#if LWIP_TCP_PCB_HOOKS
+/* Implemented by the port. Addresses passed to the lookup are in network order,
+   ports in host order. */
+void lwip_hook_tcp_pcb_active(struct tcp_pcb *pcb);
+void lwip_hook_tcp_pcb_inactive(struct tcp_pcb *pcb);
+struct tcp_pcb *lwip_hook_tcp_pcb_lookup(u32_t src, u32_t dest, u16_t sport, u16_t dport);
+#define TCP_HOOK_ACTIVE(pcb)      lwip_hook_tcp_pcb_active(pcb)
+#define TCP_HOOK_INACTIVE(pcb)    lwip_hook_tcp_pcb_inactive(pcb)
+#else /* LWIP_TCP_PCB_HOOKS */
+#define TCP_HOOK_ACTIVE(pcb)
+#define TCP_HOOK_INACTIVE(pcb)
+#endif /* LWIP_TCP_PCB_HOOKS */
+
 #define TCP_REG_ACTIVE(npcb)                       \
   do {                                             \
     TCP_REG(&tcp_active_pcbs, npcb);               \
+    TCP_HOOK_ACTIVE(npcb);                         \
     tcp_active_pcbs_changed = 1;                   \
   } while (0)
 
 #define TCP_RMV_ACTIVE(npcb)                       \
   do {                                             \
+    TCP_HOOK_INACTIVE(npcb);                       \
     TCP_RMV(&tcp_active_pcbs, npcb);               \
     tcp_active_pcbs_changed = 1;                   \
   } while (0)
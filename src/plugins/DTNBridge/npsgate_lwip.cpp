@@ -45,6 +45,33 @@ struct ListenSocket {
 	Packet* p;
 };
 
+/* Index of lwIP's active pcbs, keyed the way tcp_input() sees a segment with the
+   remote end as the source. Replaces lwIP's walk of tcp_active_pcbs. */
+static FlowTable<tcp_pcb*> active_pcbs;
+
+static inline FlowKey pcb_key(const tcp_pcb* pcb) {
+	return FlowKey(ntohl(pcb->remote_ip.addr), ntohl(pcb->local_ip.addr), pcb->remote_port, pcb->local_port);
+}
+
+extern "C" {
+	void lwip_hook_tcp_pcb_active(struct tcp_pcb* pcb) {
+		active_pcbs.insert(pcb_key(pcb), pcb, 0);
+	}
+
+	void lwip_hook_tcp_pcb_inactive(struct tcp_pcb* pcb) {
+		FlowKey key = pcb_key(pcb);
+		tcp_pcb** p = active_pcbs.find(key);
+		if(p && *p == pcb) {
+			active_pcbs.erase(key);
+		}
+	}
+
+	struct tcp_pcb* lwip_hook_tcp_pcb_lookup(u32_t src, u32_t dest, u16_t sport, u16_t dport) {
+		tcp_pcb** p = active_pcbs.find(FlowKey(ntohl(src), ntohl(dest), sport, dport));
+		return p ? *p : NULL;
+	}
+};
+
 extern "C" {
 	void NPSGATE_LOG(const char* format, ...) {
 		char buffer[1024];
@@ -83,6 +110,13 @@ extern "C" {
 NpsGateLWIP::NpsGateLWIP(DTNBridge* s, uint16_t m) {
 	stcp = s;
 	mtu = m;
+	idle_timeout = 3600;
+	coalesce_bytes = 16384;
+	coalesce_delay = 5;
+	stream_msgs = stream_records = stream_bytes = stream_data = 0;
+	http_hold = 1 << 20;
+	http_hold_time = 2000;
+	http_connections = http_messages = http_units = http_expired = http_passthrough = 0;
 	xmit_buffer = (uint8_t*)malloc(m);
 
 	/* Each interfaces needs an IP address associated to it, for NpsGate usage, we
@@ -117,17 +151,138 @@ NpsGateLWIP::NpsGateLWIP(DTNBridge* s, uint16_t m) {
 }
 
 NpsGateLWIP::~NpsGateLWIP() {
+	vector<LWIPSocket*> all;
+
+	sockets.values(&all);
+	BOOST_FOREACH(LWIPSocket* s, all) {
+		delete s;
+	}
+	BOOST_FOREACH(LWIPSocket* s, retired) {
+		delete s;
+	}
+	free(xmit_buffer);
+
 	netif_remove(&if_in);
 	netif_remove(&if_out);
+
+	/* Takes the pcbs still open with it */
+	memp_release();
 }
 
 LWIPSocket* NpsGateLWIP::find_socket(uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport) {
-	BOOST_FOREACH(LWIPSocket* s, sockets) {
-		if(saddr == s->get_saddr() && daddr == s->get_daddr() && sport == s->get_sport() && dport == s->get_dport()) {
-			return s;
+	FlowKey key(saddr, daddr, sport, dport);
+	LWIPSocket** s = sockets.find(key);
+
+	if(!s) {
+		return NULL;
+	}
+
+	sockets.touch(key, time(NULL));
+	return *s;
+}
+
+/* Adds a new connection to the table and the totals */
+void NpsGateLWIP::track(LWIPSocket* sock) {
+	sock->opened = time(NULL);
+	sockets.insert(sock->get_key(), sock, sock->opened);
+	totals.opened++;
+	totals.active++;
+}
+
+/* Takes a connection out of the totals once it has left the table. 'aborted'
+   when it did not close normally. */
+void NpsGateLWIP::untrack(LWIPSocket* sock, bool aborted) {
+	totals.active--;
+	if(aborted) {
+		totals.aborted++;
+	} else {
+		totals.closed++;
+	}
+	totals.queued -= sock->queued;
+	sock->queued = 0;
+}
+
+void NpsGateLWIP::retire(LWIPSocket* sock, bool aborted) {
+	release_stream(sock);
+
+	LWIPSocket** s = sockets.find(sock->get_key());
+	if(s && *s == sock) {
+		sockets.erase(sock->get_key());
+		untrack(sock, aborted);
+	}
+
+	/* The socket may be somewhere up the call stack, so it is only deleted from
+	   the next timeout() */
+	retired.push_back(sock);
+}
+
+void LWIPSocket::shutdown() {
+	if(!pcb) {
+		return;
+	}
+
+	tcp_arg(pcb, NULL);
+	tcp_close(pcb);
+	pcb = NULL;
+
+	lwip->retire(this, false);
+}
+
+void LWIPSocket::abort() {
+	if(!pcb) {
+		return;
+	}
+
+	tcp_arg(pcb, NULL);
+	tcp_abort(pcb);
+	pcb = NULL;
+
+	lwip->retire(this, true);
+}
+
+void LWIPSocket::enqueue_data(uint8_t* data, int len) {
+	if(data && len > 0) {
+		pbuf* new_data = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+		if(!new_data) {
+			LOG_WARNING("Failed to allocate pbuf with size: %u. Data dropped!\n", len);
+			return;
+		}
+		pbuf_take(new_data, data, len);
+		if(queued_data) {
+			pbuf_cat(queued_data, new_data);
+		} else {
+			queued_data = new_data;
 		}
+		queued += len;
+		lwip->totals.queued += len;
 	}
-	return NULL;
+}
+
+int LWIPSocket::send_queued_data() {
+	int sndbuf, byte_count = 0;
+	pbuf* old;
+
+	sndbuf = tcp_sndbuf(pcb);
+	while(queued_data && sndbuf >= queued_data->len) {
+		if(ERR_OK != tcp_write(pcb, queued_data->payload, queued_data->len, TCP_WRITE_FLAG_COPY)) {
+			//NPSGATE_LOG("tcp_write() failed for %u bytes. Sndbuf: %u\n", queued_data->len, sndbuf);
+			break;
+		}
+		byte_count = queued_data->len;
+		queued -= queued_data->len;
+		lwip->totals.queued -= queued_data->len;
+		//NPSGATE_LOG("Sent queued data: %u\n", queued_data->len);
+		old = queued_data;
+		queued_data = pbuf_dechain(queued_data);
+		pbuf_free(old);
+		sndbuf = tcp_sndbuf(pcb);
+	}
+
+	if(pending_close && !queued_data) {
+		shutdown();
+	}
+	
+	return byte_count;
 }
 
 LWIPSocket* NpsGateLWIP::connect(uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport) {
@@ -149,8 +304,9 @@ LWIPSocket* NpsGateLWIP::connect(uint32_t saddr, uint32_t daddr, uint16_t sport,
 	}
 
 	LWIPSocket* sock = new LWIPSocket(pcb, this);
-	sockets.push_back(sock);
+	track(sock);
 	tcp_arg(pcb, sock);
+	tcp_err(pcb, error);
 
 	return sock;
 }
@@ -176,7 +332,6 @@ LWIPSocket* NpsGateLWIP::listen(uint32_t addr, uint16_t port) {
 
 	
 	LWIPSocket* sock = new LWIPSocket(lpcb, this);
-	sockets.push_back(sock);
 
 	tcp_accept(lpcb, accept_connection);
 	tcp_arg(lpcb, sock);
@@ -204,17 +359,29 @@ err_t NpsGateLWIP::accept_connection(void* arg, tcp_pcb* spcb,  err_t err) {
 	NpsGateLWIP* lwip = lsock->lwip;
 
 	LWIPSocket* sock = new LWIPSocket(spcb, lwip);
-	lwip->sockets.push_back(sock);
+	lwip->track(sock);
 
 	tcp_arg(spcb, sock);
 	tcp_recv(spcb, recv_data);
 	tcp_sent(spcb, sent_data);
 	tcp_err(spcb, error);
 
-	lwip->sockets.remove(lsock);
 	tcp_close(lsock->pcb);
 	delete lsock;
 
+	/* The other end connects to the host once this arrives. For HTTP it is held
+	   and goes with the first request. */
+	if(find(lwip->http_ports.begin(), lwip->http_ports.end(), sock->get_sport()) != lwip->http_ports.end()) {
+		uint8_t flags = DTN_STREAM_OPEN_HTTP;
+
+		lwip->enable_http(sock, HTTP_REQUEST);
+		sock->http->holding = true;
+		sock->http->since = sys_now();
+		lwip->stream(sock, DTN_STREAM_OPEN, &flags, 1);
+	} else {
+		lwip->stream(sock, DTN_STREAM_OPEN, NULL, 0);
+	}
+
 	return ERR_OK;
 }
 
@@ -231,14 +398,42 @@ err_t NpsGateLWIP::connected(void* arg, tcp_pcb* pcb, err_t err) {
 }
 
 err_t NpsGateLWIP::recv_data(void* arg, tcp_pcb* pcb, pbuf* p, err_t err) {
+	LWIPSocket* sock = (LWIPSocket*) arg;
+
 	/* NULL pbuf means the remote side has closed connection */
 	if(!p) {
+		if(sock) {
+			/* A response without a length ends here */
+			if(sock->http && !sock->http->passthrough && sock->http->started) {
+				sock->http->parser.finish();
+				if(sock->http->parser.done()) {
+					sock->lwip->http_messages++;
+				}
+			}
+			sock->lwip->stream(sock, DTN_STREAM_FIN, NULL, 0);
+		}
 		return ERR_OK;
 	}
 
+	if(sock) {
+		sock->lwip->sockets.touch(sock->get_key(), time(NULL));
+		sock->rx_bytes += p->tot_len;
+		sock->lwip->totals.rx_bytes += p->tot_len;
+
+		/* Only the stream goes over DTN, the host's segments and ACKs end here */
+		for(pbuf* q = p; q; q = q->next) {
+			if(sock->http) {
+				sock->lwip->stream_http(sock, (const uint8_t*)q->payload, q->len, q->next == NULL);
+			} else {
+				sock->lwip->stream(sock, DTN_STREAM_DATA, (const uint8_t*)q->payload, q->len);
+			}
+		}
+	}
+
 	/* Acknowledge to LWIP that we have received this data so the receive window
-	   can be opened back up. Then queue the pbuf for transmission. */
+	   can be opened back up. */
 	tcp_recved(pcb, p->tot_len);
+	pbuf_free(p);
 
 	return ERR_OK;
 }
@@ -246,13 +441,290 @@ err_t NpsGateLWIP::recv_data(void* arg, tcp_pcb* pcb, pbuf* p, err_t err) {
 err_t NpsGateLWIP::sent_data(void* arg, tcp_pcb* pcb, uint16_t len) {
 	LWIPSocket* sock = (LWIPSocket*) arg;
 	if(arg) {
+		sock->tx_bytes += len;
+		sock->lwip->totals.tx_bytes += len;
 		sock->send(NULL, 0);
 	}
 	return ERR_OK;
 }
 
 void NpsGateLWIP::error(void* arg, err_t err) {
+	LWIPSocket* sock = (LWIPSocket*) arg;
+
 	LOG_DEBUG("***** TCP Error has occurred.\n");
+
+	/* lwIP has already freed the pcb */
+	if(sock) {
+		sock->pcb = NULL;
+		sock->lwip->stream(sock, DTN_STREAM_RESET, NULL, 0);
+		sock->lwip->retire(sock, true);
+	}
+}
+
+void NpsGateLWIP::set_coalesce(size_t bytes, uint32_t delay) {
+	size_t max = DTN_STREAM_MAX - DTN_STREAM_HEADER;
+
+	coalesce_bytes = bytes < 512 ? 512 : (bytes > max ? max : bytes);
+	coalesce_delay = delay;
+}
+
+void NpsGateLWIP::stream(LWIPSocket* sock, uint8_t type, const uint8_t* data, size_t len) {
+	vector<uint8_t>& msg = sock->outbound;
+	size_t limit = sock->http && sock->http->holding ? DTN_STREAM_MAX : DTN_STREAM_HEADER + coalesce_bytes;
+	size_t room, n;
+
+	for(;;) {
+		if(msg.empty()) {
+			dtn_stream_begin(msg);
+			sock->last_record = 0;
+			sock->flush_at = sys_now() + coalesce_delay;
+			unflushed.push_back(sock);
+		}
+		room = msg.size() < limit ? limit - msg.size() : 0;
+
+		if(type == DTN_STREAM_DATA && sock->last_record && msg[sock->last_record] == DTN_STREAM_DATA) {
+			/* Consecutive data grows the last record rather than starting another */
+			size_t r = sock->last_record;
+			size_t total;
+
+			n = min(room, len);
+			total = ((msg[r + 1] << 8) | msg[r + 2]) + n;
+			msg.insert(msg.end(), data, data + n);
+			msg[r + 1] = total >> 8;
+			msg[r + 2] = total & 0xff;
+		} else if(room < DTN_STREAM_RECORD + (len ? 1 : 0)) {
+			flush_stream(sock);
+			continue;
+		} else {
+			n = min(room - DTN_STREAM_RECORD, len);
+			sock->last_record = msg.size();
+			dtn_stream_append(msg, type, data, n);
+			stream_records++;
+		}
+
+		if(type == DTN_STREAM_DATA) {
+			stream_data += n;
+		}
+		data += n;
+		len -= n;
+
+		if(msg.size() >= limit) {
+			flush_stream(sock);
+		}
+		if(!len) {
+			break;
+		}
+	}
+
+	/* Anything but data changes the connection, so it goes at once together with
+	   the data before it. The open of an HTTP connection waits for a request. */
+	if(type != DTN_STREAM_DATA && !(type == DTN_STREAM_OPEN && sock->http)) {
+		release_stream(sock);
+	}
+}
+
+/* Messages carry the addresses and ports the way the host's segments did, with
+   the host's end as the source. While an HTTP message is incomplete full
+   messages are held rather than sent. */
+void NpsGateLWIP::flush_stream(LWIPSocket* sock) {
+	HttpTransactions* h = sock->http;
+
+	if(!sock->outbound.empty()) {
+		dtn_stream_finish(sock->outbound, sock->get_daddr(), sock->get_saddr(), sock->get_dport(), sock->get_sport());
+		unflushed.erase(find(unflushed.begin(), unflushed.end(), sock));
+
+		if(h && h->holding) {
+			if(h->held_bytes + sock->outbound.size() <= http_hold) {
+				if(h->held.empty()) {
+					holding.push_back(sock);
+				}
+				h->held.push_back(vector<uint8_t>());
+				h->held.back().swap(sock->outbound);
+				h->held_bytes += h->held.back().size();
+				return;
+			}
+
+			/* Too large to hold, the rest of it is sent as it arrives */
+			h->holding = false;
+			http_expired++;
+		}
+	}
+
+	if(h && !h->held.empty()) {
+		BOOST_FOREACH(vector<uint8_t>& m, h->held) {
+			send_message(m);
+		}
+		h->held.clear();
+		h->held_bytes = 0;
+		holding.erase(find(holding.begin(), holding.end(), sock));
+	}
+
+	if(!sock->outbound.empty()) {
+		send_message(sock->outbound);
+		sock->outbound.clear();
+	}
+}
+
+void NpsGateLWIP::send_message(vector<uint8_t>& msg) {
+	stcp->send_dtn(&msg[0], msg.size());
+	stream_msgs++;
+	stream_bytes += msg.size();
+}
+
+void NpsGateLWIP::release_stream(LWIPSocket* sock) {
+	if(sock->http) {
+		sock->http->holding = false;
+	}
+	flush_stream(sock);
+}
+
+void NpsGateLWIP::flush_streams() {
+	uint32_t now = sys_now();
+	vector<LWIPSocket*> due;
+
+	BOOST_FOREACH(LWIPSocket* s, unflushed) {
+		if(s->http && s->http->holding) {
+			if(now - s->http->since >= http_hold_time) {
+				due.push_back(s);
+			}
+		} else if((int32_t)(now - s->flush_at) >= 0) {
+			due.push_back(s);
+		}
+	}
+	BOOST_FOREACH(LWIPSocket* s, holding) {
+		if(now - s->http->since >= http_hold_time && find(due.begin(), due.end(), s) == due.end()) {
+			due.push_back(s);
+		}
+	}
+	BOOST_FOREACH(LWIPSocket* s, due) {
+		if(s->http && s->http->holding) {
+			http_expired++;
+		}
+		release_stream(s);
+	}
+}
+
+void NpsGateLWIP::set_http(const vector<uint16_t>& ports, size_t hold, uint32_t hold_time) {
+	http_ports = ports;
+	http_hold = hold;
+	http_hold_time = hold_time;
+}
+
+void NpsGateLWIP::enable_http(LWIPSocket* sock, HttpParserMode mode) {
+	delete sock->http;
+	sock->http = new HttpTransactions(mode);
+	http_connections++;
+}
+
+/* CONNECT and Upgrade turn the connection in to something else, which is passed
+   through as it is */
+static inline bool http_tunnel(const HttpMessage& m) {
+	return m.method == "CONNECT" || m.header("upgrade") != NULL;
+}
+
+/* 'last' when nothing more of what the host wrote has arrived. Pipelined messages
+   that arrived together are held until the last of them is complete. */
+void NpsGateLWIP::stream_http(LWIPSocket* sock, const uint8_t* data, size_t len, bool last) {
+	HttpTransactions* h = sock->http;
+
+	while(len) {
+		size_t n;
+
+		if(h->passthrough) {
+			stream(sock, DTN_STREAM_DATA, data, len);
+			return;
+		}
+
+		if(!h->started) {
+			h->started = true;
+			if(!h->holding) {
+				h->holding = true;
+				h->since = sys_now();
+			}
+			if(!h->no_body.empty() && h->no_body.front()) {
+				h->parser.expect_no_body();
+			}
+		}
+
+		n = h->parser.feed(data, len);
+		stream(sock, DTN_STREAM_DATA, data, n);
+		data += n;
+		len -= n;
+
+		if(h->parser.failed()) {
+			LOG_DEBUG("Connection %s is not carrying HTTP, passing it through.\n", sock->get_key().str().c_str());
+			h->passthrough = true;
+			http_passthrough++;
+			release_stream(sock);
+			continue;
+		}
+		if(!h->parser.done()) {
+			continue;
+		}
+
+		const HttpMessage& m = h->parser.message();
+		bool interim = m.status >= 100 && m.status < 200;
+
+		http_messages++;
+		if(!interim && !h->no_body.empty()) {
+			h->no_body.pop_front();
+		}
+		if(h->mode == HTTP_REQUEST && http_tunnel(m)) {
+			h->passthrough = true;
+			http_passthrough++;
+		}
+		h->parser.reset();
+		h->started = false;
+
+		/* An interim response goes at once, the client may wait for it before
+		   sending the body */
+		if(interim || h->passthrough || (!len && last)) {
+			release_stream(sock);
+			http_units++;
+		}
+	}
+}
+
+void NpsGateLWIP::http_request_sent(LWIPSocket* sock, const uint8_t* data, size_t len) {
+	HttpTransactions* h = sock->http;
+
+	if(!h || h->mode != HTTP_RESPONSE || h->passthrough) {
+		return;
+	}
+
+	while(len) {
+		size_t n = h->requests.feed(data, len);
+
+		data += n;
+		len -= n;
+
+		if(h->requests.failed() || (h->requests.done() && http_tunnel(h->requests.message()))) {
+			h->passthrough = true;
+			http_passthrough++;
+			release_stream(sock);
+			return;
+		}
+		if(h->requests.done()) {
+			h->no_body.push_back(h->requests.message().method == "HEAD");
+			h->requests.reset();
+		}
+	}
+}
+
+string NpsGateLWIP::http_stats() {
+	char buffer[192];
+
+	snprintf(buffer, sizeof(buffer), "connections=%llu messages=%llu units=%llu expired=%llu passthrough=%llu holding=%u",
+			http_connections, http_messages, http_units, http_expired, http_passthrough, (unsigned int)holding.size());
+	return string(buffer);
+}
+
+string NpsGateLWIP::stream_stats() {
+	char buffer[192];
+
+	snprintf(buffer, sizeof(buffer), "messages=%llu records=%llu bytes=%llu data_bytes=%llu pending=%u",
+			stream_msgs, stream_records, stream_bytes, stream_data, (unsigned int)unflushed.size());
+	return string(buffer);
 }
 
 bool NpsGateLWIP::send_data(uint8_t* data, int len) {
@@ -291,7 +763,6 @@ void NpsGateLWIP::lwip_driver_input(struct netif* netif, Packet* pkt) {
 	}
 
 	p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
-	p->next = NULL;
 	if(!p) {
 		LOG_WARNING("Failed to allocate pbuf with size: %u. Packet dropped!\n", len);
 		return;
@@ -325,8 +796,112 @@ err_t NpsGateLWIP::lwip_driver_output2(struct netif* netif, struct pbuf* q, ip_a
 	return netif->linkoutput(netif, q);
 }
 
+bool NpsGateLWIP::set_window(uint32_t wnd, uint32_t snd_buf) {
+	if(tcp_set_window(wnd, snd_buf) != ERR_OK) {
+		LOG_WARNING("Window of %u bytes and send buffer of %u bytes are too small, must be at least %u and %u.\n",
+				wnd, snd_buf, TCP_MSS, 2 * TCP_MSS);
+		return false;
+	}
+
+	if(wnd > tcp_cfg_wnd) {
+		LOG_WARNING("Window of %u bytes is larger than window scaling allows, using %u.\n", wnd, (unsigned int)tcp_cfg_wnd);
+	}
+	return true;
+}
+
+string NpsGateLWIP::sack_stats() {
+	char buffer[192];
+
+	snprintf(buffer, sizeof(buffer), "recoveries=%u rexmit_bytes=%llu sack_rexmit_bytes=%llu sacked_bytes=%llu",
+			tcp_sack_stats.recoveries,
+			(unsigned long long)tcp_sack_stats.rexmit_bytes,
+			(unsigned long long)tcp_sack_stats.sack_rexmit_bytes,
+			(unsigned long long)tcp_sack_stats.sacked_bytes);
+	return string(buffer);
+}
+
+/* One line per pool: element size in bytes, elements in the pool, in use now and
+   at most, and allocations that failed because it was empty */
+string NpsGateLWIP::pool_stats() {
+	char buffer[160];
+	string str;
+
+	for(int i = 0; i < MEMP_MAX; i++) {
+		struct memp_usage u;
+
+		memp_get_usage((memp_t)i, &u);
+		if(u.num == 0) {
+			continue;
+		}
+
+		snprintf(buffer, sizeof(buffer), "%s size=%u num=%u used=%u max=%u failed=%u\n",
+				u.name, u.size, u.num, u.used, u.max, u.err);
+		str += buffer;
+	}
+
+	return str;
+}
+
+void NpsGateLWIP::proxy_totals(ProxyTotals* t) {
+	*t = totals;
+	t->segs_out = lwip_stats.tcp.xmit;
+	t->segs_in = lwip_stats.tcp.recv;
+	t->drops = lwip_stats.tcp.drop;
+	t->chkerr = lwip_stats.tcp.chkerr;
+	t->memerr = lwip_stats.tcp.memerr;
+}
+
+/* Each connection: its state, bytes received and acknowledged, bytes waiting to
+   be written, unacknowledged bytes in flight, smoothed RTT in ms (in steps of
+   lwIP's slow timer), bytes retransmitted and the peer's, congestion and our
+   receive windows. lwIP's counters are read where they are. */
+string NpsGateLWIP::connection_stats(unsigned int max) {
+	vector<LWIPSocket*> socks;
+	time_t now = time(NULL);
+	char buffer[288];
+	string str;
+
+	sockets.values(&socks, max);
+	BOOST_FOREACH(LWIPSocket* s, socks) {
+		const tcp_pcb* pcb = s->pcb;
+
+		snprintf(buffer, sizeof(buffer),
+				" state=%s rx=%llu tx=%llu queued=%u inflight=%u srtt=%u rexmit=%u snd_wnd=%u cwnd=%u rcv_wnd=%u age=%u\n",
+				pcb ? tcp_debug_state_str(pcb->state) : "CLOSED", s->rx_bytes, s->tx_bytes, s->queued,
+				pcb ? (unsigned int)(pcb->snd_nxt - pcb->lastack) : 0,
+				pcb && pcb->sa > 0 ? (unsigned int)(pcb->sa >> 3) * TCP_SLOW_INTERVAL : 0,
+				pcb ? pcb->rexmit_bytes : 0, pcb ? (unsigned int)pcb->snd_wnd : 0,
+				pcb ? (unsigned int)pcb->cwnd : 0, pcb ? (unsigned int)pcb->rcv_wnd : 0,
+				(unsigned int)(now - s->opened));
+		str += s->get_key().str() + buffer;
+	}
+
+	return str;
+}
+
 bool NpsGateLWIP::timeout() {
+	vector<LWIPSocket*> idle;
+
 	tcp_tmr();
+
+	BOOST_FOREACH(LWIPSocket* s, retired) {
+		delete s;
+	}
+	retired.clear();
+
+	/* Age out connections whose peer went away without closing them */
+	sockets.expire(time(NULL), idle_timeout, &idle);
+	BOOST_FOREACH(LWIPSocket* s, idle) {
+		LOG_DEBUG("Aborting idle connection %s\n", s->get_key().str().c_str());
+		stream(s, DTN_STREAM_RESET, NULL, 0);
+		untrack(s, true);
+		if(s->pcb) {
+			tcp_arg(s->pcb, NULL);
+			tcp_abort(s->pcb);
+		}
+		delete s;
+	}
+
 	return true;
 }
 
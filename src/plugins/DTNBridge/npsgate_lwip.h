@@ -23,11 +23,17 @@
 #include <crafter.h>
 #include <unistd.h> 
 #include <map>
+#include <deque>
 #include "../npsgate_plugin.hpp"
 #include "../logger.hpp"
+#include "../flow_table.hpp"
+#include "../proxy_stats.hpp"
+#include "../http_parser.hpp"
 #include "dtn_bridge.h"
+#include "dtn_stream.h"
 
 #include "lwip/tcp.h"
+#include "lwip/memp.h"
 
 extern "C" {
 	void NPSGATE_LOG(const char* format, ...);
@@ -72,27 +78,58 @@ static uint32_t NETMASKS[] = {
 	0b11111111111111111111111111111111
 };
 
+/* The HTTP side of a connection opened with DTN_STREAM_OPEN_HTTP. Each end
+   follows the messages its host writes, requests at the client's end and
+   responses at the server's, and holds their records until a message is
+   complete, so a transaction crosses DTN as one unit instead of in the pieces
+   TCP delivered it in. */
+struct HttpTransactions {
+	HttpTransactions(HttpParserMode m) : mode(m), parser(m), requests(HTTP_REQUEST),
+			started(false), holding(false), passthrough(false), since(0), held_bytes(0) { }
+
+	HttpParserMode mode;		/* What the host writes */
+	HttpParser parser;
+	HttpParser requests;		/* The server's end follows the requests it writes to know which
+								   responses have no body */
+	std::deque<bool> no_body;	/* For each request written and not yet answered */
+	bool started;				/* Bytes of the current message have been seen */
+	bool holding;				/* Records are held until the message is complete */
+	bool passthrough;			/* Not HTTP, or a tunnel after CONNECT or Upgrade */
+	uint32_t since;				/* sys_now() when holding started */
+	vector< vector<uint8_t> > held;	/* Finished messages waiting for the rest */
+	size_t held_bytes;
+};
+
 class LWIPSocket {
 	public:
-		LWIPSocket() : pcb(NULL), lwip(NULL), queued_data(NULL), pending_close(false) { }
-		LWIPSocket(tcp_pcb* p, NpsGateLWIP* l) : pcb(p), lwip(l), queued_data(NULL), pending_close(false) { }
+		LWIPSocket() : pcb(NULL), lwip(NULL), queued_data(NULL), pending_close(false),
+				opened(0), rx_bytes(0), tx_bytes(0), queued(0), last_record(0), flush_at(0), http(NULL) { }
+		LWIPSocket(tcp_pcb* p, NpsGateLWIP* l) : pcb(p), lwip(l), queued_data(NULL), pending_close(false),
+				key(ntohl(p->local_ip.addr), ntohl(p->remote_ip.addr), p->local_port, p->remote_port),
+				opened(0), rx_bytes(0), tx_bytes(0), queued(0), last_record(0), flush_at(0), http(NULL) { }
 
-		inline uint32_t get_saddr() const { return ntohl(pcb->local_ip.addr); }
-		inline uint32_t get_daddr() const { return ntohl(pcb->remote_ip.addr); }
-		inline uint16_t get_sport() const { return pcb->local_port; }
-		inline uint16_t get_dport() const { return pcb->remote_port; }
+		~LWIPSocket() {
+			if(queued_data) {
+				pbuf_free(queued_data);
+			}
+			delete http;
+		}
 
-		inline void set_saddr(uint32_t saddr) { pcb->local_ip.addr = htonl(saddr); }
-		inline void set_daddr(uint32_t daddr) { pcb->remote_ip.addr = htonl(daddr); }
-		inline void set_sport(uint16_t sport) { pcb->local_port = sport; }
-		inline void set_dport(uint16_t dport) { pcb->remote_port = dport; }
+		/* The addresses are kept in the key so they can still be read after lwIP
+		   has freed the pcb. */
+		inline uint32_t get_saddr() const { return key.saddr; }
+		inline uint32_t get_daddr() const { return key.daddr; }
+		inline uint16_t get_sport() const { return key.sport; }
+		inline uint16_t get_dport() const { return key.dport; }
+		inline const FlowKey& get_key() const { return key; }
 
-		inline string get_saddr_str() const { return addr_to_str(pcb->local_ip.addr); }
-		inline string get_daddr_str() const { return addr_to_str(pcb->remote_ip.addr); }
-		inline void set_saddr(const string& str) { pcb->local_ip.addr = str_to_addr(str); }
-		inline void set_daddr(const string& str) { pcb->remote_ip.addr = str_to_addr(str); }
+		inline string get_saddr_str() const { return addr_to_str(key.saddr); }
+		inline string get_daddr_str() const { return addr_to_str(key.daddr); }
 
 		int send(uint8_t* data, int len) {
+			if(!pcb) {
+				return -1;
+			}
 
 			if(data && len > 0) {
 				enqueue_data(data, len);
@@ -113,10 +150,13 @@ class LWIPSocket {
 			if(queued_data) {
 				pending_close = true;
 			} else {
-				tcp_close(pcb);
+				shutdown();
 			}
 		}
 
+		/* Resets the connection to the host, dropping anything still queued */
+		void abort();
+
 		bool operator==(const LWIPSocket& s2) {
 			return (pcb == s2.pcb) && (lwip == s2.lwip);
 		}
@@ -139,47 +179,31 @@ class LWIPSocket {
 
 		friend class NpsGateLWIP;
 	private:
-		void enqueue_data(uint8_t* data, int len) {
-			if(data && len > 0) {
-				pbuf* new_data = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
-				pbuf_take(new_data, data, len);
-				if(queued_data) {
-					pbuf_cat(queued_data, new_data);
-				} else {
-					queued_data = new_data;
-				}
-			}
-		}
-
-		int send_queued_data() {
-			int sndbuf, byte_count = 0;
-			pbuf* old;
-
-			sndbuf = tcp_sndbuf(pcb);
-			while(queued_data && sndbuf >= queued_data->len) {
-				if(ERR_OK != tcp_write(pcb, queued_data->payload, queued_data->len, TCP_WRITE_FLAG_COPY)) {
-					//NPSGATE_LOG("tcp_write() failed for %u bytes. Sndbuf: %u\n", queued_data->len, sndbuf);
-					break;
-				}
-				byte_count = queued_data->len;
-				//NPSGATE_LOG("Sent queued data: %u\n", queued_data->len);
-				old = queued_data;
-				queued_data = pbuf_dechain(queued_data);
-				pbuf_free(old);
-				sndbuf = tcp_sndbuf(pcb);
-			}
+		/* Both keep the stack's totals of queued bytes up to date, so they are
+		   defined after NpsGateLWIP */
+		void enqueue_data(uint8_t* data, int len);
+		int send_queued_data();
 
-			if(pending_close && !queued_data) {
-				tcp_close(pcb);
-			}
-			
-			return byte_count;
-		}
+		/* Detaches from the pcb, which lwIP frees once the close handshake is done,
+		   and hands the socket back to NpsGateLWIP to be deleted. */
+		void shutdown();
 
 		tcp_pcb* pcb;
 		NpsGateLWIP* lwip;
 		pbuf* queued_data;
 		bool pending_close;
+		FlowKey key;
+
+		time_t opened;
+		unsigned long long rx_bytes;	/* Received from the host */
+		unsigned long long tx_bytes;	/* Sent to it and acknowledged */
+		uint32_t queued;				/* Bytes in 'queued_data' */
+
+		vector<uint8_t> outbound;		/* Stream records not yet sent over DTN */
+		size_t last_record;				/* Offset of the last of them */
+		uint32_t flush_at;				/* sys_now() by which they are sent */
+
+		HttpTransactions* http;			/* NULL unless the connection carries HTTP */
 };
 
 
@@ -195,17 +219,102 @@ class NpsGateLWIP {
 		LWIPSocket* connect(uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport);
 		LWIPSocket* listen(uint32_t addr, uint16_t port);
 
-		string stats();
+		/* Connections that have seen no traffic for this many seconds are aborted */
+		inline void set_idle_timeout(time_t t) { idle_timeout = t; }
+
+		/* Receive window and send buffer, in bytes, of sockets opened from now on */
+		bool set_window(uint32_t wnd, uint32_t snd_buf);
+
+		/* Whether sockets opened from now on offer selective acknowledgements */
+		inline void set_sack(bool enable) { tcp_set_sack(enable ? 1 : 0); }
+
+		/* Data received from a host is sent over DTN once a connection has 'bytes'
+		   of it or the oldest has waited 'delay' milliseconds */
+		void set_coalesce(size_t bytes, uint32_t delay);
+
+		/* Connections accepted on these ports are carried as HTTP transactions.
+		   Records of a message are held until it is complete, for at most 'hold'
+		   bytes and 'hold_time' milliseconds. */
+		void set_http(const vector<uint16_t>& ports, size_t hold, uint32_t hold_time);
+
+		/* Starts following HTTP on a connection, 'mode' being what its host writes */
+		void enable_http(LWIPSocket* sock, HttpParserMode mode);
+
+		/* The server's end learns of each request it writes to its host */
+		void http_request_sent(LWIPSocket* sock, const uint8_t* data, size_t len);
+
+		/* Sends the records of connections whose delay has run out */
+		void flush_streams();
+
+		/* Messages, records and bytes sent over DTN and how many were stream data */
+		string stream_stats();
+
+		/* Connections and transactions carried as HTTP */
+		string http_stats();
+
+		/* Retransmission and SACK totals since the stack started */
+		string sack_stats();
+
+		/* Size and occupancy of each of lwIP's memory pools */
+		string pool_stats();
+
+		/* Totals kept up to date as connections open, move data and close */
+		void proxy_totals(ProxyTotals* t);
+
+		/* One line for each of up to 'max' connections */
+		string connection_stats(unsigned int max);
 
 		uint8_t* xmit_buffer;
+
+		friend class LWIPSocket;
 	private:
 		struct ip_addr ipaddr, netmask, gw;
 		struct netif if_in, if_out;
 		DTNBridge* stcp;
-		list<LWIPSocket*> sockets;
+
+		/* Established and connecting sockets keyed by local/remote address and port.
+		   Listening sockets are not kept here, accept_connection() frees them. */
+		FlowTable<LWIPSocket*> sockets;
+		list<LWIPSocket*> retired;
+		time_t idle_timeout;
+		ProxyTotals totals;
+
+		/* Sockets with records waiting in 'outbound' */
+		vector<LWIPSocket*> unflushed;
+		size_t coalesce_bytes;
+		uint32_t coalesce_delay;
+		unsigned long long stream_msgs;
+		unsigned long long stream_records;
+		unsigned long long stream_bytes;
+		unsigned long long stream_data;
+
+		vector<uint16_t> http_ports;
+		size_t http_hold;
+		uint32_t http_hold_time;
+		vector<LWIPSocket*> holding;	/* Sockets with messages in 'held' */
+		unsigned long long http_connections;
+		unsigned long long http_messages;	/* Complete requests and responses */
+		unsigned long long http_units;		/* Sent as one, a pipelined run counting once */
+		unsigned long long http_expired;	/* Released before they were complete */
+		unsigned long long http_passthrough;
 
 		uint16_t mtu;
 
+		void track(LWIPSocket* sock);
+		void retire(LWIPSocket* sock, bool aborted);
+		void untrack(LWIPSocket* sock, bool aborted);
+
+		/* Adds a record to the socket's next message, sending it when it fills */
+		void stream(LWIPSocket* sock, uint8_t type, const uint8_t* data, size_t len);
+		void flush_stream(LWIPSocket* sock);
+		void send_message(vector<uint8_t>& msg);
+
+		/* Sends the held messages and records of an HTTP connection */
+		void release_stream(LWIPSocket* sock);
+
+		/* Streams what the host wrote to an HTTP connection, message by message */
+		void stream_http(LWIPSocket* sock, const uint8_t* data, size_t len, bool last);
+
 		static err_t accept_connection(void* arg, tcp_pcb* newpcb,  err_t err);
 		static err_t connected(void* arg, tcp_pcb* pcb, err_t err);
 		static err_t recv_data(void* arg, tcp_pcb* pcb, pbuf* p, err_t err);
@@ -45,25 +45,26 @@ public:
 	bool init() {
 		plugin_list = get_outputs();
 
-		/* Remove one of the output in the list and store in a
-		   separate variable. This will be the plugin where the
-		   "original" packet is sent to. */
-		first_plugin = *plugin_list.begin();
-		plugin_list.erase(first_plugin);
+		if(plugin_list.empty()) {
+			LOG_CRITICAL("Duplicate plugin requires at least one output.\n");
+			return false;
+		}
 
 		return true;
 	}
 
 	bool process_packet(Packet* p) {
 
-		/* Send a duplicate copy of the packet to each valid output */
+		/* Every output receives the same packet. The PacketManager keeps a
+		   reference for each output, and a plugin that modifies the packet gets
+		   its own copy through make_writable(). Build the raw packet once here so
+		   the outputs do not all race to do it on their own threads. */
+		p->GetRawPtr();
+
 		BOOST_FOREACH(const string& plugin, plugin_list) {
-			Packet* new_p = new Packet(*p);
-			forward_packet(plugin, new_p);
+			forward_packet(plugin, p);
 		}
 
-		/* Send the original packet to the first output plugin */
-		forward_packet(first_plugin, p);
 		return true;
 	}
 
@@ -77,7 +78,6 @@ public:
 	}
 
 private:
-	string first_plugin;
 	set<string> plugin_list;
 };
 
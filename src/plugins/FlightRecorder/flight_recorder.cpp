@@ -0,0 +1,497 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file flight_recorder.cpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#include <pcap.h>
+#include <crafter.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdlib.h>
+
+#include <vector>
+#include <boost/foreach.hpp>
+
+#include "../npsgate_plugin.hpp"
+#include "../logger.hpp"
+#include "../PCAPOutput/pcap_writer.hpp"
+
+using namespace Crafter;
+using namespace NpsGate;
+
+/* One packet held by the recorder */
+struct RecorderSlot {
+	Packet* packet;
+	timeval ts;
+	uint32_t size;
+};
+
+/* A configured trigger condition. Either 'topic' or 'queue' is set. */
+struct RecorderCondition {
+	string topic;		/* Published variable to watch */
+	string field;		/* For "key=value" string values, the key to read */
+	string queue;		/* Plugin whose input queue depth is watched */
+	double above;		/* Trigger when the value exceeds this */
+	double delta;		/* Trigger when the value grows by more than this between updates */
+	double last;
+	bool have_last;
+};
+
+class FlightRecorder;
+
+/* Everything a dump thread needs. It owns one reference to each packet. */
+struct RecorderDump {
+	FlightRecorder* recorder;
+	string filename;
+	string reason;
+	vector<RecorderSlot> slots;
+	uint32_t snaplen;
+	int compression;
+};
+
+/**************************************************************
+ **
+ ** FlightRecorder keeps the most recent packets that pass
+ ** through it and writes them to a pcap file when triggered.
+ ** Packets are not copied; the recorder holds a reference to
+ ** each one in a preallocated circular array and releases it
+ ** when the packet ages out.
+ **
+ **************************************************************/
+class FlightRecorder : public NpsGatePlugin {
+public:
+	FlightRecorder(PluginCore* c) : NpsGatePlugin(c) {
+		max_bytes = 64ULL << 20;
+		max_seconds = 10;
+		max_packets = 100000;
+		post_seconds = 0;
+		holdoff = 30;
+		check_interval = 1000;
+		snaplen = 65535;
+		compression = 0;
+		output_prefix = "flightrecorder";
+		forward = false;
+		head = count = 0;
+		held_bytes = 0;
+		packets_seen = 0;
+		dump_at = 0;
+		last_dump = 0;
+		dumps = 0;
+		dump_busy = false;
+		slots = NULL;
+	}
+
+	virtual ~FlightRecorder() {
+		while(dump_busy) {
+			usleep(10000);
+		}
+		while(count > 0) {
+			evict();
+		}
+		delete [] slots;
+	}
+
+	virtual bool init() {
+		const Config* config = get_config();
+		int max_mb = 64;
+
+		config->lookupValue("flightrecorder.max_mb", max_mb);
+		config->lookupValue("flightrecorder.max_seconds", max_seconds);
+		config->lookupValue("flightrecorder.max_packets", max_packets);
+		config->lookupValue("flightrecorder.post_seconds", post_seconds);
+		config->lookupValue("flightrecorder.holdoff", holdoff);
+		config->lookupValue("flightrecorder.check_interval", check_interval);
+		config->lookupValue("flightrecorder.snaplen", snaplen);
+		config->lookupValue("flightrecorder.compression", compression);
+		config->lookupValue("flightrecorder.output_prefix", output_prefix);
+		config->lookupValue("flightrecorder.forward", forward);
+
+		if(max_packets < 1 || max_mb < 1) {
+			LOG_CRITICAL("max_packets and max_mb must be positive.\n");
+			return false;
+		}
+		max_bytes = (unsigned long long)max_mb << 20;
+
+		if(forward && get_default_output().empty()) {
+			LOG_CRITICAL("'forward' is set but FlightRecorder has no outputs.\n");
+			return false;
+		}
+
+		slots = new RecorderSlot[max_packets];
+
+		if(!parse_triggers(config)) {
+			return false;
+		}
+
+		if(check_interval > 0) {
+			set_timeout(check_interval);
+		}
+
+		LOG_INFO("FlightRecorder holding up to %d packets, %d MB, %d seconds.\n",
+				max_packets, max_mb, max_seconds);
+
+		return true;
+	}
+
+	virtual bool process_packet(Packet* p) {
+		timeval now;
+
+		if(count == (unsigned int)max_packets) {
+			evict();
+		}
+
+		RecorderSlot& s = slots[(head + count) % max_packets];
+
+		/* Steady state is one extra reference per packet and a few stores */
+		if(!ingress_time(p, &s.ts)) {
+			gettimeofday(&s.ts, NULL);
+		}
+		now = s.ts;
+
+		/* The dump thread reads the raw bytes while other plugins may hold the
+		   packet, so make sure they are built now. This is a no-op for packets
+		   that have already been composed upstream. */
+		p->GetRawPtr();
+
+		s.packet = share_packet(p);
+		s.size = p->GetSize();
+		held_bytes += s.size;
+		count++;
+
+		while(count > 1 && (held_bytes > max_bytes ||
+				(max_seconds > 0 && now.tv_sec - slots[head].ts.tv_sec > max_seconds))) {
+			evict();
+		}
+
+		if(forward) {
+			forward_packet(get_default_output(), p);
+		} else {
+			drop_packet(p);
+		}
+
+		/* message_timeout() does not run while packets keep arriving */
+		if((++packets_seen & 0x3ff) == 0) {
+			periodic(now.tv_sec);
+		}
+
+		return true;
+	}
+
+	virtual bool process_message(Message* m) {
+		if(m->fq_name == "trigger") {
+			string reason = "monitor";
+			if(m->value->type() == typeid(string)) {
+				reason = m->value->get<string>();
+			}
+			trigger(reason);
+			return true;
+		}
+
+		BOOST_FOREACH(const string& t, trigger_topics) {
+			if(m->fq_name == t) {
+				trigger(t);
+				return true;
+			}
+		}
+
+		BOOST_FOREACH(RecorderCondition& c, conditions) {
+			double v;
+			if(c.topic == m->fq_name && value_of(m->value, c.field, &v)) {
+				check_condition(c, v);
+			}
+		}
+
+		return true;
+	}
+
+	virtual bool message_timeout() {
+		periodic(time(NULL));
+		return true;
+	}
+
+	bool main() {
+		message_loop();
+		return true;
+	}
+
+private:
+	unsigned long long max_bytes;
+	int max_seconds;
+	int max_packets;
+	int post_seconds;
+	int holdoff;
+	int check_interval;
+	int snaplen;
+	int compression;
+	string output_prefix;
+	bool forward;
+
+	RecorderSlot* slots;
+	unsigned int head;
+	unsigned int count;
+	unsigned long long held_bytes;
+	unsigned long long packets_seen;
+
+	vector<string> trigger_topics;
+	vector<RecorderCondition> conditions;
+
+	string dump_reason;
+	time_t dump_at;
+	time_t last_dump;
+	unsigned int dumps;
+	volatile bool dump_busy;
+
+	inline void evict() {
+		RecorderSlot& s = slots[head];
+
+		held_bytes -= s.size;
+		release_packet(s.packet);
+		s.packet = NULL;
+		head = (head + 1) % max_packets;
+		count--;
+	}
+
+	bool parse_triggers(const Config* config) {
+		try {
+			if(config->exists("flightrecorder.topics")) {
+				const Setting& topics = config->lookup("flightrecorder.topics");
+				for(int i = 0; i < topics.getLength(); i++) {
+					string t = topics[i];
+					trigger_topics.push_back(t);
+					subscribe(t);
+				}
+			}
+
+			if(config->exists("flightrecorder.conditions")) {
+				const Setting& conds = config->lookup("flightrecorder.conditions");
+				for(int i = 0; i < conds.getLength(); i++) {
+					RecorderCondition c;
+
+					c.above = 0;
+					c.delta = 0;
+					c.last = 0;
+					c.have_last = false;
+					conds[i].lookupValue("topic", c.topic);
+					conds[i].lookupValue("field", c.field);
+					conds[i].lookupValue("queue", c.queue);
+					conds[i].lookupValue("above", c.above);
+					conds[i].lookupValue("delta", c.delta);
+
+					if(c.topic.empty() == c.queue.empty()) {
+						LOG_CRITICAL("Condition %d must have exactly one of 'topic' or 'queue'.\n", i);
+						return false;
+					}
+					if(c.above <= 0 && c.delta <= 0) {
+						LOG_CRITICAL("Condition %d needs an 'above' or 'delta' threshold.\n", i);
+						return false;
+					}
+					if(!c.topic.empty()) {
+						subscribe(c.topic);
+					}
+					conditions.push_back(c);
+				}
+			}
+		} catch(SettingException& ex) {
+			LOG_CRITICAL("Invalid trigger configuration at '%s'.\n", ex.getPath());
+			return false;
+		}
+
+		return true;
+	}
+
+	/* Reads a number out of a published variable. String values are either a
+	   plain number or a list of "key=value" pairs, as the stats topics use. */
+	static bool value_of(NpsGateVar* v, const string& field, double* out) {
+		const type_info& t = v->type();
+
+		if(t == typeid(int)) {
+			*out = v->get<int>();
+		} else if(t == typeid(unsigned int)) {
+			*out = v->get<unsigned int>();
+		} else if(t == typeid(long long)) {
+			*out = v->get<long long>();
+		} else if(t == typeid(unsigned long long)) {
+			*out = v->get<unsigned long long>();
+		} else if(t == typeid(double)) {
+			*out = v->get<double>();
+		} else if(t == typeid(string)) {
+			string s = v->get<string>();
+			size_t pos = 0;
+
+			if(!field.empty()) {
+				string key = field + "=";
+				for(pos = s.find(key); pos != string::npos; pos = s.find(key, pos + 1)) {
+					if(pos == 0 || s[pos - 1] == ' ') {
+						break;
+					}
+				}
+				if(pos == string::npos) {
+					return false;
+				}
+				pos += key.size();
+			}
+
+			char* end;
+			*out = strtod(s.c_str() + pos, &end);
+			return end != s.c_str() + pos;
+		} else {
+			return false;
+		}
+
+		return true;
+	}
+
+	void check_condition(RecorderCondition& c, double v) {
+		const string& name = (c.topic.empty() ? c.queue : c.topic);
+		char reason[256];
+
+		if(c.above > 0 && v > c.above) {
+			snprintf(reason, sizeof(reason), "%s%s%s=%.0f above %.0f", name.c_str(),
+					c.field.empty() ? "" : ".", c.field.c_str(), v, c.above);
+			trigger(reason);
+		} else if(c.delta > 0 && c.have_last && v - c.last > c.delta) {
+			snprintf(reason, sizeof(reason), "%s%s%s grew by %.0f", name.c_str(),
+					c.field.empty() ? "" : ".", c.field.c_str(), v - c.last);
+			trigger(reason);
+		}
+
+		c.last = v;
+		c.have_last = true;
+	}
+
+	/* Queue depth checks, plus the delayed dump when post_seconds is set */
+	void periodic(time_t now) {
+		BOOST_FOREACH(RecorderCondition& c, conditions) {
+			if(!c.queue.empty()) {
+				int depth = queue_depth(c.queue);
+				if(depth >= 0) {
+					check_condition(c, depth);
+				}
+			}
+		}
+
+		/* Age out packets even when none are arriving */
+		while(count > 0 && max_seconds > 0 && now - slots[head].ts.tv_sec > max_seconds) {
+			evict();
+		}
+
+		if(dump_at && now >= dump_at) {
+			dump_at = 0;
+			start_dump();
+		}
+	}
+
+	void trigger(const string& reason) {
+		time_t now = time(NULL);
+
+		if(dump_at || dump_busy || (last_dump && now - last_dump < holdoff)) {
+			LOG_DEBUG("FlightRecorder ignoring trigger '%s'.\n", reason.c_str());
+			return;
+		}
+
+		LOG_INFO("FlightRecorder triggered: %s\n", reason.c_str());
+		last_dump = now;
+		dump_reason = reason;
+
+		/* Keep recording for a little while so the aftermath is captured too */
+		if(post_seconds > 0) {
+			dump_at = now + post_seconds;
+		} else {
+			start_dump();
+		}
+	}
+
+	/* Hands a snapshot of the buffer to a thread that writes the file. The
+	   snapshot takes its own reference to each packet, so recording carries on
+	   while the file is written. */
+	void start_dump() {
+		char stamp[32];
+		char name[64];
+		time_t now = time(NULL);
+		tm t;
+		pthread_t thread;
+		pthread_attr_t attr;
+
+		if(count == 0) {
+			LOG_INFO("FlightRecorder buffer is empty. Nothing to dump.\n");
+			return;
+		}
+
+		RecorderDump* d = new RecorderDump();
+
+		localtime_r(&now, &t);
+		strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &t);
+		snprintf(name, sizeof(name), "-%s-%u.pcap", stamp, dumps++);
+		d->filename = output_prefix + name;
+		d->reason = dump_reason;
+		d->snaplen = snaplen;
+		d->compression = compression;
+		d->recorder = this;
+		d->slots.reserve(count);
+
+		for(unsigned int i = 0; i < count; i++) {
+			RecorderSlot s = slots[(head + i) % max_packets];
+			s.packet = share_packet(s.packet);
+			d->slots.push_back(s);
+		}
+
+		/* dump_main() deletes 'd', so the name is published before it starts */
+		string filename = d->filename;
+		NpsGateVar* var = new NpsGateVar();
+		var->set(filename);
+		publish("FlightRecorder.dump", var);
+		var->unref();
+
+		dump_busy = true;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if(pthread_create(&thread, &attr, dump_main, d)) {
+			LOG_WARNING("Failed to start dump thread. Writing on the plugin thread.\n");
+			dump_main(d);
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	static void* dump_main(void* arg) {
+		RecorderDump* d = (RecorderDump*)arg;
+		PcapWriter writer;
+		unsigned int written = 0;
+
+		if(writer.open(d->filename, PCAP_WRITER_LINKTYPE_RAW, d->snaplen, d->compression)) {
+			BOOST_FOREACH(RecorderSlot& s, d->slots) {
+				uint32_t caplen = (s.size > d->snaplen ? d->snaplen : s.size);
+				if(writer.write(s.ts, s.packet->GetRawPtr(), caplen, s.size)) {
+					written++;
+				}
+			}
+			writer.close();
+			LOG_INFO("FlightRecorder wrote %u packets to '%s' (%s).\n",
+					written, d->filename.c_str(), d->reason.c_str());
+		}
+
+		BOOST_FOREACH(RecorderSlot& s, d->slots) {
+			d->recorder->release_packet(s.packet);
+		}
+
+		d->recorder->dump_busy = false;
+		delete d;
+		return NULL;
+	}
+};
+
+NPSGATE_PLUGIN_CREATE(FlightRecorder);
+NPSGATE_PLUGIN_DESTROY();
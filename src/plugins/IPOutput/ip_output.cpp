@@ -28,9 +28,11 @@
 #include <pcap.h>
 #include <crafter.h>
 #include <unistd.h>
+#include <stdio.h>
 
 #include "../npsgate_plugin.hpp"
 #include "../logger.hpp"
+#include "tx_engine.hpp"
 
 using namespace Crafter;
 using namespace NpsGate;
@@ -38,13 +40,76 @@ using namespace NpsGate;
 
 class IPOutput : public NpsGatePlugin {
 public:
-	IPOutput(PluginCore* c) : NpsGatePlugin(c) {
+	IPOutput(PluginCore* c) : NpsGatePlugin(c), engine(NULL) {
+	}
+
+	virtual ~IPOutput() {
+		delete engine;
 	}
 
 	virtual bool init() {
-		raw_socket = create_raw_socket();
+		const Config* config = get_config();
+		string engine_name = "socket";
+		string interface;
+		string next_hop;
+		int sndbuf = 0;
+		int batch_size = 32;
+		int batch_delay = 1;
+		int ring_frames = 4096;
+		int frame_size = 2048;
+		int mtu = 1500;
+
+		config->lookupValue("ipoutput.engine", engine_name);
+		config->lookupValue("ipoutput.sndbuf", sndbuf);
+		config->lookupValue("ipoutput.batch-size", batch_size);
+		config->lookupValue("ipoutput.batch-delay", batch_delay);
+		config->lookupValue("ipoutput.interface", interface);
+		config->lookupValue("ipoutput.next-hop-mac", next_hop);
+		config->lookupValue("ipoutput.ring-frames", ring_frames);
+		config->lookupValue("ipoutput.frame-size", frame_size);
+		config->lookupValue("ipoutput.mtu", mtu);
+
+		if(batch_size < 1) {
+			batch_size = 1;
+		}
+		if(batch_delay < 1) {
+			batch_delay = 1;
+		}
+
+		if(engine_name == "socket") {
+			engine = new SocketTxEngine();
+		} else if(engine_name == "batch") {
+			engine = new BatchTxEngine(batch_size, batch_delay, mtu);
+		} else if(engine_name == "ring") {
+			uint8_t mac[ETH_ALEN];
+
+			if(interface.empty()) {
+				LOG_CRITICAL("The ring engine requires 'ipoutput.interface'.\n");
+				return false;
+			}
+			if(!parse_mac(next_hop, mac)) {
+				LOG_CRITICAL("The ring engine requires a valid 'ipoutput.next-hop-mac'.\n");
+				return false;
+			}
+			engine = new RingTxEngine(interface, mac, ring_frames, frame_size, batch_size, batch_delay);
+		} else {
+			LOG_CRITICAL("Unknown IPOutput engine '%s'. Expected socket, batch or ring.\n", engine_name.c_str());
+			return false;
+		}
+
+		engine->set_sndbuf(sndbuf);
+		if(!engine->open()) {
+			return false;
+		}
+
+		/* Pending batches are flushed from message_timeout() when the queue goes idle */
+		if(engine_name != "socket") {
+			set_timeout(batch_delay);
+		}
+
+		LOG_INFO("IPOutput using the '%s' transmit engine.\n", engine->name());
 
-		return (raw_socket == -1 ? false : true);
+		return true;
 	}
 
 	virtual bool process_packet(Packet* p) {
@@ -53,12 +118,14 @@ public:
 
 		if(!ip) {
 			LOG_WARNING("Received a non-IP packet. Dropping packet.\n");
-		} else if(!p->SocketSend(raw_socket)) {
+		} else if(!engine->send(p->GetRawPtr(), p->GetSize())) {
 			LOG_WARNING("Failed to send packet. Packet will be dropped!\n");
 		} else {
 			rval = true;
 		}
 
+		engine->poll(tx_now_ms());
+
 		drop_packet(p);
 
 		return rval;
@@ -68,25 +135,36 @@ public:
 		return true;
 	}
 
+	virtual bool message_timeout() {
+		engine->poll(tx_now_ms());
+		return true;
+	}
+
+	virtual void exit_handler() {
+		if(engine) {
+			engine->flush();
+			engine->print_stats();
+		}
+	}
+
 	bool main() {
 		message_loop();
 		return true;
 	}
 
 private:
-	int raw_socket;
+	TxEngine* engine;
 
-	int create_raw_socket() {
-		int s;
-		int val = 1;
+	static bool parse_mac(const string& s, uint8_t* mac) {
+		unsigned int b[ETH_ALEN];
 
-		s = socket(AF_INET, SOCK_RAW, 4);
-		setsockopt(s, IPPROTO_IP, IP_HDRINCL, &val, sizeof(val));
-		if(s == -1) {
-			LOG_CRITICAL("Failed to create raw socket. Reason: %s\n", strerror(errno));
+		if(sscanf(s.c_str(), "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != ETH_ALEN) {
+			return false;
 		}
-
-		return s;
+		for(int i = 0; i < ETH_ALEN; i++) {
+			mac[i] = b[i];
+		}
+		return true;
 	}
 
 };
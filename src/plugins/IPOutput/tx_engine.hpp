@@ -0,0 +1,499 @@
+/******************************************************************************
+  **
+  **  NpsGate IPOutput plugin.
+  **  Copyright (c) 2014, Lance Alt
+  **
+  **  This file is part of NpsGate.
+  **
+  **  This program is free software: you can redistribute it and/or modify
+  **  it under the terms of the GNU General Public License as published
+  **  by the Free Software Foundation, either version 3 of the License, or
+  **  (at your option) any later version.
+  **
+  **  This program is distributed in the hope that it will be useful,
+  **  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  **  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  **  GNU General Public License for more details.
+  **
+  **  You should have received a copy of the GNU Lesser General Public License
+  **  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+  **
+  **
+  **  @file tx_engine.hpp
+  **  @date 2026/10/19
+  **
+  *******************************************************************************/
+
+#ifndef TX_ENGINE_HPP_INCLUDED
+#define TX_ENGINE_HPP_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <linux/if_packet.h>
+
+#include <string>
+
+#include "../logger.hpp"
+
+using namespace std;
+using namespace NpsGate;
+
+/* Milliseconds on the monotonic clock. Used to age pending batches. */
+static inline uint64_t tx_now_ms() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Reads the destination address straight out of an IPv4 header. */
+static inline bool tx_ip_destination(const uint8_t* data, size_t len, sockaddr_in* sin) {
+	if(len < 20 || (data[0] >> 4) != 4) {
+		return false;
+	}
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	memcpy(&sin->sin_addr.s_addr, data + 16, 4);
+	return true;
+}
+
+/**************************************************************
+ **
+ ** TxEngine is the interface between IPOutput and the kernel.
+ ** 'send' is handed a complete IPv4 datagram. Engines that
+ ** batch are allowed to hold on to the data (they copy it)
+ ** until 'flush' is called or 'poll' decides the oldest
+ ** packet has waited long enough.
+ **
+ **************************************************************/
+class TxEngine {
+	public:
+		TxEngine() : packets(0), bytes(0), syscalls(0), errors(0), sndbuf(0) { }
+		virtual ~TxEngine() { }
+
+		virtual bool open() = 0;
+		virtual bool send(const uint8_t* data, size_t len) = 0;
+		virtual bool flush() { return true; }
+		virtual bool poll(uint64_t now_ms) { return true; }
+		virtual const char* name() const = 0;
+
+		void set_sndbuf(int size) { sndbuf = size; }
+
+		void print_stats() {
+			LOG_INFO("IPOutput '%s' engine: %llu packets, %llu bytes, %llu syscalls, %llu errors\n",
+					name(), packets, bytes, syscalls, errors);
+		}
+
+		unsigned long long packets;
+		unsigned long long bytes;
+		unsigned long long syscalls;
+		unsigned long long errors;
+
+	protected:
+		int sndbuf;
+
+		/* Applies the configured SO_SNDBUF. SO_SNDBUFFORCE lets root go past
+		   net.core.wmem_max, so try that first. */
+		void apply_sndbuf(int s) {
+			int actual;
+			socklen_t optlen = sizeof(actual);
+
+			if(sndbuf <= 0) {
+				return;
+			}
+
+			if(setsockopt(s, SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf, sizeof(sndbuf)) < 0 &&
+					setsockopt(s, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0) {
+				LOG_WARNING("Failed to set send buffer to %d bytes. Reason: %s\n", sndbuf, strerror(errno));
+				return;
+			}
+
+			getsockopt(s, SOL_SOCKET, SO_SNDBUF, &actual, &optlen);
+			LOG_INFO("Send buffer size is %d bytes (requested %d).\n", actual, sndbuf);
+		}
+};
+
+/* The original behaviour: one sendto() per packet on a raw IP socket. */
+class SocketTxEngine : public TxEngine {
+	public:
+		SocketTxEngine() : raw_socket(-1) { }
+
+		virtual ~SocketTxEngine() {
+			if(raw_socket != -1) {
+				close(raw_socket);
+			}
+		}
+
+		virtual const char* name() const { return "socket"; }
+
+		virtual bool open() {
+			int val = 1;
+
+			/* IPPROTO_RAW implies IP_HDRINCL; set it anyway to be explicit. */
+			raw_socket = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+			if(raw_socket == -1) {
+				LOG_CRITICAL("Failed to create raw socket. Reason: %s\n", strerror(errno));
+				return false;
+			}
+			setsockopt(raw_socket, IPPROTO_IP, IP_HDRINCL, &val, sizeof(val));
+			apply_sndbuf(raw_socket);
+
+			return true;
+		}
+
+		virtual bool send(const uint8_t* data, size_t len) {
+			sockaddr_in sin;
+
+			if(!tx_ip_destination(data, len, &sin)) {
+				errors++;
+				return false;
+			}
+
+			syscalls++;
+			if(sendto(raw_socket, data, len, 0, (sockaddr*)&sin, sizeof(sin)) < 0) {
+				errors++;
+				return false;
+			}
+
+			packets++;
+			bytes += len;
+			return true;
+		}
+
+	protected:
+		int raw_socket;
+};
+
+/* Queues packets and hands them to the kernel with a single sendmmsg() once
+   'batch_size' packets are waiting or the oldest has waited 'max_delay' ms. */
+class BatchTxEngine : public SocketTxEngine {
+	public:
+		BatchTxEngine(unsigned int size, unsigned int delay, unsigned int mtu) :
+				batch_size(size), max_delay(delay), slot_size(mtu), count(0), oldest(0) {
+			buffer = new uint8_t[batch_size * slot_size];
+			msgs = new mmsghdr[batch_size];
+			iovs = new iovec[batch_size];
+			addrs = new sockaddr_in[batch_size];
+
+			memset(msgs, 0, sizeof(mmsghdr) * batch_size);
+			for(unsigned int i = 0; i < batch_size; i++) {
+				iovs[i].iov_base = buffer + i * slot_size;
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+				msgs[i].msg_hdr.msg_name = &addrs[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+			}
+		}
+
+		virtual ~BatchTxEngine() {
+			flush();
+			delete [] buffer;
+			delete [] msgs;
+			delete [] iovs;
+			delete [] addrs;
+		}
+
+		virtual const char* name() const { return "batch"; }
+
+		virtual bool send(const uint8_t* data, size_t len) {
+			/* Oversized packets bypass the batch, after the packets queued ahead
+			   of them so the order is kept */
+			if(len > slot_size) {
+				flush();
+				return SocketTxEngine::send(data, len);
+			}
+
+			if(!tx_ip_destination(data, len, &addrs[count])) {
+				errors++;
+				return false;
+			}
+
+			memcpy(iovs[count].iov_base, data, len);
+			iovs[count].iov_len = len;
+			if(count == 0) {
+				oldest = tx_now_ms();
+			}
+			count++;
+
+			if(count == batch_size) {
+				return flush();
+			}
+			return true;
+		}
+
+		virtual bool poll(uint64_t now_ms) {
+			if(count > 0 && now_ms - oldest >= max_delay) {
+				return flush();
+			}
+			return true;
+		}
+
+		virtual bool flush() {
+			unsigned int sent = 0;
+			bool rval = true;
+
+			while(sent < count) {
+				syscalls++;
+				int n = sendmmsg(raw_socket, msgs + sent, count - sent, 0);
+				if(n < 0) {
+					if(errno == EINTR) {
+						continue;
+					}
+					/* Skip the packet the kernel refused and carry on with the rest */
+					LOG_WARNING("sendmmsg() failed. Reason: %s\n", strerror(errno));
+					errors++;
+					sent++;
+					rval = false;
+					continue;
+				}
+
+				for(int i = 0; i < n; i++) {
+					bytes += iovs[sent + i].iov_len;
+				}
+				packets += n;
+				sent += n;
+			}
+
+			count = 0;
+			return rval;
+		}
+
+	private:
+		unsigned int batch_size;
+		unsigned int max_delay;
+		unsigned int slot_size;
+		unsigned int count;
+		uint64_t oldest;
+
+		uint8_t* buffer;
+		mmsghdr* msgs;
+		iovec* iovs;
+		sockaddr_in* addrs;
+};
+
+/* Writes Ethernet frames straight in to an AF_PACKET PACKET_TX_RING (TPACKET_V3,
+   Linux 4.11 or later). Frames are addressed to a fixed next-hop MAC, so this
+   engine is only useful when all traffic leaves through one interface towards
+   one gateway. The kernel is kicked once per batch. */
+class RingTxEngine : public TxEngine {
+	public:
+		RingTxEngine(const string& ifname, const uint8_t* mac, unsigned int frames,
+				unsigned int fsize, unsigned int size, unsigned int delay) :
+				interface(ifname), packet_socket(-1), ring(NULL), ring_size(0),
+				frame_nr(frames), frame_size(fsize), frame_index(0),
+				block_bytes(0), block_frames(1),
+				batch_size(size), max_delay(delay), pending(0), oldest(0) {
+			memcpy(dst_mac, mac, ETH_ALEN);
+			memset(src_mac, 0, ETH_ALEN);
+		}
+
+		virtual ~RingTxEngine() {
+			flush();
+			if(ring) {
+				munmap(ring, ring_size);
+			}
+			if(packet_socket != -1) {
+				close(packet_socket);
+			}
+		}
+
+		virtual const char* name() const { return "ring"; }
+
+		virtual bool open() {
+			int version = TPACKET_V3;
+			tpacket_req3 req;
+			sockaddr_ll sll;
+			ifreq ifr;
+			long page = sysconf(_SC_PAGESIZE);
+
+			packet_socket = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+			if(packet_socket == -1) {
+				LOG_CRITICAL("Failed to create packet socket. Reason: %s\n", strerror(errno));
+				return false;
+			}
+
+			if(setsockopt(packet_socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+				LOG_CRITICAL("Kernel does not support TPACKET_V3. Reason: %s\n", strerror(errno));
+				return false;
+			}
+
+			/* Frames are packed in to page sized blocks */
+			frame_size = TPACKET_ALIGN(frame_size);
+			unsigned int frames_per_block = (frame_size < page ? page / frame_size : 1);
+			unsigned int block_size = frames_per_block * frame_size;
+			block_size = ((block_size + page - 1) / page) * page;
+			frames_per_block = block_size / frame_size;
+
+			memset(&req, 0, sizeof(req));
+			req.tp_block_size = block_size;
+			req.tp_block_nr = (frame_nr + frames_per_block - 1) / frames_per_block;
+			req.tp_frame_size = frame_size;
+			req.tp_frame_nr = req.tp_block_nr * frames_per_block;
+			frame_nr = req.tp_frame_nr;
+			block_bytes = block_size;
+			block_frames = frames_per_block;
+
+			if(setsockopt(packet_socket, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+				LOG_CRITICAL("Failed to create PACKET_TX_RING. Reason: %s\n", strerror(errno));
+				return false;
+			}
+
+			ring_size = (size_t)req.tp_block_size * req.tp_block_nr;
+			ring = (uint8_t*)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, packet_socket, 0);
+			if(ring == MAP_FAILED) {
+				ring = NULL;
+				LOG_CRITICAL("Failed to mmap TX ring. Reason: %s\n", strerror(errno));
+				return false;
+			}
+
+			memset(&ifr, 0, sizeof(ifr));
+			strncpy(ifr.ifr_name, interface.c_str(), IFNAMSIZ - 1);
+			if(ioctl(packet_socket, SIOCGIFINDEX, &ifr) < 0) {
+				LOG_CRITICAL("Unknown interface '%s'.\n", interface.c_str());
+				return false;
+			}
+			int ifindex = ifr.ifr_ifindex;
+
+			if(ioctl(packet_socket, SIOCGIFHWADDR, &ifr) < 0) {
+				LOG_CRITICAL("Failed to read MAC address of '%s'.\n", interface.c_str());
+				return false;
+			}
+			memcpy(src_mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+			memset(&sll, 0, sizeof(sll));
+			sll.sll_family = AF_PACKET;
+			sll.sll_protocol = htons(ETH_P_IP);
+			sll.sll_ifindex = ifindex;
+			if(bind(packet_socket, (sockaddr*)&sll, sizeof(sll)) < 0) {
+				LOG_CRITICAL("Failed to bind packet socket to '%s'. Reason: %s\n",
+						interface.c_str(), strerror(errno));
+				return false;
+			}
+
+			apply_sndbuf(packet_socket);
+
+			LOG_INFO("TX ring on '%s': %u frames of %u bytes.\n", interface.c_str(), frame_nr, frame_size);
+			return true;
+		}
+
+		virtual bool send(const uint8_t* data, size_t len) {
+			tpacket3_hdr* hdr = frame(frame_index);
+			uint8_t* payload;
+
+			if(len + ETH_HLEN > frame_size - (TPACKET3_HDRLEN - sizeof(sockaddr_ll))) {
+				LOG_WARNING("Packet of %u bytes does not fit in a %u byte ring frame. Dropping.\n",
+						(unsigned int)len, frame_size);
+				errors++;
+				return false;
+			}
+
+			/* The kernel still owns this frame. Kick the ring, even when
+			   nothing of ours is pending, and give it one chance to catch
+			   up before dropping. */
+			if(!reclaim(hdr)) {
+				kick();
+				if(!reclaim(hdr)) {
+					errors++;
+					return false;
+				}
+			}
+
+			payload = (uint8_t*)hdr + TPACKET3_HDRLEN - sizeof(sockaddr_ll);
+			ether_header* eth = (ether_header*)payload;
+			memcpy(eth->ether_dhost, dst_mac, ETH_ALEN);
+			memcpy(eth->ether_shost, src_mac, ETH_ALEN);
+			eth->ether_type = htons(ETHERTYPE_IP);
+			memcpy(payload + ETH_HLEN, data, len);
+
+			hdr->tp_next_offset = 0;
+			hdr->tp_len = len + ETH_HLEN;
+			hdr->tp_snaplen = len + ETH_HLEN;
+			__sync_synchronize();
+			hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+			frame_index = (frame_index + 1) % frame_nr;
+			packets++;
+			bytes += len;
+
+			if(pending == 0) {
+				oldest = tx_now_ms();
+			}
+			if(++pending >= batch_size) {
+				return flush();
+			}
+			return true;
+		}
+
+		virtual bool poll(uint64_t now_ms) {
+			if(pending > 0 && now_ms - oldest >= max_delay) {
+				return flush();
+			}
+			return true;
+		}
+
+		virtual bool flush() {
+			if(packet_socket == -1 || pending == 0) {
+				return true;
+			}
+			return kick();
+		}
+
+	private:
+		/* Whether the frame can be filled. Without PACKET_LOSS the kernel
+		   leaves a frame it rejected in TP_STATUS_WRONG_FORMAT, and every
+		   packet that wraps on to it would be dropped, so hand it back. */
+		bool reclaim(tpacket3_hdr* hdr) {
+			if(hdr->tp_status == TP_STATUS_WRONG_FORMAT) {
+				LOG_WARNING("Kernel rejected a %u byte frame on '%s'.\n",
+						hdr->tp_len, interface.c_str());
+				errors++;
+				hdr->tp_status = TP_STATUS_AVAILABLE;
+				__sync_synchronize();
+			}
+			return hdr->tp_status == TP_STATUS_AVAILABLE;
+		}
+
+		bool kick() {
+			pending = 0;
+			syscalls++;
+			if(::send(packet_socket, NULL, 0, 0) < 0) {
+				LOG_WARNING("Failed to kick TX ring. Reason: %s\n", strerror(errno));
+				errors++;
+				return false;
+			}
+			return true;
+		}
+
+		inline tpacket3_hdr* frame(unsigned int i) {
+			return (tpacket3_hdr*)(ring + (size_t)(i / block_frames) * block_bytes +
+					(size_t)(i % block_frames) * frame_size);
+		}
+
+		string interface;
+		int packet_socket;
+		uint8_t* ring;
+		size_t ring_size;
+		unsigned int frame_nr;
+		unsigned int frame_size;
+		unsigned int frame_index;
+		unsigned int block_bytes;
+		unsigned int block_frames;
+		unsigned int batch_size;
+		unsigned int max_delay;
+		unsigned int pending;
+		uint64_t oldest;
+		uint8_t src_mac[ETH_ALEN];
+		uint8_t dst_mac[ETH_ALEN];
+};
+
+#endif /* TX_ENGINE_HPP_INCLUDED */
@@ -21,26 +21,92 @@
 #include <crafter.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <sstream>
 
 #include "../npsgate_plugin.hpp"
 #include "../logger.hpp"
+#include "../checksum.h"
 #include "../../plugincore.h"
 
 using namespace Crafter;
 using namespace NpsGate;
 
+/* On-disk pcap headers. See pcap-savefile(5). */
+struct PcapFileHeader {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct PcapRecordHeader {
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+#define PCAP_MAGIC_USEC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+
+#define LINKTYPE_NULL		0
+#define LINKTYPE_ETHERNET	1
+#define LINKTYPE_RAW		101
+#define LINKTYPE_LINUX_SLL	113
+
+/* One IPv4 packet from the capture. 'data' points in to the mapped file. */
+struct ReplayRecord {
+	uint64_t ts;		/* Capture time in nanoseconds */
+	const uint8_t* data;
+	uint32_t len;
+	Packet* pkt;		/* Pre-decoded packet, we hold one reference */
+};
+
 class PCAPInput : public NpsGatePlugin {
 
 public:
+	enum ReplayMode { REPLAY_SPEED, REPLAY_PPS, REPLAY_BPS, REPLAY_MAX };
+	enum RewriteMode { REWRITE_NONE = 0, REWRITE_SOURCE = 1, REWRITE_DESTINATION = 2, REWRITE_BOTH = 3 };
 
 	PCAPInput(PluginCore* c) : NpsGatePlugin(c) {
-		packet_count = 0;
 		kill_on_eof = false;
 		real_time = true;
-		drift_time = 150;
+		mode = "";
+		speed = 1.0;
+		rate = 0;
+		loops = 1;
+		replay = REPLAY_SPEED;
+		rewrite = REWRITE_NONE;
+		map = NULL;
+		map_size = 0;
+		sent_packets = 0;
+		sent_bytes = 0;
+		late_packets = 0;
+		max_lateness = 0;
+	}
+
+	virtual ~PCAPInput() {
+		for(size_t i = 0; i < records.size(); i++) {
+			release_packet(records[i].pkt);
+		}
+		free_pass();
+		if(map) {
+			munmap(map, map_size);
+		}
 	}
 
 	bool init() {
+		string rewrite_name = "none";
+
 		LOG_INFO("PCAPInput plugin starting intialization.\n");
 		config = get_config();
 
@@ -51,87 +117,114 @@ public:
 
 		config->lookupValue("pcapinput.kill_on_eof", kill_on_eof);
 		config->lookupValue("pcapinput.real_time", real_time);
-		config->lookupValue("pcapinput.drift_time", drift_time);
+		config->lookupValue("pcapinput.mode", mode);
+		config->lookupValue("pcapinput.speed", speed);
+		config->lookupValue("pcapinput.rate", rate);
+		config->lookupValue("pcapinput.loops", loops);
+		config->lookupValue("pcapinput.rewrite", rewrite_name);
+
+		/* Older configs only know about real_time */
+		if(mode.empty()) {
+			mode = (real_time ? "speed" : "max");
+		}
+
+		if(mode == "speed") {
+			replay = REPLAY_SPEED;
+		} else if(mode == "pps") {
+			replay = REPLAY_PPS;
+		} else if(mode == "bps") {
+			replay = REPLAY_BPS;
+		} else if(mode == "max") {
+			replay = REPLAY_MAX;
+		} else {
+			LOG_CRITICAL("Unknown replay mode '%s'. Expected speed, pps, bps or max.\n", mode.c_str());
+			return false;
+		}
+		if((replay == REPLAY_PPS || replay == REPLAY_BPS) && rate <= 0) {
+			LOG_CRITICAL("Replay mode '%s' requires a positive 'rate'.\n", mode.c_str());
+			return false;
+		}
+		if(replay == REPLAY_SPEED && speed <= 0) {
+			LOG_CRITICAL("Replay speed must be positive.\n");
+			return false;
+		}
 
-		OpenOffPcap(&link_layer_type, pcap_handle, "test.pcap", filter_string);
+		if(rewrite_name == "none") {
+			rewrite = REWRITE_NONE;
+		} else if(rewrite_name == "source") {
+			rewrite = REWRITE_SOURCE;
+		} else if(rewrite_name == "destination") {
+			rewrite = REWRITE_DESTINATION;
+		} else if(rewrite_name == "both") {
+			rewrite = REWRITE_BOTH;
+		} else {
+			LOG_CRITICAL("Unknown rewrite '%s'. Expected none, source, destination or both.\n", rewrite_name.c_str());
+			return false;
+		}
+
+		if(!load_file()) {
+			return false;
+		}
 
 		return true;
 	}
 
 	bool process_packet(Packet* p) {
-		Packet* old_pkt;
-		LOG_DEBUG("Received a packet of length: %d\n", p->GetSize());
+		drop_packet(p);
+		return true;
+	}
 
-		Ethernet* eth = p->GetLayer<Ethernet>();
-		if(eth) {
-			LOG_DEBUG("Read Ethernet header, stripping.\n");
-			old_pkt = p;
-			p = new Packet();
-			*p = old_pkt->SubPacket(1, old_pkt->GetLayerCount());
-			delete old_pkt;
-		}
+	bool main() {
+		timespec start, end;
+		uint64_t loop_start = 0;
+		uint64_t prepare_time = 0;
+		uint64_t duration = capture_duration();
 
-		forward_packet(get_default_output(), p);
+		LOG_INFO("Replaying '%s' in '%s' mode, %d loop(s).\n", input_file.c_str(), mode.c_str(), loops);
 
-//		NpsGateVar* var1 = new NpsGateVar();
-//		var1->set_int(p->GetSize());
-//		publish("pcapinput.packet_size", var1);
+		clock_gettime(CLOCK_MONOTONIC, &start);
 
-//		var1->unref();
+		for(int loop = 0; loops <= 0 || loop < loops; loop++) {
+			bool rewritten = (loop > 0 && rewrite != REWRITE_NONE);
 
-//		NpsGateVar* var2 = new NpsGateVar();
-//		var2->set_int(++packet_count);
-//		publish("pcapinput.packet_count", var2);
+			/* Decode the whole pass before its first packet is due, and push
+			   the schedule back by the time that took. */
+			if(rewritten) {
+				uint64_t t = elapsed_since(start);
+				build_pass(loop);
+				t = elapsed_since(start) - t;
+				loop_start += t;
+				prepare_time += t;
+			}
 
-		return true;
-	}
+			for(size_t i = 0; i < records.size(); i++) {
+				ReplayRecord& r = records[i];
 
-	bool main() {
-		struct timeval last_tv, tv;
-		uint32_t last_sec = 0, last_usec = 0;
-		int32_t delay_sec, delay_usec;
-		pcap_pkthdr* hdr;
-		const u_char* data;
-
-		while(1 == pcap_next_ex(pcap_handle, &hdr, &data)) {
-			// Create a new Crafter packet from the PCAP data
-			Packet* pkt = new Packet();
-			pkt->PacketFromLinkLayer(data, hdr->len, link_layer_type);
-
-			gettimeofday(&tv, NULL);
-
-			/* Use realistic delays between packets */
-			if(real_time && last_sec != 0 && last_usec != 0) {
-				/* Calculate the time difference between this packet and the last packet */
-				delay_sec = hdr->ts.tv_sec - last_sec;
-				delay_usec = hdr->ts.tv_usec - last_usec;
-
-				/* Get the current time, and subtract the actual time between processing
-				   the last packet */
-				gettimeofday(&tv, NULL);
-				delay_sec -= (tv.tv_sec - last_tv.tv_sec);
-				delay_usec -= (tv.tv_usec - last_tv.tv_usec) + 150;
-				if(delay_usec < 0 && delay_sec > 0) {
-					delay_sec--;
-					delay_usec = tv.tv_usec + 1000000 - last_tv.tv_usec;
-				}
+				wait_until(ts_add(start, loop_start + schedule(i)));
+
+				Packet* pkt = (rewritten ? pass[i] : r.pkt);
+
+				/* Records entered the packet store when the file was loaded. Their
+				   ingress is when they are sent, as it would be for a live input. */
+				set_ingress(pkt);
 
-				/* Sleep the necessary amount of time */
-				if(delay_sec > 0) {
-					sleep(delay_sec);
+				if(forward_packet(get_default_output(), pkt)) {
+					sent_packets++;
+					sent_bytes += r.len;
+				} else if(rewritten) {
+					delete pkt;
 				}
-				if(delay_usec > 0) {
-					usleep(delay_usec);
+				if(rewritten) {
+					pass[i] = NULL;
 				}
 			}
-			last_sec = hdr->ts.tv_sec;
-			last_usec = hdr->ts.tv_usec;
-			last_tv.tv_sec = tv.tv_sec;
-			last_tv.tv_usec = tv.tv_usec;
 
-			process_packet(pkt);
+			loop_start += loop_length(duration);
 		}
 
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		report(end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9 - prepare_time / 1e9);
+
 		LOG_INFO("PCAPInput plugin finished reading input file. Terminating thread.\n");
 		if(kill_on_eof) {
 			LOG_INFO("kill_on_eof is set! PCAPInput sending SIGUSR1.\n");
@@ -141,16 +234,347 @@ public:
 	}
 
 private:
-	int		link_layer_type;
-	pcap_t*	pcap_handle;
-	string	filter_string;
 	string  input_file;
 	const Config* config;
 	bool kill_on_eof;
 	bool real_time;
-	int drift_time;
+	string mode;
+	double speed;
+	double rate;
+	int loops;
+	ReplayMode replay;
+	RewriteMode rewrite;
+
+	uint8_t* map;
+	size_t map_size;
+	vector<ReplayRecord> records;
+
+	/* The rewritten copy of each record for the current pass. Entries are
+	   cleared as they are handed on. */
+	vector<Packet*> pass;
+	vector<uint8_t> scratch;
+
+	/* Running totals used by the byte rate schedule */
+	vector<uint64_t> byte_offsets;
+	uint64_t total_bytes;
+
+	unsigned long long sent_packets;
+	unsigned long long sent_bytes;
+	unsigned long long late_packets;
+	uint64_t max_lateness;
+
+	/* Maps the capture in to memory and decodes every IPv4 record up front so
+	   the replay loop does nothing but pace and forward. */
+	bool load_file() {
+		struct stat st;
+		int fd;
 
-	int packet_count;
+		fd = open(input_file.c_str(), O_RDONLY);
+		if(fd == -1 || fstat(fd, &st) < 0) {
+			LOG_CRITICAL("Failed to open '%s'. Reason: %s\n", input_file.c_str(), strerror(errno));
+			if(fd != -1) {
+				close(fd);
+			}
+			return false;
+		}
+
+		map_size = st.st_size;
+		if(map_size < sizeof(PcapFileHeader)) {
+			LOG_CRITICAL("'%s' is too short to be a pcap file.\n", input_file.c_str());
+			close(fd);
+			return false;
+		}
+
+		map = (uint8_t*)mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		close(fd);
+		if(map == MAP_FAILED) {
+			map = NULL;
+			LOG_CRITICAL("Failed to mmap '%s'. Reason: %s\n", input_file.c_str(), strerror(errno));
+			return false;
+		}
+		madvise(map, map_size, MADV_SEQUENTIAL);
+
+		const PcapFileHeader* fh = (const PcapFileHeader*)map;
+		bool swapped = false, nsec = false;
+
+		if(fh->magic == PCAP_MAGIC_USEC || fh->magic == PCAP_MAGIC_NSEC) {
+			nsec = (fh->magic == PCAP_MAGIC_NSEC);
+		} else if(fh->magic == __builtin_bswap32(PCAP_MAGIC_USEC) || fh->magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+			swapped = true;
+			nsec = (fh->magic == __builtin_bswap32(PCAP_MAGIC_NSEC));
+		} else {
+			LOG_CRITICAL("'%s' is not a pcap file (pcapng is not supported).\n", input_file.c_str());
+			return false;
+		}
+
+		uint32_t linktype = rd32(fh->linktype, swapped);
+		size_t offset = sizeof(PcapFileHeader);
+		unsigned long long skipped = 0;
+
+		total_bytes = 0;
+
+		while(offset + sizeof(PcapRecordHeader) <= map_size) {
+			const PcapRecordHeader* rh = (const PcapRecordHeader*)(map + offset);
+			uint32_t caplen = rd32(rh->caplen, swapped);
+			const uint8_t* frame = map + offset + sizeof(PcapRecordHeader);
+
+			offset += sizeof(PcapRecordHeader) + caplen;
+			if(offset > map_size) {
+				LOG_WARNING("'%s' is truncated. Ignoring the last record.\n", input_file.c_str());
+				break;
+			}
+
+			ReplayRecord r;
+			uint32_t ip_offset;
+
+			if(!ip_header_offset(linktype, frame, caplen, &ip_offset)) {
+				skipped++;
+				continue;
+			}
+
+			r.data = frame + ip_offset;
+			r.len = caplen - ip_offset;
+			r.ts = (uint64_t)rd32(rh->ts_sec, swapped) * 1000000000ULL +
+				(uint64_t)rd32(rh->ts_frac, swapped) * (nsec ? 1 : 1000);
+
+			/* The Ethernet header is stripped here, as it always has been */
+			r.pkt = new Packet();
+			r.pkt->PacketFromIP(r.data, r.len);
+
+			/* The same Packet is forwarded on every loop and may be read by
+			   several plugins at once. Compose the raw data now so nobody has to
+			   do it lazily while it is shared. */
+			r.pkt->GetRawPtr();
+			share_packet(r.pkt);
+
+			byte_offsets.push_back(total_bytes);
+			total_bytes += r.len;
+			records.push_back(r);
+		}
+
+		LOG_INFO("Loaded %u packets (%llu bytes) from '%s'. Skipped %llu non-IPv4 records.\n",
+				(unsigned int)records.size(), (unsigned long long)total_bytes, input_file.c_str(), skipped);
+
+		if(records.empty()) {
+			LOG_CRITICAL("No IPv4 packets in '%s'.\n", input_file.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	static inline uint32_t rd32(uint32_t v, bool swapped) {
+		return (swapped ? __builtin_bswap32(v) : v);
+	}
+
+	/* Finds the start of the IPv4 header for the supported link types. */
+	static bool ip_header_offset(uint32_t linktype, const uint8_t* frame, uint32_t caplen, uint32_t* offset) {
+		uint32_t off;
+		uint16_t ethertype;
+
+		switch(linktype) {
+			case LINKTYPE_ETHERNET:
+				if(caplen < 14) {
+					return false;
+				}
+				off = 14;
+				ethertype = (frame[12] << 8) | frame[13];
+				/* One 802.1Q tag */
+				if(ethertype == 0x8100 && caplen >= 18) {
+					ethertype = (frame[16] << 8) | frame[17];
+					off = 18;
+				}
+				if(ethertype != 0x0800) {
+					return false;
+				}
+				break;
+			case LINKTYPE_LINUX_SLL:
+				if(caplen < 16 || ((frame[14] << 8) | frame[15]) != 0x0800) {
+					return false;
+				}
+				off = 16;
+				break;
+			case LINKTYPE_NULL:
+				off = 4;
+				break;
+			case LINKTYPE_RAW:
+			case DLT_RAW:
+				off = 0;
+				break;
+			default:
+				return false;
+		}
+
+		if(caplen < off + 20 || (frame[off] >> 4) != 4) {
+			return false;
+		}
+
+		*offset = off;
+		return true;
+	}
+
+	uint64_t capture_duration() {
+		if(records.back().ts < records.front().ts) {
+			return 0;
+		}
+		return records.back().ts - records.front().ts;
+	}
+
+	/* Nanoseconds after the start of a loop at which a record should be sent */
+	uint64_t schedule(size_t i) {
+		switch(replay) {
+			case REPLAY_SPEED:
+				/* Records that go back in time are sent right away */
+				if(records[i].ts < records.front().ts) {
+					return 0;
+				}
+				return (uint64_t)((records[i].ts - records.front().ts) / speed);
+			case REPLAY_PPS:
+				return (uint64_t)(i * 1e9 / rate);
+			case REPLAY_BPS:
+				return (uint64_t)(byte_offsets[i] * 8 * 1e9 / rate);
+			default:
+				return 0;
+		}
+	}
+
+	/* Length of one pass through the capture. In speed mode the average packet
+	   gap is added so the first packet of the next loop does not collide with
+	   the last packet of this one. */
+	uint64_t loop_length(uint64_t duration) {
+		switch(replay) {
+			case REPLAY_SPEED: {
+				uint64_t gap = (records.size() > 1 ? duration / (records.size() - 1) : 0);
+				return (uint64_t)((duration + gap) / speed);
+			}
+			case REPLAY_PPS:
+				return (uint64_t)(records.size() * 1e9 / rate);
+			case REPLAY_BPS:
+				return (uint64_t)(total_bytes * 8 * 1e9 / rate);
+			default:
+				return 0;
+		}
+	}
+
+	static inline timespec ts_add(const timespec& t, uint64_t ns) {
+		timespec r;
+		uint64_t n = t.tv_nsec + ns;
+		r.tv_sec = t.tv_sec + n / 1000000000ULL;
+		r.tv_nsec = n % 1000000000ULL;
+		return r;
+	}
+
+	static inline uint64_t elapsed_since(const timespec& t) {
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (uint64_t)(now.tv_sec - t.tv_sec) * 1000000000ULL + now.tv_nsec - t.tv_nsec;
+	}
+
+	/* Sleeps until an absolute point on the monotonic clock, so errors do not
+	   accumulate the way relative sleeps do. */
+	void wait_until(const timespec& target) {
+		timespec now;
+
+		if(replay == REPLAY_MAX) {
+			return;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int64_t ahead = (int64_t)(target.tv_sec - now.tv_sec) * 1000000000LL + (target.tv_nsec - now.tv_nsec);
+
+		if(ahead > 0) {
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) == EINTR);
+		} else if(-ahead > 1000000) {
+			/* More than a millisecond behind schedule */
+			late_packets++;
+			if((uint64_t)-ahead > max_lateness) {
+				max_lateness = -ahead;
+			}
+		}
+	}
+
+	/* Decodes a copy of every record with its addresses moved by 'loop', so
+	   each pass through the capture looks like a new set of flows. The IP and
+	   TCP/UDP checksums are patched incrementally (RFC 1624). */
+	void build_pass(int loop) {
+		free_pass();
+		pass.resize(records.size());
+
+		for(size_t i = 0; i < records.size(); i++) {
+			const ReplayRecord& r = records[i];
+			uint32_t ihl;
+
+			scratch.assign(r.data, r.data + r.len);
+			ihl = (scratch[0] & 0x0f) * 4;
+
+			if(rewrite & REWRITE_SOURCE) {
+				rewrite_address(&scratch[0], r.len, ihl, 12, loop);
+			}
+			if(rewrite & REWRITE_DESTINATION) {
+				rewrite_address(&scratch[0], r.len, ihl, 16, loop);
+			}
+
+			pass[i] = new Packet();
+			pass[i]->PacketFromIP(&scratch[0], r.len);
+		}
+	}
+
+	void free_pass() {
+		for(size_t i = 0; i < pass.size(); i++) {
+			delete pass[i];
+		}
+		pass.clear();
+	}
+
+	static void rewrite_address(uint8_t* ip, uint32_t len, uint32_t ihl, uint32_t pos, int loop) {
+		uint32_t old_addr = (ip[pos] << 24) | (ip[pos + 1] << 16) | (ip[pos + 2] << 8) | ip[pos + 3];
+		uint32_t new_addr = old_addr + loop;
+		uint8_t* l4csum = NULL;
+		bool fragment = ((ip[6] & 0x1f) | ip[7]) != 0;
+
+		ip[pos] = new_addr >> 24;
+		ip[pos + 1] = new_addr >> 16;
+		ip[pos + 2] = new_addr >> 8;
+		ip[pos + 3] = new_addr;
+
+		/* TCP and UDP checksums cover the addresses through the pseudo header.
+		   Only the first fragment carries the transport header. */
+		if(!fragment) {
+			if(ip[9] == IPPROTO_TCP && len >= ihl + 18) {
+				l4csum = ip + ihl + 16;
+			} else if(ip[9] == IPPROTO_UDP && len >= ihl + 8 && (ip[ihl + 6] | ip[ihl + 7])) {
+				l4csum = ip + ihl + 6;
+			}
+		}
+
+		csum_replace32(ip + 10, old_addr, new_addr);
+		if(l4csum) {
+			csum_replace32(l4csum, old_addr, new_addr);
+		}
+	}
+
+	/* Logs the achieved rate and publishes it on 'PCAPInput.stats' */
+	void report(double elapsed) {
+		ostringstream out;
+		double pps = (elapsed > 0 ? sent_packets / elapsed : 0);
+		double mbps = (elapsed > 0 ? sent_bytes * 8 / elapsed / 1e6 : 0);
+
+		out << "packets=" << sent_packets << " bytes=" << sent_bytes << " seconds=" << elapsed
+			<< " pps=" << (unsigned long long)pps << " mbps=" << mbps
+			<< " late=" << late_packets << " max_late_us=" << max_lateness / 1000;
+
+		LOG_INFO("Replay of '%s' complete (mode %s).\n", input_file.c_str(), mode.c_str());
+		LOG_INFO("    Packets sent:  %llu\n", sent_packets);
+		LOG_INFO("    Bytes sent:    %llu\n", sent_bytes);
+		LOG_INFO("    Elapsed:       %.3f s\n", elapsed);
+		LOG_INFO("    Achieved rate: %.0f pps, %.3f Mbit/s\n", pps, mbps);
+		LOG_INFO("    Late packets:  %llu (worst %llu us)\n", late_packets, (unsigned long long)max_lateness / 1000);
+
+		NpsGateVar* var = new NpsGateVar();
+		var->set(out.str());
+		publish("PCAPInput.stats", var);
+		var->unref();
+	}
 
 };
 
@@ -0,0 +1,235 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file pcap_writer.hpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef PCAP_WRITER_HPP_INCLUDED
+#define PCAP_WRITER_HPP_INCLUDED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <zlib.h>
+
+#include <string>
+
+#include "../logger.hpp"
+
+using namespace std;
+using namespace NpsGate;
+
+#define PCAP_WRITER_LINKTYPE_ETHERNET	1
+#define PCAP_WRITER_LINKTYPE_RAW		101
+
+/**************************************************************
+ **
+ ** PcapWriter writes classic pcap files without going through
+ ** libpcap. Records are collected in a large page aligned
+ ** buffer and written with a single write() when it fills, or
+ ** streamed through zlib when compression is enabled.
+ **
+ ** Not thread safe. Each file should be owned by one thread.
+ **
+ **************************************************************/
+class PcapWriter {
+	public:
+		PcapWriter(size_t buffer_size = 4 << 20) :
+				total_bytes(0), total_packets(0), fd(-1), gz(NULL), buffer(NULL),
+				size(buffer_size), used(0), file_bytes(0), file_packets(0) {
+			if(posix_memalign((void**)&buffer, 4096, size)) {
+				buffer = NULL;
+			}
+		}
+
+		~PcapWriter() {
+			close();
+			free(buffer);
+		}
+
+		/* Creates 'path' and writes the file header. A 'compression' level of 1-9
+		   gzip's the file, 0 writes it uncompressed. */
+		bool open(const string& path, uint32_t linktype, uint32_t snaplen, int compression = 0) {
+			struct {
+				uint32_t magic;
+				uint16_t version_major;
+				uint16_t version_minor;
+				int32_t thiszone;
+				uint32_t sigfigs;
+				uint32_t snaplen;
+				uint32_t linktype;
+			} hdr;
+
+			close();
+
+			if(!buffer) {
+				LOG_CRITICAL("Failed to allocate a %u byte pcap write buffer.\n", (unsigned int)size);
+				return false;
+			}
+
+			fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if(fd == -1) {
+				LOG_CRITICAL("Failed to create '%s'. Reason: %s\n", path.c_str(), strerror(errno));
+				return false;
+			}
+
+			if(compression > 0) {
+				char mode[4];
+				snprintf(mode, sizeof(mode), "wb%d", compression > 9 ? 9 : compression);
+				gz = gzdopen(fd, mode);
+				if(!gz) {
+					LOG_CRITICAL("Failed to start compression on '%s'.\n", path.c_str());
+					::close(fd);
+					fd = -1;
+					return false;
+				}
+				gzbuffer(gz, 256 << 10);
+			}
+
+			filename = path;
+			file_bytes = 0;
+			file_packets = 0;
+
+			hdr.magic = 0xa1b2c3d4;
+			hdr.version_major = 2;
+			hdr.version_minor = 4;
+			hdr.thiszone = 0;
+			hdr.sigfigs = 0;
+			hdr.snaplen = snaplen;
+			hdr.linktype = linktype;
+			append(&hdr, sizeof(hdr));
+
+			return true;
+		}
+
+		/* 'len' is the original length of the packet, 'caplen' how much of it is in 'data' */
+		bool write(const timeval& ts, const uint8_t* data, uint32_t caplen, uint32_t len) {
+			uint32_t rec[4];
+
+			rec[0] = ts.tv_sec;
+			rec[1] = ts.tv_usec;
+			rec[2] = caplen;
+			rec[3] = len;
+
+			if(!append(rec, sizeof(rec)) || !append(data, caplen)) {
+				return false;
+			}
+
+			file_packets++;
+			total_packets++;
+			return true;
+		}
+
+		bool flush() {
+			if(used == 0) {
+				return true;
+			}
+
+			bool rval = (gz ? write_gz(buffer, used) : write_fd(buffer, used));
+			used = 0;
+			return rval;
+		}
+
+		void close() {
+			if(fd == -1) {
+				return;
+			}
+
+			flush();
+			if(gz) {
+				gzclose(gz);
+				gz = NULL;
+			} else {
+				::close(fd);
+			}
+			fd = -1;
+		}
+
+		inline bool is_open() const { return fd != -1; }
+		inline const string& name() const { return filename; }
+
+		/* Bytes handed to the file so far, before compression */
+		inline unsigned long long bytes() const { return file_bytes; }
+		inline unsigned long long packets() const { return file_packets; }
+
+		unsigned long long total_bytes;
+		unsigned long long total_packets;
+
+	private:
+		int fd;
+		gzFile gz;
+		uint8_t* buffer;
+		size_t size;
+		size_t used;
+		string filename;
+		unsigned long long file_bytes;
+		unsigned long long file_packets;
+
+		bool append(const void* data, size_t len) {
+			if(fd == -1) {
+				return false;
+			}
+
+			file_bytes += len;
+			total_bytes += len;
+
+			/* Too big to be worth buffering */
+			if(len > size / 2) {
+				return flush() && (gz ? write_gz(data, len) : write_fd(data, len));
+			}
+
+			if(used + len > size && !flush()) {
+				return false;
+			}
+
+			memcpy(buffer + used, data, len);
+			used += len;
+			return true;
+		}
+
+		bool write_fd(const void* data, size_t len) {
+			const uint8_t* p = (const uint8_t*)data;
+
+			while(len > 0) {
+				ssize_t n = ::write(fd, p, len);
+				if(n < 0) {
+					if(errno == EINTR) {
+						continue;
+					}
+					LOG_WARNING("Write to '%s' failed. Reason: %s\n", filename.c_str(), strerror(errno));
+					return false;
+				}
+				p += n;
+				len -= n;
+			}
+			return true;
+		}
+
+		bool write_gz(const void* data, size_t len) {
+			if(gzwrite(gz, data, len) != (int)len) {
+				int err;
+				LOG_WARNING("Compressed write to '%s' failed: %s\n", filename.c_str(), gzerror(gz, &err));
+				return false;
+			}
+			return true;
+		}
+};
+
+#endif /* PCAP_WRITER_HPP_INCLUDED */
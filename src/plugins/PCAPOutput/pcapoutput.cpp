@@ -20,28 +20,145 @@
 #include <pcap.h>
 #include <crafter.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sstream>
 
 #include "../npsgate_plugin.hpp"
 #include "../logger.hpp"
+#include "pcap_writer.hpp"
 
 using namespace Crafter;
 using namespace NpsGate;
 
+/* Header in front of every packet in the RecordRing. A 'size' of zero marks
+   the unused space at the end of the ring before it wraps. */
+struct RingRecord {
+	uint32_t size;
+	uint32_t caplen;
+	uint32_t len;
+	uint32_t reserved;
+	timeval ts;
+};
+
+/**************************************************************
+ **
+ ** Single producer, single consumer ring of variable sized
+ ** records. The plugin thread copies packets in, the writer
+ ** thread drains them. No locks are taken on either side; the
+ ** producer only moves 'head' and the consumer only moves
+ ** 'tail'. When the ring is full packets are dropped rather
+ ** than stalling the pipeline.
+ **
+ **************************************************************/
+class RecordRing {
+	public:
+		RecordRing() : buffer(NULL), size(0), mask(0), head(0), tail(0) { }
+		~RecordRing() { free(buffer); }
+
+		bool init(size_t bytes) {
+			for(size = 4096; size < bytes; size <<= 1);
+			mask = size - 1;
+			return posix_memalign((void**)&buffer, 4096, size) == 0;
+		}
+
+		/* Producer side */
+		bool push(const timeval& ts, const uint8_t* data, uint32_t caplen, uint32_t len) {
+			uint32_t need = (sizeof(RingRecord) + caplen + 7) & ~7;
+			uint64_t h = head;
+			uint64_t t = tail;
+			size_t pos = h & mask;
+			size_t skip = 0;
+
+			__sync_synchronize();
+
+			/* Records never wrap. Skip to the start if this one would. */
+			if(pos + need > size) {
+				skip = size - pos;
+			}
+			if(need > size / 2 || (h + skip + need) - t > size) {
+				return false;
+			}
+
+			if(skip) {
+				((RingRecord*)(buffer + pos))->size = 0;
+				pos = 0;
+			}
+
+			RingRecord* r = (RingRecord*)(buffer + pos);
+			r->size = need;
+			r->caplen = caplen;
+			r->len = len;
+			r->ts = ts;
+			memcpy(r + 1, data, caplen);
+
+			__sync_synchronize();
+			head = h + skip + need;
+			return true;
+		}
+
+		/* Consumer side. Returns NULL when the ring is empty. */
+		const RingRecord* peek() {
+			for(;;) {
+				uint64_t t = tail;
+				if(t == head) {
+					return NULL;
+				}
+				__sync_synchronize();
+
+				RingRecord* r = (RingRecord*)(buffer + (t & mask));
+				if(r->size != 0) {
+					return r;
+				}
+				tail = t + (size - (t & mask));
+			}
+		}
+
+		void pop(const RingRecord* r) {
+			__sync_synchronize();
+			tail = tail + r->size;
+		}
+
+	private:
+		uint8_t* buffer;
+		size_t size;
+		size_t mask;
+		volatile uint64_t head;
+		volatile uint64_t tail;
+};
 
 class PCAPOutput : public NpsGatePlugin {
 public:
 	PCAPOutput(PluginCore* c) : NpsGatePlugin(c) {
 		packet_count = 0;
+		snaplen = 65535;
+		linktype = "raw";
+		rotate_size = 0;
+		rotate_seconds = 0;
+		sample_rate = 1;
+		sample_mode = "packet";
+		compression = 0;
+		ring_size = 64;
+		buffer_size = 4096;
+		writer = NULL;
+		file_index = 0;
+		file_opened = 0;
+		running = false;
+		sampled_out = 0;
+		ring_drops = 0;
+		write_errors = 0;
 	}
 
 	~PCAPOutput() {
-		ClosePcapDumper(pcap_handle, pcap_dumper);
+		stop_writer();
 	}
 
 	virtual bool init() {
 		LOG_INFO("PCAPOutput plugin starting intialization.\n");
 
 		config = get_config();
+		stats_topic = register_topic("PCAPOutput.stats");
 
 		/* Get the output file name from the config. Fail if not set. */
 		if(!config->lookupValue("pcapoutput.output_file", output_file)) {
@@ -49,53 +166,99 @@ public:
 			return false;
 		}
 
-		// Assume that the data link layer is Ethernet
-		OpenPcapDumper(DLT_EN10MB, output_file, pcap_handle, pcap_dumper);
+		config->lookupValue("pcapoutput.snaplen", snaplen);
+		config->lookupValue("pcapoutput.linktype", linktype);
+		config->lookupValue("pcapoutput.rotate_size", rotate_size);
+		config->lookupValue("pcapoutput.rotate_seconds", rotate_seconds);
+		config->lookupValue("pcapoutput.sample_rate", sample_rate);
+		config->lookupValue("pcapoutput.sample_mode", sample_mode);
+		config->lookupValue("pcapoutput.compression", compression);
+		config->lookupValue("pcapoutput.ring_size", ring_size);
+		config->lookupValue("pcapoutput.buffer_size", buffer_size);
+
+		if(snaplen <= 0 || snaplen > 65535) {
+			snaplen = 65535;
+		}
+		if(sample_rate < 1) {
+			sample_rate = 1;
+		}
+		if(sample_mode != "packet" && sample_mode != "flow") {
+			LOG_CRITICAL("Unknown sample_mode '%s'. Expected packet or flow.\n", sample_mode.c_str());
+			return false;
+		}
+		if(linktype != "raw" && linktype != "ethernet") {
+			LOG_CRITICAL("Unknown linktype '%s'. Expected raw or ethernet.\n", linktype.c_str());
+			return false;
+		}
+
+		if(!ring.init((size_t)ring_size << 20)) {
+			LOG_CRITICAL("Failed to allocate a %d MB capture ring.\n", ring_size);
+			return false;
+		}
+
+		writer = new PcapWriter((size_t)buffer_size << 10);
+		if(!open_file()) {
+			return false;
+		}
 
-		if(pcap_handle == NULL || pcap_dumper == NULL) {
-			LOG_CRITICAL("Failed to open PCAP dumper!\n");
+		running = true;
+		if(pthread_create(&writer_thread, NULL, writer_main, this)) {
+			LOG_CRITICAL("Failed to start the PCAPOutput writer thread.\n");
+			running = false;
 			return false;
 		}
 
+		set_timeout(1000);
+
 		return true;
 	}
 
 	virtual bool process_packet(Packet* p) {
-		timeval tv;
-		pcap_pkthdr header;
-		LOG_DEBUG("Received a packet of length: %d\n", p->GetSize());
-
-		/* Fill in the PCAP header struct */
-		gettimeofday(&tv, NULL);
-		header.ts = tv;
-		header.caplen = p->GetSize();
-		header.len = p->GetSize();
-
-		/* Publish the packet_size */
-//		NpsGateVar* var1 = new NpsGateVar();
-//		var1->set_int(p->GetSize());
-//		publish("pcapoutput.packet_size", var1);
-
-		/* Publish the packet_count */
-//		NpsGateVar* var2 = new NpsGateVar();
-//		var2->set_int(++packet_count);
-//		publish("pcapoutput.packet_count", var2);
-
-		/* Dump the packet to the output, then drop the packet */
-		DumperPcap(pcap_dumper, &header, p->GetRawPtr());
+		timeval ts;
+		uint32_t len = p->GetSize();
+		uint32_t caplen = (len > (uint32_t)snaplen ? snaplen : len);
+		const uint8_t* data = p->GetRawPtr();
+
+		LOG_DEBUG("Received a packet of length: %d\n", len);
+
+		if(!sample(data, len)) {
+			sampled_out++;
+			drop_packet(p);
+			return true;
+		}
+
+		/* Use the time the packet entered NpsGate, not the time it got here */
+		if(!ingress_time(p, &ts)) {
+			gettimeofday(&ts, NULL);
+		}
+
+		if(!ring.push(ts, data, caplen, len)) {
+			ring_drops++;
+		}
 		drop_packet(p);
 
 		return true;
 	}
 
 	virtual bool process_message(Message* m) {
-//		if(m) {
-//			LOG_INFO("Received message: fq_name='%s', val='%d'\n",
-//					m->fq_name.c_str(), m->value->get_int());
-//		}
 		return true;
 	}
 
+	virtual bool message_timeout() {
+		publish_stats();
+		return true;
+	}
+
+	virtual void exit_handler() {
+		unsigned long long packets = 0;
+		unsigned long long bytes = 0;
+
+		/* stop_writer() frees the writer, and the totals with it */
+		stop_writer(&packets, &bytes);
+		LOG_INFO("PCAPOutput wrote %llu packets (%llu bytes) to %u file(s). Sampled out: %llu, ring drops: %llu\n",
+				packets, bytes, file_index, sampled_out, ring_drops);
+	}
+
 	bool main() {
 		LOG_DEBUG("Inside main. Entering message_loop.\n");
 		message_loop();
@@ -103,14 +266,190 @@ public:
 	}
 
 private:
-	int		link_layer_type;
-	pcap_t*	pcap_handle;
-	pcap_dumper_t* pcap_dumper;
-	string	filter_string;
 	string output_file;
 	const Config* config;
 
-	int packet_count;
+	int snaplen;
+	string linktype;
+	int rotate_size;		/* MB, 0 disables */
+	int rotate_seconds;		/* 0 disables */
+	int sample_rate;
+	string sample_mode;
+	int compression;
+	int ring_size;			/* MB */
+	int buffer_size;		/* KB */
+
+	RecordRing ring;
+	PcapWriter* writer;
+	pthread_t writer_thread;
+	volatile bool running;
+	unsigned int file_index;
+	time_t file_opened;
+
+	unsigned long long packet_count;
+	unsigned long long sampled_out;
+	unsigned long long ring_drops;
+	unsigned long long write_errors;
+	TopicId stats_topic;
+
+	/* 1-in-N sampling. In flow mode the decision is made from a hash of the
+	   addresses, protocol and ports, so both directions of a flow are either
+	   all kept or all dropped. */
+	bool sample(const uint8_t* ip, uint32_t len) {
+		if(sample_rate == 1) {
+			return true;
+		}
+
+		if(sample_mode == "packet") {
+			return (packet_count++ % sample_rate) == 0;
+		}
+
+		if(len < 20 || (ip[0] >> 4) != 4) {
+			return true;
+		}
+
+		uint32_t ihl = (ip[0] & 0x0f) * 4;
+		uint32_t a = (ip[12] << 24) | (ip[13] << 16) | (ip[14] << 8) | ip[15];
+		uint32_t b = (ip[16] << 24) | (ip[17] << 16) | (ip[18] << 8) | ip[19];
+		uint32_t ports = 0;
+
+		if((ip[9] == IPPROTO_TCP || ip[9] == IPPROTO_UDP) && len >= ihl + 4 && !(((ip[6] & 0x1f) | ip[7]))) {
+			ports = ((ip[ihl] << 8) | ip[ihl + 1]) ^ ((ip[ihl + 2] << 8) | ip[ihl + 3]);
+		}
+
+		uint32_t h = (a ^ b) * 0x9e3779b1 ^ (ports * 0x85ebca6b) ^ ip[9];
+		h ^= h >> 16;
+		h *= 0x7feb352d;
+		h ^= h >> 15;
+
+		return (h % sample_rate) == 0;
+	}
+
+	/* With rotation enabled the files are numbered: capture.pcap becomes
+	   capture-00000.pcap, capture-00001.pcap, ... */
+	string next_filename() {
+		string name = output_file;
+
+		if(rotate_size > 0 || rotate_seconds > 0) {
+			char index[16];
+			size_t dot = name.rfind('.');
+			size_t slash = name.rfind('/');
+
+			snprintf(index, sizeof(index), "-%05u", file_index);
+			if(dot == string::npos || (slash != string::npos && dot < slash)) {
+				name += index;
+			} else {
+				name.insert(dot, index);
+			}
+		}
+
+		if(compression > 0 && (name.size() < 3 || name.compare(name.size() - 3, 3, ".gz") != 0)) {
+			name += ".gz";
+		}
+
+		return name;
+	}
+
+	bool open_file() {
+		string name = next_filename();
+		uint32_t lt = (linktype == "ethernet" ? PCAP_WRITER_LINKTYPE_ETHERNET : PCAP_WRITER_LINKTYPE_RAW);
+
+		if(!writer->open(name, lt, snaplen, compression)) {
+			return false;
+		}
+
+		LOG_DEBUG("PCAPOutput writing to '%s'.\n", name.c_str());
+		file_index++;
+		file_opened = time(NULL);
+		return true;
+	}
+
+	bool rotate_due(time_t now) {
+		if(rotate_size > 0 && writer->bytes() >= ((unsigned long long)rotate_size << 20)) {
+			return true;
+		}
+		if(rotate_seconds > 0 && now - file_opened >= rotate_seconds && writer->packets() > 0) {
+			return true;
+		}
+		return false;
+	}
+
+	static void* writer_main(void* arg) {
+		((PCAPOutput*)arg)->writer_loop();
+		return NULL;
+	}
+
+	/* Drains the ring in to the current file. Disk stalls only hold up this
+	   thread; the plugin thread keeps filling the ring. */
+	void writer_loop() {
+		time_t last_flush = time(NULL);
+
+		for(;;) {
+			const RingRecord* r = ring.peek();
+
+			if(!r) {
+				if(!running) {
+					break;
+				}
+
+				time_t now = time(NULL);
+				if(now != last_flush) {
+					writer->flush();
+					last_flush = now;
+				}
+				if(rotate_due(now) && !open_file()) {
+					write_errors++;
+				}
+				usleep(1000);
+				continue;
+			}
+
+			if(!writer->is_open() || rotate_due(time(NULL))) {
+				if(!open_file()) {
+					write_errors++;
+				}
+			}
+
+			if(!writer->write(r->ts, (const uint8_t*)(r + 1), r->caplen, r->len)) {
+				write_errors++;
+			}
+			ring.pop(r);
+		}
+
+		writer->close();
+	}
+
+	/* Waits for the ring to be drained. The writer's totals go in 'packets' and
+	   'bytes' when given. */
+	void stop_writer(unsigned long long* packets = NULL, unsigned long long* bytes = NULL) {
+		if(running) {
+			running = false;
+			pthread_join(writer_thread, NULL);
+		}
+		if(writer && packets) {
+			*packets = writer->total_packets;
+			*bytes = writer->total_bytes;
+		}
+		delete writer;
+		writer = NULL;
+	}
+
+	void publish_stats() {
+		ostringstream out;
+
+		if(!writer) {
+			return;
+		}
+
+		out << "packets=" << writer->total_packets << " bytes=" << writer->total_bytes
+			<< " files=" << file_index << " sampled_out=" << sampled_out
+			<< " ring_drops=" << ring_drops << " write_errors=" << write_errors;
+
+		NpsGateVar* var = new NpsGateVar();
+		var->set(out.str());
+		publish(stats_topic, var);
+		var->unref();
+	}
 };
 
 NPSGATE_PLUGIN_CREATE(PCAPOutput);
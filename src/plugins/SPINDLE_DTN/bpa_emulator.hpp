@@ -0,0 +1,490 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file bpa_emulator.hpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef BPA_EMULATOR_H_INCLUDED
+#define BPA_EMULATOR_H_INCLUDED
+
+/* A stand-in for the SPINDLE bundle protocol agent, built instead of the real
+ * BpaInterface when BPA_EMULATOR is defined. Each registration is a local
+ * datagram socket named after its endpoint, so a DTNOutput and a DTNInput in
+ * different NpsGate processes on one host can talk without a DTN daemon.
+ *
+ * The link is modelled by the sender. Each bundle is given a time it arrives,
+ * after waiting for the bundles ahead of it to be sent at the link rate, for
+ * any outage to end and for the propagation delay. The receiver holds it until
+ * then. Bundles are lost at random, dropped when the link's buffer is full and
+ * expire if they cannot arrive within their lifetime, much as a DTN would store
+ * them and carry them across a disruption. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <deque>
+#include <queue>
+#include <string>
+#include <vector>
+#include <libconfig.h++>
+
+#include "../logger.hpp"
+
+using namespace std;
+using namespace libconfig;
+using namespace NpsGate;
+
+#define BPA_EMU_MAGIC		0x42704575
+#define BPA_EMU_MAX_BUNDLE	(256 * 1024)
+
+/* Microseconds on the monotonic clock, which both ends of the link share */
+static inline uint64_t bpa_now_us() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct BpaEndpoint {
+	char uri[256];
+};
+
+/* Sent in front of every bundle. Both ends are on the same host. */
+struct BpaEmuHeader {
+	uint32_t magic;
+	uint32_t len;
+	uint64_t sent;			// When the sender handed the bundle over [us]
+	uint64_t arrival;		// When the receiver may deliver it [us]
+};
+
+/**************************************************************
+ **
+ ** BpaLinkModel decides when, and whether, a bundle reaches
+ ** the other end. Outages are given relative to when the
+ ** interface was created and repeat every 'period' if set.
+ **
+ **************************************************************/
+class BpaLinkModel {
+	public:
+		BpaLinkModel() : rate(0), delay(0), loss(0), buffer(1 << 20), period(0), link_free(0), queued(0) {
+			epoch = bpa_now_us();
+			seed = (unsigned int)epoch;
+		}
+
+		uint64_t rate;		// [bytes/s], 0 is unlimited
+		uint64_t delay;		// [us]
+		double loss;		// Probability a bundle is lost
+		uint64_t buffer;	// Bytes the link holds waiting to be sent
+		uint64_t period;	// [us], 0 runs the outages once
+		vector<pair<uint64_t,uint64_t> > outages;	// [start, end) [us]
+		unsigned int seed;
+
+		/* The first time at or after 't' the link is up */
+		uint64_t next_up(uint64_t t) const {
+			bool moved = true;
+
+			for(int n = 0; moved && n < 16; n++) {
+				uint64_t phase = t - epoch;
+
+				moved = false;
+				if(period) {
+					phase %= period;
+				}
+				for(size_t i = 0; i < outages.size(); i++) {
+					if(phase >= outages[i].first && phase < outages[i].second) {
+						t += outages[i].second - phase;
+						moved = true;
+						break;
+					}
+				}
+			}
+
+			return t;
+		}
+
+		enum Result { SENT, LOST, FULL, EXPIRED };
+
+		Result transmit(size_t len, uint64_t now, uint64_t lifetime, uint64_t* arrival) {
+			uint64_t start;
+			uint64_t end;
+
+			/* Bytes the link finished sending have left its buffer */
+			while(!in_flight.empty() && in_flight.front().first <= now) {
+				queued -= in_flight.front().second;
+				in_flight.pop_front();
+			}
+			if(queued + len > buffer && !in_flight.empty()) {
+				return FULL;
+			}
+
+			start = next_up(link_free > now ? link_free : now);
+			end = start + (rate ? (uint64_t)len * 1000000 / rate : 0);
+			*arrival = end + delay;
+
+			if(*arrival - now > lifetime) {
+				return EXPIRED;
+			}
+
+			link_free = end;
+			queued += len;
+			in_flight.push_back(make_pair(end, (uint64_t)len));
+
+			if(loss > 0 && (double)rand_r(&seed) / RAND_MAX < loss) {
+				return LOST;
+			}
+			return SENT;
+		}
+
+	private:
+		uint64_t epoch;
+		uint64_t link_free;
+		uint64_t queued;
+		deque<pair<uint64_t,uint64_t> > in_flight;	// When each bundle is sent, its size
+};
+
+class BpaInterface
+{
+	private:
+		struct HeldBundle {
+			uint64_t sent;
+			uint64_t arrival;
+			vector<char> data;
+		};
+
+		struct Later {
+			bool operator()(const HeldBundle* a, const HeldBundle* b) const {
+				return a->arrival > b->arrival;
+			}
+		};
+
+		int fd;
+		string src_endpoint;
+		string dest_endpoint;
+		uint32_t expiration;	// Bundle lifetime [s]
+		BpaEndpoint default_dest;
+		BpaLinkModel link;
+		BpaStats counters;
+		priority_queue<HeldBundle*, vector<HeldBundle*>, Later> held;
+		vector<char> rx_buffer;
+
+		static socklen_t address(const BpaEndpoint* eid, sockaddr_un* sun) {
+			size_t len = strlen(eid->uri);
+			const char prefix[] = "npsgate-bpa ";
+
+			memset(sun, 0, sizeof(*sun));
+			sun->sun_family = AF_UNIX;
+
+			/* Abstract socket names start with a NUL and need no cleaning up */
+			if(len > sizeof(sun->sun_path) - sizeof(prefix)) {
+				len = sizeof(sun->sun_path) - sizeof(prefix);
+			}
+			memcpy(sun->sun_path + 1, prefix, sizeof(prefix) - 1);
+			memcpy(sun->sun_path + sizeof(prefix), eid->uri, len);
+
+			return offsetof(sockaddr_un, sun_path) + sizeof(prefix) + len;
+		}
+
+		void register_eid(const BpaEndpoint* eid) {
+			sockaddr_un sun;
+			socklen_t len = address(eid, &sun);
+			int size = 4 * 1024 * 1024;
+			timeval wait = { 0, 100000 };
+
+			fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+			if(fd < 0) {
+				LOG_CRITICAL("Failed to create BPA emulator socket: %s\n", strerror(errno));
+				return;
+			}
+
+			setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+			setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+			/* A receiver that falls behind holds the sender back, like a BPA
+			   refusing bundles, but one that stopped reading does not hang it */
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &wait, sizeof(wait));
+
+			if(bind(fd, (sockaddr*)&sun, len) < 0) {
+				LOG_CRITICAL("Error creating registration for %s: %s\n", eid->uri, strerror(errno));
+				return;
+			}
+
+			LOG_INFO("DTN registration complete (emulated).\n");
+		}
+
+		/* Moves everything waiting on the socket in to the held bundles */
+		void drain() {
+			ssize_t n;
+
+			while((n = ::recv(fd, &rx_buffer[0], rx_buffer.size(), MSG_DONTWAIT)) > 0) {
+				BpaEmuHeader h;
+
+				if((size_t)n < sizeof(h)) {
+					continue;
+				}
+				memcpy(&h, &rx_buffer[0], sizeof(h));
+				if(h.magic != BPA_EMU_MAGIC || h.len != (size_t)n - sizeof(h)) {
+					LOG_WARNING("Discarding a malformed emulated bundle.\n");
+					continue;
+				}
+
+				HeldBundle* b = new HeldBundle();
+				b->sent = h.sent;
+				b->arrival = h.arrival;
+				b->data.assign(rx_buffer.begin() + sizeof(h), rx_buffer.begin() + n);
+				held.push(b);
+			}
+		}
+
+	public:
+		BpaInterface(string s, string d) : fd(-1), src_endpoint(s), dest_endpoint(d), expiration(60 * 60),
+				rx_buffer(sizeof(BpaEmuHeader) + BPA_EMU_MAX_BUNDLE) {
+			BpaEndpoint source;
+
+			if(!parse_eid(&source, src_endpoint)) {
+				LOG_CRITICAL("Failed to parse source endpoint: %s\n", src_endpoint.c_str());
+			}
+
+			if(!parse_eid(&default_dest, dest_endpoint)) {
+				LOG_CRITICAL("Failed to parse destination endpoint: %s\n", dest_endpoint.c_str());
+			}
+
+			register_eid(&source);
+
+			LOG_INFO("BPA Initialization Complete (emulated).\n");
+			LOG_INFO("\tSource Endpoint: %s\n", src_endpoint.c_str());
+			LOG_INFO("\tDesitination Endpoint: %s\n", dest_endpoint.c_str());
+		}
+
+		~BpaInterface()
+		{
+			while(!held.empty()) {
+				delete held.top();
+				held.pop();
+			}
+			if(fd >= 0) {
+				close(fd);
+			}
+		}
+
+		/* Link parameters of bundles this interface sends:
+		 *	rate		- [kbit/s], 0 is unlimited
+		 *	delay		- One way propagation delay [ms]
+		 *	loss		- Percentage of bundles lost
+		 *	buffer		- Bytes waiting to be sent before bundles are dropped
+		 *	outages		- List of { start; duration; } [ms] when the link is down
+		 *	period		- Repeat the outages every 'period' ms
+		 *	seed		- Seed of the loss process */
+		bool configure(const Setting& s) {
+			int rate = 0;
+			int delay = 0;
+			double loss = 0;
+			int buffer = 1 << 20;
+			int period = 0;
+			int seed = 0;
+
+			try {
+				s.lookupValue("rate", rate);
+				s.lookupValue("delay", delay);
+				s.lookupValue("loss", loss);
+				s.lookupValue("buffer", buffer);
+				s.lookupValue("period", period);
+
+				link.rate = rate > 0 ? (uint64_t)rate * 1000 / 8 : 0;
+				link.delay = delay > 0 ? (uint64_t)delay * 1000 : 0;
+				link.loss = loss > 0 ? loss / 100.0 : 0;
+				link.buffer = buffer > 0 ? buffer : 0;
+				link.period = period > 0 ? (uint64_t)period * 1000 : 0;
+				if(s.lookupValue("seed", seed)) {
+					link.seed = seed;
+				}
+
+				if(s.exists("outages")) {
+					const Setting& outages = s["outages"];
+
+					for(int i = 0; i < outages.getLength(); i++) {
+						int start = 0;
+						int duration = 0;
+
+						outages[i].lookupValue("start", start);
+						outages[i].lookupValue("duration", duration);
+						if(start < 0 || duration <= 0) {
+							LOG_CRITICAL("Link outage %d needs a start and a duration.\n", i);
+							return false;
+						}
+						link.outages.push_back(make_pair((uint64_t)start * 1000, (uint64_t)(start + duration) * 1000));
+					}
+				}
+			} catch(SettingException& ex) {
+				LOG_CRITICAL("Invalid emulated link configuration at '%s'.\n", ex.getPath());
+				return false;
+			}
+
+			LOG_INFO("Emulated DTN link: %d kbit/s, %d ms delay, %.2f%% loss, %u outages.\n",
+					rate, delay, loss, (unsigned int)link.outages.size());
+			return true;
+		}
+
+		bool parse_eid(BpaEndpoint* eid, string str)
+		{
+			memset(eid, 0, sizeof(*eid));
+
+			if(str.empty() || str.size() >= sizeof(eid->uri)) {
+				LOG_DEBUG("Invalid EID: %s\n", str.c_str());
+				return false;
+			}
+
+			/* Like dtn_build_local_eid(), a bare name is a service of this node */
+			if(str.find(':') == string::npos) {
+				str = "dtn://localhost/" + str;
+				if(str.size() >= sizeof(eid->uri)) {
+					return false;
+				}
+				LOG_DEBUG("Found local EID: %s\n", str.c_str());
+			} else {
+				LOG_DEBUG("Found literal EID: %s\n", str.c_str());
+			}
+
+			memcpy(eid->uri, str.c_str(), str.size());
+			return true;
+		}
+
+		void set_expiration(uint32_t seconds) {
+			expiration = seconds;
+		}
+
+		const BpaStats& stats() const {
+			return counters;
+		}
+
+		bool send(char* payload, uint32_t size) {
+			return send(&default_dest, payload, size);
+		}
+
+		bool send(const BpaEndpoint* dest, char* payload, uint32_t size) {
+			BpaEmuHeader h;
+			sockaddr_un sun;
+			iovec iov[2];
+			msghdr msg;
+			uint64_t now = bpa_now_us();
+
+			if(size > BPA_EMU_MAX_BUNDLE) {
+				LOG_CRITICAL("Failed to set payload. Size was: %u\n", size);
+				return true;
+			}
+
+			switch(link.transmit(size, now, (uint64_t)expiration * 1000000, &h.arrival)) {
+				case BpaLinkModel::SENT:
+					break;
+				case BpaLinkModel::LOST:
+					counters.lost++;
+					return true;
+				case BpaLinkModel::FULL:
+				case BpaLinkModel::EXPIRED:
+					LOG_DEBUG("Emulated link dropped a bundle of %u bytes.\n", size);
+					counters.dropped++;
+					return true;
+			}
+
+			h.magic = BPA_EMU_MAGIC;
+			h.len = size;
+			h.sent = now;
+
+			iov[0].iov_base = &h;
+			iov[0].iov_len = sizeof(h);
+			iov[1].iov_base = payload;
+			iov[1].iov_len = size;
+
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_name = &sun;
+			msg.msg_namelen = address(dest, &sun);
+			msg.msg_iov = iov;
+			msg.msg_iovlen = 2;
+
+			if(sendmsg(fd, &msg, 0) < 0) {
+				LOG_WARNING("Failed to send bundle: %s\n", strerror(errno));
+				counters.dropped++;
+				return true;
+			}
+
+			counters.sent_bundles++;
+			counters.sent_bytes += size;
+			return true;
+		}
+
+		int recv(char* payload, uint32_t max_size, float timeout)
+		{
+			uint64_t deadline = bpa_now_us() + (uint64_t)(timeout * 1000000.0);
+
+			LOG_DEBUG("Calling dtn_recv with timeout [%f]\n", timeout);
+
+			while(true) {
+				uint64_t now = bpa_now_us();
+				uint64_t wake = deadline;
+				pollfd pfd;
+
+				if(!held.empty() && held.top()->arrival <= now) {
+					HeldBundle* b = held.top();
+					uint32_t len = b->data.size();
+
+					held.pop();
+					counters.recv_bundles++;
+					counters.recv_bytes += len;
+					counters.latency_us += now - b->sent;
+					counters.latency_count++;
+					if(now - b->sent > counters.latency_max_us) {
+						counters.latency_max_us = now - b->sent;
+					}
+
+					if(len > max_size) {
+						LOG_WARNING("Received %u DTN bytes, but buffer is only %u bytes. Throwing away data!\n", len, max_size);
+						len = max_size;
+					}
+					memcpy(payload, &b->data[0], len);
+					delete b;
+					return len;
+				}
+
+				if(!held.empty() && held.top()->arrival < wake) {
+					wake = held.top()->arrival;
+				}
+				if(now >= deadline) {
+					LOG_DEBUG("DTN Recv timeout.\n");
+					return 0;
+				}
+
+				pfd.fd = fd;
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				if(poll(&pfd, 1, (int)((wake - now + 999) / 1000)) < 0 && errno != EINTR) {
+					LOG_CRITICAL("DTN Recv Error: %s\n", strerror(errno));
+					return -1;
+				}
+				if(pfd.revents & POLLIN) {
+					drain();
+				}
+			}
+		}
+};
+
+#endif /* BPA_EMULATOR_H_INCLUDED */
@@ -20,12 +20,40 @@
 #ifndef BPA_INTERFACE_H_INCLUDED
 #define BPA_INTERFACE_H_INCLUDED
 
-#include "applib/dtn_api.h"
+#include <string>
+#include <libconfig.h++>
+
 #include "../logger.hpp"
 
 using namespace std;
+using namespace libconfig;
 using namespace NpsGate;
 
+/* What an interface sent and received. Latency is only known to the
+   emulator, which timestamps every bundle. */
+struct BpaStats {
+	BpaStats() : sent_bundles(0), sent_bytes(0), lost(0), dropped(0), recv_bundles(0), recv_bytes(0),
+			latency_us(0), latency_count(0), latency_max_us(0) { }
+
+	unsigned long long sent_bundles;
+	unsigned long long sent_bytes;
+	unsigned long long lost;			/* Lost on the emulated link */
+	unsigned long long dropped;			/* Not accepted for sending */
+	unsigned long long recv_bundles;
+	unsigned long long recv_bytes;
+	unsigned long long latency_us;		/* Sum over latency_count bundles */
+	unsigned long long latency_count;
+	unsigned long long latency_max_us;
+};
+
+#ifdef BPA_EMULATOR
+#include "bpa_emulator.hpp"
+#else
+
+#include "applib/dtn_api.h"
+
+typedef dtn_endpoint_id_t BpaEndpoint;
+
 class BpaInterface
 {
 	private:
@@ -36,6 +64,9 @@ class BpaInterface
 
 		string src_endpoint;
 		string dest_endpoint;
+		uint32_t expiration;	// Bundle lifetime [s]
+		dtn_endpoint_id_t default_dest;
+		BpaStats counters;
 
 	    dtn_bundle_spec_t m_spec;
 	    dtn_bundle_payload_t dtn_payload;
@@ -61,7 +92,7 @@ class BpaInterface
 		}
 	
 	public:
-		BpaInterface(string s, string d) : src_endpoint(s), dest_endpoint(d) {
+		BpaInterface(string s, string d) : src_endpoint(s), dest_endpoint(d), expiration(60 * 60) {
 
 			int rval = dtn_open(&dtn_handle);
 			if(DTN_SUCCESS != rval) {
@@ -78,6 +109,8 @@ class BpaInterface
 				LOG_CRITICAL("Failed to parse destination endpoint: %s\n", src_endpoint.c_str());
 			}
 
+			dtn_copy_eid(&default_dest, &bundle_spec.dest);
+
 			memset(&reginfo, 0, sizeof(reginfo));
 			dtn_copy_eid(&reginfo.endpoint, &bundle_spec.source);
 			reginfo.flags = DTN_SESSION_PUBLISH;
@@ -111,21 +144,48 @@ class BpaInterface
 			return false;
 		}
 
+		/* Link emulation settings mean nothing to a real BPA */
+		bool configure(const Setting& s) {
+			LOG_WARNING("Ignoring '%s', NpsGate was not built with the BPA emulator.\n", s.getPath().c_str());
+			return true;
+		}
+
+		void set_expiration(uint32_t seconds) {
+			expiration = seconds;
+		}
+
+		const BpaStats& stats() const {
+			return counters;
+		}
+
 		bool send(char* payload, uint32_t size) {
+			return send(&default_dest, payload, size);
+		}
+
+		/* Sends to 'dest' instead of the destination given to the constructor */
+		bool send(const dtn_endpoint_id_t* dest, char* payload, uint32_t size) {
 			dtn_bundle_id_t bundle_id;
-			bundle_spec.expiration = 60 * 60;
+			dtn_copy_eid(&bundle_spec.dest, (dtn_endpoint_id_t*)dest);
+			bundle_spec.expiration = expiration;
 			bundle_spec.priority = COS_NORMAL;
 			bundle_spec.dopts = DOPTS_SINGLETON_DEST;
 			if(DTN_ESIZE == dtn_set_payload(&dtn_payload, DTN_PAYLOAD_MEM, payload, size)) {
 				LOG_CRITICAL("Failed to set payload. Size was: %u\n", size);
+				counters.dropped++;
+				return true;
 			}
 
 			memset(&bundle_id, 0, sizeof(bundle_id));
 
 			if(0 != dtn_send(dtn_handle, regid, &bundle_spec, &dtn_payload, &bundle_id)) {
          		LOG_WARNING("Failed to send bundle: %s\n", dtn_strerror(dtn_errno(dtn_handle)));
+				counters.dropped++;
+				return true;
 			}
 
+			counters.sent_bundles++;
+			counters.sent_bytes += size;
+
 			return true;
 		}
 
@@ -149,16 +209,25 @@ class BpaInterface
 			if(dtn_payload.buf.buf_len > max_size) {
 				LOG_WARNING("Received %u DTN bytes, but buffer is only %u bytes. Throwing away data!\n", dtn_payload.buf.buf_len, max_size);
 				memcpy(payload, dtn_payload.buf.buf_val, max_size);
+				dtn_free_payload(&dtn_payload);
+				counters.recv_bundles++;
+				counters.recv_bytes += max_size;
 				return max_size;
 			}
 
-			LOG_INFO("Received %u DTN bytes.\n", dtn_payload.buf.buf_len);
-			memcpy(payload, dtn_payload.buf.buf_val, dtn_payload.buf.buf_len);
+			uint32_t len = dtn_payload.buf.buf_len;
+
+			LOG_DEBUG("Received %u DTN bytes.\n", len);
+			memcpy(payload, dtn_payload.buf.buf_val, len);
 
 			dtn_free_payload(&dtn_payload);
 
-			return dtn_payload.buf.buf_len;
+			counters.recv_bundles++;
+			counters.recv_bytes += len;
+			return len;
 		}
 };
 
+#endif /* BPA_EMULATOR */
+
 #endif /* BPA_INTERFACE_H_INCLUDED */
@@ -0,0 +1,285 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file bundle_compress.hpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef BUNDLE_COMPRESS_HPP_INCLUDED
+#define BUNDLE_COMPRESS_HPP_INCLUDED
+
+/* Compression of framed bundles with zlib. A compressed bundle is
+ *
+ *	magic (1) | version | BUNDLE_FRAME_COMPRESSED (1) | framed length (4) | zlib stream
+ *
+ * where the zlib stream inflates to the framed bundle. Every bundle is a stream
+ * of its own, since bundles may be lost or arrive out of order, but streams
+ * start from a preset dictionary both ends share so even a small bundle finds
+ * the strings common to HTTP traffic. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#include "bundle_framing.hpp"
+
+/* Loaded in to the compressor's window before every bundle. zlib reaches the
+   end of the dictionary most cheaply, so the most common strings are last. */
+static const char bundle_default_dictionary[] =
+	"<!DOCTYPE html><html><head><meta charset=\"utf-8\"><title></title>"
+	"<link rel=\"stylesheet\" type=\"text/css\" href=\"<script type=\"text/javascript\" src=\""
+	"</script></head><body><div class=\"</div><span class=\"</span><a href=\"http://</a>"
+	"<img src=\"<p></p><ul><li></li></ul><table><tr><td></td></tr></table></body></html>"
+	"{\"id\":\"name\":\"type\":\"value\":\"data\":\"status\":\"time\":\"true,false,null}]"
+	"application/json; charset=utf-8application/x-www-form-urlencoded"
+	"text/html; charset=UTF-8text/plain; charset=utf-8text/css"
+	"application/javascriptimage/pngimage/jpegimage/gif"
+	"Accept-Encoding: gzip, deflate\r\nAccept-Language: en-US,en;q=0.9\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64)\r\n"
+	"Cache-Control: no-cache\r\nCache-Control: max-age=\r\nPragma: no-cache\r\n"
+	"Last-Modified: ETag: \"If-None-Match: \"If-Modified-Since: Expires: "
+	"Set-Cookie: Cookie: Referer: http://Location: http://"
+	"Transfer-Encoding: chunked\r\nContent-Encoding: gzip\r\n"
+	"Server: Apache\r\nServer: nginx\r\nDate: Mon, Tue, Wed, Thu, Fri, Sat, Sun, "
+	"Jan Feb Mar Apr May Jun Jul Aug Sep Oct Nov Dec 2026 GMT\r\n"
+	"Connection: keep-alive\r\nConnection: close\r\n"
+	"Content-Type: text/html\r\nContent-Length: "
+	"HTTP/1.1 200 OK\r\nHTTP/1.1 304 Not Modified\r\nHTTP/1.1 404 Not Found\r\n"
+	"GET / HTTP/1.1\r\nPOST / HTTP/1.1\r\nHost: ";
+
+/* Thread CPU time in microseconds, what compressing costs the plugin */
+static inline uint64_t bundle_cpu_us() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Reads a dictionary shared with the other end. An empty path is the default one. */
+static inline bool bundle_load_dictionary(const std::string& path, std::string* dict) {
+	char buffer[4096];
+	size_t n;
+
+	if(path.empty()) {
+		dict->assign(bundle_default_dictionary, sizeof(bundle_default_dictionary) - 1);
+		return true;
+	}
+
+	FILE* fh = fopen(path.c_str(), "rb");
+	if(!fh) {
+		return false;
+	}
+
+	dict->clear();
+	while((n = fread(buffer, 1, sizeof(buffer), fh)) > 0) {
+		dict->append(buffer, n);
+	}
+	fclose(fh);
+
+	/* Only the last 32KB fit in the window */
+	if(dict->size() > 32768) {
+		dict->erase(0, dict->size() - 32768);
+	}
+	return true;
+}
+
+struct BundleCompressionStats {
+	BundleCompressionStats() : bundles(0), compressed(0), skipped(0), bytes_in(0), bytes_out(0), cpu_us(0) { }
+
+	unsigned long long bundles;
+	unsigned long long compressed;		/* Sent compressed */
+	unsigned long long skipped;			/* Not tried, the destination's data was incompressible */
+	unsigned long long bytes_in;		/* Framed bytes */
+	unsigned long long bytes_out;		/* Bytes sent for them */
+	unsigned long long cpu_us;
+
+	std::string str() const {
+		char buffer[256];
+
+		snprintf(buffer, sizeof(buffer),
+				"bundles=%llu compressed=%llu skipped=%llu bytes_in=%llu bytes_out=%llu ratio=%.2f cpu_ms=%.1f",
+				bundles, compressed, skipped, bytes_in, bytes_out,
+				bytes_out ? (double)bytes_in / bytes_out : 1.0, cpu_us / 1000.0);
+		return std::string(buffer);
+	}
+};
+
+/**************************************************************
+ **
+ ** BundleCompressor compresses the bundles of one destination.
+ ** The deflate state is allocated once and reset per bundle.
+ ** A bundle that does not shrink by 'min_saving' percent goes
+ ** uncompressed, and after such a bundle the destination's
+ ** next bundles are not tried, twice as many each time up to
+ ** 64, until one compresses again.
+ **
+ **************************************************************/
+class BundleCompressor {
+	public:
+		BundleCompressor(int level, int min_saving, const std::string& dict) :
+				ready(false), min_saving(min_saving), dictionary(dict), backoff(0), skip(0) {
+			memset(&zs, 0, sizeof(zs));
+			ready = deflateInit(&zs, level) == Z_OK;
+		}
+
+		~BundleCompressor() {
+			if(ready) {
+				deflateEnd(&zs);
+			}
+		}
+
+		/* Returns true with the compressed bundle in 'out', or false if the framed
+		   bundle should be sent as it is */
+		bool compress(const uint8_t* data, size_t len, std::vector<uint8_t>& out, BundleCompressionStats& stats) {
+			uint64_t start;
+			size_t bound;
+			bool rval = false;
+
+			stats.bundles++;
+			stats.bytes_in += len;
+
+			if(!ready || skip) {
+				if(skip) {
+					skip--;
+					stats.skipped++;
+				}
+				stats.bytes_out += len;
+				return false;
+			}
+
+			start = bundle_cpu_us();
+
+			bound = BUNDLE_FRAME_ZLIB_HEADER + deflateBound(&zs, len);
+			out.resize(bound);
+			out[0] = BUNDLE_FRAME_MAGIC;
+			out[1] = BUNDLE_FRAME_VERSION | BUNDLE_FRAME_COMPRESSED;
+			out[2] = len >> 24;
+			out[3] = len >> 16;
+			out[4] = len >> 8;
+			out[5] = len;
+
+			deflateReset(&zs);
+			if(!dictionary.empty()) {
+				deflateSetDictionary(&zs, (const Bytef*)dictionary.data(), dictionary.size());
+			}
+			zs.next_in = (Bytef*)data;
+			zs.avail_in = len;
+			zs.next_out = &out[BUNDLE_FRAME_ZLIB_HEADER];
+			zs.avail_out = bound - BUNDLE_FRAME_ZLIB_HEADER;
+
+			if(deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+				size_t n = BUNDLE_FRAME_ZLIB_HEADER + zs.total_out;
+
+				if(n * 100 <= len * (100 - min_saving)) {
+					out.resize(n);
+					rval = true;
+				}
+			}
+
+			if(rval) {
+				backoff = 0;
+				stats.compressed++;
+				stats.bytes_out += out.size();
+			} else {
+				backoff = backoff ? (backoff < 64 ? backoff * 2 : 64) : 1;
+				skip = backoff;
+				stats.bytes_out += len;
+			}
+
+			stats.cpu_us += bundle_cpu_us() - start;
+			return rval;
+		}
+
+	private:
+		z_stream zs;
+		bool ready;
+		int min_saving;
+		std::string dictionary;
+		unsigned int backoff;
+		unsigned int skip;
+};
+
+/**************************************************************
+ **
+ ** BundleDecompressor inflates compressed bundles back in to
+ ** framed ones, refusing any that claim to be larger than
+ ** 'max_size'.
+ **
+ **************************************************************/
+class BundleDecompressor {
+	public:
+		BundleDecompressor(size_t max_size, const std::string& dict) :
+				bundles(0), cpu_us(0), ready(false), max_size(max_size), dictionary(dict) {
+			memset(&zs, 0, sizeof(zs));
+			ready = inflateInit(&zs) == Z_OK;
+		}
+
+		~BundleDecompressor() {
+			if(ready) {
+				inflateEnd(&zs);
+			}
+		}
+
+		static bool compressed(const uint8_t* data, size_t len) {
+			return len >= BUNDLE_FRAME_ZLIB_HEADER && data[0] == BUNDLE_FRAME_MAGIC &&
+					data[1] == (BUNDLE_FRAME_VERSION | BUNDLE_FRAME_COMPRESSED);
+		}
+
+		bool decompress(const uint8_t* data, size_t len, std::vector<uint8_t>& out) {
+			size_t framed = ((size_t)data[2] << 24) | (data[3] << 16) | (data[4] << 8) | data[5];
+			uint64_t start = bundle_cpu_us();
+			int ret;
+
+			if(!ready || framed == 0 || framed > max_size) {
+				return false;
+			}
+
+			out.resize(framed);
+			inflateReset(&zs);
+			zs.next_in = (Bytef*)data + BUNDLE_FRAME_ZLIB_HEADER;
+			zs.avail_in = len - BUNDLE_FRAME_ZLIB_HEADER;
+			zs.next_out = &out[0];
+			zs.avail_out = framed;
+
+			ret = inflate(&zs, Z_FINISH);
+			if(ret == Z_NEED_DICT) {
+				if(inflateSetDictionary(&zs, (const Bytef*)dictionary.data(), dictionary.size()) != Z_OK) {
+					return false;
+				}
+				ret = inflate(&zs, Z_FINISH);
+			}
+
+			bundles++;
+			cpu_us += bundle_cpu_us() - start;
+
+			return ret == Z_STREAM_END && zs.total_out == framed;
+		}
+
+		/* Bundles inflated and the CPU time spent on them */
+		unsigned long long bundles;
+		unsigned long long cpu_us;
+
+	private:
+		z_stream zs;
+		bool ready;
+		size_t max_size;
+		std::string dictionary;
+};
+
+#endif /* BUNDLE_COMPRESS_HPP_INCLUDED */
@@ -0,0 +1,536 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file bundle_fec.hpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef BUNDLE_FEC_HPP_INCLUDED
+#define BUNDLE_FEC_HPP_INCLUDED
+
+/* Erasure coding of bundles so the receiver rebuilds lost ones instead of
+ * waiting for the BPA to retransmit them. Bundles are coded in groups of up to
+ * k with a systematic Reed-Solomon code over GF(2^8): the k bundles go out as
+ * they are, each behind a header, and are followed by m parity bundles. Any k
+ * of the k + m rebuild the group. Parity row i, column j of the generator is
+ * 1 / ((k + i) + j), a Cauchy matrix, so every k x k matrix of received rows
+ * can be inverted.
+ *
+ *	magic (1) | version | BUNDLE_FRAME_FEC (1) | stream (2) | group (4) | index (1) | k (1) | m (1) | ...
+ *
+ * A data bundle (index < k) continues with the bundle, which may itself be
+ * compressed. A parity bundle (index >= k) continues with the length of each of
+ * the group's bundles (4 bytes each) and the parity of the bundles padded with
+ * zeros to the longest. Data bundles carry the k and m the group was opened
+ * with, parity bundles the k it was closed with, which is smaller when a group
+ * is closed before it fills. The stream is picked at random by each sender so
+ * a receiver can tell senders, and their restarts, apart. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "bundle_framing.hpp"
+#include "bundle_compress.hpp"
+#include "gf256.hpp"
+
+#define BUNDLE_FRAME_FEC		0x40
+#define BUNDLE_FEC_HEADER		11
+#define BUNDLE_FEC_LENGTH		4
+#define BUNDLE_FEC_MAX_K		64
+#define BUNDLE_FEC_MAX_M		64
+#define BUNDLE_FEC_OVERHEAD		(BUNDLE_FEC_HEADER + BUNDLE_FEC_MAX_K * BUNDLE_FEC_LENGTH)
+
+static inline uint8_t bundle_fec_coefficient(unsigned int row, unsigned int col, unsigned int k) {
+	return gf_inv((uint8_t)((k + row) ^ col));
+}
+
+static inline void bundle_fec_header(uint8_t* h, uint16_t stream, uint32_t group, unsigned int index,
+		unsigned int k, unsigned int m) {
+	h[0] = BUNDLE_FRAME_MAGIC;
+	h[1] = BUNDLE_FRAME_VERSION | BUNDLE_FRAME_FEC;
+	h[2] = stream >> 8;
+	h[3] = stream & 0xff;
+	h[4] = group >> 24;
+	h[5] = group >> 16;
+	h[6] = group >> 8;
+	h[7] = group;
+	h[8] = index;
+	h[9] = k;
+	h[10] = m;
+}
+
+struct BundleFecStats {
+	BundleFecStats() : groups(0), data(0), parity(0), parity_bytes(0), recovered(0), lost(0), late(0),
+			expected(0), received(0), cpu_us(0) { }
+
+	unsigned long long groups;
+	unsigned long long data;			/* Data bundles sent or received */
+	unsigned long long parity;			/* Parity bundles sent or received */
+	unsigned long long parity_bytes;
+	unsigned long long recovered;		/* Bundles rebuilt from parity */
+	unsigned long long lost;			/* Bundles given up on */
+	unsigned long long late;			/* Data bundles that arrived after their group was released */
+	unsigned long long expected;		/* Bundles of the released groups */
+	unsigned long long received;		/* How many of them arrived */
+	unsigned long long cpu_us;
+
+	/* Percentage of the released groups' bundles that did not arrive */
+	double loss() const {
+		return expected ? 100.0 * (expected - received) / expected : 0.0;
+	}
+
+	/* The loss reported is 'loss_pct', such as that of the last interval */
+	std::string str(double loss_pct) const {
+		char buffer[320];
+
+		snprintf(buffer, sizeof(buffer),
+				"groups=%llu data=%llu parity=%llu parity_bytes=%llu recovered=%llu lost=%llu late=%llu "
+				"loss_pct=%.2f cpu_ms=%.1f",
+				groups, data, parity, parity_bytes, recovered, lost, late, loss_pct, cpu_us / 1000.0);
+		return std::string(buffer);
+	}
+};
+
+/**************************************************************
+ **
+ ** BundleFecEncoder codes the bundles of one destination. A
+ ** data bundle is returned wrapped at once and kept until its
+ ** group is closed, either by filling up or by the caller
+ ** when it has been open too long.
+ **
+ **************************************************************/
+class BundleFecEncoder {
+	public:
+		BundleFecEncoder(uint16_t stream, unsigned int k) :
+				stream(stream), k(std::max(1u, std::min(k, (unsigned int)BUNDLE_FEC_MAX_K))), m(0), group(0),
+				count(0), opened(0), shards(this->k) { }
+
+		/* Wraps a bundle as the next of the open group, which is opened with
+		   'parity' parity bundles if this is its first */
+		void wrap(const uint8_t* data, size_t len, std::vector<uint8_t>& out, unsigned int parity,
+				uint64_t now, BundleFecStats& stats) {
+			if(count == 0) {
+				m = std::min(parity, (unsigned int)BUNDLE_FEC_MAX_M);
+				opened = now;
+			}
+
+			out.resize(BUNDLE_FEC_HEADER + len);
+			bundle_fec_header(&out[0], stream, group, count, k, m);
+			memcpy(&out[BUNDLE_FEC_HEADER], data, len);
+
+			shards[count].assign(data, data + len);
+			count++;
+			stats.data++;
+		}
+
+		bool full() const { return count == k; }
+		bool open() const { return count != 0; }
+		uint64_t opened_at() const { return opened; }
+
+		/* Closes the group and appends its parity bundles to 'out'. A group closed
+		   early gets parity in proportion to the bundles it has. */
+		void close(std::vector< std::vector<uint8_t> >& out, BundleFecStats& stats) {
+			unsigned int parity = count == k ? m : (m * count + k - 1) / k;
+			uint64_t start = bundle_cpu_us();
+			size_t longest = 0;
+
+			for(unsigned int j = 0; j < count; j++) {
+				longest = std::max(longest, shards[j].size());
+			}
+
+			for(unsigned int i = 0; i < parity; i++) {
+				size_t lengths = BUNDLE_FEC_HEADER + count * BUNDLE_FEC_LENGTH;
+				std::vector<uint8_t> p(lengths + longest, 0);
+
+				bundle_fec_header(&p[0], stream, group, count + i, count, parity);
+				for(unsigned int j = 0; j < count; j++) {
+					uint32_t len = shards[j].size();
+					uint8_t* l = &p[BUNDLE_FEC_HEADER + j * BUNDLE_FEC_LENGTH];
+
+					l[0] = len >> 24;
+					l[1] = len >> 16;
+					l[2] = len >> 8;
+					l[3] = len;
+
+					/* Shorter bundles count as padded with zeros, which add nothing */
+					if(len) {
+						gf_muladd(&p[lengths], &shards[j][0], bundle_fec_coefficient(i, j, count), len);
+					}
+				}
+
+				stats.parity++;
+				stats.parity_bytes += p.size();
+				out.push_back(std::vector<uint8_t>());
+				out.back().swap(p);
+			}
+
+			stats.groups++;
+			stats.cpu_us += bundle_cpu_us() - start;
+
+			count = 0;
+			group++;
+		}
+
+	private:
+		uint16_t stream;
+		unsigned int k;
+		unsigned int m;
+		uint32_t group;
+		unsigned int count;
+		uint64_t opened;
+		std::vector< std::vector<uint8_t> > shards;
+};
+
+/**************************************************************
+ **
+ ** BundleFecDecoder collects the bundles of each sender's
+ ** groups, rebuilds what parity allows and releases the data
+ ** bundles in the order they were sent. A group that has
+ ** waited 'hold' microseconds since its first bundle arrived
+ ** without being completed is released with its holes, as is
+ ** a group none of whose bundles arrived once a later one has
+ ** waited as long.
+ **
+ **************************************************************/
+class BundleFecDecoder {
+	public:
+		BundleFecDecoder(size_t max_size, uint64_t hold) : max_size(max_size), hold(hold) { }
+
+		~BundleFecDecoder() {
+			for(std::map<uint16_t, Stream>::iterator s = streams.begin(); s != streams.end(); ++s) {
+				clear(s->second);
+			}
+		}
+
+		static bool coded(const uint8_t* data, size_t len) {
+			return len >= BUNDLE_FEC_HEADER && data[0] == BUNDLE_FRAME_MAGIC &&
+					data[1] == (BUNDLE_FRAME_VERSION | BUNDLE_FRAME_FEC);
+		}
+
+		/* Takes in a coded bundle. Returns false if it is malformed. */
+		bool receive(const uint8_t* data, size_t len, uint64_t now) {
+			uint16_t id = (data[2] << 8) | data[3];
+			uint32_t gid = ((uint32_t)data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+			unsigned int index = data[8];
+			unsigned int k = data[9];
+			unsigned int m = data[10];
+			const uint8_t* body = data + BUNDLE_FEC_HEADER;
+			size_t size = len - BUNDLE_FEC_HEADER;
+			Stream& s = streams[id];
+			Group* g;
+			int32_t ahead;
+
+			if(k == 0 || k > BUNDLE_FEC_MAX_K || m > BUNDLE_FEC_MAX_M || index >= k + m) {
+				return false;
+			}
+
+			s.last_seen = now;
+			if(!s.started) {
+				s.started = true;
+				s.next_group = gid;
+				s.next_index = 0;
+			}
+
+			/* A sender far from where it was has restarted */
+			ahead = (int32_t)(gid - s.next_group);
+			if(ahead < -1024 || ahead > 65536) {
+				flush(s);
+				s.next_group = gid;
+				s.next_index = 0;
+				ahead = 0;
+			}
+			/* Parity of a group completed without it still counts as arrived for the
+			   loss, which is that of the link */
+			if(ahead < 0) {
+				stats.received++;
+				if(index < k) {
+					stats.late++;
+				}
+				return true;
+			}
+
+			std::map<uint32_t, Group*>::iterator it = s.groups.find(gid);
+			if(it == s.groups.end()) {
+				g = new Group(k, m, now);
+				s.groups[gid] = g;
+			} else {
+				g = it->second;
+			}
+
+			if(index < k) {
+				/* A data bundle */
+				if(size > max_size || (g->closed && index >= g->k)) {
+					return false;
+				}
+				if(g->have[index]) {
+					return true;
+				}
+				g->data[index].assign(body, body + size);
+				g->have[index] = true;
+				g->received++;
+				stats.data++;
+				return true;
+			}
+
+			/* A parity bundle, which gives the group's final size */
+			size_t lengths = k * BUNDLE_FEC_LENGTH;
+			if(size < lengths || (g->closed && k != g->k)) {
+				return false;
+			}
+			if(g->has_parity(index)) {
+				return true;
+			}
+
+			if(!g->closed) {
+				for(unsigned int j = k; j < g->k; j++) {
+					if(g->have[j]) {
+						return false;
+					}
+				}
+				g->k = k;
+				g->m = m;
+				g->closed = true;
+				for(unsigned int j = 0; j < k; j++) {
+					const uint8_t* l = body + j * BUNDLE_FEC_LENGTH;
+					g->lengths[j] = ((uint32_t)l[0] << 24) | (l[1] << 16) | (l[2] << 8) | l[3];
+					if(g->lengths[j] > max_size) {
+						return false;
+					}
+				}
+			}
+
+			g->parity.push_back(std::make_pair(index, std::vector<uint8_t>(body + lengths, body + size)));
+			g->received++;
+			stats.parity++;
+			return true;
+		}
+
+		/* Appends the bundles that can be released, in order, to 'out' */
+		void release(uint64_t now, std::deque< std::vector<uint8_t> >& out) {
+			std::map<uint16_t, Stream>::iterator s = streams.begin();
+
+			while(s != streams.end()) {
+				release(s->second, now, out);
+
+				/* Forget senders that went quiet */
+				if(s->second.groups.empty() && now - s->second.last_seen > 60000000) {
+					streams.erase(s++);
+				} else {
+					++s;
+				}
+			}
+		}
+
+		/* True while groups are waiting, so the caller wakes up to release them */
+		bool waiting() const {
+			for(std::map<uint16_t, Stream>::const_iterator s = streams.begin(); s != streams.end(); ++s) {
+				if(!s->second.groups.empty()) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		BundleFecStats stats;
+
+	private:
+		struct Group {
+			Group(unsigned int k, unsigned int m, uint64_t now) : k(k), m(m), closed(false), received(0),
+					first_seen(now), data(BUNDLE_FEC_MAX_K), have(BUNDLE_FEC_MAX_K, false), lengths(BUNDLE_FEC_MAX_K, 0) { }
+
+			bool has_parity(unsigned int index) const {
+				for(size_t i = 0; i < parity.size(); i++) {
+					if(parity[i].first == index) {
+						return true;
+					}
+				}
+				return false;
+			}
+
+			unsigned int k;
+			unsigned int m;
+			bool closed;				/* A parity bundle gave the final k */
+			unsigned int received;
+			uint64_t first_seen;
+			std::vector< std::vector<uint8_t> > data;
+			std::vector<bool> have;
+			std::vector<uint32_t> lengths;
+			std::vector< std::pair<unsigned int, std::vector<uint8_t> > > parity;
+		};
+
+		struct Stream {
+			Stream() : started(false), next_group(0), next_index(0), last_seen(0) { }
+
+			bool started;
+			uint32_t next_group;
+			unsigned int next_index;	/* Next bundle of next_group to release */
+			uint64_t last_seen;
+			std::map<uint32_t, Group*> groups;
+		};
+
+		size_t max_size;
+		uint64_t hold;
+		std::map<uint16_t, Stream> streams;
+
+		void clear(Stream& s) {
+			for(std::map<uint32_t, Group*>::iterator it = s.groups.begin(); it != s.groups.end(); ++it) {
+				delete it->second;
+			}
+			s.groups.clear();
+		}
+
+		/* Rebuilds the missing data bundles of a group from its parity */
+		void decode(Group* g) {
+			unsigned int k = g->k;
+			std::vector<unsigned int> missing;
+			std::vector<uint8_t> matrix(k * k, 0);
+			std::vector<uint8_t> inverse(k * k);
+			std::vector<const std::vector<uint8_t>*> rows(k);
+			uint64_t start = bundle_cpu_us();
+			size_t p = 0;
+
+			for(unsigned int j = 0; j < k; j++) {
+				if(g->have[j]) {
+					matrix[j * k + j] = 1;
+					rows[j] = &g->data[j];
+				} else {
+					missing.push_back(j);
+				}
+			}
+			if(missing.empty() || g->parity.size() < missing.size()) {
+				return;
+			}
+
+			/* Rows of the missing bundles are taken by parity */
+			for(size_t i = 0; i < missing.size(); i++, p++) {
+				unsigned int row = missing[i];
+				unsigned int pi = g->parity[p].first - k;
+
+				for(unsigned int j = 0; j < k; j++) {
+					matrix[row * k + j] = bundle_fec_coefficient(pi, j, k);
+				}
+				rows[row] = &g->parity[p].second;
+			}
+
+			if(!gf_invert_matrix(&matrix[0], &inverse[0], k)) {
+				return;
+			}
+
+			for(size_t i = 0; i < missing.size(); i++) {
+				unsigned int j = missing[i];
+				std::vector<uint8_t>& out = g->data[j];
+
+				out.assign(g->lengths[j], 0);
+				for(unsigned int r = 0; r < k && !out.empty(); r++) {
+					size_t n = std::min(out.size(), rows[r]->size());
+					if(n) {
+						gf_muladd(&out[0], &(*rows[r])[0], inverse[j * k + r], n);
+					}
+				}
+				g->have[j] = true;
+				stats.recovered++;
+			}
+
+			stats.cpu_us += bundle_cpu_us() - start;
+		}
+
+		void finish(Stream& s, Group* g) {
+			for(unsigned int j = s.next_index; j < g->k; j++) {
+				if(!g->have[j]) {
+					stats.lost++;
+				}
+			}
+
+			stats.groups++;
+			stats.expected += g->k + g->m;
+			stats.received += std::min(g->received, g->k + g->m);
+
+			delete g;
+			s.groups.erase(s.next_group);
+			s.next_group++;
+			s.next_index = 0;
+		}
+
+		void release(Stream& s, uint64_t now, std::deque< std::vector<uint8_t> >& out) {
+			while(!s.groups.empty()) {
+				std::map<uint32_t, Group*>::iterator it = s.groups.find(s.next_group);
+
+				if(it == s.groups.end()) {
+					/* Nothing of the next group arrived. The earliest later one stands
+					   in for it, group ids are close enough not to wrap here. */
+					uint32_t first = s.groups.begin()->first;
+					for(it = s.groups.begin(); it != s.groups.end(); ++it) {
+						if((int32_t)(it->first - first) < 0) {
+							first = it->first;
+						}
+					}
+					Group* later = s.groups[first];
+					if(now - later->first_seen < hold) {
+						return;
+					}
+
+					/* Counted as groups the size of the later one */
+					stats.groups += first - s.next_group;
+					stats.expected += (uint64_t)(first - s.next_group) * (later->k + later->m);
+					stats.lost += (uint64_t)(first - s.next_group) * later->k;
+					s.next_group = first;
+					s.next_index = 0;
+					continue;
+				}
+
+				Group* g = it->second;
+
+				if(g->closed && g->received >= g->k) {
+					decode(g);
+				}
+
+				/* Copied out, parity may still need them */
+				while(s.next_index < g->k && g->have[s.next_index]) {
+					out.push_back(g->data[s.next_index]);
+					s.next_index++;
+				}
+
+				if(s.next_index < g->k && now - g->first_seen < hold) {
+					return;
+				}
+
+				/* Complete, or given up on with what did arrive */
+				for(unsigned int j = s.next_index; j < g->k; j++) {
+					if(g->have[j]) {
+						out.push_back(std::vector<uint8_t>());
+						out.back().swap(g->data[j]);
+					}
+				}
+				finish(s, g);
+			}
+		}
+
+		/* Gives up on what a restarted sender left behind */
+		void flush(Stream& s) {
+			for(std::map<uint32_t, Group*>::iterator it = s.groups.begin(); it != s.groups.end(); ++it) {
+				stats.lost += it->second->k - (it->first == s.next_group ? s.next_index : 0);
+				delete it->second;
+			}
+			s.groups.clear();
+		}
+};
+
+#endif /* BUNDLE_FEC_HPP_INCLUDED */
@@ -0,0 +1,157 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file bundle_framing.hpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef BUNDLE_FRAMING_HPP_INCLUDED
+#define BUNDLE_FRAMING_HPP_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/* The payload of a bundle carrying several IP packets:
+ *
+ *	magic (1) | version (1) | packet count (2) | { length (2) | packet } ...
+ *
+ * Multi-byte fields are big endian. The magic byte cannot start an IPv4 or
+ * IPv6 header, so a receiver tells framed bundles from the single raw packets
+ * older senders put in each bundle by looking at the first byte. The version
+ * byte of a compressed bundle (bundle_compress.hpp) has BUNDLE_FRAME_COMPRESSED
+ * set and is inflated before it is parsed. */
+#define BUNDLE_FRAME_MAGIC		0xd7
+#define BUNDLE_FRAME_VERSION	1
+#define BUNDLE_FRAME_HEADER		4
+#define BUNDLE_FRAME_RECORD		2
+#define BUNDLE_FRAME_MAX_PACKET	0xffff
+#define BUNDLE_FRAME_COMPRESSED	0x80
+#define BUNDLE_FRAME_ZLIB_HEADER	6
+
+/**************************************************************
+ **
+ ** BundleFramer collects packets for one bundle. The buffer is
+ ** kept between bundles so a busy destination does not
+ ** allocate once it has grown to the bundle size.
+ **
+ **************************************************************/
+class BundleFramer {
+	public:
+		BundleFramer() : count(0) {
+			clear();
+		}
+
+		void clear() {
+			buffer.resize(BUNDLE_FRAME_HEADER);
+			buffer[0] = BUNDLE_FRAME_MAGIC;
+			buffer[1] = BUNDLE_FRAME_VERSION;
+			buffer[2] = 0;
+			buffer[3] = 0;
+			count = 0;
+		}
+
+		/* Bytes the bundle would grow by if a packet of 'len' bytes was added */
+		static size_t record_size(size_t len) {
+			return BUNDLE_FRAME_RECORD + len;
+		}
+
+		bool append(const uint8_t* data, size_t len) {
+			if(len == 0 || len > BUNDLE_FRAME_MAX_PACKET || count == 0xffff) {
+				return false;
+			}
+
+			size_t off = buffer.size();
+			buffer.resize(off + record_size(len));
+			buffer[off] = len >> 8;
+			buffer[off + 1] = len & 0xff;
+			memcpy(&buffer[off + BUNDLE_FRAME_RECORD], data, len);
+
+			count++;
+			buffer[2] = count >> 8;
+			buffer[3] = count & 0xff;
+			return true;
+		}
+
+		bool empty() const { return count == 0; }
+		unsigned int packets() const { return count; }
+		size_t size() const { return buffer.size(); }
+		const uint8_t* data() const { return &buffer[0]; }
+
+	private:
+		std::vector<uint8_t> buffer;
+		unsigned int count;
+};
+
+/**************************************************************
+ **
+ ** BundleParser walks the packets of a received bundle in
+ ** place. A bundle that is not framed is returned as a single
+ ** packet. Parsing stops at the first record that runs past
+ ** the end of the bundle, so a truncated bundle still yields
+ ** the packets before the cut.
+ **
+ **************************************************************/
+class BundleParser {
+	public:
+		BundleParser(const uint8_t* data, size_t len) : p(data), end(data + len), remaining(0), raw(false) {
+			if(len >= BUNDLE_FRAME_HEADER && data[0] == BUNDLE_FRAME_MAGIC && data[1] == BUNDLE_FRAME_VERSION) {
+				remaining = (data[2] << 8) | data[3];
+				p += BUNDLE_FRAME_HEADER;
+			} else if(len > 0) {
+				remaining = 1;
+				raw = true;
+			}
+		}
+
+		/* True if the bundle was a framed one */
+		bool framed() const { return !raw; }
+
+		bool next(const uint8_t** pkt, size_t* len) {
+			if(remaining == 0) {
+				return false;
+			}
+			remaining--;
+
+			if(raw) {
+				*pkt = p;
+				*len = end - p;
+				return true;
+			}
+
+			if(end - p < BUNDLE_FRAME_RECORD) {
+				remaining = 0;
+				return false;
+			}
+
+			size_t n = (p[0] << 8) | p[1];
+			if((size_t)(end - p) < BUNDLE_FRAME_RECORD + n) {
+				remaining = 0;
+				return false;
+			}
+
+			*pkt = p + BUNDLE_FRAME_RECORD;
+			*len = n;
+			p += BUNDLE_FRAME_RECORD + n;
+			return true;
+		}
+
+	private:
+		const uint8_t* p;
+		const uint8_t* end;
+		unsigned int remaining;
+		bool raw;
+};
+
+#endif /* BUNDLE_FRAMING_HPP_INCLUDED */
@@ -0,0 +1,241 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file gf256.hpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef GF256_HPP_INCLUDED
+#define GF256_HPP_INCLUDED
+
+/* Arithmetic in GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11d)
+   for the erasure code in bundle_fec.hpp. Addition is XOR. The work is in
+   gf_muladd(), which adds a multiple of one buffer to another. Long buffers
+   are multiplied 32 or 16 bytes at a time with AVX2 or SSSE3 shuffles when the
+   CPU has them, picked once at run time, and through a table otherwise. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GF256_X86 1
+#include <immintrin.h>
+#else
+#define GF256_X86 0
+#endif
+
+/* Buffers shorter than this skip the dispatch */
+#define GF256_SIMD_MIN 64
+
+struct Gf256Tables {
+	uint8_t exp[512];			/* Doubled so a sum of two logs needs no reduction */
+	uint8_t log[256];
+	uint8_t mul[256][256];
+	uint8_t lo[256][16];		/* c times each low nibble */
+	uint8_t hi[256][16];		/* c times each high nibble */
+
+	Gf256Tables() {
+		unsigned int x = 1;
+
+		for(int i = 0; i < 255; i++) {
+			exp[i] = exp[i + 255] = x;
+			log[x] = i;
+			x <<= 1;
+			if(x & 0x100) {
+				x ^= 0x11d;
+			}
+		}
+		exp[510] = exp[511] = exp[0];
+		log[0] = 0;
+
+		for(int a = 0; a < 256; a++) {
+			for(int b = 0; b < 256; b++) {
+				mul[a][b] = (a && b) ? exp[log[a] + log[b]] : 0;
+			}
+			for(int n = 0; n < 16; n++) {
+				lo[a][n] = mul[a][n];
+				hi[a][n] = mul[a][n << 4];
+			}
+		}
+	}
+};
+
+static inline const Gf256Tables& gf256_tables() {
+	static const Gf256Tables tables;
+	return tables;
+}
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+	return gf256_tables().mul[a][b];
+}
+
+/* The inverse of a non-zero element */
+static inline uint8_t gf_inv(uint8_t a) {
+	const Gf256Tables& t = gf256_tables();
+	return t.exp[255 - t.log[a]];
+}
+
+typedef void (*gf_muladd_fn)(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len);
+
+static inline void gf_muladd_scalar(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+	const uint8_t* row = gf256_tables().mul[c];
+
+	for(size_t i = 0; i < len; i++) {
+		dst[i] ^= row[src[i]];
+	}
+}
+
+#if GF256_X86
+/* Each byte is split in to nibbles that look up their products in the 16 byte
+   tables of c, and the two products are added */
+__attribute__((target("ssse3")))
+static inline void gf_muladd_ssse3(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+	const Gf256Tables& t = gf256_tables();
+	const __m128i lo = _mm_loadu_si128((const __m128i*)t.lo[c]);
+	const __m128i hi = _mm_loadu_si128((const __m128i*)t.hi[c]);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+
+	while(len >= 16) {
+		__m128i s = _mm_loadu_si128((const __m128i*)src);
+		__m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+		__m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+		__m128i d = _mm_loadu_si128((const __m128i*)dst);
+
+		_mm_storeu_si128((__m128i*)dst, _mm_xor_si128(d, _mm_xor_si128(l, h)));
+		src += 16;
+		dst += 16;
+		len -= 16;
+	}
+
+	gf_muladd_scalar(dst, src, c, len);
+}
+
+/* The same with the tables in both halves of a 256 bit vector */
+__attribute__((target("avx2")))
+static inline void gf_muladd_avx2(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+	const Gf256Tables& t = gf256_tables();
+	const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)t.lo[c]));
+	const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)t.hi[c]));
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+
+	while(len >= 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i*)src);
+		__m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+		__m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+		__m256i d = _mm256_loadu_si256((const __m256i*)dst);
+
+		_mm256_storeu_si256((__m256i*)dst, _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+		src += 32;
+		dst += 32;
+		len -= 32;
+	}
+
+	gf_muladd_ssse3(dst, src, c, len);
+}
+#endif
+
+/* The widest version this CPU runs */
+static inline gf_muladd_fn gf_muladd_select() {
+#if GF256_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		return gf_muladd_avx2;
+	}
+	if(__builtin_cpu_supports("ssse3")) {
+		return gf_muladd_ssse3;
+	}
+#endif
+	return gf_muladd_scalar;
+}
+
+/* dst += c * src over 'len' bytes */
+static inline void gf_muladd(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+	/* Every thread picks the same function, so racing to set it is harmless */
+	static gf_muladd_fn impl = NULL;
+
+	if(c == 0) {
+		return;
+	}
+	if(c == 1) {
+		for(size_t i = 0; i < len; i++) {
+			dst[i] ^= src[i];
+		}
+		return;
+	}
+	if(len < GF256_SIMD_MIN) {
+		gf_muladd_scalar(dst, src, c, len);
+		return;
+	}
+	if(!impl) {
+		impl = gf_muladd_select();
+	}
+
+	impl(dst, src, c, len);
+}
+
+/* Inverts the n x n matrix 'm', rows of n bytes, in to 'inv' by Gauss-Jordan
+   elimination. Returns false if it is singular. 'm' is destroyed. */
+static inline bool gf_invert_matrix(uint8_t* m, uint8_t* inv, unsigned int n) {
+	memset(inv, 0, n * n);
+	for(unsigned int i = 0; i < n; i++) {
+		inv[i * n + i] = 1;
+	}
+
+	for(unsigned int col = 0; col < n; col++) {
+		unsigned int pivot = col;
+		uint8_t scale;
+
+		while(pivot < n && m[pivot * n + col] == 0) {
+			pivot++;
+		}
+		if(pivot == n) {
+			return false;
+		}
+
+		if(pivot != col) {
+			for(unsigned int j = 0; j < n; j++) {
+				uint8_t t = m[col * n + j];
+				m[col * n + j] = m[pivot * n + j];
+				m[pivot * n + j] = t;
+
+				t = inv[col * n + j];
+				inv[col * n + j] = inv[pivot * n + j];
+				inv[pivot * n + j] = t;
+			}
+		}
+
+		scale = gf_inv(m[col * n + col]);
+		for(unsigned int j = 0; j < n; j++) {
+			m[col * n + j] = gf_mul(m[col * n + j], scale);
+			inv[col * n + j] = gf_mul(inv[col * n + j], scale);
+		}
+
+		for(unsigned int row = 0; row < n; row++) {
+			uint8_t f = m[row * n + col];
+
+			if(row == col || f == 0) {
+				continue;
+			}
+			for(unsigned int j = 0; j < n; j++) {
+				m[row * n + j] ^= gf_mul(f, m[col * n + j]);
+				inv[row * n + j] ^= gf_mul(f, inv[col * n + j]);
+			}
+		}
+	}
+
+	return true;
+}
+
+#endif /* GF256_HPP_INCLUDED */
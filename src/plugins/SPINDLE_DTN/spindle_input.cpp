@@ -18,6 +18,7 @@
 *******************************************************************************/
 
 #include <vector>
+#include <deque>
 #include <map>
 #include <valarray>
 #include <iostream>
@@ -27,22 +28,43 @@
 #include <boost/thread.hpp>
 #include <libconfig.h++>
 
-#include "bpa_interface.hpp"
 #include "../npsgate_plugin.hpp"
 #include "../logger.hpp"
 #include "bpa_interface.hpp"
+#include "bundle_framing.hpp"
+#include "bundle_compress.hpp"
+#include "bundle_fec.hpp"
 
 using namespace std;
 using namespace Crafter;
 using namespace NpsGate;
 
+/* Microseconds on the monotonic clock */
+static inline uint64_t dtn_now_us() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 class DTNInput : public NpsGatePlugin {
 	private:
-		uint16_t m_mtu;
+		uint32_t m_max_bundle_size;
 		uint16_t m_timeout;
 		BpaInterface* m_dtn;
+		BundleDecompressor* m_inflater;
+		vector<uint8_t> m_inflated;
+		BundleFecDecoder* m_fec;
+		deque< vector<uint8_t> > m_released;	// Bundles the decoder put back in order
+		BundleFecStats m_fec_last;				// Decoder counters at the last report
 
-		dtn_endpoint_id_t m_ignore_eid;
+		unsigned int m_stats_interval;
+		time_t m_last_stats;
+		TopicId m_stats_topic;
+		TopicId m_fec_topic;
+		BpaStats m_last;				// BPA counters at the last report
+		unsigned long long m_packets;
+		unsigned long long m_bytes;		// IP bytes handed to the pipeline
+		unsigned long long m_last_bytes;
 		map<string,string>* m_table;
 		map<string,string>::iterator m_table_it;
 		string recv_endpoint;
@@ -74,11 +96,20 @@ class DTNInput : public NpsGatePlugin {
 	public:
 		DTNInput(PluginCore* c) : NpsGatePlugin(c) {
 			m_timeout = 2;
-			m_mtu = 1500;
+			m_inflater = NULL;
+			m_fec = NULL;
+			m_max_bundle_size = 65536;
+			m_stats_interval = 5;
+			m_last_stats = time(NULL);
+			m_packets = 0;
+			m_bytes = 0;
+			m_last_bytes = 0;
 		}
 
 		bool init() {
 			config = get_config();
+			m_stats_topic = register_topic("DTNInput.stats");
+			m_fec_topic = register_topic("DTNInput.fec");
 
 //			m_dtn = dtn;
 //			m_table = table;
@@ -97,7 +128,29 @@ class DTNInput : public NpsGatePlugin {
 			LOG_INFO("\tRecv endpoint: %s\n", recv_endpoint.c_str());
 			LOG_INFO("\tSend endpoint: %s\n", send_endpoint.c_str());
 
-			//config.lookupValue("max-bundle-size", m_max_bundle_size);
+			/* Bundles from DTNOutput carry several packets, up to its max-bundle-size */
+			config->lookupValue("dtninput.max-bundle-size", m_max_bundle_size);
+
+			/* Compressed bundles are inflated with the dictionary DTNOutput used */
+			string dictionary;
+			string shared;
+			config->lookupValue("dtninput.compression-dictionary", dictionary);
+			if(!bundle_load_dictionary(dictionary, &shared)) {
+				LOG_CRITICAL("Failed to read compression dictionary '%s'.\n", dictionary.c_str());
+				return false;
+			}
+			m_inflater = new BundleDecompressor(m_max_bundle_size, shared);
+
+			/* Coded bundles are decoded whatever this says. A group missing bundles
+			   its parity cannot make up for is given up on after fec-hold ms. */
+			unsigned int hold = 1000;
+			config->lookupValue("dtninput.fec-hold", hold);
+			m_fec = new BundleFecDecoder(m_max_bundle_size, (uint64_t)hold * 1000);
+
+			config->lookupValue("dtninput.stats_interval", m_stats_interval);
+			if(m_stats_interval < 1) {
+				m_stats_interval = 1;
+			}
 			//config.lookupValue("default-bundle-exp", m_expiration);
 			//config.lookupValue("max-packet-buffer-time", m_max_packet_buffer_time);
 			return true;
@@ -107,33 +160,120 @@ class DTNInput : public NpsGatePlugin {
 			return forward_packet(get_default_output(), p);
 		}
 
+		/* Goodput is the IP traffic delivered to the pipeline. Bundle latency,
+		   from DTNOutput handing a bundle over to it being received here, is
+		   only measured by the BPA emulator. */
+		void publish_stats() {
+			const BpaStats& s = m_dtn->stats();
+			time_t now = time(NULL);
+			double seconds = now - m_last_stats;
+			unsigned long long count = s.latency_count - m_last.latency_count;
+			char buffer[256];
+
+			snprintf(buffer, sizeof(buffer),
+					"bundles=%llu packets=%llu bytes=%llu goodput_kbps=%.1f latency_avg_ms=%.2f latency_max_ms=%.2f "
+					"inflated=%llu inflate_cpu_ms=%.1f",
+					s.recv_bundles, m_packets, m_bytes,
+					(m_bytes - m_last_bytes) * 8 / 1000.0 / seconds,
+					count ? (s.latency_us - m_last.latency_us) / 1000.0 / count : 0.0,
+					s.latency_max_us / 1000.0,
+					m_inflater->bundles, m_inflater->cpu_us / 1000.0);
+
+			LOG_INFO("DTNInput: %s\n", buffer);
+
+			NpsGateVar* var = new NpsGateVar();
+			var->set(string(buffer));
+			publish(m_stats_topic, var);
+			var->unref();
+
+			/* The loss is that of the interval, for senders adapting their redundancy */
+			const BundleFecStats& f = m_fec->stats;
+			if(f.data + f.parity > m_fec_last.data + m_fec_last.parity) {
+				unsigned long long expected = f.expected - m_fec_last.expected;
+				unsigned long long received = f.received - m_fec_last.received;
+
+				var = new NpsGateVar();
+				var->set(f.str(expected ? 100.0 * (expected - received) / expected : 0.0));
+				publish(m_fec_topic, var);
+				var->unref();
+				m_fec_last = f;
+			}
+
+			m_last = s;
+			m_last_bytes = m_bytes;
+			m_last_stats = now;
+		}
+
+		/* Hands the packets of a framed, or single packet, bundle to the pipeline */
+		void deliver(const uint8_t* bundle, size_t size) {
+			BundleParser parser(bundle, size);
+			const uint8_t* data;
+			size_t len;
+
+			while(parser.next(&data, &len)) {
+				Packet* pkt = new Packet();
+				pkt->PacketFromIP(data, len);
+
+				IP* ip = pkt->GetLayer<IP>();
+				if(ip){
+					m_packets++;
+					m_bytes += len;
+					process_packet(pkt);
+				}else{
+					LOG_WARNING("Unable to parse IP header");
+					delete pkt;
+				}
+			}
+		}
+
+		/* Inflates a bundle if it was compressed and delivers its packets */
+		void handle(const uint8_t* bundle, size_t size) {
+			if(BundleDecompressor::compressed(bundle, size)) {
+				if(m_inflater->decompress(bundle, size, m_inflated)) {
+					deliver(&m_inflated[0], m_inflated.size());
+				} else {
+					LOG_WARNING("Unable to inflate a compressed bundle of %u bytes. Check the compression dictionaries match.\n",
+							(unsigned int)size);
+				}
+			} else if(size > 0) {
+				deliver(bundle, size);
+			}
+		}
+
 		bool main() {
 			int ret;
-			dtn_bundle_spec_t bundle_spec;
-			dtn_bundle_payload_t payload;
-			byte* raw = (byte *)malloc(sizeof(byte) * m_mtu);
+			/* Parity bundles carry the lengths of their group's bundles too */
+			uint32_t size = m_max_bundle_size + BUNDLE_FEC_OVERHEAD;
+			byte* raw = (byte *)malloc(sizeof(byte) * size);
 
 			while (true)
 			{
 				LOG_DEBUG("Bundle reader looping at...\n");
-				memset(&bundle_spec, 0, sizeof(bundle_spec));
-				memset(&payload, 0, sizeof(payload));
-
-				ret = m_dtn->recv((char*)raw, m_mtu, m_timeout);
-				if(ret > 0) {
-					Packet* pkt = new Packet();
-					pkt->PacketFromIP(raw, ret);
-
-					IP* ip = pkt->GetLayer<IP>();
-					if(ip){
-						process_packet(pkt);
-					}else{
-						LOG_WARNING("Unable to parse IP header");
+
+				/* Wakes up often while the decoder holds groups back */
+				ret = m_dtn->recv((char*)raw, size, m_fec->waiting() ? 0.01 : m_timeout);
+				if(ret > 0 && BundleFecDecoder::coded(raw, ret)) {
+					if(!m_fec->receive(raw, ret, dtn_now_us())) {
+						LOG_WARNING("Dropping a malformed FEC bundle of %d bytes.\n", ret);
 					}
+				} else if(ret > 0) {
+					handle(raw, ret);
 				} else if (ret < 0) {
 					LOG_CRITICAL("DTN Received failed!\n");
 				}
 
+				m_fec->release(dtn_now_us(), m_released);
+				while(!m_released.empty()) {
+					if(!m_released.front().empty()) {
+						handle(&m_released.front()[0], m_released.front().size());
+					}
+					m_released.pop_front();
+				}
+
+				if(time(NULL) - m_last_stats >= (time_t)m_stats_interval) {
+					publish_stats();
+				}
+
 			}
 			free(raw);
 			return true;
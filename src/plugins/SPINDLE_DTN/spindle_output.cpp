@@ -17,40 +17,513 @@
 **
 *******************************************************************************/
 
-#include <map>
+#include <algorithm>
+#include <deque>
+#include <vector>
 #include <string>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include <crafter.h>
 
 #include "../npsgate_plugin.hpp"
 #include "../logger.hpp"
 #include "bpa_interface.hpp"
+#include "bundle_framing.hpp"
+#include "bundle_compress.hpp"
+#include "bundle_fec.hpp"
+#include "../segment_store.hpp"
 
 using namespace Crafter;
 using namespace NpsGate;
 
+/* Microseconds on the monotonic clock */
+static inline uint64_t dtn_now_us() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* A destination endpoint and the bundle being filled for it */
+struct DtnDestination {
+	DtnDestination() : deadline(0), compressor(NULL), fec(NULL) { }
+	~DtnDestination() { delete compressor; delete fec; }
+
+	string endpoint;
+	BpaEndpoint eid;
+	BundleFramer framer;
+	uint64_t deadline;		// When the bundle is sent even if not full [us]
+	BundleCompressor* compressor;	// NULL unless dtnoutput.compression is set
+	BundleFecEncoder* fec;	// NULL unless dtnoutput.fec is set
+};
+
+/* Packets to 'prefix' are bundled for 'dest'. Longest prefix first. */
+struct DtnRoute {
+	uint32_t prefix;
+	uint32_t mask;
+	DtnDestination* dest;
+};
+
+/* A finished bundle waiting for the pacer */
+struct DtnBundle {
+	DtnDestination* dest;
+	unsigned int packets;
+	vector<uint8_t> data;
+};
+
+/**************************************************************
+ **
+ ** TokenBucket paces bundles on to the DTN link. Tokens are
+ ** bytes, added at 'rate' bytes per second up to 'burst'. A
+ ** bundle goes when the bucket holds as many tokens as the
+ ** bundle has bytes, or a full bucket for bundles larger than
+ ** the burst, and may leave the bucket in debt.
+ **
+ **************************************************************/
+class TokenBucket {
+	public:
+		TokenBucket() : rate(0), burst(0), tokens(0), last(0) { }
+
+		void configure(uint64_t bytes_per_second, uint64_t burst_bytes) {
+			rate = bytes_per_second;
+			burst = burst_bytes;
+			tokens = burst;
+			last = dtn_now_us();
+		}
+
+		bool enabled() const { return rate != 0; }
+
+		bool take(size_t len, uint64_t now) {
+			if(!rate) {
+				return true;
+			}
+
+			if(now > last) {
+				tokens += (int64_t)((now - last) * rate / 1000000);
+				if(tokens > (int64_t)burst) {
+					tokens = burst;
+				}
+				last = now;
+			}
+
+			if(tokens < (int64_t)len && tokens < (int64_t)burst) {
+				return false;
+			}
+
+			tokens -= len;
+			return true;
+		}
+
+	private:
+		uint64_t rate;
+		uint64_t burst;
+		int64_t tokens;
+		uint64_t last;
+};
+
 class DTNOutput : public NpsGatePlugin {
 private:
 	const Config* config;
 	BpaInterface* m_dtn;
-	BpaInterface* m_adm_dtn;
 	string m_source_endpoint;
-	string m_send_adm_endpoint;
 	string m_dest_endpoint;
 	string m_multicast_group;
 	int m_max_bundle_size;	// Max allowable bundle payload size in bytes
 	int m_expiration;	// bundle expiration time [s]
-	//int m_max_packet_buffer_time;	// Max allowable time to delay packets for aggregation [ms]
-	map<string,stringstream*> m_payload;	// Temporary per-destination storage for payloads
-	int delay;
-	
+	int m_max_packet_buffer_time;	// Max allowable time to delay packets for aggregation [ms]
+	int m_max_queued_bundles;	// Bundles allowed to wait for the pacer before packets are dropped, without a store
+
+	vector<DtnDestination*> m_destinations;	// Per-destination storage for payloads
+	vector<DtnRoute> m_routes;
+	deque<DtnBundle*> m_pending;
+	size_t m_pending_bytes;
+	TokenBucket m_pacer;
+
+	SegmentStore* m_store;	// NULL unless dtnoutput.store is set
+	size_t m_store_memory;	// Bytes of bundles kept in m_pending before the rest go to the store
+	unsigned long long m_spilled;
+	unsigned long long m_replayed;
+
+	bool m_compression;
+	int m_compression_level;
+	int m_compression_min_saving;	// Percent a bundle must shrink by to be sent compressed
+	string m_dictionary;
+	BundleCompressionStats m_compression_stats;
+
+	bool m_fec;
+	int m_fec_group;	// Bundles coded together
+	int m_fec_redundancy;	// Parity as a percentage of the group, at least
+	int m_fec_max_redundancy;
+	int m_fec_max_group_time;	// A group is closed after this long even if not full [ms]
+	string m_fec_loss_topic;	// Publishes the loss on the link, as "loss_pct=" or a number
+	double m_fec_loss;	// Last loss published there [%]
+	BundleFecStats m_fec_stats;
+	unsigned long long m_fec_dropped;	// Parity bundles the pacer had no room for
+
+	unsigned int m_stats_interval;
+	time_t m_last_stats;
+	TopicId m_compression_topic;
+	TopicId m_fec_topic;
+	TopicId m_store_topic;
+
+	unsigned long long m_packets;
+	unsigned long long m_bundles;
+	unsigned long long m_bytes;
+	unsigned long long m_dropped;
+
+	DtnDestination* add_destination(const string& endpoint) {
+		for(size_t i = 0; i < m_destinations.size(); i++) {
+			if(m_destinations[i]->endpoint == endpoint) {
+				return m_destinations[i];
+			}
+		}
+
+		DtnDestination* d = new DtnDestination();
+		d->endpoint = endpoint;
+		if(!m_dtn->parse_eid(&d->eid, endpoint)) {
+			LOG_CRITICAL("Failed to parse destination endpoint: %s\n", endpoint.c_str());
+			delete d;
+			return NULL;
+		}
+
+		if(m_compression) {
+			d->compressor = new BundleCompressor(m_compression_level, m_compression_min_saving, m_dictionary);
+		}
+
+		/* Streams only need to differ between senders to one receiver, and across
+		   restarts */
+		if(m_fec) {
+			uint16_t stream = (dtn_now_us() ^ ((uint64_t)getpid() << 16) ^ (m_destinations.size() * 0x9e37)) & 0xffff;
+			d->fec = new BundleFecEncoder(stream, m_fec_group);
+		}
+
+		m_destinations.push_back(d);
+		return d;
+	}
+
+	/* Packets to addresses no route covers go to dtnoutput.dest-endpoint */
+	bool parse_routes() {
+		DtnRoute def;
+
+		def.prefix = 0;
+		def.mask = 0;
+		def.dest = add_destination(m_dest_endpoint);
+		if(!def.dest) {
+			return false;
+		}
+
+		if(config->exists("dtnoutput.routes")) {
+			try {
+				const Setting& routes = config->lookup("dtnoutput.routes");
+
+				for(int i = 0; i < routes.getLength(); i++) {
+					DtnRoute r;
+					string prefix;
+					string endpoint;
+					in_addr addr;
+					unsigned int len = 32;
+					size_t slash;
+
+					if(!routes[i].lookupValue("prefix", prefix) || !routes[i].lookupValue("endpoint", endpoint)) {
+						LOG_CRITICAL("DTN route %d needs a prefix and an endpoint.\n", i);
+						return false;
+					}
+
+					slash = prefix.find('/');
+					if(slash != string::npos) {
+						len = atoi(prefix.c_str() + slash + 1);
+					}
+					if(inet_aton(prefix.substr(0, slash).c_str(), &addr) == 0 || len > 32) {
+						LOG_CRITICAL("Failed to parse DTN route prefix: %s\n", prefix.c_str());
+						return false;
+					}
+
+					r.mask = len ? 0xffffffff << (32 - len) : 0;
+					r.prefix = ntohl(addr.s_addr) & r.mask;
+					r.dest = add_destination(endpoint);
+					if(!r.dest) {
+						return false;
+					}
+
+					vector<DtnRoute>::iterator it = m_routes.begin();
+					while(it != m_routes.end() && it->mask >= r.mask) {
+						++it;
+					}
+					m_routes.insert(it, r);
+				}
+			} catch(SettingException& ex) {
+				LOG_CRITICAL("Invalid DTN route configuration at '%s'.\n", ex.getPath());
+				return false;
+			}
+		}
+
+		m_routes.push_back(def);
+		return true;
+	}
+
+	DtnDestination* route(const uint8_t* data, size_t len) {
+		if(len >= 20 && (data[0] >> 4) == 4) {
+			uint32_t dst = (data[16] << 24) | (data[17] << 16) | (data[18] << 8) | data[19];
+
+			for(size_t i = 0; i < m_routes.size(); i++) {
+				if((dst & m_routes[i].mask) == m_routes[i].prefix) {
+					return m_routes[i].dest;
+				}
+			}
+		}
+
+		return m_routes.back().dest;
+	}
+
+	/* Hands the destination's bundle to the pacer and starts a new one */
+	void flush(DtnDestination* d) {
+		if(d->framer.empty()) {
+			return;
+		}
+
+		if(queue_full()) {
+			LOG_WARNING("DTN link is behind, dropping a bundle of %u packets for %s.\n",
+					d->framer.packets(), d->endpoint.c_str());
+			m_dropped += d->framer.packets();
+		} else {
+			DtnBundle* b = new DtnBundle();
+
+			b->dest = d;
+			b->packets = d->framer.packets();
+			if(!d->compressor || !d->compressor->compress(d->framer.data(), d->framer.size(), b->data, m_compression_stats)) {
+				b->data.assign(d->framer.data(), d->framer.data() + d->framer.size());
+			}
+			if(d->fec) {
+				vector<uint8_t> coded;
+				d->fec->wrap(&b->data[0], b->data.size(), coded, fec_parity(), dtn_now_us(), m_fec_stats);
+				b->data.swap(coded);
+			}
+			queue(b);
+
+			if(d->fec && d->fec->full()) {
+				close_group(d);
+			}
+		}
+
+		d->framer.clear();
+		d->deadline = 0;
+	}
+
+	/* Parity bundles for a full group at the current redundancy, twice the loss
+	   last published on the loss topic within the configured bounds */
+	unsigned int fec_parity() {
+		int r = min(m_fec_max_redundancy, (int)ceil(2 * m_fec_loss));
+		r = max(r, m_fec_redundancy);
+		return (m_fec_group * r + 99) / 100;
+	}
+
+	/* Queues the parity of the destination's open group */
+	void close_group(DtnDestination* d) {
+		vector< vector<uint8_t> > parity;
+
+		d->fec->close(parity, m_fec_stats);
+		for(size_t i = 0; i < parity.size(); i++) {
+			if(queue_full()) {
+				LOG_DEBUG("DTN link is behind, dropping %u parity bundles for %s.\n",
+						(unsigned int)(parity.size() - i), d->endpoint.c_str());
+				m_fec_dropped += parity.size() - i;
+				break;
+			}
+
+			DtnBundle* b = new DtnBundle();
+			b->dest = d;
+			b->packets = 0;
+			b->data.swap(parity[i]);
+			queue(b);
+		}
+	}
+
+	/* Bundles past dtnoutput.store.memory wait on disk, in segment files under
+	   'path', and are sent after a restart if they could not be before.
+	   Sizes are in megabytes, 'sync' in kilobytes. */
+	bool open_store(const Setting& s) {
+		string path;
+		int memory = 16;
+		int segment_size = 64;
+		int max_size = 0;
+		int sync = 1024;
+		int compaction = 50;
+
+		if(!s.lookupValue("path", path)) {
+			LOG_CRITICAL("dtnoutput.store needs a path.\n");
+			return false;
+		}
+		s.lookupValue("memory", memory);
+		s.lookupValue("segment-size", segment_size);
+		s.lookupValue("max-size", max_size);
+		s.lookupValue("sync", sync);
+		s.lookupValue("compaction", compaction);
+
+		m_store_memory = (size_t)max(1, memory) << 20;
+		m_store = new SegmentStore();
+		if(!m_store->open(path, (size_t)max(1, segment_size) << 20, (size_t)max(0, sync) << 10,
+				max(0, min(compaction, 100)), (uint64_t)max(0, max_size) << 20)) {
+			LOG_CRITICAL("Failed to open the DTN store: %s\n", m_store->last_error().c_str());
+			delete m_store;
+			m_store = NULL;
+			return false;
+		}
+
+		SegmentStoreStats st = m_store->stats();
+		LOG_INFO("DTNOutput keeping %d MB of bundles in memory and the rest in %s, %llu bundles waiting there.\n",
+				memory, path.c_str(), st.queued);
+		if(st.truncated) {
+			LOG_WARNING("DTN store in %s had %llu damaged records, they were discarded.\n", path.c_str(), st.truncated);
+		}
+		return true;
+	}
+
+	/* Only a queue kept in memory is ever full */
+	bool queue_full() const {
+		return !m_store && (int)m_pending.size() >= m_max_queued_bundles;
+	}
+
+	/* Puts a bundle behind the others waiting for the pacer. Once dtnoutput.store.memory
+	   bytes are waiting, bundles go to the store instead, and stay there until the
+	   ones in memory are sent, so they go out in order. */
+	void queue(DtnBundle* b) {
+		if(!m_store || (m_store->empty() && m_pending_bytes + b->data.size() <= m_store_memory)) {
+			m_pending.push_back(b);
+			m_pending_bytes += b->data.size();
+			return;
+		}
+
+		/* packets (4) | endpoint length (1) | endpoint | bundle */
+		vector<uint8_t> record(5 + b->dest->endpoint.size() + b->data.size());
+		uint32_t packets = htonl(b->packets);
+
+		memcpy(&record[0], &packets, 4);
+		record[4] = b->dest->endpoint.size();
+		memcpy(&record[5], b->dest->endpoint.data(), b->dest->endpoint.size());
+		memcpy(&record[5 + b->dest->endpoint.size()], &b->data[0], b->data.size());
+
+		if(m_store->append(0, &record[0], record.size())) {
+			m_spilled++;
+		} else {
+			LOG_WARNING("DTN store is full, dropping a bundle of %u packets for %s.\n",
+					b->packets, b->dest->endpoint.c_str());
+			m_dropped += b->packets;
+		}
+		delete b;
+	}
+
+	/* Brings bundles back from the store once half of the memory is free */
+	void refill() {
+		vector<uint8_t> record;
+
+		while(m_pending_bytes < m_store_memory / 2 && m_store->front(0, record)) {
+			DtnDestination* d = NULL;
+			uint32_t packets;
+
+			m_store->pop(0);
+			if(record.size() < 5 || record.size() < 5 + (size_t)record[4] + 1 ||
+					!(d = add_destination(string((const char*)&record[5], record[4])))) {
+				LOG_WARNING("Discarding a bundle the DTN store could not route.\n");
+				continue;
+			}
+
+			DtnBundle* b = new DtnBundle();
+			memcpy(&packets, &record[0], 4);
+			b->dest = d;
+			b->packets = ntohl(packets);
+			b->data.assign(record.begin() + 5 + record[4], record.end());
+			m_pending.push_back(b);
+			m_pending_bytes += b->data.size();
+			m_replayed++;
+		}
+	}
+
+	void send(DtnBundle* b) {
+		LOG_DEBUG("Sending a bundle of %u packets (%u bytes) to %s.\n",
+				b->packets, (unsigned int)b->data.size(), b->dest->endpoint.c_str());
+
+		m_dtn->send(&b->dest->eid, (char*)&b->data[0], b->data.size());
+		m_bundles++;
+		m_bytes += b->data.size();
+		delete b;
+	}
+
+	/* Flushes bundles whose deadline passed and sends what the pacer allows */
+	void poll(uint64_t now) {
+		for(size_t i = 0; i < m_destinations.size(); i++) {
+			DtnDestination* d = m_destinations[i];
+			if(!d->framer.empty() && now >= d->deadline) {
+				flush(d);
+			}
+			if(d->fec && d->fec->open() && now - d->fec->opened_at() >= (uint64_t)m_fec_max_group_time * 1000) {
+				close_group(d);
+			}
+		}
+
+		if(m_store && m_pending_bytes < m_store_memory / 2) {
+			refill();
+		}
+		while(!m_pending.empty() && m_pacer.take(m_pending.front()->data.size(), now)) {
+			m_pending_bytes -= m_pending.front()->data.size();
+			send(m_pending.front());
+			m_pending.pop_front();
+			if(m_store && m_pending_bytes < m_store_memory / 2) {
+				refill();
+			}
+		}
+
+		if((m_compression || m_fec || m_store) && time(NULL) - m_last_stats >= (time_t)m_stats_interval) {
+			NpsGateVar* var;
+
+			if(m_compression) {
+				var = new NpsGateVar();
+				var->set(m_compression_stats.str());
+				publish(m_compression_topic, var);
+				var->unref();
+			}
+			if(m_fec) {
+				char buffer[64];
+				snprintf(buffer, sizeof(buffer), " parity_per_group=%u dropped=%llu", fec_parity(), m_fec_dropped);
+
+				var = new NpsGateVar();
+				var->set(m_fec_stats.str(m_fec_loss) + buffer);
+				publish(m_fec_topic, var);
+				var->unref();
+			}
+			if(m_store) {
+				char buffer[64];
+				snprintf(buffer, sizeof(buffer), " spilled=%llu replayed=%llu", m_spilled, m_replayed);
+
+				var = new NpsGateVar();
+				var->set(m_store->stats().str() + buffer);
+				publish(m_store_topic, var);
+				var->unref();
+			}
+			m_last_stats = time(NULL);
+		}
+	}
 
 public:
-	DTNOutput(PluginCore* c) : NpsGatePlugin(c), delay(0) {
+	DTNOutput(PluginCore* c) : NpsGatePlugin(c), m_dtn(NULL), m_max_bundle_size(65536), m_expiration(60 * 60),
+			m_max_packet_buffer_time(10), m_max_queued_bundles(64), m_pending_bytes(0),
+			m_store(NULL), m_store_memory(0), m_spilled(0), m_replayed(0), m_compression(false), m_compression_level(1),
+			m_compression_min_saving(10), m_fec(false), m_fec_group(8), m_fec_redundancy(25), m_fec_max_redundancy(100),
+			m_fec_max_group_time(100), m_fec_loss(0), m_fec_dropped(0), m_stats_interval(5), m_last_stats(0),
+			m_packets(0), m_bundles(0), m_bytes(0), m_dropped(0) {
 	}
 
 	virtual bool init() {
+		int rate = 0;
+		int burst = 0;
+		string dictionary;
+
 		LOG_INFO("DTNOutput plugin starting initialization.\n");
-		
+
+		m_compression_topic = register_topic("DTNOutput.compression");
+		m_fec_topic = register_topic("DTNOutput.fec");
+		m_store_topic = register_topic("DTNOutput.store");
+
 		config = get_config();
 		if(!config) {
 			LOG_CRITICAL("Error accessing config file!\n");
@@ -64,49 +537,223 @@ public:
 			LOG_CRITICAL("Missing 'recv-endpoint' configuration setting\n");
 		}
 
-		config->lookupValue("dtnoutput.delay", delay);
+		if(config->exists("dtnoutput.delay")) {
+			LOG_WARNING("'dtnoutput.delay' is no longer used, bundles are paced by 'dtnoutput.rate'.\n");
+		}
 
 		try{
 			//config->lookupValue("dtnoutput.admin-endpoint", m_admin_endpoint);
 			config->lookupValue("dtnoutput.multicast-group", m_multicast_group);
 			config->lookupValue("dtnoutput.max-bundle-size", m_max_bundle_size);
 			config->lookupValue("dtnoutput.default-bundle-exp", m_expiration);
-			//config->lookupValue("dtnoutput.max-packet-buffer-time", m_max_packet_buffer_time);
+			config->lookupValue("dtnoutput.max-packet-buffer-time", m_max_packet_buffer_time);
+			config->lookupValue("dtnoutput.max-queued-bundles", m_max_queued_bundles);
+			config->lookupValue("dtnoutput.rate", rate);
+			config->lookupValue("dtnoutput.burst", burst);
+			config->lookupValue("dtnoutput.compression", m_compression);
+			config->lookupValue("dtnoutput.compression-level", m_compression_level);
+			config->lookupValue("dtnoutput.compression-min-saving", m_compression_min_saving);
+			config->lookupValue("dtnoutput.compression-dictionary", dictionary);
+			config->lookupValue("dtnoutput.stats_interval", m_stats_interval);
+			config->lookupValue("dtnoutput.fec", m_fec);
+			config->lookupValue("dtnoutput.fec-group", m_fec_group);
+			config->lookupValue("dtnoutput.fec-redundancy", m_fec_redundancy);
+			config->lookupValue("dtnoutput.fec-max-redundancy", m_fec_max_redundancy);
+			config->lookupValue("dtnoutput.fec-max-group-time", m_fec_max_group_time);
+			config->lookupValue("dtnoutput.fec-loss-topic", m_fec_loss_topic);
 		}
 		catch(const SettingNotFoundException &nfex){
 			LOG_CRITICAL("Missing BPA interface setting!\n");
 			return false;
 		}
-		//LOG_INFO("DTNOutput src EID is '%s'\n", m_send_endpoint.c_str());
-		//m_send_adm_endpoint = m_send_endpoint + "/rx";
-		
-		//m_dtn = new BpaInterface(m_send_endpoint);
+
+		if(m_max_bundle_size < BUNDLE_FRAME_HEADER + BUNDLE_FRAME_RECORD + 20) {
+			LOG_CRITICAL("dtnoutput.max-bundle-size of %d bytes cannot hold a packet.\n", m_max_bundle_size);
+			return false;
+		}
+		if(m_max_packet_buffer_time < 0) {
+			m_max_packet_buffer_time = 0;
+		}
+		if(m_max_queued_bundles < 1) {
+			m_max_queued_bundles = 1;
+		}
+		if(m_stats_interval < 1) {
+			m_stats_interval = 1;
+		}
+		m_last_stats = time(NULL);
+
+		/* Bundles are compressed with the same dictionary DTNInput inflates them with */
+		if(m_compression) {
+			if(m_compression_level < 1 || m_compression_level > 9) {
+				m_compression_level = 1;
+			}
+			if(m_compression_min_saving < 0 || m_compression_min_saving > 99) {
+				m_compression_min_saving = 10;
+			}
+			if(!bundle_load_dictionary(dictionary, &m_dictionary)) {
+				LOG_CRITICAL("Failed to read compression dictionary '%s'.\n", dictionary.c_str());
+				return false;
+			}
+			LOG_INFO("DTNOutput compressing bundles at level %d with a %u byte dictionary.\n",
+					m_compression_level, (unsigned int)m_dictionary.size());
+		}
+
+		/* Groups of up to 64 bundles with up to 64 parity bundles each */
+		if(m_fec) {
+			m_fec_group = max(1, min(m_fec_group, BUNDLE_FEC_MAX_K));
+			m_fec_redundancy = max(0, min(m_fec_redundancy, BUNDLE_FEC_MAX_M * 100 / m_fec_group));
+			m_fec_max_redundancy = max(m_fec_redundancy, min(m_fec_max_redundancy, BUNDLE_FEC_MAX_M * 100 / m_fec_group));
+			m_fec_max_group_time = max(1, m_fec_max_group_time);
+			if(!m_fec_loss_topic.empty()) {
+				subscribe(m_fec_loss_topic);
+			}
+			LOG_INFO("DTNOutput coding groups of %d bundles with %d%% to %d%% parity.\n",
+					m_fec_group, m_fec_redundancy, m_fec_max_redundancy);
+		}
+
 		m_dtn = new BpaInterface(m_source_endpoint, m_dest_endpoint);
-		//m_adm_dtn = new BpaInterface(m_send_adm_endpoint);
+		m_dtn->set_expiration(m_expiration);
+
+		if(config->exists("dtnoutput.emulator") && !m_dtn->configure(config->lookup("dtnoutput.emulator"))) {
+			return false;
+		}
+
+		if(!parse_routes()) {
+			return false;
+		}
+
+		if(config->exists("dtnoutput.store") && !open_store(config->lookup("dtnoutput.store"))) {
+			return false;
+		}
+
+		/* dtnoutput.rate is in kilobits per second, the burst in bytes */
+		if(rate > 0) {
+			if(burst < m_max_bundle_size) {
+				burst = m_max_bundle_size;
+			}
+			m_pacer.configure((uint64_t)rate * 1000 / 8, burst);
+			LOG_INFO("DTNOutput pacing bundles at %d kbit/s, %d byte burst.\n", rate, burst);
+		}
+
+		/* Bundles are flushed and paced from message_timeout() while no packets arrive */
+		if(m_max_packet_buffer_time > 0 || m_pacer.enabled() || m_fec || m_store) {
+			set_timeout(max(1, min(m_max_packet_buffer_time, 10)));
+		}
+
+		LOG_INFO("DTNOutput bundling up to %d bytes or %d ms for %u destinations.\n",
+				m_max_bundle_size, m_max_packet_buffer_time, (unsigned int)m_destinations.size());
 
 		return true;
 	}
-	
-	
 
 	virtual bool process_packet(Packet* p) {
-		bool rval = true;
-		LOG_INFO("DTNOutput processing packet\n");
+		const uint8_t* data = p->GetRawPtr();
+		size_t len = p->GetSize();
+		uint64_t now = dtn_now_us();
+		DtnDestination* d = route(data, len);
 
-		m_dtn->send((char*)p->GetRawPtr(), p->GetSize());
-		drop_packet(p);
+		m_packets++;
+
+		/* Bundles never grow past the maximum, but a packet too large for one
+		   on its own still goes in a bundle by itself */
+		if(!d->framer.empty() && d->framer.size() + BundleFramer::record_size(len) > (size_t)m_max_bundle_size) {
+			flush(d);
+		}
+
+		if(!d->framer.append(data, len)) {
+			LOG_WARNING("Unable to bundle a packet of %u bytes. Dropping packet.\n", (unsigned int)len);
+			m_dropped++;
+		} else if(d->framer.packets() == 1) {
+			d->deadline = now + (uint64_t)m_max_packet_buffer_time * 1000;
+		}
 
-		LOG_WARNING("Delaying: %u\n", delay);
-		usleep(delay);
+		if(d->framer.size() + BundleFramer::record_size(20) > (size_t)m_max_bundle_size) {
+			flush(d);
+		}
 
+		drop_packet(p);
 
-		return rval;
+		poll(now);
+
+		return true;
 	}
 
+	/* The loss on the link sets the redundancy */
 	virtual bool process_message(Message* m) {
+		const type_info& t = m->value->type();
+		double loss = -1;
+
+		if(m->fq_name != m_fec_loss_topic) {
+			return true;
+		}
+
+		if(t == typeid(double)) {
+			loss = m->value->get<double>();
+		} else if(t == typeid(int)) {
+			loss = m->value->get<int>();
+		} else if(t == typeid(string)) {
+			string s = m->value->get<string>();
+			size_t pos = s.find("loss_pct=");
+			loss = atof(pos == string::npos ? s.c_str() : s.c_str() + pos + 9);
+		}
+
+		if(loss >= 0 && loss <= 100) {
+			unsigned int before = fec_parity();
+
+			m_fec_loss = loss;
+			if(fec_parity() != before) {
+				LOG_INFO("DTNOutput loss is %.1f%%, sending %u parity bundles per group of %d.\n",
+						loss, fec_parity(), m_fec_group);
+			}
+		}
+
+		return true;
+	}
+
+	virtual bool message_timeout() {
+		poll(dtn_now_us());
 		return true;
 	}
 
+	/* Whatever is still buffered goes out unpaced */
+	virtual void exit_handler() {
+		if(!m_dtn) {
+			return;
+		}
+
+		for(size_t i = 0; i <= m_destinations.size(); i++) {
+			while(!m_pending.empty()) {
+				m_pending_bytes -= m_pending.front()->data.size();
+				send(m_pending.front());
+				m_pending.pop_front();
+			}
+			if(i < m_destinations.size()) {
+				flush(m_destinations[i]);
+				if(m_destinations[i]->fec && m_destinations[i]->fec->open()) {
+					close_group(m_destinations[i]);
+				}
+			}
+		}
+
+		LOG_INFO("DTNOutput sent %llu packets in %llu bundles (%llu bytes), dropped %llu packets.\n",
+				m_packets - m_dropped, m_bundles, m_bytes, m_dropped);
+		if(m_compression) {
+			LOG_INFO("DTNOutput compression: %s\n", m_compression_stats.str().c_str());
+		}
+		if(m_fec) {
+			LOG_INFO("DTNOutput FEC: %s\n", m_fec_stats.str(m_fec_loss).c_str());
+		}
+		if(m_store) {
+			m_store->sync();
+			LOG_INFO("DTNOutput store: %s spilled=%llu replayed=%llu\n",
+					m_store->stats().str().c_str(), m_spilled, m_replayed);
+			delete m_store;
+			m_store = NULL;
+		}
+		LOG_INFO("DTNOutput BPA accepted %llu bundles, lost %llu, dropped %llu.\n",
+				m_dtn->stats().sent_bundles, m_dtn->stats().lost, m_dtn->stats().dropped);
+	}
+
 	bool main() {
 		message_loop();
 		return true;
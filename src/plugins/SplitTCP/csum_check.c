@@ -0,0 +1,179 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file csum_check.c
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+/* Checks every version of the checksum in checksum.h against lwIP's own
+   lwip_standard_chksum (algorithm 2), built from inet_chksum.c next to it,
+   across buffer offsets and odd lengths. Then times them. Run by
+   'make check'. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../checksum.h"
+
+uint16_t lwip_standard_chksum(void* dataptr, int len);
+
+#define BUFFER_SIZE		(65536 + 64)
+#define MAX_OFFSET		64
+#define RANDOM_LENGTHS	2000
+
+struct version {
+	const char* name;
+	csum_add_fn fn;
+};
+
+static uint8_t buffer[BUFFER_SIZE];
+static unsigned int failures = 0;
+
+static uint32_t next_random(void) {
+	static uint32_t x = 2463534242U;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+static void check(const struct version* v, size_t offset, size_t len) {
+	uint16_t want = lwip_standard_chksum(buffer + offset, (int)len);
+	uint16_t got = csum_fold(v->fn(buffer + offset, len, 0));
+
+	if(got != want && failures++ < 20) {
+		printf("FAIL %s: offset %u, length %u: 0x%04x, lwIP 0x%04x\n",
+				v->name, (unsigned int)offset, (unsigned int)len, got, want);
+	}
+}
+
+/* A buffer summed in two pieces, split at an even offset, matches the whole */
+static void check_split(const struct version* v, size_t offset, size_t len, size_t split) {
+	uint64_t sum = v->fn(buffer + offset, split, 0);
+	uint16_t got = csum_fold(v->fn(buffer + offset + split, len - split, sum));
+	uint16_t want = lwip_standard_chksum(buffer + offset, (int)len);
+
+	if(got != want && failures++ < 20) {
+		printf("FAIL %s: offset %u, length %u split at %u: 0x%04x, lwIP 0x%04x\n",
+				v->name, (unsigned int)offset, (unsigned int)len, (unsigned int)split, got, want);
+	}
+}
+
+static double now(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static volatile uint64_t sink;
+
+static double gbps_lwip(size_t len, unsigned int rounds) {
+	double start = now();
+	unsigned int i;
+
+	for(i = 0; i < rounds; i++) {
+		sink += lwip_standard_chksum(buffer + (i & 1), (int)len);
+	}
+	return (double)len * rounds / (now() - start) / 1e9;
+}
+
+static double gbps(const struct version* v, size_t len, unsigned int rounds) {
+	double start = now();
+	unsigned int i;
+
+	for(i = 0; i < rounds; i++) {
+		sink += v->fn(buffer + (i & 1), len, 0);
+	}
+	return (double)len * rounds / (now() - start) / 1e9;
+}
+
+int main(void) {
+	static const size_t sizes[] = { 64, 576, 1500, 2560, 9000, 65535 };
+	struct version versions[3];
+	size_t nversions = 0;
+	size_t i, v, offset, len;
+
+	versions[nversions].name = "scalar";
+	versions[nversions++].fn = csum_add_scalar;
+#if CSUM_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) {
+		versions[nversions].name = "sse2";
+		versions[nversions++].fn = csum_add_sse2;
+	} else {
+		printf("SKIP sse2: not supported by this CPU\n");
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		versions[nversions].name = "avx2";
+		versions[nversions++].fn = csum_add_avx2;
+	} else {
+		printf("SKIP avx2: not supported by this CPU\n");
+	}
+#endif
+
+	for(i = 0; i < BUFFER_SIZE; i++) {
+		buffer[i] = (uint8_t)next_random();
+	}
+
+	for(v = 0; v < nversions; v++) {
+		for(offset = 0; offset < MAX_OFFSET; offset++) {
+			/* Every length around the vector widths and the dispatch cutoff */
+			for(len = 0; len <= 4 * CSUM_SIMD_MIN + 3; len++) {
+				check(&versions[v], offset, len);
+			}
+			for(i = 0; i < RANDOM_LENGTHS / MAX_OFFSET; i++) {
+				len = next_random() % (BUFFER_SIZE - MAX_OFFSET);
+				check(&versions[v], offset, len);
+				check_split(&versions[v], offset, len, (next_random() % (len + 1)) & ~(size_t)1);
+			}
+		}
+
+		/* All ones words exercise the end-around carry */
+		memset(buffer, 0xff, BUFFER_SIZE);
+		for(offset = 0; offset < 2; offset++) {
+			check(&versions[v], offset, BUFFER_SIZE - MAX_OFFSET);
+			check(&versions[v], offset, BUFFER_SIZE - MAX_OFFSET - 1);
+		}
+		for(i = 0; i < BUFFER_SIZE; i++) {
+			buffer[i] = (uint8_t)next_random();
+		}
+	}
+
+	if(failures) {
+		printf("%u mismatches against lwip_standard_chksum\n", failures);
+		return 1;
+	}
+	printf("PASS: %u version(s) match lwip_standard_chksum\n", (unsigned int)nversions);
+
+	printf("\n%8s %10s", "bytes", "lwip");
+	for(v = 0; v < nversions; v++) {
+		printf(" %10s", versions[v].name);
+	}
+	printf("   (GB/s)\n");
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		unsigned int rounds = (unsigned int)(200000000 / sizes[i]);
+
+		printf("%8u %10.2f", (unsigned int)sizes[i], gbps_lwip(sizes[i], rounds));
+		for(v = 0; v < nversions; v++) {
+			printf(" %10.2f", gbps(&versions[v], sizes[i], rounds));
+		}
+		printf("\n");
+	}
+
+	return 0;
+}
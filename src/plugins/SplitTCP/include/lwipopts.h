@@ -92,7 +92,7 @@
  * already use it.
  */
 #ifndef MEM_LIBC_MALLOC
-#define MEM_LIBC_MALLOC                 1
+#define MEM_LIBC_MALLOC                 0
 #endif
 
 /**
@@ -101,7 +101,17 @@
 * speed and usage from interrupts!
 */
 #ifndef MEMP_MEM_MALLOC
-#define MEMP_MEM_MALLOC                 1
+#define MEMP_MEM_MALLOC                 0
+#endif
+
+/**
+ * MEMP_ARENA==1: The pools are carved from one block allocated by lwip_init(),
+ * sized by the MEMP_NUM_* values below unless the plugin's configuration
+ * overrides them. An empty pool fails the allocation, which lwIP and the
+ * plugin treat as back pressure.
+ */
+#ifndef MEMP_ARENA
+#define MEMP_ARENA                      1
 #endif
 
 /**
@@ -110,7 +120,7 @@
  *    2 byte alignment -> #define MEM_ALIGNMENT 2
  */
 #ifndef MEM_ALIGNMENT
-#define MEM_ALIGNMENT                   4
+#define MEM_ALIGNMENT                   8
 #endif
 
 /**
@@ -149,7 +159,7 @@
  * To use this, MEMP_USE_CUSTOM_POOLS also has to be enabled.
  */
 #ifndef MEM_USE_POOLS
-#define MEM_USE_POOLS                   0
+#define MEM_USE_POOLS                   1
 #endif
 
 /**
@@ -157,7 +167,7 @@
  * bigger pool - WARNING: THIS MIGHT WASTE MEMORY but it can make a system more
  * reliable. */
 #ifndef MEM_USE_POOLS_TRY_BIGGER_POOL
-#define MEM_USE_POOLS_TRY_BIGGER_POOL   0
+#define MEM_USE_POOLS_TRY_BIGGER_POOL   1
 #endif
 
 /**
@@ -167,7 +177,7 @@
  * inlude path somewhere. 
  */
 #ifndef MEMP_USE_CUSTOM_POOLS
-#define MEMP_USE_CUSTOM_POOLS           0
+#define MEMP_USE_CUSTOM_POOLS           1
 #endif
 
 /**
@@ -201,9 +211,10 @@
  * MEMP_NUM_PBUF: the number of memp struct pbufs (used for PBUF_ROM and PBUF_REF).
  * If the application sends a lot of data out of ROM (or other static memory),
  * this should be set high.
+ * SplitTCP writes proxied data by reference, so this matches MEMP_NUM_TCP_SEG.
  */
 #ifndef MEMP_NUM_PBUF
-#define MEMP_NUM_PBUF                   128
+#define MEMP_NUM_PBUF                   262144
 #endif
 
 /**
@@ -226,17 +237,20 @@
 /**
  * MEMP_NUM_TCP_PCB: the number of simulatenously active TCP connections.
  * (requires the LWIP_TCP option)
+ * Every proxied connection takes two. SplitTCP sizes this pool from
+ * splittcp.max_connections unless splittcp.pools does.
  */
 #ifndef MEMP_NUM_TCP_PCB
-#define MEMP_NUM_TCP_PCB                64
+#define MEMP_NUM_TCP_PCB                65535
 #endif
 
 /**
  * MEMP_NUM_TCP_PCB_LISTEN: the number of listening TCP connections.
  * (requires the LWIP_TCP option)
+ * SplitTCP only needs its transparent listener.
  */
 #ifndef MEMP_NUM_TCP_PCB_LISTEN
-#define MEMP_NUM_TCP_PCB_LISTEN         64
+#define MEMP_NUM_TCP_PCB_LISTEN         1
 #endif
 
 /**
@@ -244,7 +258,7 @@
  * (requires the LWIP_TCP option)
  */
 #ifndef MEMP_NUM_TCP_SEG
-#define MEMP_NUM_TCP_SEG                6400
+#define MEMP_NUM_TCP_SEG                262144
 #endif
 
 /**
@@ -321,7 +335,7 @@
  * PBUF_POOL_SIZE: the number of buffers in the pbuf pool. 
  */
 #ifndef PBUF_POOL_SIZE
-#define PBUF_POOL_SIZE                  32
+#define PBUF_POOL_SIZE                  256
 #endif
 
 /*
@@ -746,10 +760,11 @@
 
 /**
  * TCP_WND: The size of a TCP window.  This must be at least 
- * (2 * TCP_MSS) for things to work well
+ * (2 * TCP_MSS) for things to work well. Only the default, the plugin
+ * sets the window it is configured with through tcp_set_window().
  */
 #ifndef TCP_WND
-#define TCP_WND                         20480
+#define TCP_WND                         (256 * 1024)
 //#define TCP_WND                         2048
 #endif 
 
@@ -803,7 +818,7 @@
  * TCP_SND_BUF: TCP sender buffer space (bytes). 
  */
 #ifndef TCP_SND_BUF
-#define TCP_SND_BUF                     16384
+#define TCP_SND_BUF                     (256 * 1024)
 #endif
 
 /**
@@ -846,12 +861,63 @@
 #define LWIP_TCP_TIMESTAMPS             0
 #endif
 
+/**
+ * LWIP_TCP_PCB_HOOKS==1: Tell the port whenever a pcb joins or leaves
+ * tcp_active_pcbs and let it find the pcb for an incoming segment instead of
+ * walking the list. The port provides lwip_hook_tcp_pcb_active(),
+ * lwip_hook_tcp_pcb_inactive() and lwip_hook_tcp_pcb_lookup(). IPv4 only.
+ */
+#ifndef LWIP_TCP_PCB_HOOKS
+#define LWIP_TCP_PCB_HOOKS              1
+#endif
+
+/**
+ * LWIP_WND_SCALE, TCP_RCV_SCALE: Window scaling (RFC 7323). A shift of 7
+ * allows windows of up to 8MB, enough to fill 100Mbit/s at a 600ms RTT.
+ */
+#ifndef LWIP_WND_SCALE
+#define LWIP_WND_SCALE                  1
+#define TCP_RCV_SCALE                   7
+#endif
+
+/**
+ * LWIP_TCP_RUNTIME_WND==1: The window and send buffer are read from the
+ * plugin's configuration.
+ */
+#ifndef LWIP_TCP_RUNTIME_WND
+#define LWIP_TCP_RUNTIME_WND            1
+#endif
+
+/**
+ * LWIP_TCP_SACK==1: Selective acknowledgements and SACK based loss
+ * recovery. Offered to peers unless turned off in the plugin's configuration.
+ */
+#ifndef LWIP_TCP_SACK
+#define LWIP_TCP_SACK                   1
+#endif
+
+/**
+ * LWIP_TCP_CC==1: Per connection congestion control, picked for each side
+ * of a proxied connection by the plugin's configuration.
+ */
+#ifndef LWIP_TCP_CC
+#define LWIP_TCP_CC                     1
+#endif
+
+/**
+ * LWIP_TCP_TRANSPARENT==1: One listener accepts the SYNs of every
+ * intercepted connection, whatever server they were sent to.
+ */
+#ifndef LWIP_TCP_TRANSPARENT
+#define LWIP_TCP_TRANSPARENT            1
+#endif
+
 /**
  * TCP_WND_UPDATE_THRESHOLD: difference in window to trigger an
  * explicit window update
  */
 #ifndef TCP_WND_UPDATE_THRESHOLD
-#define TCP_WND_UPDATE_THRESHOLD   (TCP_WND / 4)
+#define TCP_WND_UPDATE_THRESHOLD   (TCP_WND_CFG / 4)
 #endif
 
 /**
@@ -980,6 +1046,14 @@
 #define LWIP_NETIF_TX_SINGLE_PBUF             0
 #endif /* LWIP_NETIF_TX_SINGLE_PBUF */
 
+/**
+ * LWIP_SUPPORT_CUSTOM_PBUF==1: Enable pbuf_alloced_custom(). Received packets
+ * are handed to lwIP as custom pbufs that point in to the NpsGate packet.
+ */
+#ifndef LWIP_SUPPORT_CUSTOM_PBUF
+#define LWIP_SUPPORT_CUSTOM_PBUF              1
+#endif
+
 /*
    ------------------------------------
    ---------- LOOPIF options ----------
@@ -1261,6 +1335,12 @@
 #define LWIP_STATS_DISPLAY              1
 #endif
 
+/**
+ * LWIP_STATS_LARGE==1: 32 bit counters. The plugins publish the TCP ones, which
+ * would wrap within seconds at 16 bits.
+ */
+#define LWIP_STATS_LARGE                1
+
 /**
  * LINK_STATS==1: Enable link stats.
  */
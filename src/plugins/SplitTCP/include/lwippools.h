@@ -0,0 +1,30 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file lwippools.h
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+/* No include guard, memp_std.h includes this once for every list it builds.
+
+   The pools mem_malloc() draws from (MEM_USE_POOLS), carved from the arena like
+   the others and sized the same way, as POOL_256 and POOL_2048. PBUF_RAM pbufs
+   are all SplitTCP allocates from them: the headers of outgoing segments and
+   ACKs, which fit in 256 bytes with their options, and the full sized segments
+   tcp_write() copies when it runs out of pbufs to reference the data with. */
+
+LWIP_MALLOC_MEMPOOL_START
+LWIP_MALLOC_MEMPOOL(262144, 256)
+LWIP_MALLOC_MEMPOOL(16384, 2048)
+LWIP_MALLOC_MEMPOOL_END
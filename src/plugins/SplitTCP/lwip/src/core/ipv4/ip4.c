@@ -94,10 +94,10 @@
 #endif /* LWIP_DHCP */
 
 /** Global data for both IPv4 and IPv6 */
-struct ip_globals ip_data;
+LWIP_PER_THREAD struct ip_globals ip_data;
 
 /** The IP header ID of the next outgoing IP packet */
-static u16_t ip_id;
+static LWIP_PER_THREAD u16_t ip_id;
 
 /**
  * Finds the appropriate network interface for a given IP address. It
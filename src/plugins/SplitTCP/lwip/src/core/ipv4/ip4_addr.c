@@ -260,7 +260,7 @@ ipaddr_aton(const char *cp, ip_addr_t *addr)
 char *
 ipaddr_ntoa(const ip_addr_t *addr)
 {
-  static char str[16];
+  static LWIP_PER_THREAD char str[16];
   return ipaddr_ntoa_r(addr, str, 16);
 }
 
@@ -79,10 +79,10 @@
 #define NETIF_LINK_CALLBACK(n)
 #endif /* LWIP_NETIF_LINK_CALLBACK */ 
 
-struct netif *netif_list;
-struct netif *netif_default;
+LWIP_PER_THREAD struct netif *netif_list;
+LWIP_PER_THREAD struct netif *netif_default;
 
-static u8_t netif_num;
+static LWIP_PER_THREAD u8_t netif_num;
 
 #if LWIP_IPV6
 static err_t netif_null_output_ip6(struct netif *netif, struct pbuf *p, ip6_addr_t *ipaddr);
@@ -46,7 +46,7 @@
 
 #include <string.h>
 
-struct stats_ lwip_stats;
+LWIP_PER_THREAD struct stats_ lwip_stats;
 
 void stats_init(void)
 {
@@ -91,10 +91,24 @@ const char * const tcp_state_str[] = {
 };
 
 /* last local TCP port */
-static u16_t tcp_port = TCP_LOCAL_PORT_RANGE_START;
+static LWIP_PER_THREAD u16_t tcp_port = TCP_LOCAL_PORT_RANGE_START;
 
 /* Incremented every coarse grained timer shot (typically every 500 ms). */
-u32_t tcp_ticks;
+LWIP_PER_THREAD u32_t tcp_ticks;
+
+#if LWIP_TCP_RUNTIME_WND
+/* Window and send buffer given to new pcbs, see tcp_set_window() */
+LWIP_PER_THREAD tcpwnd_size_t tcp_cfg_wnd = TCP_WND;
+LWIP_PER_THREAD tcpwnd_size_t tcp_cfg_snd_buf = TCP_SND_BUF;
+LWIP_PER_THREAD u16_t tcp_cfg_snd_queuelen = TCP_SND_QUEUELEN;
+#endif /* LWIP_TCP_RUNTIME_WND */
+#if LWIP_TCP_SACK
+LWIP_PER_THREAD u8_t tcp_cfg_sack = 1;
+LWIP_PER_THREAD struct tcp_sack_stats tcp_sack_stats;
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_CC
+LWIP_PER_THREAD u8_t tcp_pacing_pending;
+#endif /* LWIP_TCP_CC */
 const u8_t tcp_backoff[13] =
     { 1, 2, 3, 4, 5, 6, 7, 7, 7, 7, 7, 7, 7};
  /* Times per slowtmr hits */
@@ -103,29 +117,34 @@ const u8_t tcp_persist_backoff[7] = { 3, 6, 12, 24, 48, 96, 120 };
 /* The TCP PCB lists. */
 
 /** List of all TCP PCBs bound but not yet (connected || listening) */
-struct tcp_pcb *tcp_bound_pcbs;
+LWIP_PER_THREAD struct tcp_pcb *tcp_bound_pcbs;
 /** List of all TCP PCBs in LISTEN state */
-union tcp_listen_pcbs_t tcp_listen_pcbs;
+LWIP_PER_THREAD union tcp_listen_pcbs_t tcp_listen_pcbs;
+#if LWIP_TCP_TRANSPARENT
+/** Listening pcb that accepts SYNs nobody else listens for */
+LWIP_PER_THREAD struct tcp_pcb_listen *tcp_transparent_pcb;
+#endif /* LWIP_TCP_TRANSPARENT */
 /** List of all TCP PCBs that are in a state in which
  * they accept or send data. */
-struct tcp_pcb *tcp_active_pcbs;
+LWIP_PER_THREAD struct tcp_pcb *tcp_active_pcbs;
 /** List of all TCP PCBs in TIME-WAIT state */
-struct tcp_pcb *tcp_tw_pcbs;
+LWIP_PER_THREAD struct tcp_pcb *tcp_tw_pcbs;
 
 #define NUM_TCP_PCB_LISTS               4
 #define NUM_TCP_PCB_LISTS_NO_TIME_WAIT  3
-/** An array with all (non-temporary) PCB lists, mainly used for smaller code size */
-struct tcp_pcb ** const tcp_pcb_lists[] = {&tcp_listen_pcbs.pcbs, &tcp_bound_pcbs,
-  &tcp_active_pcbs, &tcp_tw_pcbs};
+/** An array with all (non-temporary) PCB lists, mainly used for smaller code size.
+    Filled in by tcp_init() since the lists may be thread-local (LWIP_PER_THREAD),
+    in which case their addresses are not constant. */
+static LWIP_PER_THREAD struct tcp_pcb ** tcp_pcb_lists[NUM_TCP_PCB_LISTS];
 
 /** Only used for temporary storage. */
-struct tcp_pcb *tcp_tmp_pcb;
+LWIP_PER_THREAD struct tcp_pcb *tcp_tmp_pcb;
 
-u8_t tcp_active_pcbs_changed;
+LWIP_PER_THREAD u8_t tcp_active_pcbs_changed;
 
 /** Timer counter to handle calling slow-timer from tcp_tmr() */ 
-static u8_t tcp_timer;
-static u8_t tcp_timer_ctr;
+static LWIP_PER_THREAD u8_t tcp_timer;
+static LWIP_PER_THREAD u8_t tcp_timer_ctr;
 static u16_t tcp_new_port(void);
 
 /**
@@ -134,6 +153,10 @@ static u16_t tcp_new_port(void);
 void
 tcp_init(void)
 {
+  tcp_pcb_lists[0] = &tcp_listen_pcbs.pcbs;
+  tcp_pcb_lists[1] = &tcp_bound_pcbs;
+  tcp_pcb_lists[2] = &tcp_active_pcbs;
+  tcp_pcb_lists[3] = &tcp_tw_pcbs;
 #if LWIP_RANDOMIZE_INITIAL_LOCAL_PORTS && defined(LWIP_RAND)
   tcp_port = TCP_ENSURE_LOCAL_PORT_RANGE(LWIP_RAND());
 #endif /* LWIP_RANDOMIZE_INITIAL_LOCAL_PORTS && defined(LWIP_RAND) */
@@ -177,7 +200,7 @@ tcp_close_shutdown(struct tcp_pcb *pcb, u8_t rst_on_unacked_data)
   err_t err;
 
   if (rst_on_unacked_data && ((pcb->state == ESTABLISHED) || (pcb->state == CLOSE_WAIT))) {
-    if ((pcb->refused_data != NULL) || (pcb->rcv_wnd != TCP_WND)) {
+    if ((pcb->refused_data != NULL) || (pcb->rcv_wnd != TCP_WND_CFG)) {
       /* Not all data received by application, send RST to tell the remote
          side about this. */
       LWIP_ASSERT("pcb->flags & TF_RXCLOSED", pcb->flags & TF_RXCLOSED);
@@ -219,6 +242,11 @@ tcp_close_shutdown(struct tcp_pcb *pcb, u8_t rst_on_unacked_data)
     break;
   case LISTEN:
     err = ERR_OK;
+#if LWIP_TCP_TRANSPARENT
+    if ((struct tcp_pcb_listen *)pcb == tcp_transparent_pcb) {
+      tcp_transparent_pcb = NULL;
+    }
+#endif /* LWIP_TCP_TRANSPARENT */
     tcp_pcb_remove(&tcp_listen_pcbs.pcbs, pcb);
     memp_free(MEMP_TCP_PCB_LISTEN, pcb);
     pcb = NULL;
@@ -615,7 +643,7 @@ u32_t tcp_update_rcv_ann_wnd(struct tcp_pcb *pcb)
 {
   u32_t new_right_edge = pcb->rcv_nxt + pcb->rcv_wnd;
 
-  if (TCP_SEQ_GEQ(new_right_edge, pcb->rcv_ann_right_edge + LWIP_MIN((TCP_WND / 2), pcb->mss))) {
+  if (TCP_SEQ_GEQ(new_right_edge, pcb->rcv_ann_right_edge + LWIP_MIN((TCP_WND_CFG / 2), pcb->mss))) {
     /* we can advertise more window */
     pcb->rcv_ann_wnd = pcb->rcv_wnd;
     return new_right_edge - pcb->rcv_ann_right_edge;
@@ -658,8 +686,8 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
   //NPSGATE_LOG("Increasing Window: %u + %u => %u\n", pcb->rcv_wnd, len, pcb->rcv_wnd + len);
 
   pcb->rcv_wnd += len;
-  if (pcb->rcv_wnd > TCP_WND) {
-    pcb->rcv_wnd = TCP_WND;
+  if (pcb->rcv_wnd > TCP_WND_CFG) {
+    pcb->rcv_wnd = TCP_WND_CFG;
 	LWIP_ASSERT("pcb->rcv_wnd > TCP_WND\n", 1);
   }
 
@@ -676,8 +704,108 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
   }
 
   LWIP_DEBUGF(TCP_DEBUG, ("tcp_recved: received %"U16_F" bytes, wnd %"U16_F" (%"U16_F").\n",
-         len, pcb->rcv_wnd, TCP_WND - pcb->rcv_wnd));
+         len, pcb->rcv_wnd, TCP_WND_CFG - pcb->rcv_wnd));
+}
+
+#if LWIP_TCP_RUNTIME_WND
+/**
+ * Sets the receive window and send buffer of pcbs allocated from now on.
+ * The window is limited to what can be announced with TCP_RCV_SCALE, and
+ * the send queue is sized the way TCP_SND_QUEUELEN is by default.
+ *
+ * @param wnd receive window in bytes
+ * @param snd_buf send buffer in bytes
+ * @return ERR_VAL if either is too small for TCP to work (see init.c)
+ */
+err_t
+tcp_set_window(u32_t wnd, u32_t snd_buf)
+{
+  u32_t queuelen;
+
+  if ((wnd < TCP_MSS) || (snd_buf < 2 * TCP_MSS)) {
+    return ERR_VAL;
+  }
+
+  wnd = LWIP_MIN(wnd, (u32_t)0xFFFF << TCP_RCV_SCALE);
+  snd_buf = LWIP_MIN(snd_buf, TCPWND_MAX);
+  queuelen = LWIP_MIN(4 * (snd_buf / TCP_MSS), TCP_SNDQUEUELEN_OVERFLOW);
+
+  tcp_cfg_wnd = (tcpwnd_size_t)wnd;
+  tcp_cfg_snd_buf = (tcpwnd_size_t)snd_buf;
+  tcp_cfg_snd_queuelen = (u16_t)queuelen;
+  return ERR_OK;
+}
+#endif /* LWIP_TCP_RUNTIME_WND */
+
+#if LWIP_TCP_SACK
+/**
+ * Sets whether connections opened or accepted from now on offer SACK.
+ * Connections that already agreed to use it keep doing so.
+ *
+ * @param enable 0 to stop offering SACK
+ */
+void
+tcp_set_sack(u8_t enable)
+{
+  tcp_cfg_sack = enable ? 1 : 0;
 }
+#endif /* LWIP_TCP_SACK */
+
+#if LWIP_TCP_TRANSPARENT
+/**
+ * Makes a listening pcb accept every SYN that no other pcb matches,
+ * whatever address and port it was sent to. Only one pcb does so at a time,
+ * closing it stops transparent accepts.
+ *
+ * @param pcb the tcp_pcb returned by tcp_listen(), NULL to stop
+ */
+void
+tcp_listen_transparent(struct tcp_pcb *pcb)
+{
+  LWIP_ERROR("tcp_listen_transparent: pcb not listening",
+             (pcb == NULL) || (pcb->state == LISTEN), return);
+  tcp_transparent_pcb = (struct tcp_pcb_listen *)pcb;
+}
+#endif /* LWIP_TCP_TRANSPARENT */
+
+#if LWIP_TCP_CC
+/**
+ * Hands a connection to a congestion control algorithm. Best called before
+ * the connection is established, though it may be switched at any time.
+ *
+ * @param pcb the tcp_pcb to control
+ * @param cc the algorithm, NULL for the built in Reno
+ */
+void
+tcp_set_cc(struct tcp_pcb *pcb, const struct tcp_cc_ops *cc)
+{
+  pcb->cc = cc;
+  memset(pcb->cc_priv, 0, sizeof(pcb->cc_priv));
+  pcb->pacing_rate = 0;
+  pcb->pace_credit = 0;
+  if (cc != NULL && cc->init != NULL) {
+    cc->init(pcb);
+  }
+}
+
+/**
+ * Sends what paced connections held back for lack of pacing credit. Should
+ * be called every TCP_PACE_INTERVAL milliseconds while tcp_pacing_pending
+ * is set.
+ */
+void
+tcp_pace_tmr(void)
+{
+  struct tcp_pcb *pcb;
+
+  tcp_pacing_pending = 0;
+  for (pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
+    if (pcb->pacing_rate != 0 && pcb->unsent != NULL) {
+      tcp_output(pcb);
+    }
+  }
+}
+#endif /* LWIP_TCP_CC */
 
 /**
  * Allocate a new local TCP port.
@@ -787,10 +915,10 @@ tcp_connect(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port,
   pcb->snd_nxt = iss;
   pcb->lastack = iss - 1;
   pcb->snd_lbb = iss - 1;
-  pcb->rcv_wnd = TCP_WND;
-  pcb->rcv_ann_wnd = TCP_WND;
+  pcb->rcv_wnd = TCP_WND_CFG;
+  pcb->rcv_ann_wnd = TCP_WND_CFG;
   pcb->rcv_ann_right_edge = pcb->rcv_nxt;
-  pcb->snd_wnd = TCP_WND;
+  pcb->snd_wnd = TCP_WND_CFG;
   /* As initial send MSS, we use TCP_MSS but limit it to 536.
      The send MSS is updated when an MSS option is received. */
   pcb->mss = (TCP_MSS > 536) ? 536 : TCP_MSS;
@@ -907,12 +1035,19 @@ tcp_slowtmr_start:
           pcb->rtime = 0;
 
           /* Reduce congestion window and ssthresh. */
-          eff_wnd = LWIP_MIN(pcb->cwnd, pcb->snd_wnd);
-          pcb->ssthresh = eff_wnd >> 1;
-          if (pcb->ssthresh < (tcpwnd_size_t)(pcb->mss << 1)) {
-            pcb->ssthresh = (pcb->mss << 1);
+#if LWIP_TCP_CC
+          if (pcb->cc != NULL) {
+            pcb->cc->loss(pcb, 1);
+          } else
+#endif /* LWIP_TCP_CC */
+          {
+            eff_wnd = LWIP_MIN(pcb->cwnd, pcb->snd_wnd);
+            pcb->ssthresh = eff_wnd >> 1;
+            if (pcb->ssthresh < (tcpwnd_size_t)(pcb->mss << 1)) {
+              pcb->ssthresh = (pcb->mss << 1);
+            }
+            pcb->cwnd = pcb->mss;
           }
-          pcb->cwnd = pcb->mss;
           LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: cwnd %"TCPWNDSIZE_F
                                        " ssthresh %"TCPWNDSIZE_F"\n",
                                        pcb->cwnd, pcb->ssthresh));
@@ -996,6 +1131,7 @@ tcp_slowtmr_start:
       void *err_arg;
       tcp_pcb_purge(pcb);
       /* Remove PCB from tcp_active_pcbs list. */
+      TCP_HOOK_INACTIVE(pcb);
       if (prev != NULL) {
         LWIP_ASSERT("tcp_slowtmr: middle tcp != tcp_active_pcbs", pcb != tcp_active_pcbs);
         prev->next = pcb->next;
@@ -1160,7 +1296,7 @@ tcp_process_refused_data(struct tcp_pcb *pcb)
          ) {
         /* correct rcv_wnd as the application won't call tcp_recved()
            for the FIN's seqno */
-        if (pcb->rcv_wnd != TCP_WND) {
+        if (pcb->rcv_wnd != TCP_WND_CFG) {
           pcb->rcv_wnd++;
         }
         TCP_EVENT_CLOSED(pcb, err);
@@ -1375,10 +1511,10 @@ tcp_alloc(u8_t prio)
   if (pcb != NULL) {
     memset(pcb, 0, sizeof(struct tcp_pcb));
     pcb->prio = prio;
-    pcb->snd_buf = TCP_SND_BUF;
+    pcb->snd_buf = TCP_SND_BUF_CFG;
     pcb->snd_queuelen = 0;
-    pcb->rcv_wnd = TCP_WND;
-    pcb->rcv_ann_wnd = TCP_WND;
+    pcb->rcv_wnd = TCP_WND_CFG;
+    pcb->rcv_ann_wnd = TCP_WND_CFG;
 #if LWIP_WND_SCALE
     /* snd_scale and rcv_scale are zero unless both sides agree to use scaling */
     pcb->snd_scale = 0;
@@ -1630,6 +1766,11 @@ tcp_pcb_purge(struct tcp_pcb *pcb)
 void
 tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb)
 {
+#if LWIP_TCP_PCB_HOOKS
+  if (pcblist == &tcp_active_pcbs) {
+    TCP_HOOK_INACTIVE(pcb);
+  }
+#endif /* LWIP_TCP_PCB_HOOKS */
   TCP_RMV(pcblist, pcb);
 
   tcp_pcb_purge(pcb);
@@ -1663,7 +1804,7 @@ tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb)
 u32_t
 tcp_next_iss(void)
 {
-  static u32_t iss = 6510;
+  static LWIP_PER_THREAD u32_t iss = 6510;
   
   iss += tcp_ticks;       /* XXX */
   return iss;
@@ -0,0 +1,333 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file tcp_cc.c
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+/**
+ * Congestion control algorithms for TCP
+ *
+ * Each algorithm is a struct tcp_cc_ops that tcp_set_cc() attaches to a
+ * connection. Connections without one keep using the Reno built in to
+ * tcp_in.c and tcp_out.c.
+ *
+ *  - reno:  the same slow start, congestion avoidance and halving on loss
+ *           as the built in code, for selecting it explicitly.
+ *  - hybla: Reno with its growth scaled by how much longer the RTT is than
+ *           a 25 ms reference, so long delay paths (satellite) open their
+ *           window as fast as terrestrial ones.
+ *  - rate:  estimates the bottleneck bandwidth and the minimum RTT, paces
+ *           at a gain around the bandwidth and caps cwnd at twice the
+ *           bandwidth-delay product. Loss barely changes it.
+ *
+ */
+
+#include "lwip/opt.h"
+
+#if LWIP_TCP && LWIP_TCP_CC /* don't build if not configured for use in lwipopts.h */
+
+#include "lwip/tcp_impl.h"
+#include "lwip/def.h"
+#include "lwip/sys.h"
+
+#include <string.h>
+
+/* Never let cwnd get close enough to wrap around */
+#define TCP_CC_CWND_MAX        (TCPWND_MAX >> 1)
+
+static tcpwnd_size_t
+tcp_cc_clamp(u64_t cwnd)
+{
+  return (tcpwnd_size_t)LWIP_MIN(cwnd, (u64_t)TCP_CC_CWND_MAX);
+}
+
+/*---------------------------------------------------------------------------
+ * Reno
+ *---------------------------------------------------------------------------*/
+
+static void
+reno_acked(struct tcp_pcb *pcb, u32_t acked)
+{
+  LWIP_UNUSED_ARG(acked);
+
+  if (pcb->cwnd < pcb->ssthresh) {
+    pcb->cwnd = tcp_cc_clamp((u64_t)pcb->cwnd + pcb->mss);
+  } else {
+    pcb->cwnd = tcp_cc_clamp((u64_t)pcb->cwnd + pcb->mss * pcb->mss / pcb->cwnd);
+  }
+}
+
+static void
+reno_loss(struct tcp_pcb *pcb, u8_t timeout)
+{
+  pcb->ssthresh = LWIP_MIN(pcb->cwnd, pcb->snd_wnd) >> 1;
+  if (pcb->ssthresh < (tcpwnd_size_t)(pcb->mss << 1)) {
+    pcb->ssthresh = (pcb->mss << 1);
+  }
+  if (timeout) {
+    pcb->cwnd = pcb->mss;
+  }
+}
+
+const struct tcp_cc_ops tcp_cc_reno = {
+  "reno", NULL, reno_acked, reno_loss, NULL, 0
+};
+
+/*---------------------------------------------------------------------------
+ * Hybla
+ *---------------------------------------------------------------------------*/
+
+/* The RTT Hybla makes every connection grow as fast as */
+#define HYBLA_RTT0_MS          25
+/* rho is kept in eighths and capped so 2^rho stays in range */
+#define HYBLA_RHO              0
+#define HYBLA_RHO_MAX          (16 * 8)
+
+/* 2^(i/8) * 128 */
+static const u16_t hybla_pow2_frac[8] = { 128, 140, 152, 166, 181, 197, 215, 235 };
+
+static void
+hybla_init(struct tcp_pcb *pcb)
+{
+  pcb->cc_priv[HYBLA_RHO] = 8;
+}
+
+static void
+hybla_rtt_sample(struct tcp_pcb *pcb, u32_t rtt_ms)
+{
+  u32_t rho = pcb->srtt_ms * 8 / HYBLA_RTT0_MS;
+
+  LWIP_UNUSED_ARG(rtt_ms);
+  pcb->cc_priv[HYBLA_RHO] = LWIP_MAX(8, LWIP_MIN(rho, HYBLA_RHO_MAX));
+}
+
+static void
+hybla_acked(struct tcp_pcb *pcb, u32_t acked)
+{
+  u32_t rho = pcb->cc_priv[HYBLA_RHO];
+  u64_t cwnd;
+
+  LWIP_UNUSED_ARG(acked);
+
+  if (pcb->cwnd < pcb->ssthresh) {
+    /* Slow start: cwnd += (2^rho - 1) * mss */
+    u64_t pow2 = ((u64_t)1 << (rho >> 3)) * hybla_pow2_frac[rho & 7];
+    cwnd = pcb->cwnd + (pow2 - 128) * pcb->mss / 128;
+    /* ... though not past ssthresh in one go, the factor is 2^16 on a
+       satellite hop and would put a whole window on the wire at once */
+    cwnd = LWIP_MIN(cwnd, LWIP_MAX(pcb->ssthresh, (u64_t)pcb->cwnd + pcb->mss));
+  } else {
+    /* Congestion avoidance: cwnd += rho^2 * mss^2 / cwnd */
+    cwnd = pcb->cwnd + (u64_t)rho * rho * pcb->mss * pcb->mss / 64 / pcb->cwnd;
+  }
+
+  /* Growing past what the peer ever offered only stores up a burst */
+  if (pcb->snd_wnd_max != 0 && cwnd > pcb->snd_wnd_max) {
+    cwnd = LWIP_MAX(pcb->snd_wnd_max, pcb->cwnd);
+  }
+  pcb->cwnd = tcp_cc_clamp(cwnd);
+}
+
+const struct tcp_cc_ops tcp_cc_hybla = {
+  "hybla", hybla_init, hybla_acked, reno_loss, hybla_rtt_sample, 0
+};
+
+/*---------------------------------------------------------------------------
+ * Rate based
+ *
+ * Every RTT sample is one round. The delivery rate of the round feeds a max
+ * filter over the last 5 to 10 rounds, which is taken as the bottleneck
+ * bandwidth. The minimum RTT is remembered for 10 seconds.
+ *
+ * STARTUP paces at 2.89 times the bandwidth until it stops growing by a
+ * quarter for three rounds, DRAIN then paces below it until the queue built
+ * in startup is gone, and PROBE_BW cycles the pacing gain through 1.25,
+ * 0.75 and six rounds of 1.
+ *---------------------------------------------------------------------------*/
+
+#define RATE_BW                0   /* Bottleneck bandwidth, bytes per second */
+#define RATE_BW_CUR            1   /* Max delivery rate in the current window of rounds */
+#define RATE_BW_PREV           2   /* ... and the one before */
+#define RATE_ROUNDS            3
+#define RATE_MIN_RTT           4   /* Milliseconds */
+#define RATE_MIN_RTT_STAMP     5   /* sys_now() when RATE_MIN_RTT was taken */
+#define RATE_FULL_BW           6   /* Bandwidth when startup last saw it grow */
+#define RATE_STATE             7   /* Mode, bits 0-7; gain cycle, 8-15; rounds without growth, 16-23 */
+
+#define RATE_STARTUP           0
+#define RATE_DRAIN             1
+#define RATE_PROBE_BW          2
+
+#define RATE_BW_ROUNDS         5
+#define RATE_MIN_RTT_MS        10000
+/* Gains are in 1/256 */
+#define RATE_HIGH_GAIN         739
+#define RATE_DRAIN_GAIN        89
+#define RATE_CWND_GAIN         512
+
+static const u16_t rate_cycle_gain[8] = { 320, 192, 256, 256, 256, 256, 256, 256 };
+
+#define RATE_MODE(pcb)         ((pcb)->cc_priv[RATE_STATE] & 0xff)
+#define RATE_CYCLE(pcb)        (((pcb)->cc_priv[RATE_STATE] >> 8) & 0xff)
+#define RATE_STALLED(pcb)      (((pcb)->cc_priv[RATE_STATE] >> 16) & 0xff)
+#define RATE_SET_STATE(pcb, mode, cycle, stalled) \
+  ((pcb)->cc_priv[RATE_STATE] = (mode) | ((u32_t)(cycle) << 8) | ((u32_t)(stalled) << 16))
+
+/* The bandwidth-delay product, 0 until both are known */
+static u64_t
+rate_bdp(struct tcp_pcb *pcb)
+{
+  return (u64_t)pcb->cc_priv[RATE_BW] * pcb->cc_priv[RATE_MIN_RTT] / 1000;
+}
+
+static tcpwnd_size_t
+rate_target_cwnd(struct tcp_pcb *pcb)
+{
+  u64_t bdp = rate_bdp(pcb);
+  u32_t gain = (RATE_MODE(pcb) == RATE_PROBE_BW) ? RATE_CWND_GAIN : RATE_HIGH_GAIN;
+
+  if (bdp == 0) {
+    return 0;
+  }
+  return tcp_cc_clamp(LWIP_MAX((bdp * gain) >> 8, 4U * pcb->mss));
+}
+
+static void
+rate_rtt_sample(struct tcp_pcb *pcb, u32_t rtt_ms)
+{
+  u32_t *priv = pcb->cc_priv;
+  u32_t now = sys_now();
+  u32_t gain;
+
+  if (priv[RATE_MIN_RTT] == 0 || rtt_ms <= priv[RATE_MIN_RTT] ||
+      now - priv[RATE_MIN_RTT_STAMP] > RATE_MIN_RTT_MS) {
+    priv[RATE_MIN_RTT] = rtt_ms;
+    priv[RATE_MIN_RTT_STAMP] = now;
+  }
+
+  if (++priv[RATE_ROUNDS] % RATE_BW_ROUNDS == 0) {
+    priv[RATE_BW_PREV] = priv[RATE_BW_CUR];
+    priv[RATE_BW_CUR] = 0;
+  }
+  priv[RATE_BW_CUR] = LWIP_MAX(priv[RATE_BW_CUR], pcb->delivery_rate);
+  priv[RATE_BW] = LWIP_MAX(priv[RATE_BW_CUR], priv[RATE_BW_PREV]);
+
+  switch (RATE_MODE(pcb)) {
+  case RATE_STARTUP:
+    if ((u64_t)priv[RATE_BW] * 4 >= (u64_t)priv[RATE_FULL_BW] * 5) {
+      priv[RATE_FULL_BW] = priv[RATE_BW];
+      RATE_SET_STATE(pcb, RATE_STARTUP, 0, 0);
+    } else if (RATE_STALLED(pcb) + 1 >= 3) {
+      RATE_SET_STATE(pcb, RATE_DRAIN, 0, 0);
+    } else {
+      RATE_SET_STATE(pcb, RATE_STARTUP, 0, RATE_STALLED(pcb) + 1);
+    }
+    break;
+  case RATE_DRAIN:
+    if ((u64_t)(pcb->snd_nxt - pcb->lastack) <= rate_bdp(pcb)) {
+      /* Start past the probing phases, the queue was only just drained */
+      RATE_SET_STATE(pcb, RATE_PROBE_BW, 2, 0);
+    }
+    break;
+  default:
+    RATE_SET_STATE(pcb, RATE_PROBE_BW, (RATE_CYCLE(pcb) + 1) & 7, 0);
+    break;
+  }
+
+  switch (RATE_MODE(pcb)) {
+  case RATE_STARTUP:
+    gain = RATE_HIGH_GAIN;
+    break;
+  case RATE_DRAIN:
+    gain = RATE_DRAIN_GAIN;
+    break;
+  default:
+    gain = rate_cycle_gain[RATE_CYCLE(pcb)];
+    break;
+  }
+  pcb->pacing_rate = (u32_t)LWIP_MIN(((u64_t)priv[RATE_BW] * gain) >> 8, 0x7fffffffU);
+}
+
+static void
+rate_acked(struct tcp_pcb *pcb, u32_t acked)
+{
+  tcpwnd_size_t target = rate_target_cwnd(pcb);
+
+  if (target == 0) {
+    /* Nothing measured yet, grow like slow start */
+    pcb->cwnd = tcp_cc_clamp((u64_t)pcb->cwnd + acked);
+  } else if (pcb->cwnd < target) {
+    pcb->cwnd = (tcpwnd_size_t)LWIP_MIN((u64_t)pcb->cwnd + acked, target);
+  } else {
+    pcb->cwnd = target;
+  }
+}
+
+static void
+rate_loss(struct tcp_pcb *pcb, u8_t timeout)
+{
+  tcpwnd_size_t target = rate_target_cwnd(pcb);
+
+  if (target == 0) {
+    /* Nothing measured yet */
+    reno_loss(pcb, timeout);
+    return;
+  }
+
+  /* Loss in startup means the pipe is full, no need to wait for the
+     bandwidth to stop growing */
+  if (RATE_MODE(pcb) == RATE_STARTUP) {
+    RATE_SET_STATE(pcb, RATE_DRAIN, 0, 0);
+  }
+
+  /* Fast recovery ends with cwnd = ssthresh, which is the target rather
+     than a fraction of cwnd. After a time-out start again from one segment,
+     rate_acked() brings it back to the target within a few round trips. */
+  pcb->ssthresh = LWIP_MIN(pcb->cwnd, target);
+  if (timeout) {
+    pcb->cwnd = pcb->mss;
+  }
+}
+
+const struct tcp_cc_ops tcp_cc_rate = {
+  "rate", NULL, rate_acked, rate_loss, rate_rtt_sample, 1
+};
+
+/*---------------------------------------------------------------------------*/
+
+static const struct tcp_cc_ops * const tcp_cc_all[] = {
+  &tcp_cc_reno, &tcp_cc_hybla, &tcp_cc_rate
+};
+
+/**
+ * Looks up a congestion control algorithm by name.
+ *
+ * @param name "reno", "hybla" or "rate"
+ * @return the algorithm, or NULL if there is none of that name
+ */
+const struct tcp_cc_ops *
+tcp_cc_find(const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(tcp_cc_all) / sizeof(tcp_cc_all[0]); i++) {
+    if (strcmp(tcp_cc_all[i]->name, name) == 0) {
+      return tcp_cc_all[i];
+    }
+  }
+  return NULL;
+}
+
+#endif /* LWIP_TCP && LWIP_TCP_CC */
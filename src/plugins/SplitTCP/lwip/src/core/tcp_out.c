@@ -54,7 +54,7 @@
 #include "lwip/ip6.h"
 #include "lwip/ip6_addr.h"
 #include "lwip/inet_chksum.h"
-#if LWIP_TCP_TIMESTAMPS
+#if LWIP_TCP_TIMESTAMPS || LWIP_TCP_CC
 #include "lwip/sys.h"
 #endif
 
@@ -108,7 +108,7 @@ tcp_output_alloc_header(struct tcp_pcb *pcb, u16_t optlen, u16_t datalen,
     tcphdr->seqno = seqno_be;
     tcphdr->ackno = htonl(pcb->rcv_nxt);
     TCPH_HDRLEN_FLAGS_SET(tcphdr, (5 + optlen / 4), TCP_ACK);
-    tcphdr->wnd = htons(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd));
+    tcphdr->wnd = htons(TCPWND_MIN16(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd)));
     tcphdr->chksum = 0;
     tcphdr->urgp = 0;
 
@@ -321,9 +321,9 @@ tcp_write_checks(struct tcp_pcb *pcb, u16_t len)
   /* If total number of pbufs on the unsent/unacked queues exceeds the
    * configured maximum, return an error */
   /* check for configured max queuelen and possible overflow */
-  if ((pcb->snd_queuelen >= TCP_SND_QUEUELEN) || (pcb->snd_queuelen > TCP_SNDQUEUELEN_OVERFLOW)) {
+  if ((pcb->snd_queuelen >= TCP_SND_QUEUELEN_CFG) || (pcb->snd_queuelen > TCP_SNDQUEUELEN_OVERFLOW)) {
     LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 3, ("tcp_write: too long queue %"TCPWNDSIZE_F" (max %"TCPWNDSIZE_F")\n",
-      pcb->snd_queuelen, TCP_SND_QUEUELEN));
+      pcb->snd_queuelen, TCP_SND_QUEUELEN_CFG));
     TCP_STATS_INC(tcp.memerr);
     pcb->flags |= TF_NAGLEMEMERR;
     return ERR_MEM;
@@ -588,8 +588,8 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
     /* Now that there are more segments queued, we check again if the
      * length of the queue exceeds the configured maximum or
      * overflows. */
-    if ((queuelen > TCP_SND_QUEUELEN) || (queuelen > TCP_SNDQUEUELEN_OVERFLOW)) {
-      LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 2, ("tcp_write: queue too long %"TCPWNDSIZE_F" (%"TCPWNDSIZE_F")\n", queuelen, TCP_SND_QUEUELEN));
+    if ((queuelen > TCP_SND_QUEUELEN_CFG) || (queuelen > TCP_SNDQUEUELEN_OVERFLOW)) {
+      LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 2, ("tcp_write: queue too long %"TCPWNDSIZE_F" (%"TCPWNDSIZE_F")\n", queuelen, TCP_SND_QUEUELEN_CFG));
       pbuf_free(p);
       goto memerr;
     }
@@ -748,9 +748,9 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
               (flags & (TCP_SYN | TCP_FIN)) != 0);
 
   /* check for configured max queuelen and possible overflow */
-  if ((pcb->snd_queuelen >= TCP_SND_QUEUELEN) || (pcb->snd_queuelen > TCP_SNDQUEUELEN_OVERFLOW)) {
+  if ((pcb->snd_queuelen >= TCP_SND_QUEUELEN_CFG) || (pcb->snd_queuelen > TCP_SNDQUEUELEN_OVERFLOW)) {
     LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 3, ("tcp_enqueue_flags: too long queue %"U16_F" (max %"U16_F")\n",
-                                       pcb->snd_queuelen, TCP_SND_QUEUELEN));
+                                       pcb->snd_queuelen, TCP_SND_QUEUELEN_CFG));
     TCP_STATS_INC(tcp.memerr);
     pcb->flags |= TF_NAGLEMEMERR;
     return ERR_MEM;
@@ -765,6 +765,12 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
       optflags |= TF_SEG_OPTS_WND_SCALE;
     }
 #endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_SACK
+    /* Likewise SACK is only offered in a <SYN,ACK> if the remote host offered it */
+    if (pcb->state != SYN_RCVD ? tcp_cfg_sack : (pcb->flags & TF_SACK)) {
+      optflags |= TF_SEG_OPTS_SACK_PERM;
+    }
+#endif /* LWIP_TCP_SACK */
   }
 #if LWIP_TCP_TIMESTAMPS
   if ((pcb->flags & TF_TIMESTAMP)) {
@@ -872,6 +878,93 @@ tcp_build_wnd_scale_option(u32_t *opts)
 }
 #endif
 
+#if LWIP_TCP_SACK
+/** Finds the block of contiguous out of sequence data that starts at seg
+ *
+ * @param seg first segment of the block on pcb->ooseq
+ * @param left, right filled with the edges of the block
+ * @return the segment after the block
+ */
+static struct tcp_seg *
+tcp_sack_block(struct tcp_seg *seg, u32_t *left, u32_t *right)
+{
+  *left = seg->tcphdr->seqno;
+  *right = *left + TCP_TCPLEN(seg);
+  for (seg = seg->next; seg != NULL && TCP_SEQ_LEQ(seg->tcphdr->seqno, *right); seg = seg->next) {
+    if (TCP_SEQ_GT(seg->tcphdr->seqno + TCP_TCPLEN(seg), *right)) {
+      *right = seg->tcphdr->seqno + TCP_TCPLEN(seg);
+    }
+  }
+  return seg;
+}
+
+/** Collects up to max SACK blocks (RFC 2018) from the ooseq queue. The
+ * block holding the most recently received segment goes first, the rest
+ * follow in sequence order.
+ *
+ * @param pcb the tcp_pcb to report the out of sequence data of
+ * @param blocks filled with left/right edge pairs in host byte order
+ * @param max the most blocks there is option space for
+ * @return the number of blocks
+ */
+static u8_t
+tcp_sack_blocks(struct tcp_pcb *pcb, u32_t *blocks, u8_t max)
+{
+  struct tcp_seg *seg;
+  u32_t left, right;
+  u8_t n = 0;
+
+  for (seg = pcb->ooseq; seg != NULL; ) {
+    seg = tcp_sack_block(seg, &left, &right);
+    if (TCP_SEQ_BETWEEN(pcb->sack_recent, left, right - 1)) {
+      blocks[0] = left;
+      blocks[1] = right;
+      n = 1;
+      break;
+    }
+  }
+
+  for (seg = pcb->ooseq; seg != NULL && n < max; ) {
+    seg = tcp_sack_block(seg, &left, &right);
+    if (n == 0 || left != blocks[0]) {
+      blocks[2 * n] = left;
+      blocks[2 * n + 1] = right;
+      n++;
+    }
+  }
+  return n;
+}
+
+/** Build a SACK permitted option (2 bytes long) at the specified options pointer
+ *
+ * @param opts option pointer where to store the SACK permitted option
+ */
+static void
+tcp_build_sack_perm_option(u32_t *opts)
+{
+  /* Pad with two NOP options to make everything nicely aligned */
+  opts[0] = PP_HTONL(0x01010402);
+}
+
+/** Build a SACK option at the specified options pointer
+ *
+ * @param opts option pointer where to store the SACK option
+ * @param blocks left/right edge pairs in host byte order
+ * @param n number of blocks
+ */
+static void
+tcp_build_sack_option(u32_t *opts, u32_t *blocks, u8_t n)
+{
+  u8_t i;
+
+  /* Pad with two NOP options to make everything nicely aligned */
+  opts[0] = htonl(0x01010500 | (2 + 8 * n));
+  for (i = 0; i < 2 * n; i++) {
+    opts[i + 1] = htonl(blocks[i]);
+  }
+}
+#endif /* LWIP_TCP_SACK */
+
 /** Send an ACK without data.
  *
  * @param pcb Protocol control block for the TCP connection to send the ACK
@@ -881,24 +974,35 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
 {
   struct pbuf *p;
   u8_t optlen = 0;
-#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP
+#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP || LWIP_TCP_SACK
   struct tcp_hdr *tcphdr;
-#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP */
+#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP || LWIP_TCP_SACK */
+#if LWIP_TCP_SACK
+  u32_t sack_blocks[2 * LWIP_TCP_SACK_BLOCKS];
+  u8_t sack_n = 0;
+#endif /* LWIP_TCP_SACK */
 
 #if LWIP_TCP_TIMESTAMPS
   if (pcb->flags & TF_TIMESTAMP) {
     optlen = LWIP_TCP_OPT_LENGTH(TF_SEG_OPTS_TS);
   }
 #endif
+#if LWIP_TCP_SACK
+  if ((pcb->flags & TF_SACK) && pcb->ooseq != NULL) {
+    sack_n = tcp_sack_blocks(pcb, sack_blocks,
+      (pcb->flags & TF_TIMESTAMP) ? LWIP_TCP_SACK_BLOCKS - 1 : LWIP_TCP_SACK_BLOCKS);
+    optlen += LWIP_TCP_OPT_LEN_SACK(sack_n);
+  }
+#endif /* LWIP_TCP_SACK */
 
   p = tcp_output_alloc_header(pcb, optlen, 0, htonl(pcb->snd_nxt));
   if (p == NULL) {
     LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_output: (ACK) could not allocate pbuf\n"));
     return ERR_BUF;
   }
-#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP
+#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP || LWIP_TCP_SACK
   tcphdr = (struct tcp_hdr *)p->payload;
-#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP */
+#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP || LWIP_TCP_SACK */
   LWIP_DEBUGF(TCP_OUTPUT_DEBUG, 
               ("tcp_output: sending ACK for %"U32_F"\n", pcb->rcv_nxt));
   /* remove ACK flags from the PCB, as we send an empty ACK now */
@@ -912,6 +1016,12 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
     tcp_build_timestamp_option(pcb, (u32_t *)(tcphdr + 1));
   }
 #endif 
+#if LWIP_TCP_SACK
+  if (sack_n > 0) {
+    tcp_build_sack_option((u32_t *)((u8_t *)(tcphdr + 1) + optlen - LWIP_TCP_OPT_LEN_SACK(sack_n)),
+      sack_blocks, sack_n);
+  }
+#endif /* LWIP_TCP_SACK */
 
 #if CHECKSUM_GEN_TCP
   tcphdr->chksum = ipX_chksum_pseudo(PCB_ISIPV6(pcb), p, IP_PROTO_TCP, p->tot_len,
@@ -929,6 +1039,32 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
   return ERR_OK;
 }
 
+#if LWIP_TCP_CC
+/**
+ * Adds the pacing credit earned at pacing_rate since the last refill. The
+ * credit is capped at TCP_PACE_INTERVAL worth of the rate, and at least two
+ * segments, so an idle connection does not save up a burst.
+ *
+ * @param pcb the paced tcp_pcb about to send
+ */
+static void
+tcp_pace_refill(struct tcp_pcb *pcb)
+{
+  u32_t now = sys_now();
+  u32_t elapsed = now - pcb->pace_stamp;
+  s32_t burst = (s32_t)LWIP_MAX((u32_t)pcb->mss * 2,
+    (u32_t)((u64_t)pcb->pacing_rate * TCP_PACE_INTERVAL / 1000));
+  s32_t credit;
+
+  pcb->pace_stamp = now;
+  if (elapsed > 1000) {
+    elapsed = 1000;
+  }
+  credit = pcb->pace_credit + (s32_t)((u64_t)pcb->pacing_rate * elapsed / 1000);
+  pcb->pace_credit = LWIP_MIN(credit, burst);
+}
+#endif /* LWIP_TCP_CC */
+
 /**
  * Find out what we can send and send it
  *
@@ -959,8 +1095,23 @@ tcp_output(struct tcp_pcb *pcb)
 
   wnd = LWIP_MIN(pcb->snd_wnd, pcb->cwnd);
 
+#if LWIP_TCP_CC
+  if (pcb->pacing_rate != 0) {
+    tcp_pace_refill(pcb);
+  }
+#endif /* LWIP_TCP_CC */
+
   seg = pcb->unsent;
 
+#if LWIP_TCP_SACK
+  /* Only empty ACKs carry SACK blocks. While there is out of sequence data
+   * the ACK is sent on its own so the sender learns about the holes. */
+  if ((pcb->flags & (TF_ACK_NOW | TF_SACK)) == (TF_ACK_NOW | TF_SACK) &&
+      pcb->ooseq != NULL && seg != NULL) {
+    tcp_send_empty_ack(pcb);
+  }
+#endif /* LWIP_TCP_SACK */
+
   /* If the TF_ACK_NOW flag is set and no data will be sent (either
    * because the ->unsent queue is empty or because the window does
    * not allow it), construct an empty ACK segment and send it.
@@ -1016,6 +1167,17 @@ tcp_output(struct tcp_pcb *pcb)
       ((pcb->flags & (TF_NAGLEMEMERR | TF_FIN)) == 0)){
       break;
     }
+#if LWIP_TCP_CC
+    /* Out of pacing credit: tcp_pace_tmr() sends the rest. An ACK owed
+       now cannot wait for it. */
+    if (pcb->pacing_rate != 0 && pcb->pace_credit <= 0) {
+      tcp_pacing_pending = 1;
+      if (pcb->flags & TF_ACK_NOW) {
+        tcp_send_empty_ack(pcb);
+      }
+      break;
+    }
+#endif /* LWIP_TCP_CC */
 #if TCP_CWND_DEBUG
     LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"TCPWNDSIZE_F", cwnd %"TCPWNDSIZE_F", wnd %"U32_F", effwnd %"U32_F", seq %"U32_F", ack %"U32_F", i %"S16_F"\n",
                             pcb->snd_wnd, pcb->cwnd, wnd,
@@ -1036,6 +1198,9 @@ tcp_output(struct tcp_pcb *pcb)
     seg->oversize_left = 0;
 #endif /* TCP_OVERSIZE_DBGCHECK */
     tcp_output_segment(seg, pcb);
+#if LWIP_TCP_CC
+    pcb->pace_credit -= seg->len;
+#endif /* LWIP_TCP_CC */
     snd_nxt = ntohl(seg->tcphdr->seqno) + TCP_TCPLEN(seg);
     if (TCP_SEQ_LT(pcb->snd_nxt, snd_nxt)) {
       pcb->snd_nxt = snd_nxt;
@@ -1108,11 +1273,13 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   if (seg->flags & TF_SEG_OPTS_WND_SCALE) {
     /* The Window field in a SYN segment itself (the only type where we send
        the window scale option) is never scaled. */
-    seg->tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+    seg->tcphdr->wnd = htons(TCPWND_MIN16(pcb->rcv_ann_wnd));
   } else
 #endif /* LWIP_WND_SCALE */
   {
-    seg->tcphdr->wnd = htons(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd));
+    /* Without a scale agreed on with the other end, a window above 64K is
+       announced as 64K */
+    seg->tcphdr->wnd = htons(TCPWND_MIN16(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd)));
   }
 
   pcb->rcv_ann_right_edge = pcb->rcv_nxt + pcb->rcv_ann_wnd;
@@ -1144,6 +1311,12 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
     opts += 1;
   }
 #endif
+#if LWIP_TCP_SACK
+  if (seg->flags & TF_SEG_OPTS_SACK_PERM) {
+    tcp_build_sack_perm_option(opts);
+    opts += 1;
+  }
+#endif
   
   /* Set retransmission timer running if it is not currently enabled 
      This must be set before checking the route. */
@@ -1169,6 +1342,17 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
 
     LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_output_segment: rtseq %"U32_F"\n", pcb->rtseq));
   }
+#if LWIP_TCP_CC
+  /* The congestion control samples every round trip on its own, the timing
+     above stops whenever anything is retransmitted. Only new data is timed,
+     an ACK for a retransmission could be for either copy. */
+  if (!pcb->rtt_timing && TCP_SEQ_GEQ(ntohl(seg->tcphdr->seqno), pcb->snd_nxt)) {
+    pcb->rtt_timing = 1;
+    pcb->rtt_seq = ntohl(seg->tcphdr->seqno);
+    pcb->rtt_start_ms = sys_now();
+    pcb->rtt_delivered = pcb->delivered;
+  }
+#endif /* LWIP_TCP_CC */
   LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_output_segment: %"U32_F":%"U32_F"\n",
           htonl(seg->tcphdr->seqno), htonl(seg->tcphdr->seqno) +
           seg->len));
@@ -1275,9 +1459,9 @@ tcp_rst_impl(u32_t seqno, u32_t ackno,
   tcphdr->ackno = htonl(ackno);
   TCPH_HDRLEN_FLAGS_SET(tcphdr, TCP_HLEN/4, TCP_RST | TCP_ACK);
 #if LWIP_WND_SCALE
-  tcphdr->wnd = PP_HTONS(((TCP_WND >> TCP_RCV_SCALE) & 0xFFFF));
+  tcphdr->wnd = PP_HTONS(((TCP_WND_CFG >> TCP_RCV_SCALE) & 0xFFFF));
 #else
-  tcphdr->wnd = PP_HTONS(TCP_WND);
+  tcphdr->wnd = PP_HTONS(TCP_WND_CFG);
 #endif
   tcphdr->chksum = 0;
   tcphdr->urgp = 0;
@@ -1311,6 +1495,46 @@ tcp_rexmit_rto(struct tcp_pcb *pcb)
     return;
   }
 
+#if LWIP_TCP_CC
+  /* Everything goes out again, whatever is timed now would be too long */
+  pcb->rtt_timing = 0;
+#endif /* LWIP_TCP_CC */
+
+#if LWIP_TCP_SACK
+  if (pcb->flags & TF_SACK) {
+    /* A timeout ends loss recovery */
+    pcb->flags &= ~TF_INFR;
+
+    /* The first timeout since the last new ACK (nrtx also counts the fast
+       retransmit) only resends what the peer has not SACKed. SACKed data
+       stays on unacked, tcp_output() puts the rest back in order. */
+    if (pcb->nrtx < 2) {
+      struct tcp_seg *next, **prev = &pcb->unacked;
+      for (seg = pcb->unacked; seg != NULL; seg = next) {
+        next = seg->next;
+        if (seg->flags & TF_SEG_SACKED) {
+          prev = &seg->next;
+        } else {
+          *prev = next;
+          tcp_rexmit_seg(pcb, seg);
+        }
+      }
+      ++pcb->nrtx;
+      tcp_output(pcb);
+      return;
+    }
+  }
+
+  /* Should the peer have dropped data it SACKed, only sending everything
+     again gets the connection going, so the scoreboard starts over
+     (RFC 6675, section 5.1) */
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    seg->flags &= ~(TF_SEG_SACKED | TF_SEG_SACK_REXMIT);
+    tcp_sack_stats.rexmit_bytes += seg->len;
+    pcb->rexmit_bytes += seg->len;
+  }
+#endif /* LWIP_TCP_SACK */
+
   /* Move all unacked segments to the head of the unsent queue */
   for (seg = pcb->unacked; seg->next != NULL; seg = seg->next);
   /* concatenate unsent queue after unacked queue */
@@ -1347,17 +1571,37 @@ void
 tcp_rexmit(struct tcp_pcb *pcb)
 {
   struct tcp_seg *seg;
-  struct tcp_seg **cur_seg;
 
   if (pcb->unacked == NULL) {
     return;
   }
 
   /* Move the first unacked segment to the unsent queue */
-  /* Keep the unsent queue sorted. */
   seg = pcb->unacked;
   pcb->unacked = seg->next;
+  tcp_rexmit_seg(pcb, seg);
+
+  ++pcb->nrtx;
+}
 
+/**
+ * Requeue a segment taken off the unacked queue for retransmission
+ *
+ * @param pcb the tcp_pcb the segment belongs to
+ * @param seg the segment, already unlinked from pcb->unacked
+ */
+void
+tcp_rexmit_seg(struct tcp_pcb *pcb, struct tcp_seg *seg)
+{
+  struct tcp_seg **cur_seg;
+
+#if LWIP_TCP_SACK
+  seg->flags |= TF_SEG_SACK_REXMIT;
+  tcp_sack_stats.rexmit_bytes += seg->len;
+  pcb->rexmit_bytes += seg->len;
+#endif /* LWIP_TCP_SACK */
+
+  /* Keep the unsent queue sorted. */
   cur_seg = &(pcb->unsent);
   while (*cur_seg &&
     TCP_SEQ_LT(ntohl((*cur_seg)->tcphdr->seqno), ntohl(seg->tcphdr->seqno))) {
@@ -1372,8 +1616,6 @@ tcp_rexmit(struct tcp_pcb *pcb)
   }
 #endif /* TCP_OVERSIZE */
 
-  ++pcb->nrtx;
-
   /* Don't take any rtt measurements after retransmitting. */
   pcb->rttest = 0;
 
@@ -1399,30 +1641,105 @@ tcp_rexmit_fast(struct tcp_pcb *pcb)
                  "), fast retransmit %"U32_F"\n",
                  (u16_t)pcb->dupacks, pcb->lastack,
                  ntohl(pcb->unacked->tcphdr->seqno)));
+#if LWIP_TCP_SACK
+    if (pcb->flags & TF_SACK) {
+      struct tcp_seg *seg;
+
+      /* Recovery lasts until everything sent so far is acked, any segment
+         may be retransmitted once more within it */
+      pcb->recover = pcb->snd_nxt;
+      for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+        seg->flags &= ~TF_SEG_SACK_REXMIT;
+      }
+      tcp_sack_stats.recoveries++;
+    }
+#endif /* LWIP_TCP_SACK */
     tcp_rexmit(pcb);
 
-    /* Set ssthresh to half of the minimum of the current
-     * cwnd and the advertised window */
-    if (pcb->cwnd > pcb->snd_wnd) {
-      pcb->ssthresh = pcb->snd_wnd / 2;
-    } else {
-      pcb->ssthresh = pcb->cwnd / 2;
-    }
-    
-    /* The minimum value for ssthresh should be 2 MSS */
-    if (pcb->ssthresh < (2U * pcb->mss)) {
-      LWIP_DEBUGF(TCP_FR_DEBUG, 
-                  ("tcp_receive: The minimum value for ssthresh %"U16_F
-                   " should be min 2 mss %"U16_F"...\n",
-                   pcb->ssthresh, 2*pcb->mss));
-      pcb->ssthresh = 2*pcb->mss;
+#if LWIP_TCP_CC
+    if (pcb->cc != NULL) {
+      pcb->cc->loss(pcb, 0);
+    } else
+#endif /* LWIP_TCP_CC */
+    {
+      /* Set ssthresh to half of the minimum of the current
+       * cwnd and the advertised window */
+      if (pcb->cwnd > pcb->snd_wnd) {
+        pcb->ssthresh = pcb->snd_wnd / 2;
+      } else {
+        pcb->ssthresh = pcb->cwnd / 2;
+      }
+
+      /* The minimum value for ssthresh should be 2 MSS */
+      if (pcb->ssthresh < (2U * pcb->mss)) {
+        LWIP_DEBUGF(TCP_FR_DEBUG,
+                    ("tcp_receive: The minimum value for ssthresh %"U16_F
+                     " should be min 2 mss %"U16_F"...\n",
+                     pcb->ssthresh, 2*pcb->mss));
+        pcb->ssthresh = 2*pcb->mss;
+      }
     }
-    
+
     pcb->cwnd = pcb->ssthresh + 3 * pcb->mss;
     pcb->flags |= TF_INFR;
   } 
 }
 
+#if LWIP_TCP_SACK
+/**
+ * SACK based loss recovery (RFC 6675), called by tcp_receive() for every
+ * ACK on a connection that agreed to use SACK.
+ *
+ * A segment is taken as lost once more than (DupThresh - 1) * SMSS bytes
+ * above it have been SACKed. Outside of recovery a lost first segment starts
+ * fast retransmit without waiting for three duplicate ACKs. In recovery the
+ * lowest lost segment not yet sent again is retransmitted, one per ACK, so
+ * every segment leaving the network makes room for one hole to be filled.
+ *
+ * @param pcb the tcp_pcb that received an ACK
+ */
+void
+tcp_rexmit_sack(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg, *prev;
+  u32_t sacked = 0;
+  u32_t lost = 2U * pcb->mss;
+
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    if (seg->flags & TF_SEG_SACKED) {
+      sacked += seg->len;
+    }
+  }
+  if (sacked <= lost) {
+    return;
+  }
+
+  if (!(pcb->flags & TF_INFR)) {
+    if (!(pcb->unacked->flags & (TF_SEG_SACKED | TF_SEG_SACK_REXMIT))) {
+      tcp_rexmit_fast(pcb);
+    }
+    return;
+  }
+
+  for (prev = NULL, seg = pcb->unacked; seg != NULL && sacked > lost; prev = seg, seg = seg->next) {
+    if (seg->flags & TF_SEG_SACKED) {
+      sacked -= seg->len;
+    } else if (!(seg->flags & TF_SEG_SACK_REXMIT)) {
+      LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_rexmit_sack: hole at %"U32_F", %"U32_F" bytes SACKed above\n",
+                                 ntohl(seg->tcphdr->seqno), sacked));
+      if (prev != NULL) {
+        prev->next = seg->next;
+      } else {
+        pcb->unacked = seg->next;
+      }
+      tcp_rexmit_seg(pcb, seg);
+      tcp_sack_stats.sack_rexmit_bytes += seg->len;
+      return;
+    }
+  }
+}
+#endif /* LWIP_TCP_SACK */
+
 
 /**
  * Send keepalive packets to keep a connection active although
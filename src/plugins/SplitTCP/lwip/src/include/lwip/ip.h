@@ -132,7 +132,7 @@ struct ip_globals
   /** Destination IP address of current_header */
   ipX_addr_t current_iphdr_dest;
 };
-extern struct ip_globals ip_data;
+extern LWIP_PER_THREAD struct ip_globals ip_data;
 
 
 /** Get the interface that received the current packet.
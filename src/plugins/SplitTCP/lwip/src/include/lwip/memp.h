@@ -107,6 +107,23 @@ void *memp_malloc(memp_t type);
 #endif
 void  memp_free(memp_t type, void *mem);
 
+#if MEMP_ARENA
+/** How full a pool is */
+struct memp_usage {
+  const char *name; /* The pool's name in memp_std.h, e.g. "TCP_PCB" */
+  u32_t size;       /* Bytes taken by each element */
+  u32_t num;        /* Elements in the pool, 0 if the arena could not be allocated */
+  u32_t used;
+  u32_t max;        /* Most elements ever used at once */
+  u32_t err;        /* Allocations that failed because the pool was empty */
+};
+
+void   memp_set_num(memp_t type, u32_t num);
+memp_t memp_find(const char *name);
+void   memp_get_usage(memp_t type, struct memp_usage *usage);
+void   memp_release(void);
+#endif /* MEMP_ARENA */
+
 #endif /* MEMP_MEM_MALLOC */
 
 #ifdef __cplusplus
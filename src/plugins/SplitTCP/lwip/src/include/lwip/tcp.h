@@ -129,11 +129,15 @@ typedef err_t (*tcp_connected_fn)(void *arg, struct tcp_pcb *tpcb, err_t err);
 #define RCV_WND_SCALE(pcb, wnd) (((wnd) >> (pcb)->rcv_scale))
 #define SND_WND_SCALE(pcb, wnd) (((wnd) << (pcb)->snd_scale))
 typedef u32_t tcpwnd_size_t;
-typedef u16_t tcpflags_t;
 #else
 #define RCV_WND_SCALE(pcb, wnd) (wnd)
 #define SND_WND_SCALE(pcb, wnd) (wnd)
 typedef u16_t tcpwnd_size_t;
+#endif
+
+#if LWIP_WND_SCALE || LWIP_TCP_SACK
+typedef u16_t tcpflags_t;
+#else
 typedef u8_t tcpflags_t;
 #endif
 
@@ -199,6 +203,9 @@ struct tcp_pcb {
 #define TF_NAGLEMEMERR ((tcpflags_t)0x0080U)   /* nagle enabled, memerr, try to output to prevent delayed ACK to happen */
 #if LWIP_WND_SCALE
 #define TF_WND_SCALE   ((tcpflags_t)0x0100U)   /* Window Scale option enabled */
+#endif
+#if LWIP_TCP_SACK
+#define TF_SACK        ((tcpflags_t)0x0200U)   /* SACK permitted by both ends */
 #endif
 
   /* the rest of the fields are in host byte order
@@ -301,6 +308,28 @@ struct tcp_pcb {
   u8_t snd_scale;
   u8_t rcv_scale;
 #endif
+
+#if LWIP_TCP_SACK
+  u32_t recover;     /* snd_nxt when loss recovery started, recovery ends once it is acked */
+  u32_t sack_recent; /* seqno of the latest segment queued on ooseq, its block is reported first */
+  u32_t rexmit_bytes; /* Retransmitted on this connection, counted with tcp_sack_stats */
+#endif
+
+#if LWIP_TCP_CC
+  const struct tcp_cc_ops *cc; /* NULL for the built in Reno */
+  u32_t cc_priv[8];            /* Private to the algorithm */
+  u32_t srtt_ms;               /* Smoothed RTT, 0 until the first sample */
+  u32_t min_rtt_ms;            /* Lowest RTT seen */
+  u32_t rtt_seq;               /* The segment timed for the next RTT sample */
+  u32_t rtt_start_ms;          /* sys_now() when rtt_seq was sent */
+  u32_t rtt_delivered;         /* delivered when rtt_seq was sent */
+  u8_t rtt_timing;             /* rtt_seq is valid */
+  u32_t delivered;             /* Bytes acked so far */
+  u32_t delivery_rate;         /* Bytes per second acked over the last RTT sample */
+  u32_t pacing_rate;           /* Bytes per second, 0 sends as fast as the windows allow */
+  u32_t pace_stamp;            /* sys_now() at the last pacing credit refill */
+  s32_t pace_credit;           /* Bytes that may be sent before the next refill */
+#endif
 };
 
 struct tcp_pcb_listen {
@@ -364,6 +393,55 @@ void             tcp_err     (struct tcp_pcb *pcb, tcp_err_fn err);
 #endif /* TCP_LISTEN_BACKLOG */
 
 void             tcp_recved  (struct tcp_pcb *pcb, u16_t len);
+#if LWIP_TCP_RUNTIME_WND
+err_t            tcp_set_window(u32_t wnd, u32_t snd_buf);
+#endif /* LWIP_TCP_RUNTIME_WND */
+#if LWIP_TCP_SACK
+void             tcp_set_sack(u8_t enable);
+
+/** Totals for every connection this stack has run, kept to weigh what SACK
+    saves: bytes the peers SACKed were not sent again by loss recovery. */
+struct tcp_sack_stats {
+  u64_t rexmit_bytes;      /* Retransmitted for any reason */
+  u64_t sack_rexmit_bytes; /* The part of rexmit_bytes that filled holes found with SACK */
+  u64_t sacked_bytes;      /* Newly SACKed by the peers */
+  u32_t recoveries;        /* Fast recoveries entered with SACK */
+};
+extern LWIP_PER_THREAD struct tcp_sack_stats tcp_sack_stats;
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_CC
+/** A congestion control algorithm. Every hook is called with the pcb it
+    runs for and only changes that pcb's cwnd, ssthresh, pacing_rate and
+    cc_priv. */
+struct tcp_cc_ops {
+  const char *name;
+  /* Attached to a connection, cc_priv is zeroed */
+  void (*init)(struct tcp_pcb *pcb);
+  /* New data was acked and the connection is not in fast recovery */
+  void (*acked)(struct tcp_pcb *pcb, u32_t acked);
+  /* Loss was detected, by duplicate ACKs or by a retransmission time-out.
+     Sets ssthresh, and cwnd on a time-out. */
+  void (*loss)(struct tcp_pcb *pcb, u8_t timeout);
+  /* One RTT sample, in milliseconds, taken once per round trip. srtt_ms,
+     min_rtt_ms and delivery_rate are already updated. May be NULL. */
+  void (*rtt_sample)(struct tcp_pcb *pcb, u32_t rtt_ms);
+  /* Sets pacing_rate, so the port has to call tcp_pace_tmr() */
+  u8_t pacing;
+};
+
+extern const struct tcp_cc_ops tcp_cc_reno;
+extern const struct tcp_cc_ops tcp_cc_hybla;
+extern const struct tcp_cc_ops tcp_cc_rate;
+
+const struct tcp_cc_ops * tcp_cc_find(const char *name);
+void             tcp_set_cc  (struct tcp_pcb *pcb, const struct tcp_cc_ops *cc);
+/** Set when a paced connection held back data, tcp_pace_tmr() sends it */
+extern LWIP_PER_THREAD u8_t tcp_pacing_pending;
+void             tcp_pace_tmr(void);
+#endif /* LWIP_TCP_CC */
+#if LWIP_TCP_TRANSPARENT
+void             tcp_listen_transparent(struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_TRANSPARENT */
 err_t            tcp_bind    (struct tcp_pcb *pcb, ip_addr_t *ipaddr,
                               u16_t port);
 err_t            tcp_connect (struct tcp_pcb *pcb, ip_addr_t *ipaddr,
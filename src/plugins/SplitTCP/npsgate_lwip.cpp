@@ -20,6 +20,7 @@
 #include <pcap.h>
 #include <crafter.h>
 #include <unistd.h> 
+#include <algorithm>
 #include "../npsgate_plugin.hpp"
 #include "../logger.hpp"
 #include "split_tcp.h"
@@ -39,9 +40,46 @@
 #include "lwip/stats.h"
 #include "lwip/opt.h"
 
-struct ListenSocket {
-	tcp_pcb* lpcb;
-	Packet* p;
+/* Index of lwIP's active pcbs, keyed the way tcp_input() sees a segment with the
+   remote end as the source. Replaces lwIP's walk of tcp_active_pcbs. Points at
+   the table of the stack owned by the calling thread. */
+static __thread FlowTable<tcp_pcb*>* active_pcbs;
+
+/* The stack owned by the calling thread, for accept_connection(). The pcbs of
+   half open connections carry no arg, so the stats never mistake them for an
+   endpoint. */
+static __thread NpsGateLWIP* thread_stack;
+
+/* Largest piece of a request or cached response written as one pbuf */
+#define HTTP_PBUF_MAX	32768
+
+static inline uint64_t http_now_us() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline FlowKey pcb_key(const tcp_pcb* pcb) {
+	return FlowKey(ntohl(pcb->remote_ip.addr), ntohl(pcb->local_ip.addr), pcb->remote_port, pcb->local_port);
+}
+
+extern "C" {
+	void lwip_hook_tcp_pcb_active(struct tcp_pcb* pcb) {
+		active_pcbs->insert(pcb_key(pcb), pcb, 0);
+	}
+
+	void lwip_hook_tcp_pcb_inactive(struct tcp_pcb* pcb) {
+		FlowKey key = pcb_key(pcb);
+		tcp_pcb** p = active_pcbs->find(key);
+		if(p && *p == pcb) {
+			active_pcbs->erase(key);
+		}
+	}
+
+	struct tcp_pcb* lwip_hook_tcp_pcb_lookup(u32_t src, u32_t dest, u16_t sport, u16_t dport) {
+		tcp_pcb** p = active_pcbs->find(FlowKey(ntohl(src), ntohl(dest), sport, dport));
+		return p ? *p : NULL;
+	}
 };
 
 extern "C" {
@@ -79,9 +117,21 @@ extern "C" {
 
 };
 
-NpsGateLWIP::NpsGateLWIP(SplitTCP* s, uint16_t m) {
+NpsGateLWIP::NpsGateLWIP(SplitTCP* s, uint16_t m, unsigned int sh, unsigned int n) {
 	stcp = s;
 	mtu = m;
+	shard = sh;
+	shards = n;
+	idle_timeout = 3600;
+	syn_timeout = 30;
+	close_timeout = 120;
+	max_connections = 50000;
+	max_half_open = 4096;
+	syn_dropped = 0;
+	reaped = 0;
+	congestion = NULL;
+	http_cache = NULL;
+	http_ports = NULL;
 	xmit_buffer = (uint8_t*)malloc(m);
 
 	/* Each interfaces needs an IP address associated to it, for NpsGate usage, we
@@ -90,14 +140,22 @@ NpsGateLWIP::NpsGateLWIP(SplitTCP* s, uint16_t m) {
 	IP4_ADDR(&ipaddr, 192, 0, 0, 1);
 	IP4_ADDR(&netmask, 255, 0, 0, 0);
 
-	LOG_DEBUG("Initializing NpsGateLWIP plugin.\n");
+	LOG_DEBUG("Initializing NpsGateLWIP stack %u of %u.\n", shard + 1, shards);
 
+	active_pcbs = &pcb_table;
+	thread_stack = this;
 	lwip_init();
 
 	/* Add two LWIP network interfaces, one for input, one for output */
 	netif_add(&if_in, &ipaddr, &netmask, &gw, NULL, lwip_driver_init, ip_input);
 	netif_add(&if_out, &ipaddr, &netmask, &gw, NULL, lwip_driver_init, ip_input);
 
+	struct memp_usage pcbs;
+	memp_get_usage(MEMP_TCP_PCB, &pcbs);
+	if(pcbs.num == 0) {
+		LOG_CRITICAL("lwIP could not allocate its memory pools, check splittcp.pools.\n");
+	}
+
 	/* Bring the interfaces up */
 	netif_set_up(&if_in);
 	netif_set_up(&if_out);
@@ -113,100 +171,81 @@ NpsGateLWIP::NpsGateLWIP(SplitTCP* s, uint16_t m) {
 	   state variable to provide a means to jump back to the C++ classes. */
 	if_in.state = this;
 	if_out.state = this;
+
+	/* Every intercepted SYN is accepted by this one listener, whatever server it
+	   was sent to, instead of binding a listener to each destination. */
+	tcp_pcb* pcb = tcp_new();
+	listener = pcb ? tcp_listen(pcb) : NULL;
+	if(listener) {
+		tcp_accept(listener, accept_connection);
+		tcp_listen_transparent(listener);
+	} else {
+		LOG_CRITICAL("Failed to create the listener, no connection can be split.\n");
+		if(pcb) {
+			tcp_close(pcb);
+		}
+	}
 }
 
 NpsGateLWIP::~NpsGateLWIP() {
-	map<tcp_pcb*, QueuedPbuf>::iterator iter = queued_pbufs.begin();
-	while(iter != queued_pbufs.end()) {
-		list<pbuf*>::iterator p = iter->second.pbuf_list.begin();
-		while(p != iter->second.pbuf_list.end()) {
-			pbuf_free(*p);
-			p = iter->second.pbuf_list.erase(p);
-		}
-		iter++;
+	vector<SplitConnection*> all;
+
+	connections.values(&all);
+	BOOST_FOREACH(SplitConnection* conn, all) {
+		delete conn;
+	}
+	BOOST_FOREACH(SplitConnection* conn, retired) {
+		delete conn;
+	}
+	BOOST_FOREACH(PacketPbuf* pp, pbuf_pool) {
+		delete pp;
 	}
 	free(xmit_buffer);
 
+	if(listener) {
+		tcp_close(listener);
+	}
 	netif_remove(&if_in);
 	netif_remove(&if_out);
-}
 
-// TODO: This needs to be done better.
-static tcp_pcb* lpcb;
+	/* Takes the pcbs still open with it */
+	memp_release();
+}
 
 bool NpsGateLWIP::inject_packet(Packet* p) {
-	IP* ip = p->GetLayer<IP>();
-	TCP* tcp = p->GetLayer<TCP>();
-	ListenSocket* l;
-	ip_addr sipaddr, dipaddr;
+	FlowKey key;
+	uint8_t flags;
 
-	if(!ip || !tcp) {
+	if(!FlowKey::from_ip_header(p->GetRawPtr(), p->GetSize(), &key, &flags)) {
 		LOG_WARNING("Packet does not have a valid TCP/IP header.\n");
 		return false;
 	}
 
 	/* When a new TCP packet is received, there are two possible options:
 	   1. The packet has only the SYN flag set. In this case, we assume the packet is
-	   attempting to establish a new connection. LWIP would reject this packet, since
-	   there is no listening socket, so first create a new listening socket before
-	   passing the SYN packet to LWIP.
+	   attempting to establish a new connection. The connection is added to the flow
+	   table as half open and LWIP's transparent listener accepts the SYN. Past the
+	   limits the SYN is dropped and the client will retry it, so a SYN flood can
+	   neither grow the stack without bound nor push out established connections. A
+	   retransmitted SYN finds the connection in the flow table and goes straight to
+	   LWIP.
 	   2. The packet does not have the SYN flag set. In this case, the packet should
 	   be associated with an already established connection, so we just pass it directly
 	   to LWIP. */
-	if(tcp->GetFlags() == TCP::SYN) {
-		lpcb = tcp_new();
-		unsigned int a, b, c, d;
-
-		/* When this function returns, the packet is unneeded so the SplitTCP class
-		   frees the packet, except in the case where this packet is creating a new
-		   connection. In this case, the packet can not be freed until the accept_connection
-		   function is called, so we just make a copy of it here. */
-		p = new Packet(*p);
-
-		LOG_TRACE("New Connection: %s:%u => %s:%u\n",
-				ip->GetSourceIP().c_str(), tcp->GetSrcPort(),
-				ip->GetSourceIP().c_str(), tcp->GetDstPort());
-
-		// Convert IP addresses to ip_addr struct needed by lwip
-		sscanf(ip->GetDestinationIP().c_str(), "%u.%u.%u.%u", &a, &b, &c, &d);
-		IP4_ADDR(&dipaddr, a,b,c,d);
-		sscanf(ip->GetSourceIP().c_str(), "%u.%u.%u.%u", &a, &b, &c, &d);
-		IP4_ADDR(&sipaddr, a,b,c,d);
-
-		l = new ListenSocket();
-
-		// Create a new listening socket so that we can accept this
-		// incoming SYN packet.
-		ip_set_option(lpcb, SOF_REUSEADDR);
-		err_t rval = tcp_bind(lpcb, &dipaddr, tcp->GetDstPort());
-		switch(rval) {
-			case ERR_OK:
-				l->lpcb = tcp_listen(lpcb);
-				if(!l->lpcb) {
-					LOG_WARNING("tcp_listen(): failed to create new listen socket.\n");
-					delete l;
-					return false;
-				}
-				l->p = p;
-				tcp_accept(l->lpcb, accept_connection);
-				tcp_arg(l->lpcb, l);
-				break;
-			case ERR_BUF:
-				LOG_WARNING("tcp_bind(): failed to allocate a new port.\n");
-				tcp_abort(lpcb);
-				break;
-			case ERR_USE:
-				LOG_WARNING("tcp_bind(): port already in use.\n");
-				tcp_abort(lpcb);
-				break;
-			case ERR_VAL:
-				LOG_WARNING("tcp_bind(): can only bind in state CLOSED.\n");
-				tcp_abort(lpcb);
-				break;
-			default:
-				LOG_WARNING("tcp_bind() returned an unknown error code.\n");
-				tcp_abort(lpcb);
+	if(flags == TCP::SYN && !connections.find(key)) {
+		if(connections.size() >= max_connections || half_open.size() >= max_half_open) {
+			LOG_TRACE("Dropping SYN of %s, %u connections, %u half open.\n", key.str().c_str(),
+					(unsigned int)connections.size(), (unsigned int)half_open.size());
+			syn_dropped++;
+			return false;
 		}
+
+		LOG_TRACE("New Connection: %s\n", key.str().c_str());
+
+		SplitConnection* conn = new SplitConnection(key, this);
+		time_t now = time(NULL);
+		connections.insert(key, conn, now);
+		half_open.insert(key, conn, now);
 	}
 
 	lwip_driver_input(&if_in, p);
@@ -225,65 +264,86 @@ bool NpsGateLWIP::send_data(uint8_t* data, int len) {
 	return true;
 }
 
+/* The accepted pcb has the addresses and ports of the client's SYN, which find
+   the half open connection inject_packet() made for it. */
 err_t NpsGateLWIP::accept_connection(void* arg, tcp_pcb* spcb,  err_t err) {
-	ListenSocket* l = (ListenSocket*)arg;
-	Packet* p = l->p;
-	IP* ip = p->GetLayer<IP>();
-	TCP* tcp = p->GetLayer<TCP>();
-	char* dip = strdup(ip->GetDestinationIP().c_str());
-	char* sip = strdup(ip->GetSourceIP().c_str());
-	unsigned int a, b, c, d;
+	NpsGateLWIP* lwip = thread_stack;
+	SplitConnection** c = lwip->connections.find(pcb_key(spcb));
+	SplitConnection* conn;
 	ip_addr sipaddr, dipaddr;
 	tcp_pcb* dpcb;
+	const tcp_cc_ops* client_cc = NULL;
+	const tcp_cc_ops* server_cc = NULL;
 
 	if(err != ERR_OK) {
 		LOG_WARNING("accept_connection(): err != ERR_OK\n");
 		return err;
 	}
-	
-	// Convert IP addresses to ip_addr struct needed by lwip
-	sscanf(dip, "%u.%u.%u.%u", &a, &b, &c, &d);
-	IP4_ADDR(&dipaddr, a,b,c,d);
-	sscanf(sip, "%u.%u.%u.%u", &a, &b, &c, &d);
-	IP4_ADDR(&sipaddr, a,b,c,d);
-
-	// Create a new outgoing socket to the destination IP address
-	dpcb = tcp_new();
 
-	if(ERR_OK != tcp_bind(dpcb, &sipaddr, 0)) {
-		LOG_CRITICAL("tcp_bind() did not return ERR_OK\n");
+	/* Reaped while lwIP was still in the handshake. lwIP aborts the pcb. */
+	if(!c || (*c)->client.pcb) {
+		LOG_DEBUG("No half open connection for %s.\n", pcb_key(spcb).str().c_str());
+		return ERR_VAL;
 	}
 
-	if(ERR_OK != tcp_connect(dpcb, &dipaddr, tcp->GetDstPort(), connected)) {
-		LOG_CRITICAL("tcp_connect() did not return ERR_OK\n");
-	}
+	conn = *c;
+	const FlowKey& key = conn->key;
+	lwip->half_open.erase(key);
+	conn->opened = time(NULL);
+	lwip->totals.opened++;
+	lwip->totals.active++;
 
-	tcp_err(dpcb, error);
+	if(lwip->http_cache && find(lwip->http_ports->begin(), lwip->http_ports->end(), key.dport) != lwip->http_ports->end()) {
+		conn->http = new HttpSession();
+	}
 
+	if(conn->lwip->congestion) {
+		conn->lwip->congestion->select(key.daddr, &client_cc, &server_cc);
+	}
+	
+	// Convert IP addresses to ip_addr struct needed by lwip
+	IP4_ADDR(&dipaddr, key.daddr >> 24, (key.daddr >> 16) & 0xff, (key.daddr >> 8) & 0xff, key.daddr & 0xff);
+	IP4_ADDR(&sipaddr, key.saddr >> 24, (key.saddr >> 16) & 0xff, (key.saddr >> 8) & 0xff, key.saddr & 0xff);
 
 	/* Set the recv and error functions for the new pcb. */
+	conn->client.pcb = spcb;
+	tcp_set_cc(spcb, client_cc);
+	tcp_arg(spcb, &conn->client);
 	tcp_recv(spcb, recv_data);
 	tcp_sent(spcb, sent_data);
 	tcp_err(spcb, error);
+	tcp_poll(spcb, poll, 2);
+	track_window(&conn->client);
 
-	// Close the listening socket
-	LOG_DEBUG("Closing TCP listening socket.\n");
-	tcp_close(l->lpcb);
-	delete l;
+	// Create a new outgoing socket to the destination IP address
+	dpcb = tcp_new();
+	if(!dpcb) {
+		LOG_WARNING("tcp_new(): failed to allocate the outgoing pcb.\n");
+		abort_endpoint(&conn->client);
+		conn->lwip->retire(conn, true);
+		return ERR_ABRT;
+	}
 
-	/* Pairs the two sockets using the callback arg */
-	tcp_arg(spcb, dpcb);
-	tcp_arg(dpcb, spcb);
+	conn->server.pcb = dpcb;
+	tcp_set_cc(dpcb, server_cc);
+	tcp_arg(dpcb, &conn->server);
+	tcp_err(dpcb, error);
+	tcp_poll(dpcb, poll, 2);
 
-	free(dip);
-	free(sip);
+	if(!conn->lwip->bind_outgoing(dpcb, key, &sipaddr)) {
+		LOG_CRITICAL("tcp_bind() did not return ERR_OK\n");
+	}
 
-	delete p;
+	if(ERR_OK != tcp_connect(dpcb, &dipaddr, key.dport, connected)) {
+		LOG_CRITICAL("tcp_connect() did not return ERR_OK\n");
+	}
 
 	return ERR_OK;
 }
 
 err_t NpsGateLWIP::connected(void* arg, tcp_pcb* pcb, err_t err) {
+	SplitEndpoint* ep = (SplitEndpoint*)arg;
+
 	if(err != ERR_OK) {
 		LOG_WARNING("connected(): err != ERR_OK\n");
 		return err;
@@ -295,137 +355,787 @@ err_t NpsGateLWIP::connected(void* arg, tcp_pcb* pcb, err_t err) {
 	tcp_sent(pcb, sent_data);
 	tcp_err(pcb, error);
 
-	transmit_queued_pbufs(pcb);
+	if(ep) {
+		transmit_queued_pbufs(ep);
+	}
 
 	return ERR_OK;
 }
 
 err_t NpsGateLWIP::recv_data(void* arg, tcp_pcb* pcb, pbuf* p, err_t err) {
-	tcp_pcb* other_end = (tcp_pcb*) arg;
+	SplitEndpoint* ep = (SplitEndpoint*)arg;
 
 	if(err != ERR_OK) {
 		LOG_WARNING("recv_data(): err != ERR_OK\n");
 		return err;
 	}
 
-	/* The pbuf will be NULL when the remote host closed the connection. Close the pcb,
-	   then remove this pcb from the other paired pcb. Check to see if the other end has
-	   outstanding data waiting to be sent. If no oustanding data, then close the other end. */
+	/* Nothing is attached to this pcb any more, it is on its way out */
+	if(!ep) {
+		if(p) {
+			tcp_recved(pcb, p->tot_len);
+			pbuf_free(p);
+		}
+		return ERR_OK;
+	}
+
+	/* The pbuf will be NULL when the remote host closed the connection. Both ends are
+	   closed, each as soon as everything written to it has been acknowledged, since lwIP
+	   still references that data for retransmission. */
 	if(p == NULL) {
 		LOG_DEBUG("Remote connection closed.\n");
-		tcp_close(pcb);
-		if(other_end) {
-			tcp_arg(other_end, NULL);
-			map<tcp_pcb*, QueuedPbuf>::iterator iter = queued_pbufs.find(other_end);
-			if(iter->second.pbuf_list.empty()) {
-				tcp_close(other_end);
+		if(ep->conn->http) {
+			if(ep == &ep->conn->client) {
+				http_client_closed(ep->conn);
+			} else if(ep->conn->http->state == HttpSession::FORWARDING) {
+				ep->conn->http->response.finish();
+				if(ep->conn->http->response.done()) {
+					http_response_done(ep->conn);
+				}
 			}
 		}
+		if(!ep->conn->lwip->closing.find(ep->conn->key)) {
+			ep->conn->lwip->closing.insert(ep->conn->key, ep->conn, time(NULL));
+		}
+		ep->closing = true;
+		ep->peer->closing = true;
+		close_drained(ep->peer);
+		close_drained(ep);
 		return ERR_OK;
 	}
 
-	if(p->len == 0) {
+	if(p->tot_len == 0) {
 		LOG_DEBUG("Received zero length data.\n");
+		pbuf_free(p);
 		return ERR_OK;
 	}
 	
-	/* Acknowledge to LWIP that we have received this data so the receive window
-	   can be opened back up. Then queue the pbuf for transmission. */
-	tcp_recved(pcb, p->tot_len);
-	transmit_pbuf(pcb, other_end, p);
+	/* The receive window is only opened back up once the other end has acknowledged
+	   the data (see release_acked()), so each direction holds at most a window's
+	   worth of data and a slow receiver pushes back on the sender. */
+	ep->conn->lwip->connections.touch(ep->conn->key, time(NULL));
+	ep->rx_bytes += p->tot_len;
+	ep->conn->lwip->totals.rx_bytes += p->tot_len;
+	track_window(ep);
+
+	if(ep->conn->http && ep->conn->http->state != HttpSession::PASSTHROUGH) {
+		if(ep == &ep->conn->client) {
+			http_client_data(ep->conn, p);
+			return ERR_OK;
+		}
+		http_server_data(ep->conn, p);
+	}
+
+	transmit_pbuf(ep->peer, p);
 
 	return ERR_OK;
 }
 
 err_t NpsGateLWIP::sent_data(void* arg, tcp_pcb* pcb, uint16_t len) {
-	transmit_queued_pbufs(pcb);
+	SplitEndpoint* ep = (SplitEndpoint*)arg;
+
+	if(ep) {
+		ep->acked += len;
+		ep->tx_bytes += len;
+		ep->conn->lwip->totals.tx_bytes += len;
+		transmit_queued_pbufs(ep);
+	}
 	return ERR_OK;
 }
 
 void NpsGateLWIP::error(void* arg, err_t err) {
-	tcp_pcb* other_end = (tcp_pcb*) arg;
+	SplitEndpoint* ep = (SplitEndpoint*)arg;
 
-	if(other_end == NULL) {
+	if(ep == NULL) {
 		LOG_WARNING("Received a NULL arg. Doing nothing.\n");
 		return;
 	}
 
-	/* If the other end is a listening socket, this means that the connect
-	   to the remote server failed. In this case, just close the listening socket. */
-	if(other_end->state == LISTEN) {
-		LOG_DEBUG("***** Remote connect failed. Closing listening socket.\n");
-		tcp_arg((tcp_pcb*)other_end->callback_arg, NULL);
-		tcp_close(other_end);
+	/* lwIP has already freed this pcb. Take the other half down with it. If the
+	   connect to the remote server failed, this aborts the accepted client pcb. */
+	LOG_DEBUG("***** TCP Error has occurred.\n");
+	ep->pcb = NULL;
+	track_window(ep);
+	abort_endpoint(ep->peer);
+	ep->conn->lwip->retire(ep->conn, true);
+}
+
+/* Called by lwIP every second. A write that failed because a pool was empty is
+   retried from here when no acknowledgement is outstanding to retry it. Also
+   picks up window updates that came without new data or acknowledgements. */
+err_t NpsGateLWIP::poll(void* arg, tcp_pcb* pcb) {
+	SplitEndpoint* ep = (SplitEndpoint*)arg;
+
+	if(ep && !ep->queue.empty()) {
+		transmit_queued_pbufs(ep);
+	} else if(ep) {
+		track_window(ep);
+	}
+	return ERR_OK;
+}
+
+void NpsGateLWIP::close_endpoint(SplitEndpoint* ep) {
+	if(!ep->pcb) {
 		return;
 	}
 
-	tcp_arg(other_end, NULL);
-	LOG_DEBUG("***** TCP Error has occurred.\n");
+	tcp_arg(ep->pcb, NULL);
+	tcp_close(ep->pcb);
+	ep->pcb = NULL;
+	track_window(ep);
+}
 
-	tcp_abort(other_end);
+void NpsGateLWIP::abort_endpoint(SplitEndpoint* ep) {
+	if(!ep->pcb) {
+		return;
+	}
+
+	tcp_arg(ep->pcb, NULL);
+	tcp_abort(ep->pcb);
+	ep->pcb = NULL;
+	track_window(ep);
 }
 
-void NpsGateLWIP::transmit_pbuf(tcp_pcb* spcb, tcp_pcb* dpcb, pbuf* p) {
-	map<tcp_pcb*, QueuedPbuf>::iterator iter;
-	iter = queued_pbufs.find(dpcb);
+/* Replaces what 'ep' adds to its stack's WindowStats with what its pcb shows
+   now. Called whenever lwIP tells us something changed, so reading the stats
+   never walks the pcbs. Once the pcb or the connection is gone it adds nothing. */
+void NpsGateLWIP::track_window(SplitEndpoint* ep) {
+	WindowStats& ws = ep->conn->lwip->window_counts;
+	const WindowSample& old = ep->window;
+	const tcp_pcb* pcb = ep->pcb;
+	WindowSample s;
+
+	if(pcb && !ep->conn->retired && (pcb->state == ESTABLISHED || pcb->state == CLOSE_WAIT)) {
+		s.counted = true;
+		s.scaled = (pcb->flags & TF_WND_SCALE) != 0;
+		s.sack = (pcb->flags & TF_SACK) != 0;
+		s.inflight = pcb->snd_nxt - pcb->lastack;
+		s.snd_wnd = pcb->snd_wnd;
+		s.limited = (pcb->snd_wnd > 0 && s.inflight + pcb->mss > LWIP_MIN(pcb->snd_wnd, pcb->cwnd));
+		s.rcv_queued = tcp_cfg_wnd - LWIP_MIN(pcb->rcv_wnd, tcp_cfg_wnd);
+	}
+
+	ws.connections = ws.connections - old.counted + s.counted;
+	ws.scaled = ws.scaled - old.scaled + s.scaled;
+	ws.sack = ws.sack - old.sack + s.sack;
+	ws.window_limited = ws.window_limited - old.limited + s.limited;
+	ws.inflight = ws.inflight - old.inflight + s.inflight;
+	ws.snd_wnd = ws.snd_wnd - old.snd_wnd + s.snd_wnd;
+	ws.rcv_queued = ws.rcv_queued - old.rcv_queued + s.rcv_queued;
 
-	/* If there are already queued pbufs for this connection, just append this new
-	   data to the end of the pbuf chain. If there isn't data, create a new
-	   QueuedPbuf object to the queued pbuf map. */
-	if(iter == queued_pbufs.end()) {
-		QueuedPbuf qpb;
+	ep->window = s;
+}
 
-		qpb.dpcb = dpcb;
-		qpb.spcb = spcb;
-		qpb.pbuf_list.push_back(p);
+/* Closes 'ep' if it is waiting to close and lwIP no longer needs any of its data.
+   Once both ends are gone the connection is retired. */
+void NpsGateLWIP::close_drained(SplitEndpoint* ep) {
+	if(ep->pcb && ep->closing && ep->drained()) {
+		close_endpoint(ep);
+	}
 
-		queued_pbufs[dpcb] = qpb;
-	} else {
-		iter->second.pbuf_list.push_back(p);
+	if(!ep->pcb && !ep->peer->pcb) {
+		ep->conn->lwip->retire(ep->conn, false);
+	}
+}
+
+/* 'aborted' when the connection did not close normally. Only connections whose
+   handshake completed are counted in the totals. */
+void NpsGateLWIP::retire(SplitConnection* conn, bool aborted) {
+	if(conn->retired) {
+		return;
+	}
+	conn->retired = true;
+	track_window(&conn->client);
+	track_window(&conn->server);
+
+	if(conn->opened) {
+		totals.active--;
+		if(aborted) {
+			totals.aborted++;
+		} else {
+			totals.closed++;
+		}
+	}
+	/* Nothing left to write it to */
+	totals.queued -= conn->client.queued + conn->server.queued;
+
+	if(conn->http) {
+		if(conn->http->state == HttpSession::WAITING) {
+			http_waiting[conn->http->key].remove(conn);
+		}
+		conn->http->state = HttpSession::PASSTHROUGH;
+		http_end_fill(conn);
+	}
+	conn->client.queued = conn->server.queued = 0;
+
+	FlowTable<SplitConnection*>* tables[] = { &connections, &half_open, &closing };
+	BOOST_FOREACH(FlowTable<SplitConnection*>* t, tables) {
+		SplitConnection** c = t->find(conn->key);
+		if(c && *c == conn) {
+			t->erase(conn->key);
+		}
+	}
+
+	/* lwIP may still be in a callback for one of its pcbs, so the connection is
+	   only deleted from the next timeout() */
+	retired.push_back(conn);
+}
+
+/* Aborts a connection the timers gave up on. A client still in the handshake has
+   no endpoint yet, only the pcb lwIP made for its SYN. */
+void NpsGateLWIP::reap(SplitConnection* conn) {
+	if(conn->retired) {
+		return;
 	}
 
-	/* Attempt to transmit data now. */
-	transmit_queued_pbufs(dpcb);
+	if(!conn->client.pcb) {
+		tcp_pcb** p = pcb_table.find(conn->key);
+		if(p && (*p)->state == SYN_RCVD) {
+			tcp_abort(*p);
+		}
+	}
+
+	abort_endpoint(&conn->client);
+	abort_endpoint(&conn->server);
+	reaped++;
+	retire(conn, true);
 }
 
-void NpsGateLWIP::transmit_queued_pbufs(tcp_pcb* pcb) {
-	map<tcp_pcb*, QueuedPbuf>::iterator iter = queued_pbufs.find(pcb);
-	tcp_pcb* other_end = (tcp_pcb*)pcb->callback_arg;
+/* Binds the pcb we open to the server to the client's own port when possible, so
+   both halves of the connection are the same flow to split_shard() and the
+   server's replies are handed to this stack. When that port is taken, another
+   one is picked whose replies also hash to this stack. */
+bool NpsGateLWIP::bind_outgoing(tcp_pcb* pcb, const FlowKey& key, ip_addr* sipaddr) {
+	if(tcp_bind(pcb, sipaddr, key.sport) == ERR_OK) {
+		return true;
+	}
+
+	if(shards <= 1) {
+		return tcp_bind(pcb, sipaddr, 0) == ERR_OK;
+	}
+
+	uint16_t port = 0xc000 | (key.hash() & 0x3fff);
+	for(unsigned int tries = 0, n = 0; n < 0x4000 && tries < 64; n++) {
+		port = (port == 0xffff ? 0xc000 : port + 1);
+		if(split_shard(FlowKey(key.saddr, key.daddr, port, key.dport), shards) != shard) {
+			continue;
+		}
+		if(tcp_bind(pcb, sipaddr, port) == ERR_OK) {
+			return true;
+		}
+		tries++;
+	}
+	return false;
+}
 
-	/* Nothing to send */
-	if(iter == queued_pbufs.end()) {
+void NpsGateLWIP::transmit_pbuf(SplitEndpoint* ep, pbuf* p) {
+	/* The other end is gone, nowhere to send the data */
+	if(!ep->pcb) {
+		return_window(ep, p);
+		pbuf_free(p);
 		return;
 	}
-	
-	/* Check if send buffer is zero, if so, we can't send anything right now */
-	int len = tcp_sndbuf(pcb);
-	if(len == 0) {
+
+	/* Append the new data to the end of the endpoint's queue, then attempt to
+	   transmit data now. */
+	ep->queue.push_back(p);
+	ep->queued += p->tot_len;
+	ep->conn->lwip->totals.queued += p->tot_len;
+	transmit_queued_pbufs(ep);
+}
+
+void NpsGateLWIP::transmit_queued_pbufs(SplitEndpoint* ep) {
+	tcp_pcb* pcb = ep->pcb;
+	bool blocked = false;
+	bool wrote = false;
+
+	if(!pcb) {
+		return;
+	}
+
+	/* The pbufs are written one at a time without TCP_WRITE_FLAG_COPY, so lwIP's
+	   segments point straight in to the received packets. A chain that does not
+	   fit is picked up again where it stopped on the next call. */
+	while(!ep->queue.empty() && !blocked) {
+		pbuf* head = ep->queue.front();
+		pbuf* q = head;
+		uint32_t offset = 0;
+
+		while(q && offset + q->len <= ep->written) {
+			offset += q->len;
+			q = q->next;
+		}
+
+		for(; q; q = q->next) {
+			if(q->len == 0) {
+				continue;
+			}
+
+			u8_t flags = (q->next ? TCP_WRITE_FLAG_MORE : 0);
+			err_t err = tcp_write(pcb, q->payload, q->len, flags);
+
+			/* Out of pbufs to reference the data with, and nothing outstanding whose
+			   acknowledgement would get us called again. Fall back to copying. */
+			if(err == ERR_MEM && !pcb->unsent && !pcb->unacked && tcp_sndbuf(pcb) >= q->len) {
+				err = tcp_write(pcb, q->payload, q->len, flags | TCP_WRITE_FLAG_COPY);
+			}
+
+			if(err != ERR_OK) {
+			//	LOG_DEBUG("tcp_write() failed for %u bytes. Will try again later.\n", q->len);
+				blocked = true;
+				break;
+			}
+
+			ep->written += q->len;
+			ep->queued -= q->len;
+			ep->conn->lwip->totals.queued -= q->len;
+			wrote = true;
+		}
+
+		if(!blocked) {
+			ep->queue.pop_front();
+			ep->inflight.push_back(head);
+			ep->written = 0;
+		}
+	}
+
+	if(wrote) {
+		tcp_output(pcb);
+	}
+
+	/* Writing moved this end's window and the acknowledgements released so
+	   far opened the peer's */
+	release_acked(ep);
+	close_drained(ep);
+	track_window(ep);
+	track_window(ep->peer);
+}
+
+/* Frees the written pbufs the other end has acknowledged. Acknowledgements are
+   counted in bytes and the pbufs were written in order, so the oldest ones go
+   first. */
+void NpsGateLWIP::release_acked(SplitEndpoint* ep) {
+	while(!ep->inflight.empty() && ep->acked >= ep->inflight.front()->tot_len) {
+		ep->acked -= ep->inflight.front()->tot_len;
+		return_window(ep, ep->inflight.front());
+		pbuf_free(ep->inflight.front());
+		ep->inflight.pop_front();
+	}
+
+	/* With nothing left unacknowledged, every byte written so far has arrived */
+	if(ep->pcb && !ep->pcb->unsent && !ep->pcb->unacked) {
+		BOOST_FOREACH(pbuf* p, ep->inflight) {
+			return_window(ep, p);
+			pbuf_free(p);
+		}
+		ep->inflight.clear();
+		ep->acked = ep->written;
+	}
+}
+
+/* Tells the end 'p' was received on that it has been delivered, which opens its
+   receive window by that much */
+void NpsGateLWIP::return_window(SplitEndpoint* ep, pbuf* p) {
+	if((p->flags & PBUF_FLAG_IS_CUSTOM) && ((pbuf_custom*)p)->custom_free_function == free_http_pbuf &&
+			!((HttpPbuf*)p)->window) {
+		return;
+	}
+	if(ep->peer->pcb) {
+		tcp_recved(ep->peer->pcb, p->tot_len);
+	}
+}
+
+/* The client's bytes are held back until http_pump() decides what each request
+   needs. Its window stays closed by as much until they are forwarded and
+   acknowledged by the server, or answered from the cache. */
+void NpsGateLWIP::http_client_data(SplitConnection* conn, pbuf* p) {
+	for(pbuf* q = p; q; q = q->next) {
+		conn->http->pending.append((const char*)q->payload, q->len);
+	}
+	pbuf_free(p);
+	http_pump(conn);
+}
+
+/* Follows the server's response to the forwarded request. The data itself is
+   forwarded to the client by recv_data() as usual. */
+void NpsGateLWIP::http_server_data(SplitConnection* conn, pbuf* p) {
+	HttpSession* h = conn->http;
+
+	for(pbuf* q = p; q; q = q->next) {
+		const uint8_t* data = (const uint8_t*)q->payload;
+		size_t off = 0;
+
+		while(off < q->len) {
+			bool head = h->response.head_done();
+			size_t n;
+
+			/* A response to nothing we forwarded */
+			if(h->state != HttpSession::FORWARDING) {
+				http_passthrough(conn);
+				return;
+			}
+
+			n = h->response.feed(data + off, q->len - off);
+			if(h->capturing) {
+				h->capture.insert(h->capture.end(), data + off, data + off + n);
+			}
+			off += n;
+			h->response_bytes += n;
+
+			if(h->response.failed()) {
+				http_passthrough(conn);
+				return;
+			}
+			if(!head && h->response.head_done()) {
+				http_response_head(conn);
+			} else if(h->capturing && h->capture.size() > conn->lwip->http_cache->max_object()) {
+				h->capturing = false;
+				h->capture.clear();
+				conn->lwip->http_cache->uncacheable();
+				conn->lwip->http_end_fill(conn);
+			}
+			if(h->state == HttpSession::FORWARDING && h->response.done()) {
+				http_response_done(conn);
+			}
+		}
+	}
+}
+
+/* Requests the client sent before closing are still forwarded */
+void NpsGateLWIP::http_client_closed(SplitConnection* conn) {
+	if(conn->http->state == HttpSession::WAITING) {
+		conn->lwip->http_waiting[conn->http->key].remove(conn);
+	}
+	http_passthrough(conn);
+}
+
+/* Forwards what was decided, then works through the requests in 'pending' until
+   one has to wait for a response */
+void NpsGateLWIP::http_pump(SplitConnection* conn) {
+	HttpSession* h = conn->http;
+
+	for(;;) {
+		while(h->to_forward) {
+			size_t n = min(h->to_forward, (size_t)HTTP_PBUF_MAX);
+
+			http_write(&conn->server, (const uint8_t*)h->pending.data(), n, NULL, true);
+			h->pending.erase(0, n);
+			h->parsed -= n;
+			h->to_forward -= n;
+		}
+
+		if(h->state == HttpSession::PASSTHROUGH) {
+			h->to_forward = h->parsed = h->pending.size();
+			if(h->to_forward) {
+				continue;
+			}
+			return;
+		}
+
+		/* One request at a time, the next waits for this one's response */
+		if(h->parsed == h->pending.size() || h->state == HttpSession::WAITING ||
+				(h->state == HttpSession::FORWARDING && h->request.done())) {
+			return;
+		}
+
+		h->parsed += h->request.feed((const uint8_t*)h->pending.data() + h->parsed, h->pending.size() - h->parsed);
+		if(h->request.failed()) {
+			LOG_DEBUG("Not HTTP, no longer caching %s.\n", conn->key.str().c_str());
+			http_passthrough(conn);
+			return;
+		}
+
+		if(h->state == HttpSession::FORWARDING) {
+			/* The body of a forwarded request */
+			h->to_forward = h->parsed;
+		} else if(h->request.head_done()) {
+			http_request(conn);
+		}
+	}
+}
+
+/* A request's headers have arrived. It is answered from the cache, waits for
+   the same response being fetched by another connection, or is forwarded. */
+void NpsGateLWIP::http_request(SplitConnection* conn) {
+	HttpSession* h = conn->http;
+	NpsGateLWIP* lwip = conn->lwip;
+	HttpCachedResponse* r;
+
+	h->req = h->request.message();
+	h->started = http_now_us();
+	h->key.clear();
+
+	if(!h->request.done() || !HttpCache::request_key(h->req, &h->key)) {
+		h->key.clear();
+		lwip->http_cache->bypassed();
+		http_forward_request(conn);
+		return;
+	}
+
+	r = lwip->http_cache->lookup(h->key, time(NULL));
+	if(r) {
+		http_serve(conn, r);
+		r->unref();
 		return;
 	}
 
-	list<pbuf*>& pbuf_list = iter->second.pbuf_list;
-	list<pbuf*>::iterator p = pbuf_list.begin();
+	/* Flows are spread over the stacks, so the fetch may be on another one */
+	if(!lwip->http_cache->begin_fill(h->key, lwip)) {
+		LOG_TRACE("Waiting for another fetch of %s\n", h->req.target.c_str());
+		lwip->http_waiting[h->key].push_back(conn);
+		h->state = HttpSession::WAITING;
+		lwip->http_cache->coalesced();
+		return;
+	}
+
+	h->filling = true;
+	http_forward_request(conn);
+}
+
+void NpsGateLWIP::http_forward_request(SplitConnection* conn) {
+	HttpSession* h = conn->http;
 
-	while(p != pbuf_list.end()) {
-		if((*p)->tot_len != (*p)->len) {
-			LOG_WARNING("pbuf tot_len != len, coalescing pbuf.  tot_len=%u, len=%u\n",(*p)->tot_len, (*p)->len);
-			(*p) = pbuf_coalesce(*p, PBUF_RAW);
+	if(!h->key.empty()) {
+		conn->lwip->http_cache->miss();
+	}
+	h->state = HttpSession::FORWARDING;
+	h->to_forward = h->parsed;
+	h->response.reset();
+	if(h->req.method == "HEAD") {
+		h->response.expect_no_body();
+	}
+	h->capturing = !h->key.empty();
+	h->capture.clear();
+	h->response_bytes = 0;
+}
+
+/* Whether the response being received can be stored is known from its headers */
+void NpsGateLWIP::http_response_head(SplitConnection* conn) {
+	HttpSession* h = conn->http;
+	const HttpMessage& resp = h->response.message();
+
+	if(resp.status == 101) {
+		http_passthrough(conn);
+		return;
+	}
+	/* Interim responses are forwarded and otherwise ignored */
+	if(resp.status < 200) {
+		return;
+	}
+
+	if(h->capturing && (h->response.until_close() || !HttpCache::expires(h->req, resp, time(NULL)))) {
+		h->capturing = false;
+		h->capture.clear();
+		conn->lwip->http_cache->uncacheable();
+		conn->lwip->http_end_fill(conn);
+	}
+}
+
+/* Stores the response if it may be, hands it to the connections waiting for it
+   and goes on to the client's next request */
+void NpsGateLWIP::http_response_done(SplitConnection* conn) {
+	HttpSession* h = conn->http;
+	HttpCache* cache = conn->lwip->http_cache;
+	time_t now = time(NULL);
+
+	if(h->response.message().status < 200) {
+		h->response.reset();
+		h->capture.clear();
+		return;
+	}
+
+	cache->fetched(h->response_bytes, http_now_us() - h->started);
+	if(h->capturing) {
+		time_t expires = HttpCache::expires(h->req, h->response.message(), now);
+		if(expires) {
+			cache->store(h->key, h->capture, h->response.message().header_len, expires, now);
+		} else {
+			cache->uncacheable();
 		}
-		
-		if(ERR_OK != tcp_write(pcb, (*p)->payload, (*p)->tot_len, TCP_WRITE_FLAG_COPY)) {
-		//	LOG_DEBUG("tcp_write() failed for %u bytes. Will try again later.\n", len);
-			break;
+		h->capturing = false;
+		h->capture.clear();
+	}
+	conn->lwip->http_end_fill(conn);
+
+	/* The server answered before the whole request body was sent */
+	if(!h->request.done()) {
+		http_passthrough(conn);
+		return;
+	}
+
+	h->state = HttpSession::IDLE;
+	h->request.reset();
+	h->response.reset();
+	http_pump(conn);
+}
+
+/* Answers the request from the cache. The request goes no further and its bytes
+   are acknowledged to the client. An Age header is added to the response. */
+void NpsGateLWIP::http_serve(SplitConnection* conn, HttpCachedResponse* r) {
+	HttpSession* h = conn->http;
+	const char* head = (const char*)&r->data[0];
+	size_t eol = (const char*)memchr(head, '\n', r->header_len) - head + 1;
+	string header(head, eol);
+	char age[32];
+
+	LOG_TRACE("HTTP cache hit: %s\n", h->req.target.c_str());
+
+	snprintf(age, sizeof(age), "Age: %ld\r\n", (long)max((time_t)0, time(NULL) - r->stored));
+	header += age;
+	for(size_t pos = eol; pos < r->header_len; ) {
+		const char* nl = (const char*)memchr(head + pos, '\n', r->header_len - pos);
+		size_t end = nl ? nl - head + 1 : r->header_len;
+
+		if(strncasecmp(head + pos, "age:", 4) != 0) {
+			header.append(head + pos, end - pos);
+		}
+		pos = end;
+	}
+
+	/* Acknowledges the request */
+	for(size_t n = h->parsed; n; ) {
+		u16_t len = min(n, (size_t)0xffff);
+		if(conn->client.pcb) {
+			tcp_recved(conn->client.pcb, len);
+		}
+		n -= len;
+	}
+	h->pending.erase(0, h->parsed);
+	h->parsed = 0;
+
+	http_write(&conn->client, (const uint8_t*)header.data(), header.size(), NULL, false);
+	for(size_t off = r->header_len; off < r->data.size(); off += HTTP_PBUF_MAX) {
+		http_write(&conn->client, &r->data[off], min(r->data.size() - off, (size_t)HTTP_PBUF_MAX), r, false);
+	}
+
+	conn->lwip->http_cache->hit(header.size() + r->data.size() - r->header_len, http_now_us() - h->started);
+	h->state = HttpSession::IDLE;
+	h->request.reset();
+
+	/* The client asked for the connection to be closed after the response */
+	if(!h->req.keep_alive) {
+		h->state = HttpSession::PASSTHROUGH;
+		h->pending.clear();
+		h->parsed = h->to_forward = 0;
+		if(!conn->lwip->closing.find(conn->key)) {
+			conn->lwip->closing.insert(conn->key, conn, time(NULL));
+		}
+		conn->client.closing = true;
+		conn->server.closing = true;
+		close_drained(&conn->server);
+		if(!conn->retired) {
+			close_drained(&conn->client);
+		}
+	}
+}
+
+/* The fetch a waiting connection was waiting for finished. It is answered from
+   the cache if the response was stored, otherwise forwarded. */
+void NpsGateLWIP::http_resume(SplitConnection* conn) {
+	HttpSession* h = conn->http;
+	HttpCachedResponse* r;
+
+	if(h->state != HttpSession::WAITING) {
+		return;
+	}
+
+	r = conn->lwip->http_cache->lookup(h->key, time(NULL));
+	if(r) {
+		http_serve(conn, r);
+		r->unref();
+	} else {
+		h->key.clear();
+		http_forward_request(conn);
+		conn->lwip->http_cache->miss();
+	}
+	if(!conn->retired) {
+		http_pump(conn);
+	}
+}
+
+/* The connection is just split from now on. What the client sent that was
+   not yet forwarded is, and no one waits for it any more. */
+void NpsGateLWIP::http_passthrough(SplitConnection* conn) {
+	HttpSession* h = conn->http;
+
+	if(h->state == HttpSession::PASSTHROUGH) {
+		return;
+	}
+	h->state = HttpSession::PASSTHROUGH;
+	h->capturing = false;
+	h->capture.clear();
+	conn->lwip->http_end_fill(conn);
+	http_pump(conn);
+}
+
+/* Wakes the connections waiting for this one's response, if any. Those on
+   other stacks are woken through their worker's queue. */
+void NpsGateLWIP::http_end_fill(SplitConnection* conn) {
+	HttpSession* h = conn->http;
+	vector<void*> owners;
+	string key;
+
+	if(!h->filling) {
+		return;
+	}
+	h->filling = false;
+
+	key = h->key;
+	http_cache->end_fill(key, &owners);
+	BOOST_FOREACH(void* owner, owners) {
+		if(owner == this) {
+			http_fill_done(key);
+		} else {
+			stcp->http_fill_done(((NpsGateLWIP*)owner)->shard, key);
 		}
+	}
+}
+
+void NpsGateLWIP::http_fill_done(const string& key) {
+	list<SplitConnection*> waiting;
+
+	map<string, list<SplitConnection*> >::iterator f = http_waiting.find(key);
+	if(f == http_waiting.end()) {
+		return;
+	}
+	waiting.swap(f->second);
+	http_waiting.erase(f);
 
-		pbuf_free(*p);
-		p = pbuf_list.erase(p);
+	BOOST_FOREACH(SplitConnection* c, waiting) {
+		http_resume(c);
+	}
+}
+
+/* Queues 'len' bytes to be written to 'ep', referencing the cached response 'r'
+   or a copy of them if it is NULL */
+void NpsGateLWIP::http_write(SplitEndpoint* ep, const uint8_t* data, size_t len, HttpCachedResponse* r, bool window) {
+	HttpPbuf* hp = new HttpPbuf();
+	pbuf* p;
+
+	hp->pc.custom_free_function = free_http_pbuf;
+	hp->response = r;
+	hp->copy = NULL;
+	hp->window = window;
+	if(r) {
+		r->ref();
+	} else {
+		hp->copy = (uint8_t*)malloc(len);
+		memcpy(hp->copy, data, len);
+		data = hp->copy;
 	}
-	tcp_output(pcb);
 
-	if(other_end == NULL && pbuf_list.empty()) {
-		LOG_DEBUG("Other end is closed, and we have finished transmitting data. Closing connection.\n");
-		close_list.push_back(pcb);
+	p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &hp->pc, (void*)data, len);
+	transmit_pbuf(ep, p);
+}
+
+void NpsGateLWIP::free_http_pbuf(struct pbuf* p) {
+	HttpPbuf* hp = (HttpPbuf*)p;
+
+	if(hp->response) {
+		hp->response->unref();
 	}
+	free(hp->copy);
+	delete hp;
 }
 
 err_t NpsGateLWIP::lwip_driver_init(struct netif* netif) {
@@ -446,8 +1156,9 @@ err_t NpsGateLWIP::lwip_driver_init(struct netif* netif) {
 }
 
 void NpsGateLWIP::lwip_driver_input(struct netif* netif, Packet* pkt) {
+	NpsGateLWIP* nglwip = (NpsGateLWIP*)netif->state;
+	PacketPbuf* pp;
 	struct pbuf* p;
-	const byte* pkt_ptr;
 	uint16_t len;
 
 	len = pkt->GetSize();
@@ -457,22 +1168,43 @@ void NpsGateLWIP::lwip_driver_input(struct netif* netif, Packet* pkt) {
 		return;
 	}
 
-	p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
-	p->next = NULL;
+	if(nglwip->pbuf_pool.empty()) {
+		pp = new PacketPbuf();
+	} else {
+		pp = nglwip->pbuf_pool.back();
+		nglwip->pbuf_pool.pop_back();
+	}
+
+	/* lwIP gets the packet's own buffer instead of a copy. It rewrites the headers in
+	   place, which is fine since SplitTCP made the packet writable and nothing else
+	   looks at it again. The buffer stays valid for as long as we hold a reference and
+	   nobody changes the packet's layers. */
+	pp->packet = nglwip->stcp->share_packet(pkt);
+	pp->lwip = nglwip;
+	pp->pc.custom_free_function = free_packet_pbuf;
+
+	p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &pp->pc, (void*)pkt->GetRawPtr(), len);
 	if(!p) {
 		LOG_WARNING("Failed to allocate pbuf with size: %u. Packet dropped!\n", len);
+		nglwip->stcp->release_packet(pkt);
+		nglwip->pbuf_pool.push_back(pp);
 		return;
 	}
 
-	pkt_ptr = pkt->GetRawPtr();
-	memcpy(p->payload, pkt_ptr, p->len);
-	
 	if(ERR_OK != netif->input(p, netif)) {
 		pbuf_free(p);
 		LOG_WARNING("Failed to input packet to lwip.\n");
 	}
 }
 
+void NpsGateLWIP::free_packet_pbuf(struct pbuf* p) {
+	PacketPbuf* pp = (PacketPbuf*)p;
+
+	pp->lwip->stcp->release_packet(pp->packet);
+	pp->packet = NULL;
+	pp->lwip->pbuf_pool.push_back(pp);
+}
+
 err_t NpsGateLWIP::lwip_driver_output(struct netif* netif, struct pbuf* p) {
 	NpsGateLWIP* nglwip = (NpsGateLWIP*)netif->state;
 
@@ -481,9 +1213,15 @@ err_t NpsGateLWIP::lwip_driver_output(struct netif* netif, struct pbuf* p) {
 		return ERR_MEM;
 	}
 
-	/* Copy the packet from the pbuf in to our transmit buffer. */
-	pbuf_copy_partial(p, nglwip->xmit_buffer, p->tot_len, 0);
-	nglwip->send_data(nglwip->xmit_buffer, p->tot_len);
+	/* A single pbuf is handed over where it is. Segments carrying data written by
+	   reference are a header pbuf followed by the data, and Crafter needs them in
+	   one piece, so those are gathered in to the transmit buffer first. */
+	if(!p->next) {
+		nglwip->send_data((uint8_t*)p->payload, p->len);
+	} else {
+		pbuf_copy_partial(p, nglwip->xmit_buffer, p->tot_len, 0);
+		nglwip->send_data(nglwip->xmit_buffer, p->tot_len);
+	}
 
 	return ERR_OK;
 }
@@ -492,106 +1230,171 @@ err_t NpsGateLWIP::lwip_driver_output2(struct netif* netif, struct pbuf* q, ip_a
 	return netif->linkoutput(netif, q);
 }
 
-string NpsGateLWIP::stats() {
-	char buffer[256];
+bool NpsGateLWIP::set_window(uint32_t wnd, uint32_t snd_buf) {
+	if(tcp_set_window(wnd, snd_buf) != ERR_OK) {
+		LOG_WARNING("Window of %u bytes and send buffer of %u bytes are too small, must be at least %u and %u.\n",
+				wnd, snd_buf, TCP_MSS, 2 * TCP_MSS);
+		return false;
+	}
+
+	if(wnd > tcp_cfg_wnd) {
+		LOG_WARNING("Window of %u bytes is larger than window scaling allows, using %u.\n", wnd, (unsigned int)tcp_cfg_wnd);
+	}
+	return true;
+}
+
+void NpsGateLWIP::window_stats(WindowStats* ws) {
+	*ws = window_counts;
+	ws->recoveries = tcp_sack_stats.recoveries;
+	ws->rexmit_bytes = tcp_sack_stats.rexmit_bytes;
+	ws->sack_rexmit_bytes = tcp_sack_stats.sack_rexmit_bytes;
+	ws->sacked_bytes = tcp_sack_stats.sacked_bytes;
+	ws->half_open = half_open.size();
+	ws->syn_dropped = syn_dropped;
+	ws->reaped = reaped;
+}
+
+string WindowStats::str() const {
+	char buffer[512];
+
+	snprintf(buffer, sizeof(buffer),
+			"connections=%u scaled=%u window_limited=%u inflight=%llu snd_wnd=%llu utilisation=%u%% rcv_queued=%llu "
+			"sack=%u recoveries=%u rexmit_bytes=%llu sack_rexmit_bytes=%llu sacked_bytes=%llu "
+			"half_open=%u syn_dropped=%llu reaped=%llu",
+			connections, scaled, window_limited, inflight, snd_wnd,
+			(unsigned int)(snd_wnd ? inflight * 100 / snd_wnd : 0), rcv_queued,
+			sack, recoveries, rexmit_bytes, sack_rexmit_bytes, sacked_bytes,
+			half_open, syn_dropped, reaped);
+	return string(buffer);
+}
+
+/* One line per connection half: the connection, which side, the algorithm, cwnd,
+   smoothed and minimum RTT in ms, and the delivery and pacing rates in bytes per
+   second. Capped so a busy stack does not publish megabytes every interval. Only
+   the connection table is walked, as in connection_stats(). */
+string NpsGateLWIP::cc_stats() {
+	const unsigned int max_lines = 256;
+	vector<SplitConnection*> conns;
+	char buffer[192];
 	string str;
 
-	snprintf(buffer, 256,
-			"sockets: %u\n"
-			"lsockets: %u\n",
-			lwip_listening_socket_count(),
-			lwip_active_socket_count());
+	connections.values(&conns, max_lines / 2);
+	BOOST_FOREACH(SplitConnection* conn, conns) {
+		SplitEndpoint* ends[] = { &conn->client, &conn->server };
 
-	str = buffer;
+		BOOST_FOREACH(SplitEndpoint* ep, ends) {
+			const tcp_pcb* pcb = ep->pcb;
 
-	struct tcp_pcb_listen* lpcb = tcp_listen_pcbs.listen_pcbs;
-	while(lpcb) {
-		str += lpcb_stats(lpcb);
-		lpcb = lpcb->next;
-	}
+			if(!pcb || pcb->state != ESTABLISHED) {
+				continue;
+			}
 
-	struct tcp_pcb* apcb = tcp_active_pcbs;
-	while(apcb) {
-		str += pcb_stats(apcb);
-		apcb = apcb->next;
+			snprintf(buffer, sizeof(buffer), "%s %s cc=%s cwnd=%u srtt=%u min_rtt=%u rate=%u pacing=%u\n",
+					conn->key.str().c_str(), ep == &conn->client ? "client" : "server",
+					pcb->cc ? pcb->cc->name : "default", (unsigned int)pcb->cwnd,
+					pcb->srtt_ms, pcb->min_rtt_ms, pcb->delivery_rate, pcb->pacing_rate);
+			str += buffer;
+		}
 	}
 
 	return str;
 }
 
-string NpsGateLWIP::lpcb_stats(tcp_pcb_listen* pcb) {
-	char buffer[32];
-	in_addr ip_addr;
+/* One line per pool: element size in bytes, elements in the pool, in use now and
+   at most, and allocations that failed because it was empty */
+string NpsGateLWIP::pool_stats() {
+	char buffer[160];
+	string str;
 
-	ip_addr.s_addr = pcb->local_ip.addr;
-	snprintf(buffer, 32, "%s:%u\n", inet_ntoa(ip_addr), pcb->local_port);
+	for(int i = 0; i < MEMP_MAX; i++) {
+		struct memp_usage u;
 
-	return string(buffer);
+		memp_get_usage((memp_t)i, &u);
+		if(u.num == 0) {
+			continue;
+		}
+
+		snprintf(buffer, sizeof(buffer), "%s size=%u num=%u used=%u max=%u failed=%u\n",
+				u.name, u.size, u.num, u.used, u.max, u.err);
+		str += buffer;
+	}
+
+	return str;
 }
 
-string NpsGateLWIP::pcb_stats(tcp_pcb* pcb) {
-	char buffer[128];
-	char saddr[16], daddr[16];
-	tcp_seg* seg;
-	pbuf* pbuf;
-	int unsent, unacked, oos, refused, qpb_size = 0;
-	in_addr sip_addr, dip_addr;
-
-	for(seg = pcb->unsent, unsent=0; seg; seg = seg->next, unsent++);
-	for(seg = pcb->unacked, unacked=0; seg; seg = seg->next, unacked++);
-	for(seg = pcb->ooseq, oos=0; seg; seg = seg->next, oos++);
-	for(pbuf = pcb->refused_data, refused=0; pbuf && pbuf->len != pbuf->tot_len; pbuf=pbuf->next, refused+=pbuf->len);
-
-	map<tcp_pcb*, QueuedPbuf>::iterator iter = queued_pbufs.find(pcb);
-	if(iter != queued_pbufs.end()) {
-//		qpb_size = iter->second.p->tot_len;
-	}
-
-	sip_addr.s_addr = pcb->local_ip.addr;
-	dip_addr.s_addr = pcb->remote_ip.addr;
-	strncpy(saddr, inet_ntoa(sip_addr), 16);
-	strncpy(daddr, inet_ntoa(dip_addr), 16);
-	snprintf(buffer, 128, "%s:%u => %s:%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u",
-			saddr, pcb->local_port,
-			daddr, pcb->remote_port, 
-			pcb->rcv_wnd, pcb->rcv_ann_wnd, unsent, unacked, oos, refused, qpb_size);
-	return string(buffer);
+void NpsGateLWIP::proxy_totals(ProxyTotals* t) {
+	*t = totals;
+	t->segs_out = lwip_stats.tcp.xmit;
+	t->segs_in = lwip_stats.tcp.recv;
+	t->drops = lwip_stats.tcp.drop;
+	t->chkerr = lwip_stats.tcp.chkerr;
+	t->memerr = lwip_stats.tcp.memerr;
 }
 
-unsigned int NpsGateLWIP::lwip_listening_socket_count() {
-	struct tcp_pcb_listen* listen = tcp_listen_pcbs.listen_pcbs;
-	int i;
+/* Each side of a connection: its state, bytes received and acknowledged, bytes
+   waiting to be written to it, unacknowledged bytes in flight, smoothed RTT in
+   ms, bytes retransmitted and the peer's, congestion and our receive windows.
+   Only the connections are walked, lwIP's counters are read where they are. */
+string NpsGateLWIP::connection_stats(unsigned int max) {
+	vector<SplitConnection*> conns;
+	time_t now = time(NULL);
+	char buffer[64];
+	string str;
+
+	connections.values(&conns, max);
+	BOOST_FOREACH(SplitConnection* conn, conns) {
+		snprintf(buffer, sizeof(buffer), " age=%u\n", (unsigned int)(conn->opened ? now - conn->opened : 0));
 
-	for(i=0; listen != NULL; i++) {
-		listen = listen->next;
+		str += conn->key.str() + " client " + endpoint_stats(&conn->client) + buffer;
+		str += conn->key.str() + " server " + endpoint_stats(&conn->server) + buffer;
 	}
 
-	return i;
+	return str;
 }
 
-unsigned int NpsGateLWIP::lwip_active_socket_count() {
-	struct tcp_pcb* active = tcp_active_pcbs;
-	int i;
-
-	for(i=0; active != NULL; i++) {
-		active = active->next;
-	}
+string NpsGateLWIP::endpoint_stats(const SplitEndpoint* ep) {
+	const tcp_pcb* pcb = ep->pcb;
+	char buffer[256];
 
-	return i;
+	snprintf(buffer, sizeof(buffer), "state=%s rx=%llu tx=%llu queued=%u inflight=%u srtt=%u rexmit=%u snd_wnd=%u cwnd=%u rcv_wnd=%u",
+			pcb ? tcp_debug_state_str(pcb->state) : "CLOSED", ep->rx_bytes, ep->tx_bytes, ep->queued,
+			pcb ? (unsigned int)(pcb->snd_nxt - pcb->lastack) : 0, pcb ? pcb->srtt_ms : 0,
+			pcb ? pcb->rexmit_bytes : 0, pcb ? (unsigned int)pcb->snd_wnd : 0,
+			pcb ? (unsigned int)pcb->cwnd : 0, pcb ? (unsigned int)pcb->rcv_wnd : 0);
+	return string(buffer);
 }
 
-
 bool NpsGateLWIP::timeout() {
-//	list<tcp_pcb*>::iterator iter = close_list.begin();
-//	while(iter != close_list.end()) {
-//		tcp_close(*iter);
-//		iter = close_list.erase(iter);
-//	}
+	vector<SplitConnection*> syn, stuck, idle;
+	time_t now = time(NULL);
 
 	tcp_tmr();
-	return true;
-}
 
+	BOOST_FOREACH(SplitConnection* conn, retired) {
+		delete conn;
+	}
+	retired.clear();
+
+	/* Age out clients that never completed the handshake, connections whose close
+	   stalled because a peer stopped acknowledging, and connections whose hosts
+	   went away without closing them. Each table is swept a slice at a time, so
+	   this costs the same with ten or ten thousand connections. */
+	half_open.expire(now, syn_timeout, &syn);
+	closing.expire(now, close_timeout, &stuck);
+	connections.expire(now, idle_timeout, &idle);
+
+	BOOST_FOREACH(SplitConnection* conn, syn) {
+		LOG_DEBUG("Aborting half open connection %s\n", conn->key.str().c_str());
+		reap(conn);
+	}
+	BOOST_FOREACH(SplitConnection* conn, stuck) {
+		LOG_DEBUG("Aborting stalled close of %s\n", conn->key.str().c_str());
+		reap(conn);
+	}
+	BOOST_FOREACH(SplitConnection* conn, idle) {
+		LOG_DEBUG("Aborting idle connection %s\n", conn->key.str().c_str());
+		reap(conn);
+	}
 
-map<tcp_pcb*, QueuedPbuf> NpsGateLWIP::queued_pbufs;
-list<tcp_pcb*> NpsGateLWIP::close_list;
+	return true;
+}
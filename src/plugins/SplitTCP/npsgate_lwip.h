@@ -23,29 +23,326 @@
 #include <crafter.h>
 #include <unistd.h> 
 #include <map>
+#include <boost/foreach.hpp>
 #include "../npsgate_plugin.hpp"
 #include "../logger.hpp"
+#include "../flow_table.hpp"
+#include "../proxy_stats.hpp"
+#include "../http_cache.hpp"
 #include "split_tcp.h"
 
 #include "lwip/tcp.h"
+#include "lwip/pbuf.h"
+#include "lwip/memp.h"
 
-struct QueuedPbuf {
-	tcp_pcb* spcb;
-	tcp_pcb* dpcb;
-	list<pbuf*> pbuf_list;
+class SplitTCP;
+class NpsGateLWIP;
+struct SplitConnection;
+
+/* A received packet handed to lwIP without copying it. The pbuf points in to the
+   packet's buffer and holds a reference to the packet until lwIP frees it. */
+struct PacketPbuf {
+	struct pbuf_custom pc;
+	Packet* packet;
+	NpsGateLWIP* lwip;
 };
 
-class SplitTCP;
+/* Data written to an endpoint by the HTTP cache rather than received on its
+   peer: a request forwarded from the copy the cache made of it, or a response
+   served from the cache, which holds a reference to it. Only a forwarded
+   request was received on the peer and opens its window once acknowledged. */
+struct HttpPbuf {
+	struct pbuf_custom pc;
+	HttpCachedResponse* response;
+	uint8_t* copy;
+	bool window;
+};
+
+/* What the HTTP cache knows of a connection to one of splittcp.http_cache.ports.
+   The client's bytes are copied in to 'pending' instead of being forwarded, and
+   its requests are taken one at a time. Each is answered from the cache, waits
+   for another connection already fetching the same response, or is forwarded
+   to the server while the response is followed back. Anything that does not
+   parse as HTTP turns the connection in to a plain split connection. */
+struct HttpSession {
+	enum State {
+		IDLE,			/* Reading the next request */
+		WAITING,		/* For another connection fetching 'key' */
+		FORWARDING,		/* The request went to the server, following the response */
+		PASSTHROUGH
+	};
+
+	HttpSession() : request(HTTP_REQUEST), response(HTTP_RESPONSE), state(IDLE), parsed(0), to_forward(0),
+			filling(false), capturing(false), started(0), response_bytes(0) { }
+
+	HttpParser request;
+	HttpParser response;
+	State state;
+	string pending;		/* Received from the client and not yet acknowledged to it */
+	size_t parsed;		/* Bytes of 'pending' the request parser has seen */
+	size_t to_forward;	/* Bytes at the front of 'pending' to write to the server */
+	HttpMessage req;	/* The request being answered */
+	string key;			/* Its cache key, empty if the response may not be cached */
+	bool filling;		/* Others may be waiting for this connection's response */
+	bool capturing;		/* The response is being copied to be stored */
+	vector<uint8_t> capture;
+	uint64_t started;	/* When the request arrived [us] */
+	unsigned long long response_bytes;
+};
+
+/* What one half of a connection last added to its stack's WindowStats, so it
+   can be taken back out when its pcb changes or goes away */
+struct WindowSample {
+	WindowSample() : counted(false), scaled(false), sack(false), limited(false),
+			inflight(0), snd_wnd(0), rcv_queued(0) { }
+
+	bool counted;		/* ESTABLISHED or CLOSE_WAIT */
+	bool scaled;
+	bool sack;
+	bool limited;
+	uint32_t inflight;
+	uint32_t snd_wnd;
+	uint32_t rcv_queued;
+};
+
+/* One half of a split connection. Each endpoint is the callback arg of its pcb,
+   and 'queue' holds data received on the peer waiting to be written to 'pcb'.
+   Data is written by reference, so a pbuf moves to 'inflight' once all of it
+   has been written and is only freed after the other end acknowledged it.
+   'pcb' is set to NULL once lwIP no longer owns it for us. */
+struct SplitEndpoint {
+	SplitEndpoint() : pcb(NULL), peer(NULL), conn(NULL), written(0), acked(0), closing(false),
+			rx_bytes(0), tx_bytes(0), queued(0) { }
+
+	tcp_pcb* pcb;
+	SplitEndpoint* peer;
+	SplitConnection* conn;
+	list<pbuf*> queue;
+	list<pbuf*> inflight;
+	uint32_t written;	/* Bytes of queue.front() already written */
+	uint32_t acked;		/* Acknowledged bytes not yet matched to 'inflight' */
+	bool closing;		/* Close once everything written has been acknowledged */
+
+	unsigned long long rx_bytes;	/* Received from the host this end faces */
+	unsigned long long tx_bytes;	/* Written to it and acknowledged */
+	uint32_t queued;				/* Bytes in 'queue' not yet written */
+	WindowSample window;			/* See NpsGateLWIP::track_window() */
+
+	inline bool drained() const { return queue.empty() && inflight.empty(); }
+};
+
+/* A proxied connection, keyed in the flow table by the 4-tuple of the SYN that
+   opened it. 'client' is the pcb accepted from that SYN, 'server' the pcb we
+   open to the original destination. Until the handshake with the client
+   completes the connection is half open and 'client.pcb' is NULL. */
+struct SplitConnection {
+	SplitConnection(const FlowKey& k, NpsGateLWIP* l) : key(k), lwip(l), opened(0), retired(false), http(NULL) {
+		client.peer = &server;
+		server.peer = &client;
+		client.conn = server.conn = this;
+	}
+
+	~SplitConnection() {
+		SplitEndpoint* ends[] = { &client, &server };
+
+		BOOST_FOREACH(SplitEndpoint* ep, ends) {
+			BOOST_FOREACH(pbuf* p, ep->queue) {
+				pbuf_free(p);
+			}
+			BOOST_FOREACH(pbuf* p, ep->inflight) {
+				pbuf_free(p);
+			}
+		}
+		delete http;
+	}
+
+	FlowKey key;
+	NpsGateLWIP* lwip;
+	SplitEndpoint client;
+	SplitEndpoint server;
+	time_t opened;		/* When the handshake with the client completed */
+	bool retired;
+	HttpSession* http;	/* NULL unless the HTTP cache is looking at the connection */
+};
+
+/* How well the connections of a stack use their windows. A connection is
+   window limited when what it has in flight fills the smaller of the peer's
+   window and its congestion window. */
+struct WindowStats {
+	WindowStats() : connections(0), scaled(0), window_limited(0), inflight(0), snd_wnd(0), rcv_queued(0),
+			sack(0), recoveries(0), rexmit_bytes(0), sack_rexmit_bytes(0), sacked_bytes(0),
+			half_open(0), syn_dropped(0), reaped(0) { }
+
+	unsigned int connections;
+	unsigned int scaled;			/* Window scaling agreed with the peer */
+	unsigned int window_limited;
+	unsigned long long inflight;	/* Bytes sent and not yet acknowledged */
+	unsigned long long snd_wnd;		/* Sum of the windows offered by the peers */
+	unsigned long long rcv_queued;	/* Bytes received that lwIP has not been told were read */
+
+	/* SACK agreed with the peer. The rest are totals since the stack started. */
+	unsigned int sack;
+	unsigned int recoveries;
+	unsigned long long rexmit_bytes;
+	unsigned long long sack_rexmit_bytes;	/* Retransmissions aimed at holes reported by SACK */
+	unsigned long long sacked_bytes;		/* Reported received out of order, so not resent */
+
+	/* Handshakes in progress, and totals of SYNs refused because a limit was
+	   reached and of connections reaped for not completing a handshake or a close */
+	unsigned int half_open;
+	unsigned long long syn_dropped;
+	unsigned long long reaped;
+
+	void add(const WindowStats& s) {
+		connections += s.connections;
+		scaled += s.scaled;
+		window_limited += s.window_limited;
+		inflight += s.inflight;
+		snd_wnd += s.snd_wnd;
+		rcv_queued += s.rcv_queued;
+		sack += s.sack;
+		recoveries += s.recoveries;
+		rexmit_bytes += s.rexmit_bytes;
+		sack_rexmit_bytes += s.sack_rexmit_bytes;
+		sacked_bytes += s.sacked_bytes;
+		half_open += s.half_open;
+		syn_dropped += s.syn_dropped;
+		reaped += s.reaped;
+	}
+
+	string str() const;
+};
+
+/* Congestion control for the two sides of connections to 'prefix'/'mask', both in
+   host byte order */
+struct CongestionRule {
+	uint32_t prefix;
+	uint32_t mask;
+	const tcp_cc_ops* client;
+	const tcp_cc_ops* server;
+};
+
+/* Which congestion control each side of a proxied connection uses. The client side
+   faces the host that opened the connection, the server side its original
+   destination. Rules are kept longest prefix first and matched on that destination,
+   anything else uses the defaults. NULL is lwIP's built in Reno. Not changed once
+   the stacks are running, so they all share one. */
+struct CongestionPolicy {
+	CongestionPolicy() : client(NULL), server(NULL) { }
+
+	const tcp_cc_ops* client;
+	const tcp_cc_ops* server;
+	vector<CongestionRule> rules;
+
+	void add(const CongestionRule& r) {
+		vector<CongestionRule>::iterator i = rules.begin();
+		while(i != rules.end() && i->mask >= r.mask) {
+			i++;
+		}
+		rules.insert(i, r);
+	}
+
+	void select(uint32_t daddr, const tcp_cc_ops** c, const tcp_cc_ops** s) const {
+		BOOST_FOREACH(const CongestionRule& r, rules) {
+			if((daddr & r.mask) == r.prefix) {
+				*c = r.client;
+				*s = r.server;
+				return;
+			}
+		}
+		*c = client;
+		*s = server;
+	}
 
+	/* Whether any of the algorithms paces, the stacks then run tcp_pace_tmr() */
+	bool paced() const {
+		if((client && client->pacing) || (server && server->pacing)) {
+			return true;
+		}
+		BOOST_FOREACH(const CongestionRule& r, rules) {
+			if((r.client && r.client->pacing) || (r.server && r.server->pacing)) {
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+/* Which of 'n' workers handles the flow. Uses the top bits of the hash so the
+   choice is independent of the slot the flow lands in within a FlowTable. */
+static inline unsigned int split_shard(const FlowKey& key, unsigned int n) {
+	return (unsigned int)(((uint64_t)key.symmetric_hash() * n) >> 32);
+}
+
+/* One lwIP stack. lwIP keeps its state in thread-local globals, so an instance
+   must be created, used and deleted by a single thread, and each thread can run
+   at most one. 'shard' and 'shards' say which slice of the flows it is given.
+   Its memory pools are allocated when it is created, size them beforehand with
+   memp_set_num() from the same thread. */
 class NpsGateLWIP {
 	public:
-		NpsGateLWIP(SplitTCP*, uint16_t);
+		NpsGateLWIP(SplitTCP*, uint16_t, unsigned int shard = 0, unsigned int shards = 1);
 		~NpsGateLWIP();
 		bool inject_packet(Packet* p);
 		bool send_data(uint8_t* data, int len);
 		bool timeout();
 
-		string stats();
+		/* Connections that have seen no traffic for this many seconds are aborted */
+		inline void set_idle_timeout(time_t t) { idle_timeout = t; }
+
+		/* SYNs for new connections are dropped while the stack proxies 'max'
+		   connections or 'max_half_open' of them are still in the handshake. */
+		inline void set_connection_limits(size_t max, size_t max_half_open) {
+			max_connections = max;
+			this->max_half_open = max_half_open;
+		}
+
+		/* Connections are aborted when the client does not complete the handshake
+		   within 'syn' seconds, or when closing them takes longer than 'close'. */
+		inline void set_close_timeouts(time_t syn, time_t close) {
+			syn_timeout = syn;
+			close_timeout = close;
+		}
+
+		/* Receive window and send buffer, in bytes, of connections opened from now on */
+		bool set_window(uint32_t wnd, uint32_t snd_buf);
+
+		/* Whether connections opened from now on offer selective acknowledgements */
+		inline void set_sack(bool enable) { tcp_set_sack(enable ? 1 : 0); }
+
+		/* Congestion control of connections accepted from now on. Must outlive the stack. */
+		inline void set_congestion(const CongestionPolicy* p) { congestion = p; }
+
+		/* Answers HTTP requests to 'ports' from 'cache', shared between the stacks.
+		   Both must outlive the stack. */
+		inline void set_http_cache(HttpCache* cache, const vector<uint16_t>* ports) {
+			http_cache = cache;
+			http_ports = ports;
+		}
+
+		/* Sends what paced connections held back. Call every TCP_PACE_INTERVAL ms
+		   while pacing_pending(), more often does no harm. */
+		inline void pace() {
+			if(tcp_pacing_pending) {
+				tcp_pace_tmr();
+			}
+		}
+		inline bool pacing_pending() const { return tcp_pacing_pending != 0; }
+
+		/* The fetch of the response under 'key' ended, on this stack or another.
+		   This stack's connections waiting for it are answered or forwarded. */
+		void http_fill_done(const string& key);
+
+		/* Kept up to date from the lwIP callbacks, like the totals */
+		void window_stats(WindowStats* ws);
+		string cc_stats();
+		string pool_stats();
+
+		/* Totals kept up to date as connections open, move data and close */
+		void proxy_totals(ProxyTotals* t);
+
+		/* One line per side of up to 'max' connections */
+		string connection_stats(unsigned int max);
 
 		uint8_t* xmit_buffer;
 	private:
@@ -53,6 +350,38 @@ class NpsGateLWIP {
 		struct netif if_in, if_out;
 		SplitTCP* stcp;
 
+		FlowTable<SplitConnection*> connections;
+		FlowTable<SplitConnection*> half_open;	/* Waiting for the client's handshake */
+		FlowTable<SplitConnection*> closing;	/* Draining after the first FIN */
+		list<SplitConnection*> retired;
+
+		/* Accepts the SYN of every connection, see LWIP_TCP_TRANSPARENT */
+		tcp_pcb* listener;
+
+		/* lwIP's active pcbs, see the hooks in npsgate_lwip.cpp */
+		FlowTable<tcp_pcb*> pcb_table;
+		unsigned int shard;
+		unsigned int shards;
+		time_t idle_timeout;
+		time_t syn_timeout;
+		time_t close_timeout;
+		size_t max_connections;
+		size_t max_half_open;
+		unsigned long long syn_dropped;
+		unsigned long long reaped;
+		ProxyTotals totals;
+		WindowStats window_counts;
+		const CongestionPolicy* congestion;
+
+		/* This stack's connections waiting for a response that a connection on
+		   any stack is fetching, see HttpCache::begin_fill() */
+		HttpCache* http_cache;
+		const vector<uint16_t>* http_ports;
+		map<string, list<SplitConnection*> > http_waiting;
+
+		/* Free PacketPbufs, reused for every received packet */
+		vector<PacketPbuf*> pbuf_pool;
+
 		uint16_t mtu;
 
 		static err_t accept_connection(void* arg, tcp_pcb* newpcb,  err_t err);
@@ -60,23 +389,40 @@ class NpsGateLWIP {
 		static err_t recv_data(void* arg, tcp_pcb* pcb, pbuf* p, err_t err);
 		static err_t sent_data(void* arg, tcp_pcb* pcb, uint16_t len);
 		static void error(void* arg, err_t err);
-		static void transmit_pbuf(tcp_pcb* spcb, tcp_pcb* dpcb, pbuf* p);
-		static void transmit_queued_pbufs(tcp_pcb*);
+		static err_t poll(void* arg, tcp_pcb* pcb);
+		static void transmit_pbuf(SplitEndpoint* ep, pbuf* p);
+		static void transmit_queued_pbufs(SplitEndpoint* ep);
+		static void release_acked(SplitEndpoint* ep);
+		static void return_window(SplitEndpoint* ep, pbuf* p);
+		static void close_endpoint(SplitEndpoint* ep);
+		static void close_drained(SplitEndpoint* ep);
+		static void abort_endpoint(SplitEndpoint* ep);
+		static void track_window(SplitEndpoint* ep);
+		void retire(SplitConnection* conn, bool aborted);
+		void reap(SplitConnection* conn);
+		bool bind_outgoing(tcp_pcb* pcb, const FlowKey& key, ip_addr* sipaddr);
 
-		list<tcp_pcb*> pcb_list;
-		static list<tcp_pcb*> close_list;
-		static map<tcp_pcb*, QueuedPbuf> queued_pbufs;
+		static void http_client_data(SplitConnection* conn, pbuf* p);
+		static void http_server_data(SplitConnection* conn, pbuf* p);
+		static void http_client_closed(SplitConnection* conn);
+		static void http_pump(SplitConnection* conn);
+		static void http_request(SplitConnection* conn);
+		static void http_forward_request(SplitConnection* conn);
+		static void http_response_head(SplitConnection* conn);
+		static void http_response_done(SplitConnection* conn);
+		static void http_serve(SplitConnection* conn, HttpCachedResponse* r);
+		static void http_resume(SplitConnection* conn);
+		static void http_passthrough(SplitConnection* conn);
+		static void http_write(SplitEndpoint* ep, const uint8_t* data, size_t len, HttpCachedResponse* r, bool window);
+		void http_end_fill(SplitConnection* conn);
+		static void free_http_pbuf(struct pbuf* p);
 
 		static err_t lwip_driver_init(struct netif* netif);
 		static void lwip_driver_input(struct netif* netif, Packet* pkt);
+		static void free_packet_pbuf(struct pbuf* p);
 		static err_t lwip_driver_output(struct netif* netif, struct pbuf* p);
 		static err_t lwip_driver_output2(struct netif* netif, struct pbuf* q, ip_addr_t* ipdaddr);
-		
-		static string lpcb_stats(tcp_pcb_listen* pcb);
-		static string pcb_stats(tcp_pcb* pcb);
-		static unsigned int lwip_listening_socket_count();
-		static unsigned int lwip_active_socket_count();
-
+		static string endpoint_stats(const SplitEndpoint* ep);
 };
 
 extern "C" {
@@ -28,19 +28,98 @@
 #include "lwip/tcp.h"
 #include "lwip/tcp_impl.h"
 #include "lwip/stats.h"
+#include "lwip/sys.h"
 
 using namespace Crafter;
 using namespace NpsGate;
 SplitTCP::SplitTCP(PluginCore* c) : NpsGatePlugin(c) {
-	lwip = new NpsGateLWIP(this, 1500);
+	running = false;
+	idle_timeout = 3600;
+	syn_timeout = 30;
+	close_timeout = 120;
+	max_connections = 50000;
+	max_half_open = 4096;
+	window = TCP_WND;
+	send_buffer = TCP_SND_BUF;
+	sack = true;
+	stats_interval = 5;
+	stats_connections = 256;
+	last_stats = 0;
+	stats_requested = false;
+	http_cache = NULL;
 }
 
 SplitTCP::~SplitTCP() {
-	delete lwip;
+	stop_workers();
+	delete http_cache;
 }
 
 bool SplitTCP::init() {
+	unsigned int nworkers = 1;
+
 	set_timeout(250);
+
+	window_topic = register_topic("SplitTCP.window");
+	cc_topic = register_topic("SplitTCP.cc");
+	pools_topic = register_topic("SplitTCP.pools");
+	totals_topic = register_topic("SplitTCP.totals");
+	connections_topic = register_topic("SplitTCP.connections");
+	http_cache_topic = register_topic("SplitTCP.http_cache");
+
+	const Config* config = get_config();
+	config->lookupValue("splittcp.idle_timeout", idle_timeout);
+	config->lookupValue("splittcp.syn_timeout", syn_timeout);
+	config->lookupValue("splittcp.close_timeout", close_timeout);
+	config->lookupValue("splittcp.max_connections", max_connections);
+	config->lookupValue("splittcp.max_half_open", max_half_open);
+	config->lookupValue("splittcp.workers", nworkers);
+	config->lookupValue("splittcp.window", window);
+	config->lookupValue("splittcp.send_buffer", send_buffer);
+	config->lookupValue("splittcp.sack", sack);
+	config->lookupValue("splittcp.stats_interval", stats_interval);
+	config->lookupValue("splittcp.stats_connections", stats_connections);
+
+	if(stats_interval < 1) {
+		stats_interval = 1;
+	}
+
+	if(!parse_congestion(config) || !parse_pools(config) || !parse_http_cache(config)) {
+		return false;
+	}
+
+	/* Two pcbs for every connection, the TIME_WAIT ones are reclaimed when short */
+	if(!pool_sizes.count(MEMP_TCP_PCB)) {
+		pool_sizes[MEMP_TCP_PCB] = 2 * max_connections + 16;
+	}
+
+	/* Even a single stack runs on a worker. lwIP's state belongs to the thread
+	   that initializes it, and unlike the plugin thread, which is cancelled on
+	   unload, a worker is joined and tears its stack down itself. */
+	if(nworkers < 1) {
+		nworkers = 1;
+	}
+
+	running = true;
+	for(unsigned int i = 0; i < nworkers; i++) {
+		SplitWorker* w = new SplitWorker();
+		w->index = i;
+		w->plugin = this;
+		w->stats_due = false;
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		workers.push_back(w);
+	}
+
+	for(size_t i = 0; i < workers.size(); i++) {
+		if(pthread_create(&workers[i]->thread, NULL, worker_main, workers[i])) {
+			LOG_CRITICAL("Failed to start SplitTCP worker %u.\n", (unsigned int)i);
+			workers.resize(i);
+			stop_workers();
+			return false;
+		}
+	}
+
+	LOG_INFO("SplitTCP running %u lwIP stacks.\n", nworkers);
 	return true;
 }
 
@@ -55,12 +134,35 @@ bool SplitTCP::send_data(uint8_t* data, int len) {
 }
 
 bool SplitTCP::process_packet(Packet* p) {
-	lwip->inject_packet(p);
+	/* lwIP works on the packet's buffer directly and byte swaps the headers */
+	p = make_writable(p);
+
+	FlowKey key;
+	SplitWorker* w = workers[0];
+
+	/* Anything that is not TCP goes to the first worker, which discards it */
+	if(workers.size() > 1 && FlowKey::from_ip_header(p->GetRawPtr(), p->GetSize(), &key)) {
+		w = workers[split_shard(key, workers.size())];
+	}
+
+	pthread_mutex_lock(&w->lock);
+	w->queue.push_back(share_packet(p));
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
 
 	drop_packet(p);
 	return true;
 }
 
+void SplitTCP::http_fill_done(unsigned int shard, const string& key) {
+	SplitWorker* w = workers[shard];
+
+	pthread_mutex_lock(&w->lock);
+	w->fills_done.push_back(key);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
 bool SplitTCP::process_message(Message* m) {
 
 
@@ -68,32 +170,447 @@ bool SplitTCP::process_message(Message* m) {
 	return true;
 }
 
+/* When a publication is due the workers are asked for their stats first, and
+   they are published once every worker has answered */
 bool SplitTCP::message_timeout() {
-/*	static time_t last_stats = 0;
+	if(time(NULL) - last_stats >= (time_t)stats_interval) {
+		if(!stats_requested) {
+			BOOST_FOREACH(SplitWorker* w, workers) {
+				pthread_mutex_lock(&w->lock);
+				w->stats_due = true;
+				pthread_cond_signal(&w->cond);
+				pthread_mutex_unlock(&w->lock);
+			}
+			stats_requested = true;
+			return true;
+		}
+
+		BOOST_FOREACH(SplitWorker* w, workers) {
+			bool due;
+
+			pthread_mutex_lock(&w->lock);
+			due = w->stats_due;
+			pthread_mutex_unlock(&w->lock);
+			if(due) {
+				return true;
+			}
+		}
 
-	
-	if(time(NULL) - last_stats > 5) {
-		NpsGateVar* var = new NpsGateVar();
-		var->set(lwip->stats());
+		publish_window_stats();
+		publish_cc_stats();
+		publish_pool_stats();
+		publish_totals();
+		publish_connection_stats();
+		publish_http_cache_stats();
+		last_stats = time(NULL);
+		stats_requested = false;
+	}
+
+	return true;
+}
 
-		publish("SplitTCP.stats", var);
+/* Leaves '*ops' as it is when 'name' is not set */
+static bool lookup_cc(const Setting& s, const char* name, const tcp_cc_ops** ops) {
+	string alg;
 
-		string s = var->get<string>();
+	if(!s.lookupValue(name, alg)) {
+		return true;
+	}
 
-		LOG_DEBUG("STATS: %s\n", s.c_str());
+	if(alg == "default") {
+		*ops = NULL;
+		return true;
+	}
 
-		last_stats = time(NULL);
-	}*/
+	*ops = tcp_cc_find(alg.c_str());
+	if(!*ops) {
+		LOG_CRITICAL("Unknown %s congestion control '%s', use reno, hybla, rate or default.\n", name, alg.c_str());
+		return false;
+	}
+	return true;
+}
+
+/* splittcp.congestion picks the algorithm for each side, and for each side of
+   connections to particular prefixes */
+bool SplitTCP::parse_congestion(const Config* config) {
+	if(!config->exists("splittcp.congestion")) {
+		return true;
+	}
+
+	try {
+		const Setting& cc = config->lookup("splittcp.congestion");
+
+		if(!lookup_cc(cc, "client", &congestion.client) || !lookup_cc(cc, "server", &congestion.server)) {
+			return false;
+		}
+
+		if(cc.exists("rules")) {
+			const Setting& rules = cc["rules"];
+			for(int i = 0; i < rules.getLength(); i++) {
+				CongestionRule r;
+				string prefix;
+				in_addr addr;
+				unsigned int len = 32;
+				size_t slash;
+
+				if(!rules[i].lookupValue("prefix", prefix)) {
+					LOG_CRITICAL("Congestion rule %d has no prefix.\n", i);
+					return false;
+				}
+
+				slash = prefix.find('/');
+				if(slash != string::npos) {
+					len = atoi(prefix.c_str() + slash + 1);
+				}
+				if(inet_aton(prefix.substr(0, slash).c_str(), &addr) == 0 || len > 32) {
+					LOG_CRITICAL("Failed to parse congestion rule prefix: %s\n", prefix.c_str());
+					return false;
+				}
+
+				r.mask = len ? 0xffffffff << (32 - len) : 0;
+				r.prefix = ntohl(addr.s_addr) & r.mask;
+				r.client = congestion.client;
+				r.server = congestion.server;
+				if(!lookup_cc(rules[i], "client", &r.client) || !lookup_cc(rules[i], "server", &r.server)) {
+					return false;
+				}
+				congestion.add(r);
+			}
+		}
+	} catch(SettingException& ex) {
+		LOG_CRITICAL("Invalid congestion configuration at '%s'.\n", ex.getPath());
+		return false;
+	}
+
+	LOG_INFO("SplitTCP congestion control: client %s, server %s, %u prefix rules.\n",
+			congestion.client ? congestion.client->name : "default",
+			congestion.server ? congestion.server->name : "default",
+			(unsigned int)congestion.rules.size());
+	return true;
+}
+
+/* splittcp.pools sizes lwIP's memory pools by their names in memp_std.h and
+   lwippools.h, e.g. TCP_SEG = 500000. The counts are shared between the stacks. */
+bool SplitTCP::parse_pools(const Config* config) {
+	if(!config->exists("splittcp.pools")) {
+		return true;
+	}
 
-	lwip->timeout();
+	try {
+		const Setting& pools = config->lookup("splittcp.pools");
 
+		for(int i = 0; i < pools.getLength(); i++) {
+			memp_t type = memp_find(pools[i].getName());
+			unsigned int num = pools[i];
+
+			if(type == MEMP_MAX) {
+				LOG_CRITICAL("Unknown lwIP pool '%s'.\n", pools[i].getName());
+				return false;
+			}
+			pool_sizes[type] = num;
+		}
+	} catch(SettingException& ex) {
+		LOG_CRITICAL("Invalid pool configuration at '%s'.\n", ex.getPath());
+		return false;
+	}
+
+	return true;
+}
+
+/* splittcp.http_cache answers HTTP requests to 'ports' from responses kept in
+   'memory' and on 'disk' megabytes in 'path'. One cache is shared by the stacks. */
+bool SplitTCP::parse_http_cache(const Config* config) {
+	unsigned int memory = 64;
+	unsigned int disk = 0;
+	unsigned int max_object = 8;
+	string path;
+
+	if(!config->exists("splittcp.http_cache")) {
+		return true;
+	}
+
+	try {
+		const Setting& hc = config->lookup("splittcp.http_cache");
+
+		hc.lookupValue("memory", memory);
+		hc.lookupValue("disk", disk);
+		hc.lookupValue("path", path);
+		hc.lookupValue("max_object", max_object);
+
+		if(hc.exists("ports")) {
+			const Setting& ports = hc["ports"];
+			for(int i = 0; i < ports.getLength(); i++) {
+				int port = ports[i];
+				http_ports.push_back(port);
+			}
+		} else {
+			http_ports.push_back(80);
+		}
+	} catch(SettingException& ex) {
+		LOG_CRITICAL("Invalid HTTP cache configuration at '%s'.\n", ex.getPath());
+		return false;
+	}
+
+	http_cache = new HttpCache();
+	if(!http_cache->open((size_t)memory << 20, path, (uint64_t)disk << 20, (size_t)max_object << 20)) {
+		LOG_CRITICAL("Failed to open the HTTP cache in '%s': %s\n", path.c_str(), strerror(errno));
+		delete http_cache;
+		http_cache = NULL;
+		return false;
+	}
+
+	LOG_INFO("SplitTCP caching HTTP on %u ports, %u MB in memory, %u MB on disk, %llu responses found there.\n",
+			(unsigned int)http_ports.size(), memory, path.empty() ? 0 : disk, http_cache->stats().disk_entries);
 	return true;
 }
 
+/* Must be called by the thread that will run the stack */
+NpsGateLWIP* SplitTCP::create_stack(unsigned int shard, unsigned int shards) {
+	/* lwIP carves its pools out when the stack is created */
+	map<memp_t, unsigned int>::const_iterator i;
+	for(i = pool_sizes.begin(); i != pool_sizes.end(); i++) {
+		memp_set_num(i->first, (i->second + shards - 1) / shards);
+	}
+
+	NpsGateLWIP* stack = new NpsGateLWIP(this, 1500, shard, shards);
+
+	stack->set_idle_timeout(idle_timeout);
+	stack->set_close_timeouts(syn_timeout, close_timeout);
+	/* The flows are spread evenly, so each stack gets its share of the limits */
+	stack->set_connection_limits((max_connections + shards - 1) / shards, (max_half_open + shards - 1) / shards);
+	stack->set_window(window, send_buffer);
+	stack->set_sack(sack);
+	stack->set_congestion(&congestion);
+	if(http_cache) {
+		stack->set_http_cache(http_cache, &http_ports);
+	}
+	return stack;
+}
+
+void SplitTCP::publish_window_stats() {
+	WindowStats ws;
+
+	BOOST_FOREACH(SplitWorker* w, workers) {
+		pthread_mutex_lock(&w->lock);
+		ws.add(w->window);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	NpsGateVar* var = new NpsGateVar();
+	var->set(ws.str());
+	publish(window_topic, var);
+	var->unref();
+}
+
+void SplitTCP::publish_cc_stats() {
+	string s;
+
+	BOOST_FOREACH(SplitWorker* w, workers) {
+		pthread_mutex_lock(&w->lock);
+		s += w->cc;
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	NpsGateVar* var = new NpsGateVar();
+	var->set(s);
+	publish(cc_topic, var);
+	var->unref();
+}
+
+void SplitTCP::publish_pool_stats() {
+	string s;
+
+	BOOST_FOREACH(SplitWorker* w, workers) {
+		pthread_mutex_lock(&w->lock);
+		s += w->pools;
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	NpsGateVar* var = new NpsGateVar();
+	var->set(s);
+	publish(pools_topic, var);
+	var->unref();
+}
+
+void SplitTCP::publish_totals() {
+	ProxyTotals t;
+
+	BOOST_FOREACH(SplitWorker* w, workers) {
+		pthread_mutex_lock(&w->lock);
+		t.add(w->totals);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	NpsGateVar* var = new NpsGateVar();
+	var->set(t.str());
+	publish(totals_topic, var);
+	var->unref();
+}
+
+void SplitTCP::publish_connection_stats() {
+	string s;
+
+	if(stats_connections == 0) {
+		return;
+	}
+
+	BOOST_FOREACH(SplitWorker* w, workers) {
+		pthread_mutex_lock(&w->lock);
+		s += w->connections;
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	NpsGateVar* var = new NpsGateVar();
+	var->set(s);
+	publish(connections_topic, var);
+	var->unref();
+}
+
+/* The cache is shared, so this needs nothing from the workers */
+void SplitTCP::publish_http_cache_stats() {
+	if(!http_cache) {
+		return;
+	}
+
+	NpsGateVar* var = new NpsGateVar();
+	var->set(http_cache->stats().str());
+	publish(http_cache_topic, var);
+	var->unref();
+}
+
 bool SplitTCP::main() {
 	message_loop();
 	return true;
 }
 
+void SplitTCP::exit_handler() {
+	stop_workers();
+}
+
+void* SplitTCP::worker_main(void* arg) {
+	SplitWorker* w = (SplitWorker*)arg;
+
+	w->plugin->run_worker(w);
+	return NULL;
+}
+
+/* Injects queued packets a batch at a time and runs lwIP's timers every 250ms.
+   While paced connections hold back data it also wakes every TCP_PACE_INTERVAL
+   ms. Its stats are copied out only when message_timeout() asks for them. */
+void SplitTCP::run_worker(SplitWorker* w) {
+	NpsGateLWIP* stack = create_stack(w->index, workers.size());
+	vector<Packet*> batch;
+	vector<string> fills_done;
+	timespec next, now, wake;
+	bool stats_due;
+	unsigned int max_connections = (stats_connections + workers.size() - 1) / workers.size();
+
+	clock_gettime(CLOCK_REALTIME, &next);
+	pthread_mutex_lock(&w->lock);
+
+	while(running) {
+		if(w->queue.empty() && w->fills_done.empty()) {
+			wake = next;
+			if(stack->pacing_pending()) {
+				clock_gettime(CLOCK_REALTIME, &wake);
+				wake.tv_nsec += TCP_PACE_INTERVAL * 1000000;
+				if(wake.tv_nsec >= 1000000000) {
+					wake.tv_sec++;
+					wake.tv_nsec -= 1000000000;
+				}
+				if(wake.tv_sec > next.tv_sec || (wake.tv_sec == next.tv_sec && wake.tv_nsec > next.tv_nsec)) {
+					wake = next;
+				}
+			}
+			pthread_cond_timedwait(&w->cond, &w->lock, &wake);
+		}
+		batch.swap(w->queue);
+		fills_done.swap(w->fills_done);
+		stats_due = w->stats_due;
+		pthread_mutex_unlock(&w->lock);
+
+		BOOST_FOREACH(Packet* p, batch) {
+			stack->inject_packet(p);
+			release_packet(p);
+		}
+		batch.clear();
+		BOOST_FOREACH(const string& key, fills_done) {
+			stack->http_fill_done(key);
+		}
+		fills_done.clear();
+		stack->pace();
+
+		if(stats_due) {
+			WindowStats ws;
+			ProxyTotals totals;
+			string cc, pools, conns;
+			stack->window_stats(&ws);
+			stack->proxy_totals(&totals);
+			cc = stack->cc_stats();
+			pools = stack->pool_stats();
+			if(max_connections) {
+				conns = stack->connection_stats(max_connections);
+			}
+			pthread_mutex_lock(&w->lock);
+			w->window = ws;
+			w->totals = totals;
+			w->cc.swap(cc);
+			w->pools.swap(pools);
+			w->connections.swap(conns);
+			w->stats_due = false;
+			pthread_mutex_unlock(&w->lock);
+		}
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		if(now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec >= next.tv_nsec)) {
+			stack->timeout();
+
+			next.tv_nsec += 250000000;
+			if(next.tv_nsec >= 1000000000) {
+				next.tv_sec++;
+				next.tv_nsec -= 1000000000;
+			}
+			/* Fell behind, don't try to catch up on missed ticks */
+			if(next.tv_sec < now.tv_sec) {
+				next = now;
+			}
+		}
+
+		pthread_mutex_lock(&w->lock);
+	}
+
+	BOOST_FOREACH(Packet* p, w->queue) {
+		release_packet(p);
+	}
+	w->queue.clear();
+	pthread_mutex_unlock(&w->lock);
+
+	delete stack;
+}
+
+void SplitTCP::stop_workers() {
+	if(workers.empty()) {
+		return;
+	}
+
+	running = false;
+	BOOST_FOREACH(SplitWorker* w, workers) {
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	/* A worker may still queue work for the others until it has stopped */
+	BOOST_FOREACH(SplitWorker* w, workers) {
+		pthread_join(w->thread, NULL);
+	}
+	BOOST_FOREACH(SplitWorker* w, workers) {
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->cond);
+		delete w;
+	}
+	workers.clear();
+}
+
 NPSGATE_PLUGIN_CREATE(SplitTCP);
 NPSGATE_PLUGIN_DESTROY();
@@ -22,6 +22,7 @@
 #include <pcap.h>
 #include <crafter.h>
 #include <unistd.h> 
+#include <pthread.h>
 #include "../npsgate_plugin.hpp"
 #include "../logger.hpp"
 //#include "npsgate_driver.h"
@@ -62,6 +63,27 @@
 using namespace Crafter;
 using namespace NpsGate;
 
+class SplitTCP;
+
+/* A thread running its own lwIP stack on the flows split_shard() assigns to it.
+   The plugin thread makes packets writable, takes a reference and queues them
+   here. The worker injects them and gives the reference back. */
+struct SplitWorker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	vector<Packet*> queue;
+	vector<string> fills_done;	/* Keys of HTTP cache fetches another worker finished */
+	unsigned int index;
+	SplitTCP* plugin;
+	bool stats_due;			/* Set by the plugin when it is about to publish, cleared once 'window' is refreshed */
+	WindowStats window;		/* Refreshed on request, under 'lock' */
+	string cc;				/* NpsGateLWIP::cc_stats(), refreshed with 'window' */
+	string pools;			/* NpsGateLWIP::pool_stats(), refreshed with 'window' */
+	ProxyTotals totals;		/* Refreshed with 'window' */
+	string connections;		/* NpsGateLWIP::connection_stats(), refreshed with 'window' */
+};
+
 
 class SplitTCP : public NpsGatePlugin {
 public:
@@ -73,10 +95,48 @@ public:
 	bool process_message(Message* m);
 	bool message_timeout();
 	bool main();
+	void exit_handler();
+
+	/* Queues NpsGateLWIP::http_fill_done() for the stack of worker 'shard' */
+	void http_fill_done(unsigned int shard, const string& key);
 private:
 	struct ip_addr ipaddr, netmask, gw;
 	struct netif if_in, if_out;
-	NpsGateLWIP* lwip;
+
+	vector<SplitWorker*> workers;
+	volatile bool running;
+	unsigned int idle_timeout;
+	unsigned int syn_timeout;
+	unsigned int close_timeout;
+	unsigned int max_connections;	/* Across all stacks */
+	unsigned int max_half_open;
+	unsigned int window;
+	unsigned int send_buffer;
+	bool sack;
+	CongestionPolicy congestion;
+	map<memp_t, unsigned int> pool_sizes;	/* Totals across the stacks */
+	unsigned int stats_interval;	/* Seconds between publications */
+	unsigned int stats_connections;	/* Most connections listed on SplitTCP.connections */
+	time_t last_stats;
+	bool stats_requested;	/* The workers were asked to refresh their stats */
+	TopicId window_topic, cc_topic, pools_topic, totals_topic, connections_topic, http_cache_topic;
+	HttpCache* http_cache;	/* NULL unless splittcp.http_cache is set */
+	vector<uint16_t> http_ports;
+
+	bool parse_congestion(const Config* config);
+	bool parse_pools(const Config* config);
+	bool parse_http_cache(const Config* config);
+	NpsGateLWIP* create_stack(unsigned int shard, unsigned int shards);
+	void publish_window_stats();
+	void publish_cc_stats();
+	void publish_pool_stats();
+	void publish_totals();
+	void publish_connection_stats();
+	void publish_http_cache_stats();
+
+	static void* worker_main(void* arg);
+	void run_worker(SplitWorker* w);
+	void stop_workers();
 
 	uint32_t generate_sequence_num();
 };
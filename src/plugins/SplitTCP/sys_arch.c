@@ -6,6 +6,6 @@ u32_t sys_now() {
 
 	gettimeofday(&tv, NULL);
 
-	return tv.tv_sec + (1000 * tv.tv_usec);
+	return (u32_t)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
 }
 
@@ -0,0 +1,227 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file checksum.h
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef CHECKSUM_H_INCLUDED
+#define CHECKSUM_H_INCLUDED
+
+/* The Internet checksum (RFC 1071) for the plugins and their lwIP stacks, so
+   this header is C as well as C++.
+
+   Sums are kept in 64 bit accumulators of 16 bit words as they lie in memory,
+   which is the checksum in network byte order once folded, whatever the host
+   byte order. Buffers of any alignment are summed as if they started at an even
+   offset of the packet. Long buffers are summed with AVX2 or SSE2 when the CPU
+   has them, picked once at run time, and by a plain loop otherwise. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CSUM_X86 1
+#include <immintrin.h>
+#else
+#define CSUM_X86 0
+#endif
+
+/* Buffers shorter than this, such as most headers, skip the dispatch */
+#define CSUM_SIMD_MIN 64
+
+typedef uint64_t (*csum_add_fn)(const uint8_t* data, size_t len, uint64_t sum);
+
+/* Ones' complement addition of two accumulators. 2^64 - 1 is a multiple of
+   2^16 - 1, so folding the end-around carry in keeps the 16 bit sum intact. */
+static inline uint64_t csum_add64(uint64_t sum, uint64_t x) {
+	sum += x;
+	return sum + (sum < x);
+}
+
+/* Folds an accumulator down to its 16 bit sum, not complemented */
+static inline uint16_t csum_fold(uint64_t sum) {
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)sum;
+}
+
+/* The reference loop, 32 bits at a time. Also finishes off what the vector
+   versions leave over. */
+static inline uint64_t csum_add_scalar(const uint8_t* p, size_t len, uint64_t sum) {
+	uint32_t w[4];
+	uint16_t t = 0;
+
+	while(len >= 16) {
+		memcpy(w, p, 16);
+		sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+		p += 16;
+		len -= 16;
+	}
+	while(len >= 4) {
+		memcpy(w, p, 4);
+		sum += w[0];
+		p += 4;
+		len -= 4;
+	}
+	if(len >= 2) {
+		memcpy(&t, p, 2);
+		sum += t;
+		p += 2;
+		len -= 2;
+	}
+	if(len) {
+		/* A trailing byte is the first half of a word padded with zero */
+		t = 0;
+		memcpy(&t, p, 1);
+		sum += t;
+	}
+
+	return sum;
+}
+
+#if CSUM_X86
+/* Widens each 32 bit word to 64 bits and adds them lane by lane. The lanes
+   cannot overflow, so the carries are only folded in at the end. */
+__attribute__((target("sse2")))
+static inline uint64_t csum_add_sse2(const uint8_t* p, size_t len, uint64_t sum) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero;
+	__m128i acc1 = zero;
+	uint64_t lanes[2];
+
+	while(len >= 32) {
+		__m128i a = _mm_loadu_si128((const __m128i*)p);
+		__m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+		p += 32;
+		len -= 32;
+	}
+
+	_mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(acc0, acc1));
+	sum = csum_add64(sum, lanes[0]);
+	sum = csum_add64(sum, lanes[1]);
+
+	return csum_add_scalar(p, len, sum);
+}
+
+/* The same with 256 bit vectors, 64 bytes per iteration */
+__attribute__((target("avx2")))
+static inline uint64_t csum_add_avx2(const uint8_t* p, size_t len, uint64_t sum) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero;
+	__m256i acc1 = zero;
+	uint64_t lanes[4];
+
+	while(len >= 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)p);
+		__m256i b = _mm256_loadu_si256((const __m256i*)(p + 32));
+
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+		p += 64;
+		len -= 64;
+	}
+
+	_mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(acc0, acc1));
+	for(int i = 0; i < 4; i++) {
+		sum = csum_add64(sum, lanes[i]);
+	}
+
+	return csum_add_sse2(p, len, sum);
+}
+#endif
+
+/* The widest version this CPU runs */
+static inline csum_add_fn csum_select(void) {
+#if CSUM_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		return csum_add_avx2;
+	}
+	if(__builtin_cpu_supports("sse2")) {
+		return csum_add_sse2;
+	}
+#endif
+	return csum_add_scalar;
+}
+
+/* Adds 'len' bytes at 'data' to the running sum 'sum' */
+static inline uint64_t csum_add(const void* data, size_t len, uint64_t sum) {
+	/* Every thread picks the same function, so racing to set it is harmless */
+	static csum_add_fn impl = NULL;
+
+	if(len < CSUM_SIMD_MIN) {
+		return csum_add_scalar((const uint8_t*)data, len, sum);
+	}
+	if(!impl) {
+		impl = csum_select();
+	}
+
+	return impl((const uint8_t*)data, len, sum);
+}
+
+/* The checksum of a buffer, ready to be copied into a header as it is */
+static inline uint16_t csum_buffer(const void* data, size_t len) {
+	return (uint16_t)~csum_fold(csum_add(data, len, 0));
+}
+
+/* lwIP's LWIP_CHKSUM: the folded sum, not complemented */
+static inline uint16_t csum_lwip(void* data, int len) {
+	return csum_fold(csum_add(data, (size_t)len, 0));
+}
+
+/* RFC 1624 eqn. 3: the checksum 'check' after a 16 bit word it covers changed
+   from 'old_word' to 'new_word'. All three in the same byte order. */
+static inline uint16_t csum_update16(uint16_t check, uint16_t old_word, uint16_t new_word) {
+	uint64_t sum = (uint16_t)~check;
+
+	sum += (uint16_t)~old_word;
+	sum += new_word;
+
+	return (uint16_t)~csum_fold(sum);
+}
+
+/* The same for a 32 bit field such as an address */
+static inline uint16_t csum_update32(uint16_t check, uint32_t old_word, uint32_t new_word) {
+	uint64_t sum = (uint16_t)~check;
+
+	sum += (uint16_t)~(old_word >> 16);
+	sum += (uint16_t)~(old_word & 0xffff);
+	sum += new_word >> 16;
+	sum += new_word & 0xffff;
+
+	return (uint16_t)~csum_fold(sum);
+}
+
+/* Patches the big endian checksum at 'field' in a packet for a 32 bit field
+   that changed from 'old_word' to 'new_word', both in host byte order */
+static inline void csum_replace32(uint8_t* field, uint32_t old_word, uint32_t new_word) {
+	uint16_t check = (field[0] << 8) | field[1];
+
+	check = csum_update32(check, old_word, new_word);
+	field[0] = check >> 8;
+	field[1] = check & 0xff;
+}
+
+#endif
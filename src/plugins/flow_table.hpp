@@ -0,0 +1,316 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file flow_table.hpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef FLOW_TABLE_HPP_INCLUDED
+#define FLOW_TABLE_HPP_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <string>
+#include <vector>
+
+/**************************************************************
+ **
+ ** FlowKey is a TCP/IP 4-tuple with every field in host byte
+ ** order. Keys are directional: 'saddr'/'sport' is whichever
+ ** end the owner of the table considers the source.
+ **
+ **************************************************************/
+struct FlowKey {
+	uint32_t saddr;
+	uint32_t daddr;
+	uint16_t sport;
+	uint16_t dport;
+
+	FlowKey() : saddr(0), daddr(0), sport(0), dport(0) { }
+	FlowKey(uint32_t s, uint32_t d, uint16_t sp, uint16_t dp) :
+			saddr(s), daddr(d), sport(sp), dport(dp) { }
+
+	inline bool operator==(const FlowKey& k) const {
+		return saddr == k.saddr && daddr == k.daddr && sport == k.sport && dport == k.dport;
+	}
+
+	inline bool operator!=(const FlowKey& k) const { return !(*this == k); }
+
+	/* The same flow as seen from the other end */
+	inline FlowKey reversed() const { return FlowKey(daddr, saddr, dport, sport); }
+
+	/* "a.b.c.d:port => a.b.c.d:port", for log messages */
+	std::string str() const {
+		char buffer[48];
+		snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u:%u => %u.%u.%u.%u:%u",
+				saddr >> 24, (saddr >> 16) & 0xff, (saddr >> 8) & 0xff, saddr & 0xff, sport,
+				daddr >> 24, (daddr >> 16) & 0xff, (daddr >> 8) & 0xff, daddr & 0xff, dport);
+		return std::string(buffer);
+	}
+
+	inline uint32_t hash() const {
+		uint32_t h = saddr * 0x9e3779b1;
+		h ^= mix(daddr);
+		h ^= ((uint32_t)sport << 16) | dport;
+		return mix(h);
+	}
+
+	/* The same value for both directions of a flow, for spreading flows over
+	   workers so each sees all of its flows' packets */
+	inline uint32_t symmetric_hash() const {
+		if(saddr < daddr || (saddr == daddr && sport <= dport)) {
+			return hash();
+		}
+		return reversed().hash();
+	}
+
+	static inline uint32_t mix(uint32_t h) {
+		h ^= h >> 16;
+		h *= 0x85ebca6b;
+		h ^= h >> 13;
+		h *= 0xc2b2ae35;
+		h ^= h >> 16;
+		return h;
+	}
+
+	/* Builds the key straight from a raw IPv4 packet. Returns false for anything that
+	   is not an unfragmented TCP segment with a complete header. The TCP flags byte is
+	   stored in 'flags' when it is not NULL. */
+	static bool from_ip_header(const uint8_t* data, size_t len, FlowKey* key, uint8_t* flags = NULL) {
+		size_t ihl;
+
+		if(len < 20 || (data[0] >> 4) != 4 || data[9] != IPPROTO_TCP) {
+			return false;
+		}
+
+		/* Only the first fragment carries the ports */
+		if(((data[6] & 0x1f) | data[7]) != 0) {
+			return false;
+		}
+
+		ihl = (data[0] & 0x0f) * 4;
+		if(ihl < 20 || len < ihl + 20) {
+			return false;
+		}
+
+		key->saddr = ((uint32_t)data[12] << 24) | (data[13] << 16) | (data[14] << 8) | data[15];
+		key->daddr = ((uint32_t)data[16] << 24) | (data[17] << 16) | (data[18] << 8) | data[19];
+		key->sport = (data[ihl] << 8) | data[ihl + 1];
+		key->dport = (data[ihl + 2] << 8) | data[ihl + 3];
+
+		if(flags) {
+			*flags = data[ihl + 13];
+		}
+
+		return true;
+	}
+};
+
+/**************************************************************
+ **
+ ** FlowTable maps a FlowKey to a value in constant time. It is
+ ** an open addressed hash table with linear probing and a power
+ ** of two number of slots, grown once 70% of the slots are in
+ ** use (deleted slots included). Each entry remembers when it
+ ** was last touched so idle flows can be aged out a few slots at
+ ** a time from a timer.
+ **
+ ** Values are copied in to the table and move when it grows, so
+ ** store pointers to anything that must stay put. Pointers
+ ** returned by find() are only valid until the next insert().
+ **
+ ** Not thread safe.
+ **
+ **************************************************************/
+template <class V>
+class FlowTable {
+	public:
+		FlowTable(size_t initial_size = 1024) : count(0), used(0), cursor(0) {
+			size_t n = 16;
+			while(n < initial_size) {
+				n <<= 1;
+			}
+			slots.resize(n);
+		}
+
+		inline size_t size() const { return count; }
+		inline size_t capacity() const { return slots.size(); }
+
+		V* find(const FlowKey& key) {
+			Slot* s = lookup(key);
+			return s ? &s->value : NULL;
+		}
+
+		/* Adds or replaces the value for 'key' */
+		V* insert(const FlowKey& key, const V& value, time_t now) {
+			Slot* s = lookup(key);
+
+			if(!s) {
+				if((used + 1) * 10 > slots.size() * 7) {
+					rehash(count * 2 + 1 > slots.size() / 2 ? slots.size() * 2 : slots.size());
+				}
+
+				size_t mask = slots.size() - 1;
+				size_t i = key.hash() & mask;
+				while(slots[i].state == SLOT_FULL) {
+					i = (i + 1) & mask;
+				}
+
+				s = &slots[i];
+				if(s->state == SLOT_EMPTY) {
+					used++;
+				}
+				s->state = SLOT_FULL;
+				s->key = key;
+				count++;
+			}
+
+			s->value = value;
+			s->last_seen = now;
+			return &s->value;
+		}
+
+		bool erase(const FlowKey& key) {
+			Slot* s = lookup(key);
+			if(!s) {
+				return false;
+			}
+
+			s->state = SLOT_DELETED;
+			s->value = V();
+			count--;
+
+			/* A tombstone followed by an empty slot ends every probe sequence that
+			   reaches it, so it can be reclaimed right away. */
+			size_t mask = slots.size() - 1;
+			size_t i = s - &slots[0];
+			if(slots[(i + 1) & mask].state == SLOT_EMPTY) {
+				while(slots[i].state == SLOT_DELETED) {
+					slots[i].state = SLOT_EMPTY;
+					used--;
+					i = (i - 1) & mask;
+				}
+			}
+			return true;
+		}
+
+		/* Marks the flow as active at 'now'. Returns false if it is not in the table. */
+		bool touch(const FlowKey& key, time_t now) {
+			Slot* s = lookup(key);
+			if(!s) {
+				return false;
+			}
+			s->last_seen = now;
+			return true;
+		}
+
+		/* Looks at up to 'budget' slots, continuing where the previous call stopped,
+		   and removes every flow that has not been touched for 'idle' seconds. The
+		   removed values are appended to 'expired' so the caller can clean them up.
+		   Calling this from a timer ages the whole table out without ever walking it
+		   all at once. */
+		size_t expire(time_t now, time_t idle, std::vector<V>* expired, size_t budget = 256) {
+			size_t n = 0;
+
+			if(budget > slots.size()) {
+				budget = slots.size();
+			}
+
+			while(budget-- > 0) {
+				cursor = (cursor + 1) & (slots.size() - 1);
+				Slot& s = slots[cursor];
+				if(s.state == SLOT_FULL && now - s.last_seen >= idle) {
+					if(expired) {
+						expired->push_back(s.value);
+					}
+					erase(s.key);
+					n++;
+				}
+			}
+			return n;
+		}
+
+		/* Copies every value in the table in to 'out', or the first 'max' found */
+		void values(std::vector<V>* out, size_t max = (size_t)-1) const {
+			for(size_t i = 0; i < slots.size() && out->size() < max; i++) {
+				if(slots[i].state == SLOT_FULL) {
+					out->push_back(slots[i].value);
+				}
+			}
+		}
+
+		void clear() {
+			for(size_t i = 0; i < slots.size(); i++) {
+				slots[i] = Slot();
+			}
+			count = used = 0;
+		}
+
+	private:
+		enum SlotState { SLOT_EMPTY = 0, SLOT_FULL, SLOT_DELETED };
+
+		struct Slot {
+			Slot() : value(), last_seen(0), state(SLOT_EMPTY) { }
+			FlowKey key;
+			V value;
+			time_t last_seen;
+			uint8_t state;
+		};
+
+		std::vector<Slot> slots;
+		size_t count;
+		size_t used;
+		size_t cursor;
+
+		Slot* lookup(const FlowKey& key) {
+			size_t mask = slots.size() - 1;
+			size_t i = key.hash() & mask;
+
+			while(slots[i].state != SLOT_EMPTY) {
+				if(slots[i].state == SLOT_FULL && slots[i].key == key) {
+					return &slots[i];
+				}
+				i = (i + 1) & mask;
+			}
+			return NULL;
+		}
+
+		void rehash(size_t new_size) {
+			std::vector<Slot> old;
+			old.swap(slots);
+			slots.resize(new_size);
+			count = used = 0;
+
+			size_t mask = new_size - 1;
+			for(size_t j = 0; j < old.size(); j++) {
+				if(old[j].state != SLOT_FULL) {
+					continue;
+				}
+
+				size_t i = old[j].key.hash() & mask;
+				while(slots[i].state == SLOT_FULL) {
+					i = (i + 1) & mask;
+				}
+				slots[i] = old[j];
+				count++;
+				used++;
+			}
+		}
+};
+
+#endif /* FLOW_TABLE_HPP_INCLUDED */
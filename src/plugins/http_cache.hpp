@@ -0,0 +1,620 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file http_cache.hpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef HTTP_CACHE_HPP_INCLUDED
+#define HTTP_CACHE_HPP_INCLUDED
+
+/* A shared cache of HTTP responses for the proxies. Responses are kept as the
+ * server sent them, headers and body, under the host, target and
+ * Accept-Encoding of the GET that fetched them. The most recently used are
+ * kept in memory, and those pushed out of memory are written to a directory,
+ * one file each, where they stay until the disk budget pushes them out too.
+ * The files are found again when the cache is reopened. What may be stored and
+ * for how long follows the Cache-Control, Expires, Date, Age and Last-Modified
+ * headers of RFC 7234 for a shared cache. */
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "http_parser.hpp"
+
+#define HTTP_CACHE_FILE_MAGIC	"NPSGATE-HTTP-CACHE 1\n"
+#define HTTP_CACHE_HEURISTIC	86400	/* Longest lifetime guessed from Last-Modified [s] */
+
+/* A stored response. Shared by the cache and whoever is sending it, the last to
+   unref() it frees it. */
+struct HttpCachedResponse {
+	HttpCachedResponse() : header_len(0), stored(0), expires(0), refs(1) { }
+
+	std::string key;
+	std::vector<uint8_t> data;	/* The response as the server sent it */
+	size_t header_len;
+	time_t stored;				/* When it was received, for the Age header */
+	time_t expires;
+
+	void ref() { __sync_fetch_and_add(&refs, 1); }
+	void unref() {
+		if(__sync_sub_and_fetch(&refs, 1) == 0) {
+			delete this;
+		}
+	}
+
+	private:
+		int refs;
+};
+
+struct HttpCacheStats {
+	HttpCacheStats() : requests(0), hits(0), misses(0), coalesced(0), bypassed(0), stored(0), uncacheable(0),
+			evicted(0), hit_bytes(0), miss_bytes(0), hit_us(0), miss_us(0), memory_entries(0), memory_bytes(0),
+			disk_entries(0), disk_bytes(0) { }
+
+	unsigned long long requests;	/* GETs that could be answered from the cache, hits and misses */
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long coalesced;	/* Misses that waited for another to fetch the same response */
+	unsigned long long bypassed;	/* Requests that may not be answered from the cache */
+	unsigned long long stored;
+	unsigned long long uncacheable;	/* Responses to misses that could not be stored */
+	unsigned long long evicted;		/* From the disk, or from memory without a disk */
+	unsigned long long hit_bytes;	/* Served from the cache, so saved on the link */
+	unsigned long long miss_bytes;
+	unsigned long long hit_us;		/* Total time from request to response [us] */
+	unsigned long long miss_us;
+	unsigned long long memory_entries;
+	unsigned long long memory_bytes;
+	unsigned long long disk_entries;
+	unsigned long long disk_bytes;
+
+	std::string str() const {
+		char buffer[512];
+
+		snprintf(buffer, sizeof(buffer),
+				"requests=%llu hits=%llu misses=%llu hit_ratio=%.3f coalesced=%llu bypassed=%llu stored=%llu "
+				"uncacheable=%llu evicted=%llu bytes_saved=%llu miss_bytes=%llu hit_latency_ms=%.2f "
+				"miss_latency_ms=%.2f memory_entries=%llu memory_bytes=%llu disk_entries=%llu disk_bytes=%llu",
+				requests, hits, misses, requests ? (double)hits / requests : 0.0, coalesced, bypassed, stored,
+				uncacheable, evicted, hit_bytes, miss_bytes, hits ? hit_us / 1000.0 / hits : 0.0,
+				misses ? miss_us / 1000.0 / misses : 0.0, memory_entries, memory_bytes, disk_entries, disk_bytes);
+		return std::string(buffer);
+	}
+};
+
+/**************************************************************
+ **
+ ** HttpCache may be used by several threads at once. The index
+ ** is hashed on the key and each tier keeps its own LRU list.
+ ** It also tracks the misses being fetched, so that misses on
+ ** the same response in any thread wait for one fetch.
+ **
+ **************************************************************/
+class HttpCache {
+	public:
+		HttpCache() : memory_limit(0), disk_limit(0), object_limit(0), memory_bytes(0), disk_bytes(0) {
+			pthread_mutex_init(&lock, NULL);
+		}
+
+		/* What is only in memory is written out, as far as the disk budget allows,
+		   most recently used first */
+		~HttpCache() {
+			for(std::list<uint64_t>::iterator h = mem_lru.begin(); h != mem_lru.end(); ++h) {
+				Entry& e = index[*h];
+				if(!e.on_disk && disk_bytes + e.size <= disk_limit && write_file(*h, e.mem)) {
+					disk_bytes += e.size;
+				}
+			}
+			for(std::map<uint64_t, Entry>::iterator e = index.begin(); e != index.end(); ++e) {
+				if(e->second.mem) {
+					e->second.mem->unref();
+				}
+			}
+			pthread_mutex_destroy(&lock);
+		}
+
+		/* Keeps up to 'memory' bytes of responses in memory and 'disk' bytes in
+		   'path', none if it is empty. Responses larger than 'max_object' are not
+		   stored. False if the directory cannot be used. */
+		bool open(size_t memory, const std::string& path, uint64_t disk, size_t max_object) {
+			DIR* d;
+			dirent* e;
+
+			memory_limit = memory;
+			object_limit = max_object;
+			dir = path;
+			disk_limit = path.empty() ? 0 : disk;
+			if(!disk_limit) {
+				return true;
+			}
+
+			if(mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+				return false;
+			}
+			d = opendir(dir.c_str());
+			if(!d) {
+				return false;
+			}
+
+			/* Files from before are found in no particular order, they are the
+			   first to be evicted */
+			pthread_mutex_lock(&lock);
+			while((e = readdir(d)) != NULL) {
+				unsigned long long h;
+				char tail;
+				Entry entry;
+
+				if(sscanf(e->d_name, "%16llx%c", &h, &tail) != 1 || strlen(e->d_name) != 16) {
+					if(strlen(e->d_name) == 20 && strcmp(e->d_name + 16, ".tmp") == 0) {
+						unlink((dir + "/" + e->d_name).c_str());
+					}
+					continue;
+				}
+				if(!read_file(h, &entry, NULL) || entry.expires <= time(NULL) || index.count(h)) {
+					unlink(file_of(h).c_str());
+					continue;
+				}
+				entry.on_disk = true;
+				disk_lru.push_back(h);
+				entry.disk_pos = --disk_lru.end();
+				disk_bytes += entry.size;
+				index[h] = entry;
+			}
+			closedir(d);
+			pthread_mutex_unlock(&lock);
+
+			trim_disk();
+			return true;
+		}
+
+		size_t max_object() const { return object_limit; }
+
+		/* The fresh response stored under 'key', with a reference for the caller.
+		   NULL if there is none, a miss. */
+		HttpCachedResponse* lookup(const std::string& key, time_t now) {
+			uint64_t h = hash(key);
+			HttpCachedResponse* r = NULL;
+			bool on_disk = false;
+
+			pthread_mutex_lock(&lock);
+			std::map<uint64_t, Entry>::iterator e = index.find(h);
+			if(e != index.end() && (e->second.key != key || e->second.expires <= now)) {
+				remove(e);
+				e = index.end();
+			}
+			if(e != index.end() && e->second.mem) {
+				r = e->second.mem;
+				r->ref();
+				mem_lru.splice(mem_lru.begin(), mem_lru, e->second.mem_pos);
+			} else if(e != index.end()) {
+				on_disk = e->second.on_disk;
+			}
+			pthread_mutex_unlock(&lock);
+
+			/* Read back from the disk without holding up the other threads */
+			if(on_disk) {
+				Entry loaded;
+				r = new HttpCachedResponse();
+				if(!read_file(h, &loaded, r) || loaded.key != key) {
+					r->unref();
+					r = NULL;
+				} else {
+					r->key = key;
+					insert(h, r, false);
+				}
+			}
+
+			return r;
+		}
+
+		/* Stores a response, taking the contents of 'data'. Replaces any response
+		   stored under the same key. */
+		void store(const std::string& key, std::vector<uint8_t>& data, size_t header_len, time_t expires, time_t now) {
+			HttpCachedResponse* r;
+
+			if(data.size() > object_limit || data.size() > memory_limit) {
+				uncacheable();
+				return;
+			}
+
+			r = new HttpCachedResponse();
+			r->key = key;
+			r->data.swap(data);
+			r->header_len = header_len;
+			r->stored = now;
+			r->expires = expires;
+			insert(hash(key), r, true);
+			r->unref();
+		}
+
+		/* A request was answered from the cache, 'us' microseconds after it arrived */
+		void hit(size_t bytes, uint64_t us) {
+			pthread_mutex_lock(&lock);
+			stats_.requests++;
+			stats_.hits++;
+			stats_.hit_bytes += bytes;
+			stats_.hit_us += us;
+			pthread_mutex_unlock(&lock);
+		}
+
+		/* A request the cache could not answer went to the server */
+		void miss() {
+			pthread_mutex_lock(&lock);
+			stats_.requests++;
+			stats_.misses++;
+			pthread_mutex_unlock(&lock);
+		}
+
+		/* The server's response to a miss took 'us' microseconds */
+		void fetched(size_t bytes, uint64_t us) {
+			pthread_mutex_lock(&lock);
+			stats_.miss_bytes += bytes;
+			stats_.miss_us += us;
+			pthread_mutex_unlock(&lock);
+		}
+
+		/* Claims the fetch of the response under 'key' for the caller if no one is
+		   fetching it yet. Otherwise 'owner' is handed back by end_fill() when
+		   that fetch ends, and false is returned. */
+		bool begin_fill(const std::string& key, void* owner) {
+			bool claimed;
+
+			pthread_mutex_lock(&lock);
+			std::map<std::string, std::vector<void*> >::iterator f = fills.find(key);
+			claimed = (f == fills.end());
+			if(claimed) {
+				fills[key];
+			} else if(std::find(f->second.begin(), f->second.end(), owner) == f->second.end()) {
+				f->second.push_back(owner);
+			}
+			pthread_mutex_unlock(&lock);
+			return claimed;
+		}
+
+		/* The fetch of 'key' ended. The owners of whoever waited for it are moved
+		   to 'owners', each once. */
+		void end_fill(const std::string& key, std::vector<void*>* owners) {
+			pthread_mutex_lock(&lock);
+			std::map<std::string, std::vector<void*> >::iterator f = fills.find(key);
+			if(f != fills.end()) {
+				owners->swap(f->second);
+				fills.erase(f);
+			}
+			pthread_mutex_unlock(&lock);
+		}
+
+		void coalesced() { count(&HttpCacheStats::coalesced); }
+		void bypassed() { count(&HttpCacheStats::bypassed); }
+		void uncacheable() { count(&HttpCacheStats::uncacheable); }
+
+		HttpCacheStats stats() {
+			HttpCacheStats s;
+
+			pthread_mutex_lock(&lock);
+			s = stats_;
+			s.memory_entries = mem_lru.size();
+			s.memory_bytes = memory_bytes;
+			s.disk_entries = disk_lru.size();
+			s.disk_bytes = disk_bytes;
+			pthread_mutex_unlock(&lock);
+			return s;
+		}
+
+		/* The key a request's response is cached under. False if the request may
+		   not be answered from a shared cache: anything but a GET, a range, or
+		   one with credentials or asking not to be served from a cache. */
+		static bool request_key(const HttpMessage& req, std::string* key) {
+			const std::string* host = req.header("host");
+			const std::string* encoding = req.header("accept-encoding");
+
+			if(req.method != "GET" || req.header("range") || req.header("authorization") ||
+					req.has_token("cache-control", "no-store") || req.has_token("cache-control", "no-cache") ||
+					req.has_token("pragma", "no-cache")) {
+				return false;
+			}
+
+			if(req.target.compare(0, 7, "http://") == 0) {
+				*key = req.target.substr(7);
+			} else if(host && !req.target.empty() && req.target[0] == '/') {
+				*key = *host + req.target;
+			} else {
+				return false;
+			}
+			for(size_t i = 0; i < key->size() && (*key)[i] != '/'; i++) {
+				if((*key)[i] >= 'A' && (*key)[i] <= 'Z') {
+					(*key)[i] += 'a' - 'A';
+				}
+			}
+
+			/* Responses that vary by encoding are told apart by it */
+			key->append("\t");
+			if(encoding) {
+				key->append(*encoding);
+			}
+			return true;
+		}
+
+		/* When the response to 'req' stops being fresh, 0 if it may not be stored.
+		   Only responses that are complete in themselves and the same for every
+		   client are. */
+		static time_t expires(const HttpMessage& req, const HttpMessage& resp, time_t now) {
+			const std::string* vary = resp.header("vary");
+			const std::string* header;
+			std::string arg;
+			time_t date = now;
+			long lifetime = -1;
+			long age = 0;
+
+			switch(resp.status) {
+				case 200: case 203: case 300: case 301: case 410:
+					break;
+				default:
+					return 0;
+			}
+
+			if(resp.has_token("cache-control", "no-store") || resp.has_token("cache-control", "no-cache") ||
+					resp.has_token("cache-control", "private") || resp.has_token("pragma", "no-cache") ||
+					resp.header("set-cookie") || resp.header("content-range") ||
+					(vary && strcasecmp(vary->c_str(), "accept-encoding") != 0)) {
+				return 0;
+			}
+
+			if((header = resp.header("date"))) {
+				time_t t = parse_date(*header);
+				if(t > 0 && t <= now) {
+					date = t;
+				}
+			}
+			if((header = resp.header("age"))) {
+				age = atol(header->c_str());
+			}
+
+			if(resp.has_token("cache-control", "s-maxage", &arg) || resp.has_token("cache-control", "max-age", &arg)) {
+				lifetime = atol(arg.c_str());
+			} else if((header = resp.header("expires"))) {
+				time_t t = parse_date(*header);
+				lifetime = t > date ? t - date : 0;
+			} else if((header = resp.header("last-modified"))) {
+				time_t t = parse_date(*header);
+				if(t > 0 && t < date) {
+					lifetime = (date - t) / 10;
+					if(lifetime > HTTP_CACHE_HEURISTIC) {
+						lifetime = HTTP_CACHE_HEURISTIC;
+					}
+				}
+			}
+
+			/* Left fresh for how long since it was received */
+			lifetime -= age + (now - date);
+			return lifetime > 0 ? now + lifetime : 0;
+		}
+
+		/* An IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT". 0 if it is not one. */
+		static time_t parse_date(const std::string& s) {
+			tm t;
+
+			memset(&t, 0, sizeof(t));
+			if(!strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S", &t)) {
+				return 0;
+			}
+			return timegm(&t);
+		}
+
+	private:
+		struct Entry {
+			Entry() : mem(NULL), size(0), expires(0), on_disk(false) { }
+
+			std::string key;
+			HttpCachedResponse* mem;	/* NULL while only on the disk */
+			size_t size;
+			time_t expires;
+			bool on_disk;
+			std::list<uint64_t>::iterator mem_pos;
+			std::list<uint64_t>::iterator disk_pos;
+		};
+
+		size_t memory_limit;
+		uint64_t disk_limit;
+		size_t object_limit;
+		std::string dir;
+
+		pthread_mutex_t lock;
+		std::map<uint64_t, Entry> index;
+		std::list<uint64_t> mem_lru;		/* Most recently used first */
+		std::list<uint64_t> disk_lru;
+		size_t memory_bytes;
+		uint64_t disk_bytes;
+		HttpCacheStats stats_;
+
+		/* Responses being fetched, and the owners of those waiting for them */
+		std::map<std::string, std::vector<void*> > fills;
+
+		void count(unsigned long long HttpCacheStats::* field) {
+			pthread_mutex_lock(&lock);
+			stats_.*field += 1;
+			pthread_mutex_unlock(&lock);
+		}
+
+		/* FNV-1a */
+		static uint64_t hash(const std::string& key) {
+			uint64_t h = 0xcbf29ce484222325ULL;
+			for(size_t i = 0; i < key.size(); i++) {
+				h = (h ^ (uint8_t)key[i]) * 0x100000001b3ULL;
+			}
+			return h;
+		}
+
+		std::string file_of(uint64_t h) const {
+			char name[24];
+			snprintf(name, sizeof(name), "/%016llx", (unsigned long long)h);
+			return dir + name;
+		}
+
+		/* Adds a response to memory, pushing the least recently used out to the
+		   disk. 'fresh' responses were just fetched and replace one on the disk. */
+		void insert(uint64_t h, HttpCachedResponse* r, bool fresh) {
+			pthread_mutex_lock(&lock);
+			std::map<uint64_t, Entry>::iterator e = index.find(h);
+
+			if(e != index.end() && (fresh || e->second.key != r->key)) {
+				remove(e);
+				e = index.end();
+			}
+			if(e == index.end()) {
+				Entry entry;
+				entry.key = r->key;
+				entry.size = r->data.size();
+				entry.expires = r->expires;
+				e = index.insert(std::make_pair(h, entry)).first;
+			}
+			if(!e->second.mem) {
+				r->ref();
+				e->second.mem = r;
+				mem_lru.push_front(h);
+				e->second.mem_pos = mem_lru.begin();
+				memory_bytes += r->data.size();
+			}
+			if(fresh) {
+				stats_.stored++;
+			}
+
+			while(memory_bytes > memory_limit && !mem_lru.empty()) {
+				std::map<uint64_t, Entry>::iterator last = index.find(mem_lru.back());
+				HttpCachedResponse* old = last->second.mem;
+
+				if(!last->second.on_disk && disk_limit && old->data.size() <= disk_limit && write_file(last->first, old)) {
+					last->second.on_disk = true;
+					disk_lru.push_front(last->first);
+					last->second.disk_pos = disk_lru.begin();
+					disk_bytes += last->second.size;
+				}
+				mem_lru.pop_back();
+				memory_bytes -= old->data.size();
+				last->second.mem = NULL;
+				old->unref();
+				if(!last->second.on_disk) {
+					stats_.evicted++;
+					index.erase(last);
+				}
+			}
+			pthread_mutex_unlock(&lock);
+
+			trim_disk();
+		}
+
+		/* Deletes the least recently used files over the disk budget */
+		void trim_disk() {
+			pthread_mutex_lock(&lock);
+			while(disk_bytes > disk_limit && !disk_lru.empty()) {
+				std::map<uint64_t, Entry>::iterator last = index.find(disk_lru.back());
+
+				unlink(file_of(last->first).c_str());
+				disk_lru.pop_back();
+				disk_bytes -= last->second.size;
+				last->second.on_disk = false;
+				stats_.evicted++;
+				if(!last->second.mem) {
+					index.erase(last);
+				}
+			}
+			pthread_mutex_unlock(&lock);
+		}
+
+		/* Drops an entry from both tiers. Called with the lock held. */
+		void remove(std::map<uint64_t, Entry>::iterator e) {
+			if(e->second.mem) {
+				mem_lru.erase(e->second.mem_pos);
+				memory_bytes -= e->second.mem->data.size();
+				e->second.mem->unref();
+			}
+			if(e->second.on_disk) {
+				unlink(file_of(e->first).c_str());
+				disk_lru.erase(e->second.disk_pos);
+				disk_bytes -= e->second.size;
+			}
+			index.erase(e);
+		}
+
+		/* magic | key \n | expires stored header_len size \n | response. Written
+		   to a temporary name first so a crash never leaves half a file. */
+		bool write_file(uint64_t h, const HttpCachedResponse* r) {
+			std::string path = file_of(h);
+			std::string tmp = path + ".tmp";
+			FILE* f = fopen(tmp.c_str(), "wb");
+			bool ok;
+
+			if(!f) {
+				return false;
+			}
+			ok = fputs(HTTP_CACHE_FILE_MAGIC, f) >= 0 &&
+					fprintf(f, "%s\n%lld %lld %llu %llu\n", r->key.c_str(), (long long)r->expires,
+							(long long)r->stored, (unsigned long long)r->header_len,
+							(unsigned long long)r->data.size()) > 0 &&
+					(r->data.empty() || fwrite(&r->data[0], r->data.size(), 1, f) == 1);
+			ok = fclose(f) == 0 && ok;
+			if(!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+				unlink(tmp.c_str());
+				return false;
+			}
+			return true;
+		}
+
+		/* Reads a file's header in to 'e', and its response in to 'r' if given */
+		bool read_file(uint64_t h, Entry* e, HttpCachedResponse* r) {
+			FILE* f = fopen(file_of(h).c_str(), "rb");
+			char magic[sizeof(HTTP_CACHE_FILE_MAGIC)];
+			char key[8192];
+			long long expires, stored;
+			unsigned long long header_len, size;
+			bool ok;
+
+			if(!f) {
+				return false;
+			}
+			ok = fgets(magic, sizeof(magic), f) && strcmp(magic, HTTP_CACHE_FILE_MAGIC) == 0 &&
+					fgets(key, sizeof(key), f) && strlen(key) > 1 && key[strlen(key) - 1] == '\n' &&
+					fscanf(f, "%lld %lld %llu %llu", &expires, &stored, &header_len, &size) == 4 && fgetc(f) == '\n';
+			if(ok) {
+				key[strlen(key) - 1] = 0;
+				e->key = key;
+				e->expires = expires;
+				e->size = size;
+			}
+			if(ok && r) {
+				r->data.resize(size);
+				r->header_len = header_len;
+				r->stored = stored;
+				r->expires = expires;
+				ok = size == 0 || fread(&r->data[0], size, 1, f) == 1;
+			}
+			fclose(f);
+			return ok;
+		}
+};
+
+#endif /* HTTP_CACHE_HPP_INCLUDED */
@@ -0,0 +1,375 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file http_parser.hpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef HTTP_PARSER_HPP_INCLUDED
+#define HTTP_PARSER_HPP_INCLUDED
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+enum HttpParserMode {
+	HTTP_REQUEST,
+	HTTP_RESPONSE
+};
+
+/* The start line and headers of a request or response. Header names are
+   lower cased. */
+struct HttpMessage {
+	HttpMessage() : status(0), header_len(0), keep_alive(true) { }
+
+	std::string method;		/* Requests */
+	std::string target;
+	std::string version;
+	int status;				/* Responses */
+	std::vector< std::pair<std::string, std::string> > headers;
+	size_t header_len;		/* Bytes up to and including the blank line */
+	bool keep_alive;		/* The connection carries another message after this one */
+
+	/* The first header called 'name', in lower case. NULL if there is none. */
+	const std::string* header(const char* name) const {
+		for(size_t i = 0; i < headers.size(); i++) {
+			if(headers[i].first == name) {
+				return &headers[i].second;
+			}
+		}
+		return NULL;
+	}
+
+	/* Whether a comma separated header, such as Cache-Control, lists 'token',
+	   ignoring case and any "=value". The value goes in 'arg' when given. */
+	bool has_token(const char* name, const char* token, std::string* arg = NULL) const {
+		size_t tlen = strlen(token);
+
+		for(size_t i = 0; i < headers.size(); i++) {
+			const std::string& v = headers[i].second;
+			size_t pos = 0;
+
+			if(headers[i].first != name) {
+				continue;
+			}
+			while(pos < v.size()) {
+				size_t end = v.find(',', pos);
+				if(end == std::string::npos) {
+					end = v.size();
+				}
+				while(pos < end && (v[pos] == ' ' || v[pos] == '\t')) {
+					pos++;
+				}
+				if(end - pos >= tlen && strncasecmp(v.c_str() + pos, token, tlen) == 0 &&
+						(pos + tlen == end || v[pos + tlen] == '=' || v[pos + tlen] == ' ')) {
+					if(arg) {
+						size_t eq = v.find('=', pos);
+						arg->clear();
+						if(eq != std::string::npos && eq < end) {
+							size_t last = end;
+							while(last > eq + 1 && (v[last - 1] == ' ' || v[last - 1] == '\t')) {
+								last--;
+							}
+							arg->assign(v, eq + 1, last - eq - 1);
+							if(arg->size() >= 2 && (*arg)[0] == '"') {
+								*arg = arg->substr(1, arg->size() - 2);
+							}
+						}
+					}
+					return true;
+				}
+				pos = end + 1;
+			}
+		}
+		return false;
+	}
+};
+
+/**************************************************************
+ **
+ ** HttpParser follows the HTTP/1.1 messages on one direction
+ ** of a connection as their bytes arrive, in any pieces. It
+ ** copies only the start line and headers. feed() stops at the
+ ** end of a message, so the caller knows where each one ends,
+ ** and reset() goes on to the next.
+ **
+ **************************************************************/
+class HttpParser {
+	public:
+		enum State {
+			HEAD,			/* Start line and headers */
+			BODY,			/* Content-Length bytes */
+			CHUNK_SIZE,
+			CHUNK_DATA,
+			CHUNK_END,		/* The CRLF after a chunk */
+			TRAILERS,
+			UNTIL_CLOSE,	/* A response without a length ends with the connection */
+			DONE,
+			FAILED
+		};
+
+		HttpParser(HttpParserMode m, size_t max_head = 65536) : mode(m), max_head(max_head) {
+			reset();
+		}
+
+		/* Starts on the next message */
+		void reset() {
+			state = HEAD;
+			head.clear();
+			line.clear();
+			remaining = 0;
+			no_body = false;
+			msg = HttpMessage();
+		}
+
+		/* The response being parsed answers a HEAD request, so has no body */
+		void expect_no_body() { no_body = true; }
+
+		/* Consumes bytes of the current message, and no further than its end.
+		   Returns how many. */
+		size_t feed(const uint8_t* data, size_t len) {
+			size_t used = 0;
+
+			while(used < len && state != DONE && state != FAILED) {
+				const uint8_t* p = data + used;
+				size_t n = len - used;
+
+				switch(state) {
+					case HEAD:
+						used += feed_head(p, n);
+						break;
+
+					case BODY:
+					case CHUNK_DATA:
+						n = n < remaining ? n : (size_t)remaining;
+						remaining -= n;
+						used += n;
+						if(remaining == 0) {
+							state = (state == BODY ? DONE : CHUNK_END);
+						}
+						break;
+
+					case UNTIL_CLOSE:
+						used = len;
+						break;
+
+					case CHUNK_SIZE:
+					case CHUNK_END:
+					case TRAILERS:
+						used += feed_line(p, n);
+						break;
+
+					default:
+						break;
+				}
+			}
+
+			return used;
+		}
+
+		/* The connection closed. A response running until then is complete. */
+		void finish() {
+			if(state == UNTIL_CLOSE) {
+				state = DONE;
+			} else if(state != DONE) {
+				state = FAILED;
+			}
+		}
+
+		State current() const { return state; }
+		bool head_done() const { return state != HEAD && state != FAILED; }
+		bool done() const { return state == DONE; }
+		bool failed() const { return state == FAILED; }
+		bool until_close() const { return state == UNTIL_CLOSE; }
+		const HttpMessage& message() const { return msg; }
+
+	private:
+		HttpParserMode mode;
+		size_t max_head;
+		State state;
+		std::string head;
+		std::string line;
+		uint64_t remaining;
+		bool no_body;
+		HttpMessage msg;
+
+		size_t feed_head(const uint8_t* p, size_t n) {
+			size_t start = head.size() > 3 ? head.size() - 3 : 0;
+			size_t skipped = 0;
+			size_t end;
+
+			/* Blank lines before a message are ignored */
+			while(head.empty() && skipped < n && (p[skipped] == '\r' || p[skipped] == '\n')) {
+				skipped++;
+			}
+			p += skipped;
+			n -= skipped;
+
+			head.append((const char*)p, n);
+			end = head.find("\r\n\r\n", start);
+			if(end != std::string::npos) {
+				end += 4;
+			} else if((end = head.find("\n\n", start)) != std::string::npos) {
+				end += 2;
+			} else {
+				if(head.size() > max_head) {
+					state = FAILED;
+				}
+				return skipped + n;
+			}
+
+			size_t used = skipped + n - (head.size() - end);
+			head.resize(end);
+			msg.header_len = end;
+			if(!parse_head()) {
+				state = FAILED;
+				return used;
+			}
+			start_body();
+			return used;
+		}
+
+		/* The lines of chunked bodies. Returns bytes consumed. */
+		size_t feed_line(const uint8_t* p, size_t n) {
+			const uint8_t* nl = (const uint8_t*)memchr(p, '\n', n);
+			size_t used = nl ? nl - p + 1 : n;
+
+			line.append((const char*)p, used);
+			if(!nl) {
+				if(line.size() > 1024) {
+					state = FAILED;
+				}
+				return used;
+			}
+
+			while(!line.empty() && (line[line.size() - 1] == '\n' || line[line.size() - 1] == '\r')) {
+				line.resize(line.size() - 1);
+			}
+
+			if(state == CHUNK_SIZE) {
+				char* end;
+				remaining = strtoull(line.c_str(), &end, 16);
+				if(end == line.c_str()) {
+					state = FAILED;
+				} else {
+					state = remaining ? CHUNK_DATA : TRAILERS;
+				}
+			} else if(state == CHUNK_END) {
+				state = line.empty() ? CHUNK_SIZE : FAILED;
+			} else if(line.empty()) {
+				state = DONE;
+			}
+			line.clear();
+			return used;
+		}
+
+		static std::string lower(const std::string& s) {
+			std::string r(s);
+			for(size_t i = 0; i < r.size(); i++) {
+				if(r[i] >= 'A' && r[i] <= 'Z') {
+					r[i] += 'a' - 'A';
+				}
+			}
+			return r;
+		}
+
+		static std::string trim(const std::string& s) {
+			size_t b = s.find_first_not_of(" \t\r");
+			size_t e = s.find_last_not_of(" \t\r");
+			return b == std::string::npos ? std::string() : s.substr(b, e - b + 1);
+		}
+
+		bool parse_head() {
+			size_t eol = head.find('\n');
+			std::string first = trim(head.substr(0, eol));
+			size_t sp1 = first.find(' ');
+			size_t sp2 = sp1 == std::string::npos ? std::string::npos : first.find(' ', sp1 + 1);
+
+			if(sp1 == std::string::npos) {
+				return false;
+			}
+
+			if(mode == HTTP_REQUEST) {
+				if(sp2 == std::string::npos) {
+					return false;
+				}
+				msg.method = first.substr(0, sp1);
+				msg.target = first.substr(sp1 + 1, sp2 - sp1 - 1);
+				msg.version = first.substr(sp2 + 1);
+			} else {
+				msg.version = first.substr(0, sp1);
+				msg.status = atoi(first.c_str() + sp1 + 1);
+				if(msg.status < 100 || msg.status > 999) {
+					return false;
+				}
+			}
+			if(msg.version.compare(0, 5, "HTTP/") != 0) {
+				return false;
+			}
+
+			for(size_t pos = eol + 1; pos < head.size(); ) {
+				size_t next = head.find('\n', pos);
+				std::string h = head.substr(pos, (next == std::string::npos ? head.size() : next) - pos);
+				size_t colon = h.find(':');
+
+				pos = (next == std::string::npos ? head.size() : next + 1);
+				if(trim(h).empty()) {
+					continue;
+				}
+				if(colon == std::string::npos) {
+					return false;
+				}
+				msg.headers.push_back(std::make_pair(lower(trim(h.substr(0, colon))), trim(h.substr(colon + 1))));
+			}
+
+			msg.keep_alive = msg.version != "HTTP/1.0";
+			if(msg.has_token("connection", "close")) {
+				msg.keep_alive = false;
+			} else if(msg.has_token("connection", "keep-alive")) {
+				msg.keep_alive = true;
+			}
+			return true;
+		}
+
+		/* RFC 7230 3.3.3 */
+		void start_body() {
+			const std::string* cl = msg.header("content-length");
+
+			if(mode == HTTP_RESPONSE && (no_body || msg.status < 200 || msg.status == 204 || msg.status == 304)) {
+				state = DONE;
+			} else if(msg.has_token("transfer-encoding", "chunked")) {
+				state = CHUNK_SIZE;
+			} else if(cl) {
+				char* end;
+				remaining = strtoull(cl->c_str(), &end, 10);
+				if(end == cl->c_str()) {
+					state = FAILED;
+				} else {
+					state = remaining ? BODY : DONE;
+				}
+			} else if(mode == HTTP_RESPONSE) {
+				state = UNTIL_CLOSE;
+				msg.keep_alive = false;
+			} else {
+				state = DONE;
+			}
+		}
+};
+
+#endif /* HTTP_PARSER_HPP_INCLUDED */
@@ -98,10 +98,55 @@ class NpsGatePlugin {
 			return core->drop_packet(p);
 		}
 
+		/* Packets may be shared with other plugins and must not be modified
+		   unless make_writable() has been called. share_packet() keeps an extra
+		   reference that must later be given back with release_packet(). */
+		inline Packet* share_packet(Packet* p) {
+			return core->share_packet(p);
+		}
+
+		inline void release_packet(Packet* p) {
+			core->release_packet(p);
+		}
+
+		inline bool is_shared(Packet* p) {
+			return core->is_shared(p);
+		}
+
+		inline Packet* make_writable(Packet* p) {
+			return core->make_writable(p);
+		}
+
+		/* Time the packet first entered the pipeline */
+		inline bool ingress_time(Packet* p, timeval* tv) {
+			return core->ingress_time(p, tv);
+		}
+
+		/* A packet the plugin holds on to enters the pipeline again, now. Input
+		   plugins that forward the same packet more than once call this first. */
+		inline bool set_ingress(Packet* p) {
+			return core->set_ingress(p);
+		}
+
+		/* Topics published often are registered once, in init(), and published
+		   by id */
+		inline TopicId register_topic(const string fq_name) {
+			return core->register_topic(fq_name);
+		}
+
+		inline bool publish(TopicId topic, NpsGateVar* v) {
+			return core->publish(topic, v);
+		}
+
 		inline bool publish(const string fq_name, NpsGateVar* v) {
 			return core->publish(fq_name, v);
 		}
 
+		/* Sends 'v' straight to one plugin as a SUBSCRIBE_UPDATE message */
+		inline bool publish(const string module, const string fq_name, NpsGateVar* v) {
+			return core->publish(module, fq_name, v);
+		}
+
 		inline bool subscribe(const string fq_name) {
 			return core->subscribe(fq_name);
 		}
@@ -130,6 +175,10 @@ class NpsGatePlugin {
 			return core->set_timeout(t);
 		}
 
+		inline int queue_depth(const string plugin) {
+			return core->queue_depth(plugin);
+		}
+
 	private:
 		PluginCore* core;
 };
@@ -0,0 +1,80 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file proxy_stats.hpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef PROXY_STATS_HPP_INCLUDED
+#define PROXY_STATS_HPP_INCLUDED
+
+#include <stdio.h>
+#include <string>
+
+/**************************************************************
+ **
+ ** ProxyTotals counts what the connections terminated by an
+ ** lwIP stack did. The plugins update it from their lwIP
+ ** callbacks as connections open, move data and close, so
+ ** reading it never walks a connection or pcb list. Each
+ ** stack keeps its own and the plugin adds them up.
+ **
+ **************************************************************/
+struct ProxyTotals {
+	ProxyTotals() : active(0), opened(0), closed(0), aborted(0), rx_bytes(0), tx_bytes(0), queued(0),
+			segs_out(0), segs_in(0), drops(0), chkerr(0), memerr(0) { }
+
+	unsigned int active;			/* Connections open now */
+	unsigned long long opened;
+	unsigned long long closed;		/* Closed by both ends */
+	unsigned long long aborted;		/* Reset, failed to connect or timed out */
+	unsigned long long rx_bytes;	/* Received from the hosts */
+	unsigned long long tx_bytes;	/* Sent to the hosts and acknowledged by them */
+	unsigned long long queued;		/* Received, waiting to be written to the other end */
+
+	/* lwIP's own TCP counters (LWIP_STATS), copied in when read */
+	unsigned long long segs_out;
+	unsigned long long segs_in;
+	unsigned long long drops;
+	unsigned long long chkerr;
+	unsigned long long memerr;
+
+	void add(const ProxyTotals& t) {
+		active += t.active;
+		opened += t.opened;
+		closed += t.closed;
+		aborted += t.aborted;
+		rx_bytes += t.rx_bytes;
+		tx_bytes += t.tx_bytes;
+		queued += t.queued;
+		segs_out += t.segs_out;
+		segs_in += t.segs_in;
+		drops += t.drops;
+		chkerr += t.chkerr;
+		memerr += t.memerr;
+	}
+
+	std::string str() const {
+		char buffer[384];
+
+		snprintf(buffer, sizeof(buffer),
+				"active=%u opened=%llu closed=%llu aborted=%llu rx_bytes=%llu tx_bytes=%llu queued=%llu "
+				"segs_out=%llu segs_in=%llu drops=%llu chkerr=%llu memerr=%llu",
+				active, opened, closed, aborted, rx_bytes, tx_bytes, queued,
+				segs_out, segs_in, drops, chkerr, memerr);
+		return std::string(buffer);
+	}
+};
+
+#endif
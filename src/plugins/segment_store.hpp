@@ -0,0 +1,752 @@
+/******************************************************************************
+**
+**  This file is part of NpsGate.
+**
+**  This software was developed at the Naval Postgraduate School by employees
+**  of the Federal Government in the course of their official duties. Pursuant
+**  to title 17 Section 105 of the United States Code this software is not
+**  subject to copyright protection and is in the public domain. NpsGate is an
+**  experimental system. The Naval Postgraduate School assumes no responsibility
+**  whatsoever for its use by other parties, and makes no guarantees, expressed
+**  or implied, about its quality, reliability, or any other characteristic. We
+**  would appreciate acknowledgment if the software is used.
+**
+**  @file segment_store.hpp
+**  @date 2026/10/19
+**
+*******************************************************************************/
+
+#ifndef SEGMENT_STORE_HPP_INCLUDED
+#define SEGMENT_STORE_HPP_INCLUDED
+
+/* A persistent store of queued payloads for plugins to spill to while the link
+ * is down. Each key is a FIFO queue. The store is a directory of segment files,
+ * segment-<id>.log, that are only ever appended to:
+ *
+ *	magic (4) | crc32 (4) | length (4) | type (1) | pad (3) | key (8) | seq (8) | payload | pad to 8
+ *
+ * in host byte order, as the files never leave the machine. The crc covers the
+ * header after it and the payload. A DATA record is a payload, an ACK record
+ * says its key's payloads up to and including 'seq' were consumed. Nothing else
+ * is written, so the index of what is queued is rebuilt by reading the
+ * segments in order when the store is opened, and a crash loses at most the
+ * torn record at the end, which is cut off. Payloads are read through a
+ * read-only mapping of each segment.
+ *
+ * A background thread deletes the oldest segment once nothing in it is queued.
+ * An oldest segment that is mostly consumed has what is left copied to the end
+ * of the log first. Deleting only the oldest keeps every ACK on disk for as
+ * long as a payload it covers is. */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#define SEGMENT_STORE_MAGIC		0x4753504e		/* "NPSG" */
+#define SEGMENT_RECORD_HEADER	32
+#define SEGMENT_WRITE_BUFFER	(256 * 1024)	/* Small records are written this many bytes at a time */
+
+enum SegmentRecordType {
+	SEGMENT_DATA = 1,
+	SEGMENT_ACK
+};
+
+struct SegmentRecordHeader {
+	uint32_t magic;
+	uint32_t crc;
+	uint32_t len;
+	uint8_t type;
+	uint8_t pad[3];
+	uint64_t key;
+	uint64_t seq;
+};
+
+struct SegmentStoreStats {
+	SegmentStoreStats() : appended(0), appended_bytes(0), consumed(0), compacted(0), compacted_bytes(0),
+			recovered(0), truncated(0), full(0), queued(0), queued_bytes(0), segments(0), disk_bytes(0) { }
+
+	unsigned long long appended;
+	unsigned long long appended_bytes;
+	unsigned long long consumed;
+	unsigned long long compacted;		/* Payloads copied forward out of old segments */
+	unsigned long long compacted_bytes;
+	unsigned long long recovered;		/* Payloads found queued when the store was opened */
+	unsigned long long truncated;		/* Torn or corrupt records cut off */
+	unsigned long long full;			/* Appends refused for lack of space */
+	unsigned long long queued;
+	unsigned long long queued_bytes;
+	unsigned long long segments;
+	unsigned long long disk_bytes;
+
+	std::string str() const {
+		char buffer[320];
+
+		snprintf(buffer, sizeof(buffer),
+				"queued=%llu queued_bytes=%llu appended=%llu appended_bytes=%llu consumed=%llu compacted=%llu "
+				"compacted_bytes=%llu recovered=%llu truncated=%llu full=%llu segments=%llu disk_bytes=%llu",
+				queued, queued_bytes, appended, appended_bytes, consumed, compacted, compacted_bytes,
+				recovered, truncated, full, segments, disk_bytes);
+		return std::string(buffer);
+	}
+};
+
+/**************************************************************
+ **
+ ** SegmentStore keeps FIFO queues of payloads by key in a
+ ** directory of segment files. Every method may be called
+ ** from any thread. Appends go through a write buffer and are
+ ** made durable every 'sync_bytes' bytes, or by sync().
+ **
+ **************************************************************/
+class SegmentStore {
+	public:
+		SegmentStore() : segment_size(64 << 20), sync_bytes(0), compact_live_pct(50), max_bytes(0),
+				active(NULL), unsynced(0), running(false), stopping(false) {
+			pthread_mutex_init(&lock, NULL);
+			pthread_cond_init(&wake, NULL);
+		}
+
+		~SegmentStore() {
+			close();
+			pthread_cond_destroy(&wake);
+			pthread_mutex_destroy(&lock);
+		}
+
+		/* Opens, or creates, the store in 'dir' and starts compacting it. Segments
+		   are rolled at 'segment_size' bytes. The oldest is compacted when less than
+		   'compact_live_pct' percent of it is still queued. 'max_bytes' of 0 lets
+		   the store grow until the disk is full. */
+		bool open(const std::string& path, size_t seg_size, size_t sync, unsigned int live_pct, uint64_t max) {
+			std::vector<uint64_t> ids;
+			DIR* d;
+			dirent* e;
+
+			dir = path;
+			segment_size = seg_size < 4096 ? 4096 : seg_size;
+			sync_bytes = sync;
+			compact_live_pct = live_pct > 100 ? 100 : live_pct;
+			max_bytes = max;
+
+			if(mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+				error = "cannot create " + dir + ": " + strerror(errno);
+				return false;
+			}
+
+			d = opendir(dir.c_str());
+			if(!d) {
+				error = "cannot read " + dir + ": " + strerror(errno);
+				return false;
+			}
+			while((e = readdir(d)) != NULL) {
+				unsigned long long id;
+				char tail;
+				if(sscanf(e->d_name, "segment-%16llx.lo%c", &id, &tail) == 2 && tail == 'g') {
+					ids.push_back(id);
+				}
+			}
+			closedir(d);
+			std::sort(ids.begin(), ids.end());
+
+			pthread_mutex_lock(&lock);
+			for(size_t i = 0; i < ids.size(); i++) {
+				if(!recover(ids[i], i + 1 == ids.size())) {
+					pthread_mutex_unlock(&lock);
+					return false;
+				}
+			}
+			if(!active && !roll(ids.empty() ? 1 : ids.back() + 1, 0)) {
+				pthread_mutex_unlock(&lock);
+				return false;
+			}
+			for(std::map<uint64_t, Queue>::iterator q = queues.begin(); q != queues.end(); ++q) {
+				stats_.recovered += q->second.size();
+			}
+			pthread_mutex_unlock(&lock);
+
+			stopping = false;
+			if(pthread_create(&compactor, NULL, compactor_main, this) == 0) {
+				running = true;
+			}
+			return true;
+		}
+
+		/* Flushes and closes the store. Queued payloads stay on disk for next time. */
+		void close() {
+			if(running) {
+				pthread_mutex_lock(&lock);
+				stopping = true;
+				pthread_cond_signal(&wake);
+				pthread_mutex_unlock(&lock);
+				pthread_join(compactor, NULL);
+				running = false;
+			}
+
+			pthread_mutex_lock(&lock);
+			if(active) {
+				flush_buffer();
+				fdatasync(active->fd);
+			}
+			for(std::map<uint64_t, Segment*>::iterator s = segments.begin(); s != segments.end(); ++s) {
+				unmap(s->second);
+				delete s->second;
+			}
+			segments.clear();
+			queues.clear();
+			active = NULL;
+			pthread_mutex_unlock(&lock);
+		}
+
+		/* Queues a payload behind the others of 'key'. False if the store is full
+		   or cannot be written. */
+		bool append(uint64_t key, const void* data, size_t len) {
+			bool rval;
+
+			pthread_mutex_lock(&lock);
+			rval = append_locked(key, next_seq[key] + 1, data, len, NULL);
+			if(rval) {
+				next_seq[key]++;
+				stats_.appended++;
+				stats_.appended_bytes += len;
+			}
+			pthread_mutex_unlock(&lock);
+			return rval;
+		}
+
+		/* Copies the oldest payload of 'key' in to 'out'. False if there is none. */
+		bool front(uint64_t key, std::vector<uint8_t>& out) {
+			bool rval = false;
+
+			pthread_mutex_lock(&lock);
+			std::map<uint64_t, Queue>::iterator q = queues.find(key);
+			if(q != queues.end() && !q->second.empty()) {
+				const Location& l = q->second.begin()->second;
+				const uint8_t* p = payload(l);
+
+				if(p) {
+					out.assign(p, p + l.len);
+					rval = true;
+				}
+			}
+			pthread_mutex_unlock(&lock);
+			return rval;
+		}
+
+		/* Consumes the oldest payload of 'key' */
+		void pop(uint64_t key) {
+			pthread_mutex_lock(&lock);
+			std::map<uint64_t, Queue>::iterator q = queues.find(key);
+			if(q != queues.end() && !q->second.empty()) {
+				Queue::iterator first = q->second.begin();
+				uint64_t seq = first->first;
+
+				forget(first->second);
+				q->second.erase(first);
+				if(q->second.empty()) {
+					queues.erase(q);
+				}
+				append_locked(key, seq, NULL, 0, NULL);
+				stats_.consumed++;
+				pthread_cond_signal(&wake);
+			}
+			pthread_mutex_unlock(&lock);
+		}
+
+		size_t count(uint64_t key) {
+			size_t n;
+
+			pthread_mutex_lock(&lock);
+			std::map<uint64_t, Queue>::iterator q = queues.find(key);
+			n = q == queues.end() ? 0 : q->second.size();
+			pthread_mutex_unlock(&lock);
+			return n;
+		}
+
+		bool empty() {
+			bool rval;
+
+			pthread_mutex_lock(&lock);
+			rval = queues.empty();
+			pthread_mutex_unlock(&lock);
+			return rval;
+		}
+
+		/* Keys with payloads queued */
+		void keys(std::vector<uint64_t>* out) {
+			pthread_mutex_lock(&lock);
+			out->clear();
+			for(std::map<uint64_t, Queue>::iterator q = queues.begin(); q != queues.end(); ++q) {
+				out->push_back(q->first);
+			}
+			pthread_mutex_unlock(&lock);
+		}
+
+		/* Writes out the buffer and waits for the disk */
+		void sync() {
+			pthread_mutex_lock(&lock);
+			if(active) {
+				flush_buffer();
+				fdatasync(active->fd);
+				unsynced = 0;
+			}
+			pthread_mutex_unlock(&lock);
+		}
+
+		SegmentStoreStats stats() {
+			SegmentStoreStats s;
+
+			pthread_mutex_lock(&lock);
+			s = stats_;
+			s.queued = s.queued_bytes = s.disk_bytes = 0;
+			for(std::map<uint64_t, Queue>::iterator q = queues.begin(); q != queues.end(); ++q) {
+				s.queued += q->second.size();
+			}
+			for(std::map<uint64_t, Segment*>::iterator i = segments.begin(); i != segments.end(); ++i) {
+				s.queued_bytes += i->second->live;
+				s.disk_bytes += i->second->size;
+			}
+			s.segments = segments.size();
+			pthread_mutex_unlock(&lock);
+			return s;
+		}
+
+		/* Why open() failed */
+		const std::string& last_error() const { return error; }
+
+	private:
+		struct Segment {
+			Segment() : id(0), fd(-1), map(NULL), map_len(0), size(0), written(0), live(0) { }
+
+			uint64_t id;
+			int fd;
+			uint8_t* map;
+			size_t map_len;
+			size_t size;		/* Bytes appended, some maybe still in the write buffer */
+			size_t written;		/* Bytes in the file */
+			uint64_t live;		/* Payload bytes still queued */
+		};
+
+		struct Location {
+			Segment* segment;
+			size_t offset;		/* Of the payload */
+			uint32_t len;
+		};
+
+		typedef std::map<uint64_t, Location> Queue;		/* By sequence number */
+
+		std::string dir;
+		std::string error;
+		size_t segment_size;
+		size_t sync_bytes;
+		unsigned int compact_live_pct;
+		uint64_t max_bytes;
+
+		std::map<uint64_t, Segment*> segments;		/* By id, oldest first */
+		std::map<uint64_t, Queue> queues;
+		std::map<uint64_t, uint64_t> next_seq;		/* Last sequence number used for each key */
+		Segment* active;
+		std::vector<uint8_t> wbuf;
+		size_t unsynced;
+		SegmentStoreStats stats_;
+
+		pthread_mutex_t lock;
+		pthread_cond_t wake;
+		pthread_t compactor;
+		bool running;
+		bool stopping;
+
+		static size_t record_size(size_t len) {
+			return (SEGMENT_RECORD_HEADER + len + 7) & ~(size_t)7;
+		}
+
+		std::string path_of(uint64_t id) const {
+			char name[40];
+			snprintf(name, sizeof(name), "/segment-%016llx.log", (unsigned long long)id);
+			return dir + name;
+		}
+
+		static uint32_t checksum(const SegmentRecordHeader& h, const void* data, size_t len) {
+			uLong crc = crc32(0L, (const Bytef*)&h.len, SEGMENT_RECORD_HEADER - 8);
+			if(len) {
+				crc = crc32(crc, (const Bytef*)data, len);
+			}
+			return crc;
+		}
+
+		bool map_segment(Segment* s, size_t len) {
+			void* p = mmap(NULL, len, PROT_READ, MAP_SHARED, s->fd, 0);
+			if(p == MAP_FAILED) {
+				error = "cannot map " + path_of(s->id) + ": " + strerror(errno);
+				return false;
+			}
+			s->map = (uint8_t*)p;
+			s->map_len = len;
+			return true;
+		}
+
+		void unmap(Segment* s) {
+			if(s->map) {
+				munmap(s->map, s->map_len);
+				s->map = NULL;
+			}
+			if(s->fd >= 0) {
+				::close(s->fd);
+				s->fd = -1;
+			}
+		}
+
+		/* Starts a new active segment able to hold a record of 'need' bytes. The
+		   mapping covers the whole segment up front, appends through write() are
+		   seen in it. */
+		bool roll(uint64_t id, size_t need) {
+			Segment* s = new Segment();
+			int dfd;
+
+			if(active) {
+				flush_buffer();
+				fdatasync(active->fd);
+				unsynced = 0;
+			}
+
+			s->id = id;
+			s->fd = ::open(path_of(id).c_str(), O_RDWR | O_CREAT | O_EXCL | O_APPEND, 0600);
+			if(s->fd < 0) {
+				error = "cannot create " + path_of(id) + ": " + strerror(errno);
+				delete s;
+				return false;
+			}
+			if(!map_segment(s, need > segment_size ? need : segment_size)) {
+				unmap(s);
+				unlink(path_of(id).c_str());
+				delete s;
+				return false;
+			}
+
+			/* The new name is durable before anything in it is */
+			dfd = ::open(dir.c_str(), O_RDONLY);
+			if(dfd >= 0) {
+				fsync(dfd);
+				::close(dfd);
+			}
+
+			segments[id] = s;
+			active = s;
+			pthread_cond_signal(&wake);
+			return true;
+		}
+
+		/* Reads a segment back in to the index. The last one becomes the active
+		   segment, cut off at its first bad record. */
+		bool recover(uint64_t id, bool last) {
+			Segment* s = new Segment();
+			struct stat st;
+			size_t off = 0;
+
+			s->id = id;
+			s->fd = ::open(path_of(id).c_str(), (last ? O_RDWR | O_APPEND : O_RDONLY));
+			if(s->fd < 0 || fstat(s->fd, &st) != 0) {
+				error = "cannot open " + path_of(id) + ": " + strerror(errno);
+				unmap(s);
+				delete s;
+				return false;
+			}
+			if(st.st_size && !map_segment(s, last && (size_t)st.st_size < segment_size ? segment_size : st.st_size)) {
+				unmap(s);
+				delete s;
+				return false;
+			}
+
+			while(off + SEGMENT_RECORD_HEADER <= (size_t)st.st_size) {
+				SegmentRecordHeader h;
+
+				memcpy(&h, s->map + off, SEGMENT_RECORD_HEADER);
+				if(h.magic != SEGMENT_STORE_MAGIC || h.len > st.st_size - off - SEGMENT_RECORD_HEADER ||
+						checksum(h, s->map + off + SEGMENT_RECORD_HEADER, h.len) != h.crc) {
+					break;
+				}
+
+				if(h.type == SEGMENT_DATA) {
+					Location l;
+
+					l.segment = s;
+					l.offset = off + SEGMENT_RECORD_HEADER;
+					l.len = h.len;
+					if(h.seq > acked(h.key)) {
+						queues[h.key][h.seq] = l;
+						s->live += h.len;
+					}
+				} else if(h.type == SEGMENT_ACK) {
+					Queue& q = queues[h.key];
+					while(!q.empty() && q.begin()->first <= h.seq) {
+						forget(q.begin()->second);
+						q.erase(q.begin());
+					}
+					if(q.empty()) {
+						queues.erase(h.key);
+					}
+					acks[h.key] = std::max(acks[h.key], h.seq);
+				}
+				if(h.seq > next_seq[h.key]) {
+					next_seq[h.key] = h.seq;
+				}
+				off += std::min(record_size(h.len), (size_t)st.st_size - off);
+			}
+
+			if(off < (size_t)st.st_size) {
+				stats_.truncated++;
+				if(last && ftruncate(s->fd, off) != 0) {
+					error = "cannot truncate " + path_of(id) + ": " + strerror(errno);
+				}
+			}
+
+			s->size = s->written = off;
+			segments[id] = s;
+			if(last) {
+				acks.clear();
+				if(!s->map && !map_segment(s, segment_size)) {
+					return false;
+				}
+				active = s;
+			}
+			return true;
+		}
+
+		/* Consumption seen so far while recovering */
+		std::map<uint64_t, uint64_t> acks;
+
+		uint64_t acked(uint64_t key) {
+			std::map<uint64_t, uint64_t>::iterator a = acks.find(key);
+			return a == acks.end() ? 0 : a->second;
+		}
+
+		void forget(const Location& l) {
+			l.segment->live -= l.len;
+		}
+
+		const uint8_t* payload(const Location& l) {
+			if(l.segment == active && l.offset + l.len > active->written) {
+				flush_buffer();
+			}
+			if(l.offset + l.len > l.segment->map_len) {
+				return NULL;
+			}
+			return l.segment->map + l.offset;
+		}
+
+		void flush_buffer() {
+			size_t off = 0;
+
+			while(off < wbuf.size()) {
+				ssize_t n = write(active->fd, &wbuf[off], wbuf.size() - off);
+				if(n < 0 && errno == EINTR) {
+					continue;
+				}
+				if(n <= 0) {
+					break;
+				}
+				off += n;
+			}
+			active->written += off;
+			wbuf.clear();
+		}
+
+		/* Appends a DATA record, or an ACK if 'data' is NULL. The new location of a
+		   payload goes in 'moved' when it is copied forward. */
+		bool append_locked(uint64_t key, uint64_t seq, const void* data, size_t len, Location* moved) {
+			SegmentRecordHeader h;
+			size_t rec = record_size(len);
+			uint64_t disk = 0;
+
+			if(!active) {
+				return false;
+			}
+
+			if(data && max_bytes) {
+				for(std::map<uint64_t, Segment*>::iterator i = segments.begin(); i != segments.end(); ++i) {
+					disk += i->second->size;
+				}
+				if(disk + rec > max_bytes && !moved) {
+					stats_.full++;
+					return false;
+				}
+			}
+
+			/* A record larger than a segment gets one of its own */
+			if(active->size + rec > active->map_len || (active->size && active->size + rec > segment_size)) {
+				if(!roll(active->id + 1, rec)) {
+					return false;
+				}
+			}
+
+			memset(&h, 0, sizeof(h));
+			h.magic = SEGMENT_STORE_MAGIC;
+			h.len = len;
+			h.type = data ? SEGMENT_DATA : SEGMENT_ACK;
+			h.key = key;
+			h.seq = seq;
+			h.crc = checksum(h, data, len);
+
+			if(wbuf.size() + rec > SEGMENT_WRITE_BUFFER) {
+				flush_buffer();
+			}
+			if(rec > SEGMENT_WRITE_BUFFER) {
+				/* Large payloads skip the buffer */
+				uint8_t pad[8] = { 0 };
+				struct iovec iov[3];
+				size_t off = 0;
+				ssize_t n;
+
+				iov[0].iov_base = &h;
+				iov[0].iov_len = SEGMENT_RECORD_HEADER;
+				iov[1].iov_base = (void*)data;
+				iov[1].iov_len = len;
+				iov[2].iov_base = pad;
+				iov[2].iov_len = rec - SEGMENT_RECORD_HEADER - len;
+				n = writev(active->fd, iov, 3);
+				off = n > 0 ? n : 0;
+				while(off < rec && n >= 0) {
+					/* A short write, finish it from the pieces */
+					size_t hdr = SEGMENT_RECORD_HEADER;
+					const uint8_t* src = off < hdr ? (const uint8_t*)&h + off :
+							off < hdr + len ? (const uint8_t*)data + off - hdr : pad;
+					size_t avail = off < hdr ? hdr - off : off < hdr + len ? hdr + len - off : rec - off;
+					n = write(active->fd, src, avail);
+					if(n > 0) {
+						off += n;
+					} else if(n < 0 && errno == EINTR) {
+						n = 0;
+					}
+				}
+				if(off < rec) {
+					return false;
+				}
+				active->written += rec;
+			} else {
+				size_t at = wbuf.size();
+				wbuf.resize(at + rec, 0);
+				memcpy(&wbuf[at], &h, SEGMENT_RECORD_HEADER);
+				if(len) {
+					memcpy(&wbuf[at + SEGMENT_RECORD_HEADER], data, len);
+				}
+			}
+
+			if(data) {
+				Location l;
+
+				l.segment = active;
+				l.offset = active->size + SEGMENT_RECORD_HEADER;
+				l.len = len;
+				active->live += len;
+				if(moved) {
+					*moved = l;
+				} else {
+					queues[key][seq] = l;
+				}
+			}
+			active->size += rec;
+
+			unsynced += rec;
+			if(sync_bytes && unsynced >= sync_bytes) {
+				flush_buffer();
+				fdatasync(active->fd);
+				unsynced = 0;
+			}
+			return true;
+		}
+
+		/* Deletes the oldest segment if nothing in it is queued, first copying what
+		   is when little is. Returns true if there may be more to do. */
+		bool compact_step() {
+			Segment* s;
+			size_t off = 0;
+
+			if(segments.size() < 2) {
+				return false;
+			}
+			s = segments.begin()->second;
+
+			if(s->live && s->live * 100 >= (uint64_t)s->size * compact_live_pct) {
+				return false;
+			}
+
+			while(s->live && off + SEGMENT_RECORD_HEADER <= s->size) {
+				SegmentRecordHeader h;
+
+				memcpy(&h, s->map + off, SEGMENT_RECORD_HEADER);
+				if(h.type == SEGMENT_DATA) {
+					std::map<uint64_t, Queue>::iterator q = queues.find(h.key);
+					Queue::iterator r;
+
+					if(q != queues.end() && (r = q->second.find(h.seq)) != q->second.end() &&
+							r->second.segment == s && r->second.offset == off + SEGMENT_RECORD_HEADER) {
+						Location l;
+
+						if(!append_locked(h.key, h.seq, s->map + r->second.offset, h.len, &l)) {
+							return false;
+						}
+						forget(r->second);
+						r->second = l;
+						stats_.compacted++;
+						stats_.compacted_bytes += h.len;
+					}
+				}
+				off += record_size(h.len);
+
+				/* Lets appends in between records */
+				pthread_mutex_unlock(&lock);
+				pthread_mutex_lock(&lock);
+				if(stopping || segments.empty() || segments.begin()->second != s) {
+					return false;
+				}
+			}
+
+			if(s->live) {
+				return false;
+			}
+
+			/* What was copied must be on disk before the original goes */
+			flush_buffer();
+			fdatasync(active->fd);
+			unsynced = 0;
+
+			segments.erase(segments.begin());
+			unlink(path_of(s->id).c_str());
+			unmap(s);
+			delete s;
+			return true;
+		}
+
+		static void* compactor_main(void* arg) {
+			SegmentStore* store = (SegmentStore*)arg;
+
+			pthread_mutex_lock(&store->lock);
+			while(!store->stopping) {
+				timespec ts;
+
+				while(!store->stopping && store->compact_step()) {
+				}
+
+				clock_gettime(CLOCK_REALTIME, &ts);
+				ts.tv_sec += 1;
+				pthread_cond_timedwait(&store->wake, &store->lock, &ts);
+			}
+			pthread_mutex_unlock(&store->lock);
+			return NULL;
+		}
+};
+
+#endif /* SEGMENT_STORE_HPP_INCLUDED */
@@ -23,9 +23,11 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sched.h>
 
 #include <string>
 #include <list>
+#include <algorithm>
 
 #include "logger.h"
 #include "plugincore.h"
@@ -38,105 +40,289 @@ using namespace Crafter;
 namespace NpsGate {
 
 PublishSubscribe::PublishSubscribe(const NpsGateContext& c) : context(c) {
+	pthread_mutex_init(&lock, NULL);
+	pthread_key_create(&reader_key, release_reader);
+	memset((void*)topics, 0, sizeof(topics));
+	topic_count = 0;
+	epoch = 1;
+	readers = NULL;
 }
 
 PublishSubscribe::~PublishSubscribe() {
-	for(map<string, list<PluginCore*>* >::iterator it = subscriptions.begin(); it != subscriptions.end(); ++it) {
-		delete it->second;
-		subscriptions.erase(it);
+	for(int i = 0; i < TOPIC_CHUNKS && topics[i]; i++) {
+		for(int j = 0; j < TOPIC_CHUNK; j++) {
+			delete topics[i][j].subs;
+		}
+		delete[] topics[i];
+	}
+	for(list<Retired>::iterator it = retired.begin(); it != retired.end(); ++it) {
+		delete it->subs;
+	}
+	while(readers) {
+		Reader* r = readers;
+		readers = r->next;
+		delete r;
+	}
+
+	pthread_key_delete(reader_key);
+	pthread_mutex_destroy(&lock);
+}
+
+/* The calling thread's reader, reusing one left by a thread that has exited */
+PublishSubscribe::Reader* PublishSubscribe::reader() {
+	Reader* r = (Reader*)pthread_getspecific(reader_key);
+
+	if(r) {
+		return r;
+	}
+
+	for(r = readers; r; r = r->next) {
+		if(!r->used && __sync_bool_compare_and_swap(&r->used, 0, 1)) {
+			break;
+		}
+	}
+
+	if(!r) {
+		r = new Reader();
+		r->epoch = 0;
+		r->used = 1;
+		do {
+			r->next = readers;
+		} while(!__sync_bool_compare_and_swap(&readers, r->next, r));
+	}
+
+	pthread_setspecific(reader_key, r);
+	return r;
+}
+
+void PublishSubscribe::release_reader(void* r) {
+	((Reader*)r)->epoch = 0;
+	__sync_synchronize();
+	((Reader*)r)->used = 0;
+}
+
+/* Called with 'lock' held */
+TopicId PublishSubscribe::find_topic(const string& fq_name) {
+	map<string, TopicId>::iterator it = topic_ids.find(fq_name);
+	TopicId id = topic_count;
+	Topic* t;
+
+	if(it != topic_ids.end()) {
+		return it->second;
+	}
+
+	if(id >= (TopicId)TOPIC_CHUNK * TOPIC_CHUNKS) {
+		LOG_CRITICAL("Too many topics, can not register '%s'.\n", fq_name.c_str());
+		return NO_TOPIC;
+	}
+
+	if(!topics[id / TOPIC_CHUNK]) {
+		topics[id / TOPIC_CHUNK] = new Topic[TOPIC_CHUNK];
 	}
+
+	t = &topics[id / TOPIC_CHUNK][id % TOPIC_CHUNK];
+	t->fq_name = fq_name;
+	t->subs = new Subscribers();
+
+	/* The topic is complete before publishers can see its id */
+	__sync_synchronize();
+	topic_count = id + 1;
+	topic_ids[fq_name] = id;
+
+	return id;
+}
+
+/* Publishes a new subscriber array for the topic. Called with 'lock' held. */
+void PublishSubscribe::replace(Topic* t, Subscribers* subs) {
+	Retired r;
+
+	__sync_synchronize();
+	r.subs = t->subs;
+	r.epoch = epoch;
+	t->subs = subs;
+	retired.push_back(r);
+	__sync_fetch_and_add(&epoch, 1);
+}
+
+/* Frees the arrays no publisher can still be reading. A publisher that started
+   after an array was replaced only sees its replacement. With 'wait' this waits
+   for the publishers still running to finish. Called with 'lock' held. */
+void PublishSubscribe::reclaim(bool wait) {
+	unsigned long oldest;
+
+	if(retired.empty()) {
+		return;
+	}
+
+	for(;;) {
+		__sync_synchronize();
+		oldest = epoch;
+		for(Reader* r = readers; r; r = r->next) {
+			unsigned long e = r->epoch;
+			if(e && e < oldest) {
+				oldest = e;
+			}
+		}
+
+		if(!wait || oldest == epoch) {
+			break;
+		}
+		sched_yield();
+	}
+
+	while(!retired.empty() && retired.front().epoch < oldest) {
+		delete retired.front().subs;
+		retired.pop_front();
+	}
+}
+
+TopicId PublishSubscribe::register_topic(const string fq_name) {
+	TopicId id;
+
+	pthread_mutex_lock(&lock);
+	id = find_topic(fq_name);
+	pthread_mutex_unlock(&lock);
+
+	return id;
 }
 
 bool PublishSubscribe::add_subscription(PluginCore* p, const string fq_name) {
-	list<PluginCore*>* plist;
+	Subscribers* subs;
+	Topic* t;
+	TopicId id;
 
 	if(!p) {
 		LOG_WARNING("PluginCore was NULL!\n");
 		return false;
 	}
 
-	/* Check to see if this fq_name already exists, if not create it */
-	if(subscriptions.find(fq_name) == subscriptions.end()) {
-		plist = new list<PluginCore*>();
-		subscriptions[fq_name] = plist;
-	} else {
-		plist = subscriptions[fq_name];
+	pthread_mutex_lock(&lock);
+
+	/* Subscribing registers the topic if it has not been yet */
+	id = find_topic(fq_name);
+	if(id == NO_TOPIC) {
+		pthread_mutex_unlock(&lock);
+		return false;
 	}
+	t = topic(id);
 
 	/* Check to see if this plugin is already subscribed to this fq_name */
-	for(list<PluginCore*>::iterator it = plist->begin(); it != plist->end(); ++it) {
-		if(*it == p) {
-			return true;
-		}
+	if(find(t->subs->begin(), t->subs->end(), p) == t->subs->end()) {
+		subs = new Subscribers(*t->subs);
+		subs->push_back(p);
+		replace(t, subs);
+		reclaim(false);
 	}
 
-	plist->push_back(p);
-
+	pthread_mutex_unlock(&lock);
 	return true;
 }
 
 bool PublishSubscribe::remove_subscription(PluginCore* p, const string fq_name) {
-	list<PluginCore*>* plist;
+	map<string, TopicId>::iterator it;
 
 	if(!p) {
 		LOG_WARNING("PluginCore was NULL!\n");
 		return false;
 	}
 
-	if(subscriptions.find(fq_name) != subscriptions.end()) {
-		plist = subscriptions[fq_name];
-		plist->remove(p);
+	pthread_mutex_lock(&lock);
+
+	it = topic_ids.find(fq_name);
+	if(it != topic_ids.end()) {
+		Topic* t = topic(it->second);
+
+		if(find(t->subs->begin(), t->subs->end(), p) != t->subs->end()) {
+			Subscribers* subs = new Subscribers(*t->subs);
+			subs->erase(find(subs->begin(), subs->end(), p));
+			replace(t, subs);
+			reclaim(false);
+		}
 	}
 
+	pthread_mutex_unlock(&lock);
 	return true;
 }
 
+/* Once this returns no publisher is delivering to 'p', so it can be freed */
 bool PublishSubscribe::remove_all_subscriptions(PluginCore* p) {
-	for(map<string, list<PluginCore*>* >::iterator it = subscriptions.begin(); it != subscriptions.end(); ++it) {
-		remove_subscription(p, it->first);
+	pthread_mutex_lock(&lock);
+
+	for(TopicId id = 0; id < topic_count; id++) {
+		Topic* t = topic(id);
+
+		if(find(t->subs->begin(), t->subs->end(), p) != t->subs->end()) {
+			Subscribers* subs = new Subscribers(*t->subs);
+			subs->erase(find(subs->begin(), subs->end(), p));
+			replace(t, subs);
+		}
 	}
+	reclaim(true);
+
+	pthread_mutex_unlock(&lock);
 	return true;
 }
 
-bool PublishSubscribe::publish(PluginCore* p, const string fq_name, NpsGateVar* v) {
-	list<PluginCore*>* plist;
+/* Touches only the topic's own subscriber array */
+bool PublishSubscribe::publish(PluginCore* p, TopicId id, NpsGateVar* v) {
+	Topic* t = topic(id);
+	Reader* r;
 
 	if(!p) {
 		LOG_WARNING("PluginCore was NULL!\n");
 		return false;
 	}
 
-	LOG_DEBUG("Publish: %s\n", fq_name.c_str());
-
-	if(subscriptions.find(fq_name) == subscriptions.end()) {
-		subscriptions[fq_name] = new list<PluginCore*>;
-//		return true;
+	if(!t) {
+		LOG_WARNING("Publish to unknown topic %u.\n", id);
+		return false;
 	}
 
+	LOG_DEBUG("Publish: %s\n", t->fq_name.c_str());
 
-	plist = subscriptions[fq_name];
+	/* The epoch is noted before the array is read, so the array is not freed
+	   until it is no longer in use */
+	r = reader();
+	r->epoch = epoch;
+	__sync_synchronize();
 
-	for(list<PluginCore*>::iterator it = plist->begin(); it != plist->end(); ++it) {
+	const Subscribers* subs = t->subs;
+
+	for(Subscribers::const_iterator it = subs->begin(); it != subs->end(); ++it) {
 		JobQueueItem* item = new JobQueueItem();
-		PluginCore* p = *it;
+		PluginCore* sub = *it;
 
 		item->type = MESSAGE;
 		item->message = new Message();
 		item->message->type = SUBSCRIBE_UPDATE;
-		item->message->fq_name = fq_name;
+		item->message->fq_name = t->fq_name;
 		item->message->value = v;
 		item->message->orig = p;
 
 		/* Acquire a reference to the NpsGateVar for each destination */
 		v->ref();
 
-		LOG_DEBUG("Sending updated '%s' to plugin %p\n", fq_name.c_str(), p);
-		p->input_queue.Enqueue(item);
+		LOG_DEBUG("Sending updated '%s' to plugin %p\n", t->fq_name.c_str(), sub);
+		sub->input_queue.Enqueue(item);
 	}
 
+	__sync_synchronize();
+	r->epoch = 0;
+
 	return true;
 }
 
+/* Looks the topic up by name each time. Publishers that publish often register
+   their topics once and publish by id. */
+bool PublishSubscribe::publish(PluginCore* p, const string fq_name, NpsGateVar* v) {
+	TopicId id = register_topic(fq_name);
+
+	if(id == NO_TOPIC) {
+		return false;
+	}
+	return publish(p, id, v);
+}
+
 bool PublishSubscribe::add_publication(PluginCore* p, const string fq_name, const string desc, NpsGateVar* v) {
 	LOG_TRACE("Adding Publication: %s", fq_name.c_str());
 
@@ -162,5 +348,20 @@ const map<string,Publication>& PublishSubscribe::list_publications(PluginCore* p
 	return publications[p];
 }
 
+void PublishSubscribe::list_subscriptions(map<string, vector<PluginCore*> >* subs) {
+	pthread_mutex_lock(&lock);
+
+	subs->clear();
+	for(TopicId id = 0; id < topic_count; id++) {
+		Topic* t = topic(id);
+
+		if(!t->subs->empty()) {
+			(*subs)[t->fq_name] = *t->subs;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
 }
 
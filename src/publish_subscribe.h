@@ -27,8 +27,12 @@
 #include <stdio.h>
 #include <errno.h>
 
+#include <stdint.h>
+
 #include <string>
 #include <list>
+#include <map>
+#include <vector>
 #include <crafter.h>
 
 #include "npsgate_context.hpp"
@@ -45,6 +49,11 @@ namespace NpsGate {
 	class NpsGateContext;
 
 
+/* A topic registered with PublishSubscribe. Publishing by id reaches the
+   topic's subscribers without looking up its name. */
+typedef uint32_t TopicId;
+#define NO_TOPIC ((TopicId)~0u)
+
 class Publication {
 	public:
 		string fq_name;
@@ -53,26 +62,94 @@ class Publication {
 		NpsGateVar* last_value;
 };
 
+/**************************************************************
+ **
+ ** PublishSubscribe delivers published values to the plugins
+ ** subscribed to their topic. Each topic's subscribers are
+ ** kept in an array that is never changed once published.
+ ** Subscribing replaces the array under 'lock', and publishing
+ ** reads it without locks. A replaced array is freed once no
+ ** publisher can still be reading it: publishers note the
+ ** epoch they started in, and each replacement starts a new
+ ** one.
+ **
+ **************************************************************/
 class PublishSubscribe {
 	public:
 		PublishSubscribe(const NpsGateContext&);
 		~PublishSubscribe(); 
 
+		/* The id of 'fq_name', registering it the first time. NO_TOPIC when the
+		   table is full. */
+		TopicId register_topic(const string fq_name);
+
 		bool add_subscription(PluginCore* p, const string fq_name);
 		bool remove_subscription(PluginCore* p, const string fq_name);
 		bool remove_all_subscriptions(PluginCore*);
+		bool publish(PluginCore* p, TopicId topic, NpsGateVar* v);
 		bool publish(PluginCore* p, const string fq_name, NpsGateVar* v);
 
 		bool add_publication(PluginCore* p, const string fq_name, const string desc, NpsGateVar* v);
 		//list<string> list_subscriptions(PluginCore* p);
 		const map<string,Publication>& list_publications(PluginCore* p);
 
+		/* The subscribers of every topic that has any */
+		void list_subscriptions(map<string, vector<PluginCore*> >* subs);
+
 		friend class Monitor;
 	private:
+		typedef vector<PluginCore*> Subscribers;
+
+		struct Topic {
+			Topic() : subs(NULL) { }
+
+			string fq_name;
+			Subscribers* volatile subs;
+		};
+
+		/* One for each thread that has published. 'epoch' is 0 outside of publish(). */
+		struct Reader {
+			volatile unsigned long epoch;
+			volatile int used;
+			Reader* next;
+		};
+
+		struct Retired {
+			Subscribers* subs;
+			unsigned long epoch;	/* Replaced while this was the epoch */
+		};
+
+		enum {
+			TOPIC_CHUNK = 256,		/* Topics are allocated this many at a time */
+			TOPIC_CHUNKS = 1024
+		};
+
 		const NpsGateContext& context;
 		PluginManager* plugin_mgr;
-		map<string, list<PluginCore*>* > subscriptions;
 		map<PluginCore*, map<string, Publication> > publications;
+
+		pthread_mutex_t lock;		/* Held by everything but publish() */
+		map<string, TopicId> topic_ids;
+		Topic* volatile topics[TOPIC_CHUNKS];
+		volatile TopicId topic_count;
+		volatile unsigned long epoch;
+		Reader* volatile readers;
+		pthread_key_t reader_key;
+		list<Retired> retired;
+
+		inline Topic* topic(TopicId id) {
+			if(id >= topic_count) {
+				return NULL;
+			}
+			return &topics[id / TOPIC_CHUNK][id % TOPIC_CHUNK];
+		}
+
+		Reader* reader();
+		static void release_reader(void* r);
+
+		TopicId find_topic(const string& fq_name);
+		void replace(Topic* t, Subscribers* subs);
+		void reclaim(bool wait);
 };
 
 }
@@ -89,7 +89,8 @@ template <typename T> T Queue<T>::Dequeue(uint32_t timeout)
 
 	boost::system_time t = boost::get_system_time() + boost::posix_time::milliseconds(timeout);
  
-	if(m_queue.size() == 0) {
+	/* A wakeup can be spurious, or another thread took the item first */
+	while(m_queue.size() == 0) {
 		if(!m_cond.timed_wait(lock,t)) {
 			return NULL;
 		}